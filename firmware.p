@@ -114,6 +114,8 @@ WAIT_FOR_COMMAND:
         qbeq TEST_TRACK_0, interface.command, COMMAND_TEST_TRACK_0
         qbeq WRITE_TIMING, interface.command, COMMAND_WRITE_TIMING
         qbeq READ_TIMING, interface.command, COMMAND_READ_TIMING
+        qbeq WRITE_VERIFY, interface.command, COMMAND_WRITE_VERIFY
+        qbeq RUN_QUEUE, interface.command, COMMAND_RUN_QUEUE
 
         jmp  WAIT_FOR_COMMAND
 
@@ -240,6 +242,89 @@ WRITE_TIMING:
 READ_TIMING:
         jal  STACK.ret_addr, fnRead_Timing
         jmp  SEND_ACK
+WRITE_VERIFY:
+        jal  STACK.ret_addr, fnWrite_Timing
+        // From here, the interrupts are for samples read.
+        ldi  interface.phase, PHASE_VERIFY
+        sbbo interface.phase, GLOBAL.pruMem, OFFSET(interface.phase), \
+                                             SIZE(interface.phase)
+        // read_count is what the write left. If the samples ran out
+        // before the index, the head is somewhere in the track: read
+        // from the next index, as READ_TIMING does.
+        qbeq write_verify_next_index, interface.read_count, #0
+        // The write stopped on the index, read back from the same pulse.
+        jal  STACK.ret_addr, fnRead_Timing_Now
+        jmp  SEND_ACK
+write_verify_next_index:
+        jal  STACK.ret_addr, fnRead_Timing
+        jmp  SEND_ACK
+
+.struct Run_Queue
+        .u16  offset            // Of the current op in PRU ram
+        .u16  remaining         // Ops left to run
+.ends
+.assign Run_Queue, r26, r26, run_queue
+.assign QUEUE_OP, r4, r5, queue_op
+RUN_QUEUE:
+        // The same as the commands, but without a round trip to the host
+        // for each. Each op is acked in place, and the queue when done.
+        ldi  run_queue.offset, QUEUE_OFFSET
+        rcp  run_queue.remaining, interface.argument
+        qbge run_queue_next, run_queue.remaining, QUEUE_MAX_OPS
+        ldi  run_queue.remaining, QUEUE_MAX_OPS
+
+run_queue_next:
+        qbeq SEND_ACK, run_queue.remaining, #0
+        M_CHECK_ABORT
+        lbbo queue_op, GLOBAL.pruMem, run_queue.offset, SIZE(queue_op)
+        rcp  interface.argument, queue_op.argument
+        rclr interface.read_count
+
+        qbeq run_queue_set_head_dir, queue_op.command, COMMAND_SET_HEAD_DIR
+        qbeq run_queue_set_head_side, queue_op.command, COMMAND_SET_HEAD_SIDE
+        qbeq run_queue_step_head, queue_op.command, COMMAND_STEP_HEAD
+        qbeq run_queue_read_timing, queue_op.command, COMMAND_READ_TIMING
+        // Not an op we can queue, stop here and leave it unacked.
+        jmp  SEND_ACK
+
+run_queue_set_head_dir:
+        set  PIN_HEAD_DIR
+        qbne run_queue_op_done, interface.argument, #1
+        clr  PIN_HEAD_DIR
+        jmp  run_queue_op_done
+
+run_queue_set_head_side:
+        set  PIN_HEAD_SELECT
+        qbeq run_queue_op_done, interface.argument, #1
+        clr  PIN_HEAD_SELECT
+        jmp  run_queue_op_done
+
+run_queue_step_head:
+        jal  STACK.ret_addr, fnStep_Head
+        jmp  run_queue_op_done
+
+run_queue_read_timing:
+        jal  STACK.ret_addr, fnRead_Timing
+        lbbo interface.read_count, GLOBAL.pruMem, \
+                                   OFFSET(interface.read_count), \
+                                   SIZE(interface.read_count)
+
+run_queue_op_done:
+        // The result first, the host takes the ack to mean it is there.
+        add  run_queue.offset, run_queue.offset, OFFSET(queue_op.result)
+        sbbo interface.read_count, GLOBAL.pruMem, run_queue.offset, \
+                                                  SIZE(queue_op.result)
+        sub  run_queue.offset, run_queue.offset, OFFSET(queue_op.result)
+        and  queue_op.command, queue_op.command, 0x7f
+        sbbo queue_op.command, GLOBAL.pruMem, run_queue.offset, \
+                                              SIZE(queue_op.command)
+
+        qbbc run_queue_skip_notify, queue_op.flags, QUEUE_OP_NOTIFY
+        mov  r31.b0, PRU0_ARM_INTERRUPT+16
+run_queue_skip_notify:
+        add  run_queue.offset, run_queue.offset, SIZE(queue_op)
+        dec  run_queue.remaining
+        jmp  run_queue_next
 
 SEND_ACK:
         and  interface.command, interface.command, 0x7f
@@ -1064,7 +1149,8 @@ write_bit_timing_break_loop:
         .u16  weak_bit
         .u16  tmp
         .u32  sample_count
-        .u32  flags
+        .u16  flags
+        .u16  refills           // Interrupts raised for more samples
 .ends
 .enter write_timing_scope
 .assign Write_Timing, r19, r24, write_timing
@@ -1075,6 +1161,7 @@ fnWrite_Timing:
 
         rclr write_timing.ram_offset
         rclr write_timing.flags
+        rclr write_timing.refills
 
         ldi  write_timing.fnPtr_Write_Low, fnWrite_Timing_Regular_Bit
         ldi  write_timing.weak_bit, #8192 - 511 // #0xffff
@@ -1104,10 +1191,7 @@ write_timing_LOOP:
                                                 write_timing.tmp
 
         ldi  r31.b0, PRU0_ARM_INTERRUPT+16
-        jmp  write_timing_check_ram_offset
-write_timing_skip_interrupt:
-        nop0 r0, r0, r0
-        nop0 r0, r0, r0
+        inc  write_timing.refills
 
         // ---- 35 ns -- from write_timing_LOOP
 write_timing_check_ram_offset:
@@ -1121,6 +1205,11 @@ write_timing_reset_ram_offset:
         rclr write_timing.ram_offset
         jmp  write_timing_write
 
+write_timing_skip_interrupt:
+        // Takes as long as the interrupt and the count above
+        nop0 r0, r0, r0
+        jmp  write_timing_check_ram_offset
+
 write_timing_wrong_offset:
         nop0 r0, r0, r0
         nop0 r0, r0, r0
@@ -1210,6 +1299,11 @@ write_timing_BREAK_LOOP:
         rcp  interface.read_count, write_timing.sample_count
         sbbo interface.read_count, GLOBAL.pruMem, OFFSET(interface.read_count), \
                                                SIZE(interface.read_count)
+        // In place of the sync word, before WRITE_VERIFY sets its phase.
+        // The host can still owe us refills when the read has begun.
+        sbbo write_timing.refills, GLOBAL.pruMem, \
+                                   OFFSET(interface.sync_word), \
+                                   SIZE(write_timing.refills)
 
         rcp  STACK.ret_addr, write_timing.ret_addr
         jmp  STACK.ret_addr
@@ -1280,7 +1374,7 @@ write_timing_timer_WEAK_HI_LOOP:
         .u8   flags
         .u8   revolutions
         .u8   revolution_count
-        .u8   unused1
+        .u8   now               // Start right away, not at the next index
         .u16  rev_ram_offset    // Revolutions offset ram_pointer
         .u16  ram_offset        // Position of write pointer
         .u16  ret_addr
@@ -1292,7 +1386,14 @@ write_timing_timer_WEAK_HI_LOOP:
 .ends
 .enter read_timing_scope
 .assign Read_Timing, r19, r25, read_timing
+fnRead_Timing_Now:
+        // Only after a write that stopped on the index, with INDEX
+        // still asserted.
+        ldi  read_timing.now, #1
+        jmp  read_timing_setup
 fnRead_Timing:
+        ldi  read_timing.now, #0
+read_timing_setup:
         rcp  read_timing.ret_addr, STACK.ret_addr
 
         rclr read_timing.total_time
@@ -1318,6 +1419,9 @@ read_timing_set_revolutions:
         ldi  read_timing.target_time.w0, #0xb9ab
         ldi  read_timing.target_time.w2, #0x0065
 
+        // INDEX_PIN_LOW_FLAG is set, so the read ends on the next
+        // falling edge after this pulse, a full revolution.
+        qbne read_timing_LOOP, read_timing.now, #0
 
 // First wait for INDEX to go high.
 read_timing_wait_index_high:
@@ -1384,10 +1488,11 @@ read_timing_reset_ram_offset:
         jmp  read_timing_check_index_pin
 
 read_timing_wrong_offset:
-        nop0 r0, r0, r0
-        nop0 r0, r0, r0
-        nop0 r0, r0, r0
-        nop0 r0, r0, r0
+        // The host wants no more samples. Only checked off the 0x1000
+        // byte boundary, so the last interrupt is never raced by the ack.
+        lbbo interface.phase, GLOBAL.pruMem, OFFSET(interface.phase), \
+                                             SIZE(interface.phase)
+        qbeq read_timing_BREAK_LOOP, interface.phase, PHASE_STOP
         nop0 r0, r0, r0
 
         // ---- 60ns from PIN_READ_DATA LOW
@@ -21,29 +21,66 @@
 #define COMMAND_TEST_TRACK_0            (0x0e | 0x80)
 #define COMMAND_WRITE_TIMING            (0x0f | 0x80)
 #define COMMAND_READ_TIMING             (0x10 | 0x80)
+#define COMMAND_WRITE_VERIFY            (0x11 | 0x80)
+#define COMMAND_RUN_QUEUE               (0x12 | 0x80)
+
+// interface.phase during WRITE_VERIFY, cleared by the host. The read has
+// begun once the phase is PHASE_VERIFY, and the host has taken as many
+// refill interrupts as interface.refills.
+#define PHASE_WRITE                     0
+#define PHASE_VERIFY                    1
+// Set by the host during READ_TIMING, to end the read at the next sample.
+// The host clears it before each read.
+#define PHASE_STOP                      2
+
+// RUN_QUEUE runs interface.argument ops of QUEUE_OP, from QUEUE_OFFSET
+// in PRU ram. Only SET_HEAD_DIR, SET_HEAD_SIDE, STEP_HEAD and READ_TIMING.
+#define QUEUE_OFFSET                    0x200
+#define QUEUE_MAX_OPS                   64
+// QUEUE_OP.flags bit: interrupt the host when the op is done.
+#define QUEUE_OP_NOTIFY                 0
 
 #ifndef __GNUC__
 .struct ARM_IF
         .u8  command
-        .u8  unused
+        .u8  phase
         .u16 argument
         .u32 sync_word
         .u32 read_count
 .ends
 .assign ARM_IF, r27, r29, interface
 
+.struct QUEUE_OP
+        .u8  command
+        .u8  flags
+        .u16 argument
+        .u32 result
+.ends
+
 #else
 
 #include <stdint.h>
 
 struct ARM_IF {
 	uint8_t  volatile command;
-	uint8_t  volatile unused;
+	uint8_t  volatile phase;
         uint16_t volatile argument;
-        uint32_t volatile sync_word;
+        union {
+                uint32_t volatile sync_word;
+                // WRITE_TIMING, WRITE_VERIFY: the refill interrupts the
+                // write raised, set when it is done.
+                uint16_t volatile refills;
+        };
         uint32_t volatile read_count;
 }__attribute__((packed));
 
+struct QUEUE_OP {
+        uint8_t  volatile command;      // Acked as command & 0x7f when done
+        uint8_t  volatile flags;
+        uint16_t volatile argument;
+        uint32_t volatile result;       // Samples read, for READ_TIMING
+}__attribute__((packed));
+
 #endif
 
 
@@ -0,0 +1,225 @@
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "../mfm_utils/mfm_utils.h"
+#include "../mfm_utils/amiga_decode.h"
+
+/*
+ * Amiga sector decode: the old parse_amiga_mfm_sector(), one sector and
+ * one malloc at a time, against amiga_decode_sectors() on whole tracks.
+ * Then amiga_decode_track() from flux, with the index in the middle of
+ * a sector.
+ */
+
+#define TRACKS          16
+#define TRACK_BYTES     (AMIGA_SECTORS_PER_TRACK * AMIGA_MFM_SECTOR_SIZE)
+
+static uint8_t tracks[TRACKS][TRACK_BYTES];
+static uint32_t flux[TRACKS][BENCH_MAX_TRACK_SAMPLES];
+static size_t flux_counts[TRACKS];
+
+/*
+ * parse_amiga_mfm_sector() before it used amiga_decode_sector(),
+ * as the reference.
+ */
+static int legacy_parse_sector(const uint8_t *bitstream,
+                struct amiga_sector *parsed_sector, uint8_t **sector_data_out)
+{
+        static const uint32_t mask = 0x55555555;
+        uint32_t w[14];
+        uint16_t sync[2];
+
+        memset(parsed_sector, 0x00, sizeof(*parsed_sector));
+
+        memcpy(sync, bitstream, sizeof(sync));
+        if (be16toh(sync[0]) != 0x4489 || be16toh(sync[1]) != 0x4489) {
+                return -2;
+        }
+        // info odd/even, label odd[4]/even[4], header sum, data sum
+        memcpy(w, bitstream + 4, sizeof(w));
+
+        parsed_sector->header_info = ((w[0] & mask) << 1) | (w[1] & mask);
+        uint32_t calculated_checksum = w[0] ^ w[1];
+        for (unsigned int i = 0; i < 4; ++i) {
+                parsed_sector->header_sector_label[i] =
+                                ((w[2 + i] & mask) << 1) | (w[6 + i] & mask);
+                calculated_checksum ^= w[2 + i] ^ w[6 + i];
+        }
+        parsed_sector->calculated_header_checksum = calculated_checksum;
+        calculated_checksum ^= w[10] ^ w[11];
+        parsed_sector->header_checksum_ok = (calculated_checksum & mask) == 0;
+
+        uint32_t *sector_data = malloc(1024);
+        if (!sector_data) {
+                return -4;
+        }
+        memcpy(sector_data, bitstream + 60, 1024);
+
+        calculated_checksum = 0;
+        for (unsigned int i = 0; i < 512 / 4; ++i) {
+                calculated_checksum ^= sector_data[i];
+                calculated_checksum ^= sector_data[i + (512/4)];
+
+                sector_data[i] &= mask;
+                sector_data[i] <<= 1;
+                sector_data[i] |= sector_data[i + (512 / 4)] & mask;
+        }
+        parsed_sector->calculated_data_checksum = calculated_checksum;
+        *sector_data_out = (uint8_t *)sector_data;
+
+        calculated_checksum ^= w[12] ^ w[13];
+        parsed_sector->data_checksum_ok = (calculated_checksum & mask) == 0;
+
+        return 0;
+}
+
+static unsigned int legacy_decode_track(const uint8_t *track,
+                        struct amiga_sector *sectors, uint8_t *data)
+{
+        unsigned int good = 0;
+
+        for (unsigned int i = 0; i < AMIGA_SECTORS_PER_TRACK; i++) {
+                uint8_t *sector_data = NULL;
+                int rc = legacy_parse_sector(track + i * AMIGA_MFM_SECTOR_SIZE + 4,
+                                                &sectors[i], &sector_data);
+                if (rc == 0) {
+                        memcpy(data + i * AMIGA_SECTOR_DATA_SIZE, sector_data,
+                                                        AMIGA_SECTOR_DATA_SIZE);
+                        free(sector_data);
+                        if (sectors[i].header_checksum_ok
+                                        && sectors[i].data_checksum_ok) {
+                                good++;
+                        }
+                }
+        }
+        return good;
+}
+
+static bool same_sector(const struct amiga_sector *a, const struct amiga_sector *b)
+{
+        return a->header_info == b->header_info
+                && !memcmp(a->header_sector_label, b->header_sector_label,
+                                        sizeof(a->header_sector_label))
+                && a->calculated_header_checksum == b->calculated_header_checksum
+                && a->calculated_data_checksum == b->calculated_data_checksum
+                && a->header_checksum_ok == b->header_checksum_ok
+                && a->data_checksum_ok == b->data_checksum_ok;
+}
+
+int main(int argc, char **argv)
+{
+        const unsigned int iterations = argc > 1 ? atoi(argv[1]) : 200;
+        struct amiga_sector expect[AMIGA_SECTORS_PER_TRACK];
+        struct amiga_sector got[AMIGA_SECTORS_PER_TRACK];
+        static uint8_t expect_data[AMIGA_SECTORS_PER_TRACK * AMIGA_SECTOR_DATA_SIZE];
+        static uint8_t got_data[AMIGA_SECTORS_PER_TRACK * AMIGA_SECTOR_DATA_SIZE];
+        unsigned int seed = 1, mismatch = 0;
+        unsigned int good_legacy = 0, good_new = 0;
+        double t;
+
+        for (unsigned int i = 0; i < TRACKS; i++) {
+                bench_amiga_mfm_track(tracks[i], i, &seed);
+        }
+        // Some damage: flipped bits in a few sectors, and a lost sync.
+        for (unsigned int i = 0; i < TRACKS; i += 3) {
+                const unsigned int sector = rand_r(&seed) % AMIGA_SECTORS_PER_TRACK;
+                const unsigned int byte = 8 + rand_r(&seed) % (AMIGA_MFM_SECTOR_SIZE - 8);
+                tracks[i][sector * AMIGA_MFM_SECTOR_SIZE + byte] ^= 0x10;
+        }
+        tracks[1][AMIGA_MFM_SECTOR_SIZE * 4 + 5] ^= 0x01;
+
+        for (unsigned int i = 0; i < TRACKS; i++) {
+                memset(expect_data, 0x00, sizeof(expect_data));
+                memset(got_data, 0x00, sizeof(got_data));
+                good_legacy += legacy_decode_track(tracks[i], expect, expect_data);
+                good_new += amiga_decode_sectors(tracks[i],
+                                AMIGA_SECTORS_PER_TRACK, got, got_data);
+                for (unsigned int s = 0; s < AMIGA_SECTORS_PER_TRACK; s++) {
+                        if (!same_sector(&expect[s], &got[s])) {
+                                mismatch++;
+                        }
+                }
+                if (memcmp(expect_data, got_data, sizeof(got_data))) {
+                        mismatch++;
+                }
+        }
+        printf("%u tracks, good sectors legacy: %u new: %u, mismatch: %u\n",
+                        TRACKS, good_legacy, good_new, mismatch);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                for (unsigned int i = 0; i < TRACKS; i++) {
+                        legacy_decode_track(tracks[i], expect, expect_data);
+                }
+        }
+        bench_report("legacy parse + malloc, per track", bench_now() - t,
+                                        iterations * TRACKS, TRACK_BYTES);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                for (unsigned int i = 0; i < TRACKS; i++) {
+                        amiga_decode_sectors(tracks[i], AMIGA_SECTORS_PER_TRACK,
+                                                        got, got_data);
+                }
+        }
+        bench_report("amiga_decode_sectors, per track", bench_now() - t,
+                                        iterations * TRACKS, TRACK_BYTES);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                for (unsigned int i = 0; i < TRACKS; i++) {
+                        amiga_decode_sectors(tracks[i], AMIGA_SECTORS_PER_TRACK,
+                                                        got, NULL);
+                }
+        }
+        bench_report("checksums only, per track", bench_now() - t,
+                                        iterations * TRACKS, TRACK_BYTES);
+
+        // Start the revolution somewhere in the track, like the index does.
+        unsigned int placed = 0, wrong_place = 0;
+        struct amiga_track map;
+        for (unsigned int i = 0; i < TRACKS; i++) {
+                static uint32_t rotated[BENCH_MAX_TRACK_SAMPLES];
+                const size_t count = bench_amiga_track(flux[i],
+                                BENCH_MAX_TRACK_SAMPLES, i, 40, &seed);
+                const size_t start = rand_r(&seed) % count;
+
+                memcpy(rotated, flux[i] + start, (count - start) * sizeof(*rotated));
+                memcpy(rotated + count - start, flux[i], start * sizeof(*rotated));
+                memcpy(flux[i], rotated, count * sizeof(*rotated));
+                flux_counts[i] = count;
+
+                amiga_decode_track(flux[i], count, NULL, &map, tracks[i], got_data);
+                for (unsigned int s = 0; s < AMIGA_SECTORS_PER_TRACK; s++) {
+                        if (!map.sectors[s].found) {
+                                continue;
+                        }
+                        placed++;
+                        if (((be32toh(map.sectors[s].sector.header_info) >> 8) & 0xff) != s
+                                        || map.sectors[s].data != got_data
+                                        + (map.sectors[s].mfm - tracks[i])
+                                        / AMIGA_MFM_SECTOR_SIZE * AMIGA_SECTOR_DATA_SIZE) {
+                                wrong_place++;
+                        }
+                }
+        }
+        printf("from flux: %u of %u sectors placed, %u in the wrong place\n",
+                        placed, TRACKS * AMIGA_SECTORS_PER_TRACK, wrong_place);
+        mismatch += wrong_place;
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations / 10; it++) {
+                for (unsigned int i = 0; i < TRACKS; i++) {
+                        amiga_decode_track(flux[i], flux_counts[i], NULL, &map,
+                                                        tracks[i], got_data);
+                }
+        }
+        bench_report("amiga_decode_track, per track", bench_now() - t,
+                                        iterations / 10 * TRACKS,
+                                        flux_counts[0] * sizeof(uint32_t));
+
+        return mismatch ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,150 @@
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "../caps_parser/caps_parser.h"
+#include "../mfm_utils/amiga_decode.h"
+
+/*
+ * IPF parsing: open an image and decode the bitstream of every track,
+ * one at a time as write_flux did, and all at once into the track cache.
+ */
+
+#define TRACKS          160
+
+static void open_image(FILE *fp)
+{
+        const struct CapsImage *image;
+
+        rewind(fp);
+        struct caps_parser *parser = caps_parser_init(fp);
+        if (!parser) {
+                return;
+        }
+        for (unsigned int i = 0; i < TRACKS; i++) {
+                caps_parser_get_caps_image_for_track_and_head(parser,
+                                                &image, i >> 1, i & 1);
+        }
+        caps_parser_cleanup(parser);
+}
+
+static unsigned int decode_image(FILE *fp, bool check)
+{
+        struct amiga_sector sectors[AMIGA_SECTORS_PER_TRACK];
+        unsigned int good = 0;
+
+        rewind(fp);
+        struct caps_parser *parser = caps_parser_init(fp);
+        if (!parser) {
+                return 0;
+        }
+        for (unsigned int i = 0; i < TRACKS; i++) {
+                const struct CapsImage *image;
+                if (!caps_parser_get_caps_image_for_track_and_head(parser,
+                                                &image, i >> 1, i & 1)) {
+                        continue;
+                }
+                uint8_t *bitstream = caps_parser_get_bitstream_for_track(parser,
+                                                                        image);
+                if (bitstream && check) {
+                        good += amiga_decode_sectors(bitstream,
+                                AMIGA_SECTORS_PER_TRACK, sectors, NULL);
+                }
+                free(bitstream);
+        }
+        caps_parser_cleanup(parser);
+
+        return good;
+}
+
+// The cached tracks must be the same as decoding them one by one.
+static unsigned int check_cache(FILE *fp)
+{
+        unsigned int mismatch = 0;
+
+        rewind(fp);
+        struct caps_parser *parser = caps_parser_init(fp);
+        if (!parser || caps_parser_decode_all(parser, 0) != TRACKS) {
+                return 1;
+        }
+        for (unsigned int i = 0; i < TRACKS; i++) {
+                const struct CapsImage *image;
+                uint32_t bits;
+
+                caps_parser_get_caps_image_for_track_and_head(parser,
+                                                &image, i >> 1, i & 1);
+                uint8_t *expect = caps_parser_get_bitstream_for_track(parser,
+                                                                        image);
+                const uint8_t *got = caps_parser_get_track(parser, i >> 1,
+                                                                i & 1, &bits);
+                if (!expect || !got || bits != be32toh(image->trkbits)
+                                || memcmp(expect, got, bits >> 3)) {
+                        mismatch++;
+                }
+                free(expect);
+        }
+        caps_parser_cleanup(parser);
+
+        return mismatch;
+}
+
+static void decode_all(FILE *fp, unsigned int workers)
+{
+        rewind(fp);
+        struct caps_parser *parser = caps_parser_init(fp);
+        if (parser) {
+                caps_parser_decode_all(parser, workers);
+                caps_parser_cleanup(parser);
+        }
+}
+
+int main(int argc, char **argv)
+{
+        const unsigned int iterations = argc > 1 ? atoi(argv[1]) : 50;
+        unsigned int seed = 1;
+        double t;
+
+        FILE *fp = tmpfile();
+        if (!fp || bench_amiga_ipf(fp, TRACKS, &seed) != 0) {
+                fprintf(stderr, "Could not write the IPF image\n");
+                return EXIT_FAILURE;
+        }
+
+        const unsigned int good = decode_image(fp, true);
+        const unsigned int mismatch = check_cache(fp);
+        printf("%u tracks, good sectors: %u of %u, cache mismatch: %u\n",
+                TRACKS, good, TRACKS * AMIGA_SECTORS_PER_TRACK, mismatch);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                open_image(fp);
+        }
+        bench_report("open + find all tracks", bench_now() - t,
+                                                        iterations, 0);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                decode_image(fp, false);
+        }
+        t = bench_now() - t;
+        bench_report("open + decode all tracks", t, iterations, 0);
+        bench_report("open + decode, per track", t, iterations * TRACKS, 0);
+
+        for (unsigned int workers = 1; workers <= 4; workers *= 2) {
+                char name[64];
+
+                t = bench_now();
+                for (unsigned int it = 0; it < iterations; it++) {
+                        decode_all(fp, workers);
+                }
+                snprintf(name, sizeof(name), "open + decode_all, %u thread%s",
+                                        workers, workers > 1 ? "s" : "");
+                bench_report(name, bench_now() - t, iterations, 0);
+        }
+
+        fclose(fp);
+        return good == TRACKS * AMIGA_SECTORS_PER_TRACK && !mismatch
+                                        ? EXIT_SUCCESS : EXIT_FAILURE;
+}
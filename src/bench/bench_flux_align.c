@@ -0,0 +1,223 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "../flux_data.h"
+
+/*
+ * Lining up the revolutions of a read: the double precision xcorr that
+ * flux_data.c had, at its +/-10 window and at the new default, against
+ * flux_align().
+ *
+ * Each revolution is the same track, turned by a few samples as if the
+ * index pulse came a bit early or late, with jitter on every sample.
+ *
+ * Then flux_average() over AVERAGE_REVOLUTIONS of a track three times
+ * as long, and how much closer to the track it gets than one revolution.
+ */
+
+#define REVOLUTIONS     5
+#define JITTER          8
+#define AVERAGE_REVOLUTIONS     64
+#define AVERAGE_REPEAT          3
+
+static const int turn[REVOLUTIONS] = { 0, 7, -13, 40, -55 };
+
+// xcorr() from flux_data.c, with the window as a parameter.
+static int legacy_xcorr(const uint32_t *x, const uint32_t *y, int len,
+                                double mx, double sx, int window)
+{
+        int i, j, delay, best_delay;
+        double my, sy, sxy, denom, r;
+
+        my = 0;
+        for (i = 0; i < len; i++)
+                my += y[i];
+        my /= len;
+
+        sy = 0;
+        for (i = 0; i < len; i++)
+                sy += (y[i] - my) * (y[i] - my);
+        denom = sqrt(sx * sy);
+
+        r = 0;
+        best_delay = 0;
+        for (delay = -window; delay < window; delay++) {
+                sxy = 0;
+                for (i = 0; i < len; i++) {
+                        j = i + delay;
+                        if (j < 0 || j >= len)
+                                continue;
+                        sxy += (x[i] - mx) * (y[j] - my);
+                }
+                if (sxy / denom > r) {
+                        r = sxy / denom;
+                        best_delay = delay;
+                }
+        }
+        return best_delay;
+}
+
+static void legacy_align(const uint32_t *data, const int *starts, int len,
+                                                int window, int *delay)
+{
+        double mx = 0, sx = 0;
+        int i;
+
+        for (i = 0; i < len; i++)
+                mx += data[i];
+        mx /= len;
+        for (i = 0; i < len; i++)
+                sx += (data[i] - mx) * (data[i] - mx);
+
+        delay[0] = 0;
+        for (int rev = 1; rev < REVOLUTIONS; rev++)
+                delay[rev] = legacy_xcorr(data, data + starts[rev], len,
+                                                        mx, sx, window);
+}
+
+static unsigned int misses(const int *delay, int scale)
+{
+        unsigned int miss = 0;
+
+        for (int rev = 0; rev < REVOLUTIONS; rev++) {
+                const int d = delay[rev] >= 0
+                        ? (delay[rev] + scale / 2) / scale
+                        : -((-delay[rev] + scale / 2) / scale);
+                miss += d != turn[rev];
+        }
+        return miss;
+}
+
+static int bench_average(const uint32_t *base, int n, unsigned int iterations,
+                                                        unsigned int *seed)
+{
+        const int len = n * AVERAGE_REPEAT;
+        uint32_t *data, *mean, *variance;
+        uint32_t rev_offsets[AVERAGE_REVOLUTIONS];
+        struct flux_data *fd = NULL;
+        int rc = EXIT_FAILURE;
+        uint64_t error_one = 0, error_mean = 0, spread = 0;
+        double t;
+
+        data = malloc(sizeof(*data) * len * AVERAGE_REVOLUTIONS);
+        mean = malloc(sizeof(*mean) * len);
+        variance = malloc(sizeof(*variance) * len);
+        if (!data || !mean || !variance) {
+                fprintf(stderr, "Couldn't allocate average buffers\n");
+                goto out;
+        }
+
+        for (int rev = 0; rev < AVERAGE_REVOLUTIONS; rev++) {
+                for (int i = 0; i < len; i++)
+                        data[rev * len + i] = base[i % n]
+                                + rand_r(seed) % (2 * JITTER + 1) - JITTER;
+                rev_offsets[rev] = (rev + 1) * len;
+        }
+
+        fd = flux_data_init(data, len * AVERAGE_REVOLUTIONS, rev_offsets,
+                                AVERAGE_REVOLUTIONS, FLUX_ALIGN_WINDOW);
+        if (!fd) {
+                fprintf(stderr, "flux_data_init failed\n");
+                goto out;
+        }
+
+        const int count = flux_average(fd, mean, variance);
+        for (int i = 0; i < fd->len; i++) {
+                error_one += abs((int)data[i] - (int)base[i % n]);
+                error_mean += abs((int)mean[i] - (int)base[i % n]);
+                spread += variance[i];
+        }
+        printf("%d revolutions of %d samples averaged, mean error %.2f "
+                "-> %.2f counts, variance %.1f (jitter %.1f)\n",
+                AVERAGE_REVOLUTIONS, count, (double)error_one / fd->len,
+                (double)error_mean / fd->len, (double)spread / fd->len,
+                ((2 * JITTER + 1) * (2 * JITTER + 1) - 1) / 12.0);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++)
+                flux_average(fd, mean, variance);
+        bench_report("flux_average with variance, per read", bench_now() - t,
+                iterations, (size_t)len * AVERAGE_REVOLUTIONS * sizeof(*data));
+
+        rc = EXIT_SUCCESS;
+out:
+        if (fd)
+                flux_data_free(fd);
+        free(data);
+        free(mean);
+        free(variance);
+        return rc;
+}
+
+int main(int argc, char **argv)
+{
+        const unsigned int iterations = argc > 1 ? atoi(argv[1]) : 5;
+        static uint32_t base[BENCH_MAX_TRACK_SAMPLES];
+        static uint32_t data[BENCH_MAX_TRACK_SAMPLES * REVOLUTIONS];
+        uint32_t rev_offsets[REVOLUTIONS];
+        int starts[REVOLUTIONS], delay[REVOLUTIONS], shift[REVOLUTIONS];
+        unsigned int seed = 1;
+        double t;
+
+        const int n = bench_amiga_track(base, BENCH_MAX_TRACK_SAMPLES, 2, 0,
+                                                                        &seed);
+        for (int rev = 0; rev < REVOLUTIONS; rev++) {
+                uint32_t *out = data + rev * n;
+                for (int i = 0; i < n; i++) {
+                        const int from = ((i - turn[rev]) % n + n) % n;
+                        out[i] = base[from] + rand_r(&seed) % (2 * JITTER + 1)
+                                                                - JITTER;
+                }
+                starts[rev] = rev * n;
+                rev_offsets[rev] = (rev + 1) * n;
+        }
+        const int len = n - FLUX_ALIGN_WINDOW;
+        printf("%d revolutions of %d samples\n", REVOLUTIONS, n);
+
+        legacy_align(data, starts, len, 10, delay);
+        printf("legacy +/-10 misses: %u\n", misses(delay, 1));
+        legacy_align(data, starts, len, FLUX_ALIGN_WINDOW, delay);
+        printf("legacy +/-%d misses: %u\n", FLUX_ALIGN_WINDOW,
+                                                        misses(delay, 1));
+        flux_align(data, starts, len, REVOLUTIONS, FLUX_ALIGN_WINDOW, shift);
+        printf("flux_align misses: %u, shifts:", misses(shift, FLUX_SHIFT_ONE));
+        for (int rev = 0; rev < REVOLUTIONS; rev++)
+                printf(" %.2f", (double)shift[rev] / FLUX_SHIFT_ONE);
+        printf("\n");
+
+        struct flux_data *fd = flux_data_init(data, n * REVOLUTIONS,
+                        rev_offsets, REVOLUTIONS, FLUX_ALIGN_WINDOW);
+        if (!fd) {
+                fprintf(stderr, "flux_data_init failed\n");
+                return EXIT_FAILURE;
+        }
+        printf("flux_data_init idx_pos:");
+        for (int rev = 0; rev < REVOLUTIONS; rev++)
+                printf(" %d", fd->idx_pos[rev] - starts[rev]);
+        printf("\n");
+        flux_data_free(fd);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++)
+                legacy_align(data, starts, len, 10, delay);
+        bench_report("legacy double xcorr +/-10, per read", bench_now() - t,
+                                iterations, (size_t)n * REVOLUTIONS * 4);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++)
+                legacy_align(data, starts, len, FLUX_ALIGN_WINDOW, delay);
+        bench_report("legacy double xcorr +/-64, per read", bench_now() - t,
+                                iterations, (size_t)n * REVOLUTIONS * 4);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++)
+                flux_align(data, starts, len, REVOLUTIONS, FLUX_ALIGN_WINDOW,
+                                                                        shift);
+        bench_report("flux_align int16 +/-64, per read", bench_now() - t,
+                                iterations, (size_t)n * REVOLUTIONS * 4);
+
+        return bench_average(base, n, iterations, &seed);
+}
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "../mfm_utils/mfm_bitstream.h"
+
+/*
+ * Flux to bitstream: every kernel built for this target against the
+ * scalar reference, first for equal output, then for speed.
+ */
+
+#define TRACKS          32
+#define OUT_SIZE        (BENCH_MAX_TRACK_SAMPLES)
+
+static uint32_t samples[TRACKS][BENCH_MAX_TRACK_SAMPLES];
+static size_t counts[TRACKS];
+static uint8_t expect[OUT_SIZE + 1];
+static uint8_t got[OUT_SIZE + 1];
+
+static unsigned int check(const struct mfm_bitstream_kernel *k,
+                const uint32_t *in, size_t count, size_t out_size)
+{
+        memset(expect, 0x55, sizeof(expect));
+        memset(got, 0xaa, sizeof(got));
+
+        const size_t n = mfm_flux_to_bitstream_scalar(in, count, expect, out_size);
+        const size_t m = k->convert(in, count, got, out_size);
+
+        // Also catches writes past out_size, the guard bytes differ.
+        if (n != m || memcmp(expect, got, out_size)
+                        || got[out_size] != 0xaa) {
+                fprintf(stderr, "%s: mismatch, %zu samples into %zu bytes: "
+                                "used %zu, expected %zu\n",
+                                k->name, count, out_size, m, n);
+                return 1;
+        }
+        return 0;
+}
+
+static unsigned int check_kernel(const struct mfm_bitstream_kernel *k)
+{
+        static uint32_t noise[4096];
+        unsigned int seed = 7, mismatch = 0;
+
+        // Odd lengths, edge values and the top bit set.
+        for (size_t i = 0; i < 4096; i++) {
+                static const uint32_t edges[] = {
+                        0, 500, 501, 700, 701, 0x80000000, 0xffffffff
+                };
+                noise[i] = i & 3 ? rand_r(&seed) % 900
+                                 : edges[rand_r(&seed) % 7];
+        }
+        for (size_t count = 0; count < 64; count++) {
+                for (size_t out_size = 0; out_size < 48; out_size++) {
+                        mismatch += check(k, noise, count, out_size);
+                }
+        }
+        for (unsigned int r = 0; r < 200; r++) {
+                const size_t offset = rand_r(&seed) % 1024;
+                mismatch += check(k, noise + offset,
+                                rand_r(&seed) % (4096 - offset),
+                                rand_r(&seed) % 2048);
+        }
+
+        for (unsigned int i = 0; i < TRACKS; i++) {
+                mismatch += check(k, samples[i], counts[i], 1088 * 11 - 4);
+                mismatch += check(k, samples[i], counts[i], OUT_SIZE);
+        }
+
+        return mismatch;
+}
+
+int main(int argc, char **argv)
+{
+        const unsigned int iterations = argc > 1 ? atoi(argv[1]) : 20;
+        size_t total_samples = 0;
+        unsigned int seed = 1, mismatch = 0;
+
+        for (unsigned int i = 0; i < TRACKS; i++) {
+                counts[i] = bench_amiga_track(samples[i],
+                                BENCH_MAX_TRACK_SAMPLES, i, 40, &seed);
+                total_samples += counts[i];
+        }
+        printf("%u tracks, %zu samples, best kernel: %s\n", TRACKS,
+                        total_samples, mfm_flux_to_bitstream_kernel());
+
+        for (const struct mfm_bitstream_kernel *k = mfm_bitstream_kernels;
+                                                        k->name; k++) {
+                if (!k->supported()) {
+                        printf("%s: not supported on this CPU\n", k->name);
+                        continue;
+                }
+                unsigned int bad = check_kernel(k);
+                printf("%s: %s\n", k->name, bad ? "MISMATCH" : "same as scalar");
+                mismatch += bad;
+        }
+
+        for (const struct mfm_bitstream_kernel *k = mfm_bitstream_kernels;
+                                                        k->name; k++) {
+                if (!k->supported()) {
+                        continue;
+                }
+                double t = bench_now();
+                for (unsigned int it = 0; it < iterations; it++) {
+                        for (unsigned int i = 0; i < TRACKS; i++) {
+                                k->convert(samples[i], counts[i], got, OUT_SIZE);
+                        }
+                }
+                char name[64];
+                snprintf(name, sizeof(name), "%s, per track", k->name);
+                bench_report(name, bench_now() - t, iterations * TRACKS,
+                                total_samples / TRACKS * sizeof(uint32_t));
+        }
+
+        return mismatch ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,160 @@
+#include <endian.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "../mfm_utils/mfm_encode.h"
+
+/*
+ * IPF data and gap bytes to MFM: the old bit by bit expansion into a
+ * malloc'd buffer, against mfm_encode_bytes(), per track of an amiga IPF.
+ */
+
+// One amiga track in an IPF: 0x00 0x00, the mark and 540 bytes a sector.
+#define SECTORS         11
+#define RUN_BYTES       540
+#define TRACK_BYTES     (SECTORS * (4 + 4 + 2 * RUN_BYTES))
+
+static uint8_t data[SECTORS][RUN_BYTES];
+static uint8_t expect[TRACK_BYTES];
+static uint8_t got[TRACK_BYTES + 1];
+
+// ipf_to_mfm() and parse_ipf_samples() from caps_parser.c, as the reference.
+static inline uint16_t legacy_ipf_to_mfm(uint8_t ipf)
+{
+        uint16_t mfm = 0;
+        size_t bit = 0x80;
+
+        while(bit) {
+                mfm <<= 2;
+                if (ipf & bit) {
+                        mfm |= 0x01;
+                } else if ((mfm & 0x04) == 0) {
+                        mfm |= 0x02;
+                }
+                bit >>= 1;
+        }
+
+        return htobe16(mfm);
+}
+
+static uint16_t *legacy_parse_ipf_samples(const uint8_t *samples,
+                                size_t num_samples, uint16_t prev_sample)
+{
+        uint16_t *mfm_samples = malloc(num_samples * 2);
+        if (!mfm_samples) {
+                return NULL;
+        }
+
+        for (unsigned int i = 0; i < num_samples; ++i) {
+                mfm_samples[i] = legacy_ipf_to_mfm(samples[i]);
+                if (prev_sample & htobe16(0x0001)) {
+                        mfm_samples[i] &= ~htobe16(1 << 15);
+                }
+                prev_sample = mfm_samples[i];
+        }
+
+        return mfm_samples;
+}
+
+// As read_track_to_bitstream() did, for little endian hosts.
+static uint8_t legacy_encode(const uint8_t *in, size_t count, uint8_t prev,
+                                                                uint8_t *out)
+{
+        uint16_t *mfm = legacy_parse_ipf_samples(in, count, prev << 8);
+        if (!mfm) {
+                return prev;
+        }
+        memcpy(out, mfm, count * 2);
+        prev = mfm[count - 1] >> 8;
+        free(mfm);
+        return prev;
+}
+
+static const uint8_t mark[4] = { 0x44, 0x89, 0x44, 0x89 };
+static const uint8_t zeros[2];
+
+static size_t encode_track(uint8_t *out, bool legacy)
+{
+        uint8_t prev = 0xaa;
+        size_t n = 0;
+
+        for (unsigned int s = 0; s < SECTORS; s++) {
+                if (legacy) {
+                        prev = legacy_encode(zeros, 2, prev, out + n);
+                } else {
+                        prev = mfm_encode_bytes(zeros, 2, prev, out + n);
+                }
+                n += 4;
+                // The mark is copied as it is.
+                memcpy(out + n, mark, sizeof(mark));
+                prev = mark[3];
+                n += 4;
+                if (legacy) {
+                        prev = legacy_encode(data[s], RUN_BYTES, prev, out + n);
+                } else {
+                        prev = mfm_encode_bytes(data[s], RUN_BYTES, prev, out + n);
+                }
+                n += 2 * RUN_BYTES;
+        }
+        return n;
+}
+
+int main(int argc, char **argv)
+{
+        const unsigned int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+        static uint8_t noise[4096];
+        unsigned int seed = 1, mismatch = 0;
+        double t;
+
+        for (size_t i = 0; i < sizeof(noise); i++) {
+                noise[i] = rand_r(&seed);
+        }
+        // Every length and start, with both kinds of byte before it.
+        for (size_t count = 1; count < 80; count++) {
+                for (unsigned int r = 0; r < 64; r++) {
+                        const size_t offset = rand_r(&seed) % 2048;
+                        const uint8_t prev = rand_r(&seed);
+
+                        memset(got, 0x5a, sizeof(got));
+                        const uint8_t a = legacy_encode(noise + offset, count,
+                                                        prev, expect);
+                        const uint8_t b = mfm_encode_bytes(noise + offset, count,
+                                                        prev, got);
+                        if (a != b || memcmp(expect, got, count * 2)
+                                                || got[count * 2] != 0x5a) {
+                                mismatch++;
+                        }
+                }
+        }
+
+        for (unsigned int s = 0; s < SECTORS; s++) {
+                for (unsigned int i = 0; i < RUN_BYTES; i++) {
+                        data[s][i] = rand_r(&seed);
+                }
+        }
+        encode_track(expect, true);
+        encode_track(got, false);
+        if (memcmp(expect, got, TRACK_BYTES)) {
+                mismatch++;
+        }
+        printf("mismatch: %u\n", mismatch);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                encode_track(got, true);
+        }
+        bench_report("legacy bitwise + malloc, per track", bench_now() - t,
+                                                iterations, TRACK_BYTES);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                encode_track(got, false);
+        }
+        bench_report("mfm_encode_bytes, per track", bench_now() - t,
+                                                iterations, TRACK_BYTES);
+
+        return mismatch ? EXIT_FAILURE : EXIT_SUCCESS;
+}
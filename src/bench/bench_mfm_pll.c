@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench_util.h"
+#include "../mfm_utils/mfm_utils.h"
+#include "../mfm_utils/mfm_pll.h"
+
+/*
+ * PLL data separator: good sectors from drives at the wrong speed,
+ * with the fixed 2us cells and with the PLL, then the time per track.
+ */
+
+#define TRACKS          40
+
+static uint32_t samples[TRACKS][BENCH_MAX_TRACK_SAMPLES];
+static size_t counts[TRACKS];
+static uint8_t track_buffer[AMIGA_SECTORS_PER_TRACK * AMIGA_MFM_SECTOR_SIZE];
+
+enum decoder { FIXED, PLL, PLL_ESTIMATE };
+
+static unsigned int decode_track(enum decoder decoder,
+                                const uint32_t *in, size_t count)
+{
+        const struct mfm_pll_opts defaults = MFM_PLL_OPTS_DEFAULT;
+        struct mfm_pll_opts opts = defaults;
+        struct mfm_stream stream;
+        struct mfm_pll pll;
+        unsigned int good = 0;
+
+        mfm_stream_init(&stream, track_buffer);
+        if (decoder != FIXED) {
+                if (decoder == PLL_ESTIMATE) {
+                        opts.cell = mfm_pll_estimate_cell(in, count);
+                }
+                mfm_pll_init(&pll, &opts);
+                stream.pll = &pll;
+        }
+        mfm_stream_feed(&stream, in, count);
+        mfm_stream_finish(&stream);
+
+        for (unsigned int i = 0; i < stream.sector_count; i++) {
+                const struct mfm_stream_sector *s = &stream.sectors[i];
+                if (s->rc == 0 && s->sector.header_checksum_ok
+                                        && s->sector.data_checksum_ok) {
+                        good++;
+                }
+        }
+        return good;
+}
+
+static size_t make_tracks(unsigned int jitter, double speed, double wow)
+{
+        unsigned int seed = 1;
+        size_t total = 0;
+
+        for (unsigned int i = 0; i < TRACKS; i++) {
+                counts[i] = bench_amiga_track_drift(samples[i],
+                        BENCH_MAX_TRACK_SAMPLES, i, jitter, speed, wow, &seed);
+                total += counts[i];
+        }
+        return total;
+}
+
+int main(int argc, char **argv)
+{
+        const unsigned int iterations = argc > 1 ? atoi(argv[1]) : 20;
+        static const struct {
+                unsigned int jitter;
+                double speed;
+                double wow;
+        } drives[] = {
+                { 40, 1.00, 0.00 },
+                { 40, 1.06, 0.00 },
+                { 40, 0.94, 0.00 },
+                { 40, 1.10, 0.00 },
+                { 40, 0.90, 0.00 },
+                { 40, 1.00, 0.06 },
+                { 40, 1.05, 0.05 },
+                { 60, 1.06, 0.02 },
+                { 70, 0.95, 0.03 },
+                { 40, 1.12, 0.03 },
+        };
+        unsigned int worse = 0;
+
+        printf("good sectors of %u          fixed    pll  pll+estimate\n",
+                                        TRACKS * AMIGA_SECTORS_PER_TRACK);
+        for (size_t d = 0; d < sizeof(drives) / sizeof(*drives); d++) {
+                unsigned int good[3] = {0};
+
+                make_tracks(drives[d].jitter, drives[d].speed, drives[d].wow);
+                for (unsigned int i = 0; i < TRACKS; i++) {
+                        good[FIXED] += decode_track(FIXED, samples[i], counts[i]);
+                        good[PLL] += decode_track(PLL, samples[i], counts[i]);
+                        good[PLL_ESTIMATE] += decode_track(PLL_ESTIMATE,
+                                                samples[i], counts[i]);
+                }
+                printf("jitter %2u speed %.2f wow %.2f %6u %6u %6u\n",
+                        drives[d].jitter, drives[d].speed, drives[d].wow,
+                        good[FIXED], good[PLL], good[PLL_ESTIMATE]);
+                if (good[PLL_ESTIMATE] < good[FIXED]) {
+                        worse++;
+                }
+        }
+
+        // A revolution is 200 ms, the decode should be a small part of that.
+        const size_t total = make_tracks(40, 1.0, 0.0);
+        const size_t per_track = total / TRACKS * sizeof(uint32_t);
+        double t;
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                for (unsigned int i = 0; i < TRACKS; i++) {
+                        decode_track(FIXED, samples[i], counts[i]);
+                }
+        }
+        bench_report("stream fixed, per track", bench_now() - t,
+                                        iterations * TRACKS, per_track);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                for (unsigned int i = 0; i < TRACKS; i++) {
+                        decode_track(PLL, samples[i], counts[i]);
+                }
+        }
+        bench_report("stream pll, per track", bench_now() - t,
+                                        iterations * TRACKS, per_track);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                for (unsigned int i = 0; i < TRACKS; i++) {
+                        decode_track(PLL_ESTIMATE, samples[i], counts[i]);
+                }
+        }
+        bench_report("stream pll+estimate, per track", bench_now() - t,
+                                        iterations * TRACKS, per_track);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                for (unsigned int i = 0; i < TRACKS; i++) {
+                        struct mfm_pll pll;
+                        const struct mfm_pll_opts opts = MFM_PLL_OPTS_DEFAULT;
+                        mfm_pll_init(&pll, &opts);
+                        mfm_pll_to_bitstream(&pll, samples[i], counts[i],
+                                        track_buffer, sizeof(track_buffer));
+                }
+        }
+        bench_report("pll to bitstream, per track", bench_now() - t,
+                                        iterations * TRACKS, per_track);
+
+        return worse ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,148 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench_util.h"
+#include "../mfm_utils/mfm_sync.h"
+
+/*
+ * Sync search: the per-sample ring buffer compare read_flux used to have,
+ * against mfm_sync_find_all().
+ */
+
+#define TRACKS          160
+#define MAX_HITS        64
+
+/*
+ * The old find_sync_marker() from read_flux.c, as the reference.
+ */
+static bool legacy_find_sync_marker(const uint32_t *samples, int sample_count,
+                                                                size_t *index)
+{
+        enum sample_type { UNDEF, MS4, MS6, MS8 };
+        static const enum sample_type sync[10] = {
+                MS4, MS8, MS6, MS8, MS6, // 0x4489
+                MS4, MS8, MS6, MS8, MS6  // 0x4489
+        };
+        enum sample_type ring_buffer[10] = {UNDEF};
+
+        for (int i = *index; i < sample_count; i++) {
+                if (samples[i] > 700) {
+                        ring_buffer[i % 10] = MS8;
+                } else if (samples[i] > 500) {
+                        ring_buffer[i % 10] = MS6;
+                } else {
+                        ring_buffer[i % 10] = MS4;
+                }
+
+                int r_index = (i - 10);
+                if (r_index < 0) continue;
+
+                bool found = true;
+                for (int e = 0; e < 10; e++) {
+                        if (sync[e] != ring_buffer[(r_index + e) % 10]) {
+                                found = false;
+                                break;
+                        }
+                }
+                if (found) {
+                        *index = i - 10;
+                        return true;
+                }
+        }
+        return false;
+}
+
+static size_t legacy_find_all(const uint32_t *samples, int sample_count,
+                                                size_t *positions, size_t max)
+{
+        size_t index = 0, count = 0;
+
+        while (count < max
+                && legacy_find_sync_marker(samples, sample_count, &index)) {
+                positions[count++] = index;
+                index += 10;
+        }
+        return count;
+}
+
+int main(int argc, char **argv)
+{
+        const unsigned int iterations = argc > 1 ? atoi(argv[1]) : 20;
+        static uint32_t samples[TRACKS][BENCH_MAX_TRACK_SAMPLES];
+        static size_t counts[TRACKS];
+        size_t positions[MAX_HITS];
+        struct mfm_sync_hit hits[MAX_HITS];
+        struct mfm_sync_search one, two;
+        size_t total_samples = 0, found_legacy = 0, found_new = 0;
+        unsigned int seed = 1, mismatch = 0;
+        double t;
+
+        const struct mfm_sync_pattern amiga[] = {
+                MFM_SYNC_AMIGA,
+                { .word = 0x912a912a, .bits = 32 },
+        };
+        if (!mfm_sync_search_init(&one, amiga, 1)
+                        || !mfm_sync_search_init(&two, amiga, 2)) {
+                return EXIT_FAILURE;
+        }
+
+        for (unsigned int i = 0; i < TRACKS; i++) {
+                counts[i] = bench_amiga_track(samples[i],
+                                BENCH_MAX_TRACK_SAMPLES, i, 40, &seed);
+                total_samples += counts[i];
+        }
+
+        // Same positions from both?
+        for (unsigned int i = 0; i < TRACKS; i++) {
+                size_t n = legacy_find_all(samples[i], counts[i],
+                                                        positions, MAX_HITS);
+                size_t m = mfm_sync_find_all(&one, samples[i], counts[i],
+                                                        hits, MAX_HITS);
+                found_legacy += n;
+                found_new += m;
+                for (size_t e = 0; e < n && e < m; e++) {
+                        if (positions[e] != hits[e].sample) {
+                                mismatch++;
+                        }
+                }
+                if (n != m) {
+                        mismatch++;
+                }
+        }
+        printf("%u tracks, %zu samples, syncs legacy: %zu new: %zu, "
+                        "mismatch: %u\n", TRACKS, total_samples,
+                        found_legacy, found_new, mismatch);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                for (unsigned int i = 0; i < TRACKS; i++) {
+                        found_legacy += legacy_find_all(samples[i], counts[i],
+                                                        positions, MAX_HITS);
+                }
+        }
+        bench_report("legacy ring buffer, per track", bench_now() - t,
+                                iterations * TRACKS, 0);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                for (unsigned int i = 0; i < TRACKS; i++) {
+                        found_new += mfm_sync_find_all(&one, samples[i],
+                                                counts[i], hits, MAX_HITS);
+                }
+        }
+        bench_report("mfm_sync 1 pattern, per track", bench_now() - t,
+                                iterations * TRACKS, 0);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                for (unsigned int i = 0; i < TRACKS; i++) {
+                        found_new += mfm_sync_find_all(&two, samples[i],
+                                                counts[i], hits, MAX_HITS);
+                }
+        }
+        bench_report("mfm_sync 2 patterns, per track", bench_now() - t,
+                                iterations * TRACKS, 0);
+
+        return mismatch ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,140 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "../mfm_utils/mfm_utils.h"
+
+/*
+ * Raw sectors of a track, as read_track_timing finds them: the old
+ * find_std_sector_headers() loop that shifts the whole sector along
+ * for every bit, against mfm_find_raw_sectors().
+ *
+ * ./bench-raw-sectors [iterations] [dump prefix] also runs over the
+ * recorded tracks <prefix>000 to <prefix>159, as read_track_timing saves
+ * them, for the ones that exist.
+ */
+
+#define SYNTHETIC_TRACKS        8
+#define MAX_TRACKS              (SYNTHETIC_TRACKS + 160)
+
+static void legacy_shift(uint8_t *data, int len, uint8_t bit)
+{
+        int i;
+        for (i = 0; i < len - 1; i++) {
+                data[i] <<= 1;
+                data[i] |= (data[i + 1] & 0x80) >> 7;
+        }
+        data[len - 1] <<= 1;
+        if (bit) data[len - 1] |= 1;
+}
+
+static bool legacy_check_sync(const uint8_t *sector)
+{
+        return !memcmp(sector + 4, "\x44\x89\x44\x89", 4);
+}
+
+#define LEGACY_BIT(b) do { \
+                legacy_shift(cur, AMIGA_MFM_SECTOR_SIZE, b); \
+                if (legacy_check_sync(cur)) { \
+                        if (!--count) goto done; \
+                        cur += AMIGA_MFM_SECTOR_SIZE; \
+                } \
+        } while (0)
+
+// The loop from find_std_sector_headers() in read_track_timing.c
+static int legacy_find_raw_sectors(const uint32_t *timing, int sample_count,
+                                        uint8_t *sectors, int max_sectors)
+{
+        uint8_t *cur = sectors;
+        int count = max_sectors;
+
+        memset(sectors, 0x00, max_sectors * AMIGA_MFM_SECTOR_SIZE);
+        for (int i = 0; i < sample_count; i++) {
+                if (timing[i] > 720)
+                        LEGACY_BIT(0);
+                if (timing[i] > 540)
+                        LEGACY_BIT(0);
+                LEGACY_BIT(0);
+                LEGACY_BIT(1);
+        }
+done:
+        return max_sectors - count;
+}
+
+static int load_dump(const char *prefix, unsigned int track, uint32_t *samples)
+{
+        char filename[512];
+        FILE *fp;
+        size_t n;
+
+        snprintf(filename, sizeof(filename), "%s%03u", prefix, track);
+        fp = fopen(filename, "rb");
+        if (!fp)
+                return 0;
+        n = fread(samples, sizeof(*samples), BENCH_MAX_TRACK_SAMPLES, fp);
+        fclose(fp);
+        return n;
+}
+
+int main(int argc, char **argv)
+{
+        const unsigned int iterations = argc > 1 ? atoi(argv[1]) : 1;
+        static uint32_t samples[MAX_TRACKS][BENCH_MAX_TRACK_SAMPLES];
+        static int counts[MAX_TRACKS];
+        static uint8_t legacy[AMIGA_SECTORS_PER_TRACK * AMIGA_MFM_SECTOR_SIZE];
+        static uint8_t found[AMIGA_SECTORS_PER_TRACK * AMIGA_MFM_SECTOR_SIZE];
+        unsigned int tracks = 0, recorded = 0, seed = 1, mismatch = 0;
+        size_t sectors_legacy = 0, sectors_new = 0;
+        double t;
+
+        for (unsigned int i = 0; i < SYNTHETIC_TRACKS; i++) {
+                counts[tracks] = bench_amiga_track(samples[tracks],
+                                BENCH_MAX_TRACK_SAMPLES, i, 40, &seed);
+                tracks++;
+        }
+        for (unsigned int i = 0; argc > 2 && i < 160; i++) {
+                counts[tracks] = load_dump(argv[2], i, samples[tracks]);
+                if (counts[tracks]) {
+                        tracks++;
+                        recorded++;
+                }
+        }
+
+        // The same bytes from both?
+        for (unsigned int i = 0; i < tracks; i++) {
+                const int n = legacy_find_raw_sectors(samples[i], counts[i],
+                                        legacy, AMIGA_SECTORS_PER_TRACK);
+                memset(found, 0x00, sizeof(found));
+                const int m = mfm_find_raw_sectors(samples[i], counts[i],
+                                        found, AMIGA_SECTORS_PER_TRACK);
+                sectors_legacy += n;
+                sectors_new += m;
+                if (n != m || memcmp(legacy, found, n * AMIGA_MFM_SECTOR_SIZE))
+                        mismatch++;
+        }
+        printf("%u tracks (%u recorded), sectors legacy: %zu new: %zu, "
+                        "mismatch: %u\n", tracks, recorded, sectors_legacy,
+                        sectors_new, mismatch);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                for (unsigned int i = 0; i < tracks; i++)
+                        legacy_find_raw_sectors(samples[i], counts[i], legacy,
+                                                AMIGA_SECTORS_PER_TRACK);
+        }
+        bench_report("legacy shift per bit, per track", bench_now() - t,
+                                                iterations * tracks, 0);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                for (unsigned int i = 0; i < tracks; i++)
+                        mfm_find_raw_sectors(samples[i], counts[i], found,
+                                                AMIGA_SECTORS_PER_TRACK);
+        }
+        bench_report("mfm_find_raw_sectors, per track", bench_now() - t,
+                                                iterations * tracks, 0);
+
+        return mismatch ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,139 @@
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "../scp_image.h"
+#include "../timing_arena.h"
+
+/*
+ * Replaying an SCP image: the flux of a whole disk, scaled from the
+ * mapped file into the write timing arena, against walking it only.
+ *
+ * The image is written to a temporary file first, in the layout of
+ * read_scp, with a few long samples to test the overflow entries.
+ */
+
+#define TRACKS          160
+#define REVOLUTIONS     5
+
+static const char *write_image(const char *filename, uint64_t *total_counts)
+{
+        static uint32_t samples[BENCH_MAX_TRACK_SAMPLES];
+        static uint16_t flux[BENCH_MAX_TRACK_SAMPLES * 2];
+        uint32_t table[TRACKS] = {0};
+        uint8_t header[0x10] = "SCP";
+        unsigned int seed = 1;
+        FILE *fp = fopen(filename, "w+b");
+
+        if (!fp)
+                return NULL;
+
+        header[0x5] = REVOLUTIONS;
+        header[0x7] = TRACKS - 1;
+        fwrite(header, 1, sizeof(header), fp);
+        fwrite(table, 1, sizeof(table), fp);
+
+        *total_counts = 0;
+        for (unsigned int track = 0; track < TRACKS; track++) {
+                const size_t n = bench_amiga_track(samples,
+                                BENCH_MAX_TRACK_SAMPLES, track, 40, &seed);
+                uint32_t revs[REVOLUTIONS * 3];
+                uint32_t count = 0, duration = 0;
+
+                // A blank stretch, longer than 16 bits of ticks.
+                samples[n / 2] = 400000;
+                for (size_t i = 0; i < n; i++) {
+                        uint32_t ticks = samples[i] * 2 / 5;
+                        duration += ticks;
+                        for (; ticks > UINT16_MAX; ticks -= 0x10000)
+                                flux[count++] = 0;
+                        flux[count++] = htobe16(ticks);
+                }
+                *total_counts += (uint64_t)duration * 5 / 2;
+
+                table[track] = htole32(ftell(fp));
+                for (unsigned int r = 0; r < REVOLUTIONS; r++) {
+                        revs[r * 3] = htole32(duration);
+                        revs[r * 3 + 1] = htole32(count);
+                        revs[r * 3 + 2] = htole32(4 + sizeof(revs)
+                                        + r * count * sizeof(*flux));
+                }
+                fwrite("TRK", 1, 3, fp);
+                fputc(track, fp);
+                fwrite(revs, 1, sizeof(revs), fp);
+                for (unsigned int r = 0; r < REVOLUTIONS; r++)
+                        fwrite(flux, sizeof(*flux), count, fp);
+        }
+
+        fseek(fp, sizeof(header), SEEK_SET);
+        fwrite(table, 1, sizeof(table), fp);
+        fclose(fp);
+
+        return filename;
+}
+
+int main(int argc, char **argv)
+{
+        const unsigned int iterations = argc > 1 ? atoi(argv[1]) : 20;
+        const char *filename = "/tmp/bench-scp-image.scp";
+        struct scp_image image;
+        struct timing_arena arena;
+        uint64_t expected_counts, counts = 0, walked = 0;
+        double t;
+
+        if (!write_image(filename, &expected_counts)
+                        || !scp_image_open(&image, filename)) {
+                fprintf(stderr, "Couldn't make %s\n", filename);
+                return EXIT_FAILURE;
+        }
+
+        // Same length of flux as went in? The long samples are cut to
+        // UINT16_MAX, and counted as they were.
+        timing_arena_init(&arena);
+        const int tracks = timing_arena_from_scp(&arena, &image, 3);
+        for (unsigned int track = 0; track < TRACKS; track++) {
+                size_t n = 0;
+                const uint16_t *timing = timing_arena_get(&arena, track, &n);
+                for (size_t i = 0; timing && i < n; i++)
+                        counts += timing[i] == UINT16_MAX ? 400000 : timing[i];
+        }
+        printf("%d tracks, %zu samples, %llu counts of 10 nSec, %llu in\n",
+                                tracks, arena.used,
+                                (unsigned long long)counts,
+                                (unsigned long long)expected_counts);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                for (unsigned int track = 0; track < TRACKS; track++) {
+                        struct scp_revolution rev;
+                        struct scp_flux_iter iter;
+                        uint32_t ticks;
+
+                        if (!scp_image_revolution(&image, track, 3, &rev))
+                                continue;
+                        scp_flux_iter_init(&iter, &rev);
+                        while (scp_flux_next(&iter, &ticks))
+                                walked += ticks;
+                }
+        }
+        bench_report("scp_flux_next, per track", bench_now() - t,
+                                iterations * TRACKS, 0);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                timing_arena_reset(&arena);
+                timing_arena_from_scp(&arena, &image, 3);
+        }
+        bench_report("timing_arena_from_scp, per track", bench_now() - t,
+                                iterations * TRACKS,
+                                arena.used * sizeof(*arena.samples) / TRACKS);
+        printf("%llu ticks walked\n", (unsigned long long)walked);
+
+        timing_arena_cleanup(&arena);
+        scp_image_close(&image);
+        remove(filename);
+
+        return EXIT_SUCCESS;
+}
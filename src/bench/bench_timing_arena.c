@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "../caps_parser/caps_parser.h"
+#include "../timing_arena.h"
+
+/*
+ * MFM bitstream to write timing: the bit by bit loop write_flux ran for
+ * each track, against the table, and a whole IPF into the arena.
+ */
+
+#define TRACKS          160
+#define MAX_SAMPLES     (1u << 16)
+
+static uint16_t expect[MAX_SAMPLES];
+static uint16_t got[MAX_SAMPLES];
+
+// bitstream_to_timing_samples() from write_flux.c, as the reference.
+static size_t legacy_timing(const uint8_t *bitstream, size_t track_size,
+                                                        uint16_t *samples)
+{
+        size_t sample_index = 0;
+        uint8_t counter = 0;
+
+        for (size_t i = 0; i < track_size; ++i) {
+                const uint8_t b = bitstream[i];
+                uint8_t bit = 0x80;
+                while(bit) {
+                        counter++;
+                        if (b & bit) {
+                                if (counter == 4) {
+                                        samples[sample_index++] = 800;
+                                } else if (counter == 3) {
+                                        samples[sample_index++] = 600;
+                                } else if (counter == 2) {
+                                        samples[sample_index++] = 400;
+                                }
+                                counter = 0;
+                        }
+                        bit >>= 1;
+                        if (sample_index >= MAX_SAMPLES) {
+                                return 0;
+                        }
+                }
+        }
+        return sample_index;
+}
+
+static unsigned int check(const uint8_t *bitstream, size_t bytes)
+{
+        const size_t n = legacy_timing(bitstream, bytes, expect);
+        const size_t m = timing_from_bitstream(bitstream, bytes, got);
+
+        return n != m || memcmp(expect, got, n * sizeof(*got));
+}
+
+int main(int argc, char **argv)
+{
+        const unsigned int iterations = argc > 1 ? atoi(argv[1]) : 50;
+        static uint8_t noise[8192];
+        struct timing_arena arena;
+        unsigned int seed = 1, mismatch = 0;
+        double t;
+
+        // Any bits, not only good MFM: 1s next to each other, long gaps.
+        for (size_t i = 0; i < sizeof(noise); i++) {
+                noise[i] = rand_r(&seed) & rand_r(&seed);
+        }
+        for (size_t bytes = 0; bytes < 64; bytes++) {
+                mismatch += check(noise + rand_r(&seed) % 4096, bytes);
+        }
+        mismatch += check(noise, sizeof(noise));
+
+        FILE *fp = tmpfile();
+        struct caps_parser *parser = NULL;
+        if (!fp || bench_amiga_ipf(fp, TRACKS, &seed) != 0
+                        || !(parser = caps_parser_init(fp))
+                        || caps_parser_decode_all(parser, 0) != TRACKS) {
+                fprintf(stderr, "Could not make the IPF image\n");
+                return EXIT_FAILURE;
+        }
+
+        timing_arena_init(&arena);
+        if (timing_arena_from_caps(&arena, parser) != TRACKS) {
+                mismatch++;
+        }
+        size_t samples = 0, bytes = 0;
+        for (unsigned int i = 0; i < TRACKS; i++) {
+                uint32_t bits;
+                size_t count;
+                const uint8_t *bitstream = caps_parser_get_track(parser,
+                                                        i >> 1, i & 1, &bits);
+                const uint16_t *timing = timing_arena_get(&arena, i, &count);
+
+                const size_t n = legacy_timing(bitstream, bits >> 3, expect);
+                if (!timing || n != count
+                                || memcmp(expect, timing, n * sizeof(*timing))) {
+                        mismatch++;
+                }
+                samples += count;
+                bytes += bits >> 3;
+        }
+        printf("%u tracks, %zu samples, mismatch: %u\n", TRACKS, samples,
+                                                                mismatch);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                for (unsigned int i = 0; i < TRACKS; i++) {
+                        uint32_t bits;
+                        const uint8_t *bitstream = caps_parser_get_track(parser,
+                                                        i >> 1, i & 1, &bits);
+                        legacy_timing(bitstream, bits >> 3, expect);
+                }
+        }
+        bench_report("legacy bit by bit, per track", bench_now() - t,
+                                        iterations * TRACKS, bytes / TRACKS);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                for (unsigned int i = 0; i < TRACKS; i++) {
+                        uint32_t bits;
+                        const uint8_t *bitstream = caps_parser_get_track(parser,
+                                                        i >> 1, i & 1, &bits);
+                        timing_from_bitstream(bitstream, bits >> 3, got);
+                }
+        }
+        bench_report("timing_from_bitstream, per track", bench_now() - t,
+                                        iterations * TRACKS, bytes / TRACKS);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                timing_arena_reset(&arena);
+                timing_arena_from_caps(&arena, parser);
+        }
+        bench_report("timing_arena_from_caps, disk", bench_now() - t,
+                                                        iterations, bytes);
+
+        timing_arena_cleanup(&arena);
+        caps_parser_cleanup(parser);
+        fclose(fp);
+        return mismatch ? EXIT_FAILURE : EXIT_SUCCESS;
+}
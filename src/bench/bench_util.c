@@ -0,0 +1,327 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench_util.h"
+
+double bench_now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief       Print time per iteration, and throughput if <bytes> is set.
+ */
+void bench_report(const char *name, double seconds, size_t iterations,
+                                                        size_t bytes)
+{
+        printf("%-32s %10.3f us/iter", name, seconds * 1e6 / iterations);
+        if (bytes) {
+                printf(" %10.1f MB/s",
+                        (double)bytes * iterations / seconds / (1024 * 1024));
+        }
+        printf("\n");
+}
+
+/* -------------------------------------------------------------------------
+ * Synthetic amiga track
+ * ---------------------------------------------------------------------- */
+
+#define TRACK_BITS      100000  // 200ms of 2us cells
+
+struct bitwriter {
+        uint8_t *bits;
+        size_t count;
+};
+
+static void put_bit(struct bitwriter *w, unsigned int bit)
+{
+        if (w->count < TRACK_BITS) {
+                w->bits[w->count++] = bit;
+        }
+}
+
+static void put_raw16(struct bitwriter *w, uint16_t word)
+{
+        for (int i = 15; i >= 0; i--) {
+                put_bit(w, (word >> i) & 1);
+        }
+}
+
+// Data bits on the even positions, with the MFM clock bits filled in.
+static void put_mfm_long(struct bitwriter *w, uint32_t value)
+{
+        for (int i = 31; i >= 0; i--) {
+                if (!(i & 1)) {
+                        put_bit(w, (value >> i) & 1);
+                } else {
+                        const unsigned int prev = w->count
+                                                ? w->bits[w->count - 1] : 0;
+                        const unsigned int next = (value >> (i - 1)) & 1;
+                        put_bit(w, !prev && !next);
+                }
+        }
+}
+
+static void put_amiga_sector(struct bitwriter *w, unsigned int track,
+                                unsigned int sector, unsigned int *seed)
+{
+        const uint32_t info = 0xff000000 | (track << 16) | (sector << 8)
+                                                        | (11 - sector);
+        uint32_t longs[2 + 8 + 2 + 2 + 256] = {0};
+        uint32_t data[128];
+        uint32_t checksum;
+        unsigned int i;
+
+        for (i = 0; i < 128; i++) {
+                data[i] = rand_r(seed);
+        }
+
+        longs[0] = (info >> 1) & 0x55555555;
+        longs[1] = info & 0x55555555;
+        // longs 2-9 is the sector label, left as zero.
+        checksum = 0;
+        for (i = 0; i < 10; i++) {
+                checksum ^= longs[i];
+        }
+        checksum &= 0x55555555;
+        longs[10] = (checksum >> 1) & 0x55555555;
+        longs[11] = checksum & 0x55555555;
+
+        checksum = 0;
+        for (i = 0; i < 128; i++) {
+                longs[14 + i] = (data[i] >> 1) & 0x55555555;
+                longs[14 + 128 + i] = data[i] & 0x55555555;
+                checksum ^= longs[14 + i] ^ longs[14 + 128 + i];
+        }
+        checksum &= 0x55555555;
+        longs[12] = (checksum >> 1) & 0x55555555;
+        longs[13] = checksum & 0x55555555;
+
+        put_raw16(w, 0xaaaa);
+        put_raw16(w, 0xaaaa);
+        put_raw16(w, 0x4489);
+        put_raw16(w, 0x4489);
+        for (i = 0; i < sizeof(longs) / sizeof(*longs); i++) {
+                put_mfm_long(w, longs[i]);
+        }
+}
+
+/**
+ * @brief       Make one revolution of flux for a formatted amiga track,
+ *              11 sectors with valid checksums and random data.
+ *
+ * @param       jitter          Random +/- ticks added to each sample.
+ *
+ * @return      The number of samples.
+ */
+size_t bench_amiga_track(uint32_t *samples, size_t max_samples,
+                unsigned int track, unsigned int jitter, unsigned int *seed)
+{
+        return bench_amiga_track_drift(samples, max_samples, track, jitter,
+                                                        1.0, 0.0, seed);
+}
+
+/**
+ * @brief       As bench_amiga_track(), from a drive that is not at
+ *              the right speed.
+ *
+ * @param       speed           Bitcell length, 1.0 is 2 uSec.
+ * @param       wow             The bitcell also changes by +/- this much,
+ *                              as a sine over the revolution.
+ */
+size_t bench_amiga_track_drift(uint32_t *samples, size_t max_samples,
+                unsigned int track, unsigned int jitter,
+                double speed, double wow, unsigned int *seed)
+{
+        struct bitwriter w = { .bits = calloc(TRACK_BITS, 1) };
+        size_t count = 0;
+        size_t last = 0;
+
+        if (!w.bits) {
+                return 0;
+        }
+
+        for (unsigned int sector = 0; sector < 11; sector++) {
+                put_amiga_sector(&w, track, sector, seed);
+        }
+        while (w.count < TRACK_BITS) {
+                put_raw16(&w, 0xaaaa);
+        }
+
+        for (size_t i = 1; i < w.count && count < max_samples; i++) {
+                if (!w.bits[i]) {
+                        continue;
+                }
+                const double cell = 200.0 * (speed
+                                + wow * sin(2 * M_PI * i / TRACK_BITS));
+                int sample = (int)((i - last) * cell + 0.5);
+                if (jitter) {
+                        sample += (int)(rand_r(seed) % (2 * jitter + 1))
+                                                                - (int)jitter;
+                }
+                samples[count++] = sample;
+                last = i;
+        }
+
+        free(w.bits);
+        return count;
+}
+
+/**
+ * @brief       The MFM of a formatted amiga track, as mfm_stream stores it:
+ *              11 sectors of aaaa aaaa 4489 4489 + 1080 bytes.
+ *
+ * @param       mfm             <OUT> 11 * 1088 bytes
+ */
+void bench_amiga_mfm_track(uint8_t *mfm, unsigned int track, unsigned int *seed)
+{
+        struct bitwriter w = { .bits = calloc(TRACK_BITS, 1) };
+        const size_t bytes = 11 * 1088;
+
+        memset(mfm, 0x00, bytes);
+        if (!w.bits) {
+                return;
+        }
+
+        for (unsigned int sector = 0; sector < 11; sector++) {
+                put_amiga_sector(&w, track, sector, seed);
+        }
+        for (size_t i = 0; i < bytes * 8 && i < w.count; i++) {
+                mfm[i >> 3] |= w.bits[i] << (7 - (i & 7));
+        }
+
+        free(w.bits);
+}
+
+/* -------------------------------------------------------------------------
+ * Synthetic IPF image
+ * ---------------------------------------------------------------------- */
+
+#define IPF_TRACK_BITS  100000
+// 0x00 0x00, the mark, 540 data bytes and the end, with their sample headers.
+#define IPF_BLOCK_BYTES (4 + 6 + 3 + 540 + 1)
+
+static void put_be32(FILE *fp, uint32_t value)
+{
+        const uint8_t b[4] = { value >> 24, value >> 16, value >> 8, value };
+        fwrite(b, 1, sizeof(b), fp);
+}
+
+static void put_chunk(FILE *fp, const char *name, uint32_t len)
+{
+        fwrite(name, 1, 4, fp);
+        put_be32(fp, len);
+        put_be32(fp, 0);        // crc, not checked
+}
+
+// The data bits of two MFM bytes.
+static uint8_t mfm_data_byte(const uint8_t *mfm)
+{
+        uint8_t data = 0;
+        for (int i = 0; i < 16; i += 2) {
+                const uint8_t byte = mfm[i >> 3];
+                data = (data << 1) | ((byte >> (6 - (i & 7))) & 1);
+        }
+        return data;
+}
+
+/**
+ * @brief       Write an SPS style IPF image of amiga tracks, as the IPF
+ *              files written to disk by write_flux.
+ *
+ * @detail      Each sector is one block: 0x00 0x00 as data, the 4489 4489
+ *              mark, and 540 data bytes, with the MFM of
+ *              bench_amiga_mfm_track(). The sectors decode with good
+ *              checksums.
+ *
+ * @param       tracks          Number of tracks, cylinder = track / 2 and
+ *                              head = track & 1.
+ *
+ * @return      0 on success, -1 if the file couldn't be written.
+ */
+int bench_amiga_ipf(FILE *fp, unsigned int tracks, unsigned int *seed)
+{
+        const uint32_t blocks = 11;
+        const uint32_t area_size = blocks * (32 + IPF_BLOCK_BYTES);
+        uint8_t mfm[11 * 1088];
+
+        put_chunk(fp, "CAPS", 12);
+
+        put_chunk(fp, "INFO", 12 + 84);
+        put_be32(fp, 1);                // FDD
+        put_be32(fp, 2);                // SPS encoder
+        put_be32(fp, 1);
+        put_be32(fp, 0);
+        put_be32(fp, 0);
+        put_be32(fp, 0);
+        put_be32(fp, 0);                // cylinders
+        put_be32(fp, (tracks + 1) / 2 - 1);
+        put_be32(fp, 0);                // heads
+        put_be32(fp, 1);
+        for (int i = 0; i < 11; i++) {
+                put_be32(fp, i == 2 ? 1 : 0); // Amiga
+        }
+
+        for (unsigned int track = 0; track < tracks; track++) {
+                put_chunk(fp, "IMGE", 12 + 68);
+                put_be32(fp, track >> 1);
+                put_be32(fp, track & 1);
+                put_be32(fp, 2);        // dentype: by track size
+                put_be32(fp, 1);        // 2 us cells
+                put_be32(fp, IPF_TRACK_BITS / 8);
+                put_be32(fp, 0);
+                put_be32(fp, 0);
+                put_be32(fp, sizeof(mfm) * 8);
+                put_be32(fp, IPF_TRACK_BITS - sizeof(mfm) * 8);
+                put_be32(fp, IPF_TRACK_BITS);
+                put_be32(fp, blocks);
+                put_be32(fp, 0);
+                put_be32(fp, 0);
+                put_be32(fp, track + 1);        // did
+                for (int i = 0; i < 3; i++) {
+                        put_be32(fp, 0);
+                }
+        }
+
+        for (unsigned int track = 0; track < tracks; track++) {
+                bench_amiga_mfm_track(mfm, track, seed);
+
+                put_chunk(fp, "DATA", 12 + 16);
+                put_be32(fp, area_size);
+                put_be32(fp, area_size * 8);
+                put_be32(fp, 0);
+                put_be32(fp, track + 1);
+
+                for (uint32_t b = 0; b < blocks; b++) {
+                        put_be32(fp, 1088 * 8);         // blockbits
+                        put_be32(fp, 0);                // gapbits
+                        put_be32(fp, 0);                // gapoffset
+                        put_be32(fp, 1);                // 2 us cells
+                        put_be32(fp, 1);                // MFM
+                        put_be32(fp, 0);
+                        put_be32(fp, 0);
+                        put_be32(fp, blocks * 32 + b * IPF_BLOCK_BYTES);
+                }
+                for (uint32_t b = 0; b < blocks; b++) {
+                        static const uint8_t head[] = {
+                                0x22, 2, 0x00, 0x00,            // data
+                                0x21, 4, 0x44, 0x89, 0x44, 0x89, // mark
+                                0x42, 540 >> 8, 540 & 0xff,     // data
+                        };
+                        const uint8_t *sector = mfm + b * 1088 + 8;
+
+                        fwrite(head, 1, sizeof(head), fp);
+                        for (int i = 0; i < 540; i++) {
+                                fputc(mfm_data_byte(sector + 2 * i), fp);
+                        }
+                        fputc(0x00, fp);                        // end
+                }
+        }
+
+        return fflush(fp) == 0 && !ferror(fp) ? 0 : -1;
+}
@@ -0,0 +1,28 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/*
+ * Helpers shared by the micro benchmarks.
+ * These are not tests, they print timings and a sanity check.
+ */
+
+// One revolution of flux for a DD disk is well below this many samples.
+#define BENCH_MAX_TRACK_SAMPLES         60000
+
+double bench_now(void);
+void bench_report(const char *name, double seconds, size_t iterations,
+                                                        size_t bytes);
+
+size_t bench_amiga_track(uint32_t *samples, size_t max_samples,
+                unsigned int track, unsigned int jitter, unsigned int *seed);
+size_t bench_amiga_track_drift(uint32_t *samples, size_t max_samples,
+                unsigned int track, unsigned int jitter,
+                double speed, double wow, unsigned int *seed);
+void bench_amiga_mfm_track(uint8_t *mfm, unsigned int track, unsigned int *seed);
+int bench_amiga_ipf(FILE *fp, unsigned int tracks, unsigned int *seed);
+
+#endif /* BENCH_UTIL_H */
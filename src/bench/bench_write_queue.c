@@ -0,0 +1,331 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench_util.h"
+#include "../arm-interface.h"
+#include "../caps_parser/caps_parser.h"
+#include "../mfm_utils/mfm_utils.h"
+#include "../mfm_utils/amiga_decode.h"
+#include "../pru-setup.h"
+#include "../timing_arena.h"
+#include "../write_queue.h"
+
+/*
+ * Writing a disk on the simulator: write, read back and decode one track
+ * at a time, as write_flux did, against the write queue with the verify
+ * in the same command, decoded as the samples come in.
+ *
+ * The simulator has no delays, so this backend waits as if the disk was
+ * turning, scaled down by EVENT_SCALE: each block of samples takes its
+ * time on the disk, and a command waits for the index. Half a
+ * revolution on average, but a whole one for a read after a write, as
+ * the write stopped on the index.
+ *
+ * Then the queue again, with LONG_TRACK_PAD samples of gap after each
+ * track. The write asks for a refill just before the index, and the
+ * simulator is reading by the time the host takes it. The samples the
+ * host streamed must add up to what the PRU read, as a host a block out
+ * of step loses only gap here, and still finds every sector.
+ *
+ * And with the samples SLOW_DRIVE_PERCENT shorter, as on a drive that
+ * turns a bit slow. The write runs out of samples before the index, and
+ * the verify has to wait for it, not retry the track.
+ */
+
+#define TRACKS          40
+#define EVENT_SCALE     20
+#define SAMPLE_NS       4000                    // 2 cells, on average
+#define REVOLUTION_NS   200000000
+#define SLOW_DRIVE_PERCENT      3
+#define LONG_TRACK_PAD          0x1800
+#define GAP_SAMPLE              400             // 4us, as the 0xaa gap
+
+// What the PRU read back, for each WRITE_VERIFY of write_queued().
+static uint32_t verify_reads[TRACKS * 3];
+static unsigned int verify_count;
+
+static void spin(unsigned long ns)
+{
+        const struct timespec t = {
+                .tv_sec = ns / EVENT_SCALE / 1000000000,
+                .tv_nsec = ns / EVENT_SCALE % 1000000000,
+        };
+        nanosleep(&t, NULL);
+}
+
+static void spin_wait_event(struct pru *pru)
+{
+        static uint8_t last_done;
+        static bool busy;
+        volatile struct ARM_IF *intf = (volatile struct ARM_IF *)pru->ram;
+        const uint8_t command = intf->command;
+
+        if (!busy && (command & 0x80)) {
+                busy = true;
+                if (command == COMMAND_READ_TIMING
+                                && last_done == COMMAND_WRITE_TIMING) {
+                        spin(REVOLUTION_NS);
+                } else if (command == COMMAND_READ_TIMING
+                                || command == COMMAND_WRITE_TIMING
+                                || command == COMMAND_WRITE_VERIFY) {
+                        spin(REVOLUTION_NS / 2);
+                }
+        }
+
+        pru_backend_sim.wait_event(pru);
+
+        if (command == COMMAND_WRITE_TIMING
+                        || (command == COMMAND_WRITE_VERIFY
+                                        && intf->phase == PHASE_WRITE)) {
+                spin(0x1000 / sizeof(uint16_t) * SAMPLE_NS);
+        } else if (command == COMMAND_READ_TIMING
+                        || command == COMMAND_WRITE_VERIFY) {
+                spin(0x1000 / sizeof(uint32_t) * SAMPLE_NS);
+        }
+        if (!(intf->command & 0x80)) {
+                busy = false;
+                last_done = intf->command | 0x80;
+                if (last_done == COMMAND_WRITE_VERIFY
+                                && verify_count < TRACKS * 3) {
+                        verify_reads[verify_count++] = intf->read_count;
+                }
+        }
+}
+
+static int spin_open(struct pru *pru)
+{
+        return pru_backend_sim.open(pru);
+}
+
+static int spin_start(struct pru *pru)
+{
+        return pru_backend_sim.start(pru);
+}
+
+static void spin_clear_event(struct pru *pru)
+{
+        pru_backend_sim.clear_event(pru);
+}
+
+static void spin_close(struct pru *pru)
+{
+        pru_backend_sim.close(pru);
+}
+
+static const struct pru_backend spin_backend = {
+        .name           = "spinning sim",
+        .open           = spin_open,
+        .start          = spin_start,
+        .wait_event     = spin_wait_event,
+        .clear_event    = spin_clear_event,
+        .close          = spin_close,
+};
+
+static uint8_t mfm[AMIGA_SECTORS_PER_TRACK * AMIGA_MFM_SECTOR_SIZE];
+static uint8_t data[AMIGA_SECTORS_PER_TRACK * AMIGA_SECTOR_DATA_SIZE];
+
+static unsigned int verify(const uint32_t *samples, int sample_count)
+{
+        struct amiga_track track;
+
+        return amiga_decode_track(samples, sample_count, NULL, &track, mfm, data);
+}
+
+static unsigned int write_serial(struct pru *pru, const struct timing_arena *timing)
+{
+        unsigned int good = 0;
+
+        pru_reset_drive(pru);
+        pru_set_head_dir(pru, PRU_HEAD_INC);
+        for (unsigned int t = 0; t < TRACKS; t++) {
+                size_t count;
+                const uint16_t *samples = timing_arena_get(timing, t, &count);
+                uint32_t *read_back, *index_offsets;
+
+                if (t && !(t & 1)) {
+                        pru_step_head(pru, 1);
+                }
+                pru_set_head_side(pru, t & 1 ? PRU_HEAD_LOWER : PRU_HEAD_UPPER);
+                pru_write_timing(pru, samples, count);
+                int sample_count = pru_read_timing(pru, &read_back, 1,
+                                                        &index_offsets);
+                good += verify(read_back, sample_count);
+                free(read_back);
+                free(index_offsets);
+        }
+        return good;
+}
+
+static unsigned int complete(struct write_queue *queue, unsigned int *writes,
+                                                unsigned int *out_of_step)
+{
+        struct write_job job;
+
+        if (write_queue_complete(queue, &job)) {
+                return 0;
+        }
+        *writes += job.writes;
+        // The jobs are done in order, and the last write is the verify.
+        if (*writes > verify_count
+                        || (uint32_t)job.sample_count != verify_reads[*writes - 1]) {
+                (*out_of_step)++;
+        }
+        free(job.mfm);
+        return job.verify.good;
+}
+
+static unsigned int write_queued(struct pru *pru, const struct timing_arena *timing,
+                                unsigned int *writes, unsigned int *out_of_step)
+{
+        unsigned int good = 0;
+
+        verify_count = 0;
+        *out_of_step = 0;
+        pru_reset_drive(pru);
+        struct write_queue *queue = write_queue_start(pru);
+        if (!queue) {
+                return 0;
+        }
+        for (unsigned int t = 0; t < TRACKS; t++) {
+                struct write_job job = {
+                        .track = t,
+                        .revolutions = 1,
+                        .expected = AMIGA_SECTORS_PER_TRACK,
+                        .retries = 2,
+                };
+                job.timing = timing_arena_get(timing, t, &job.count);
+                write_queue_submit(queue, &job);
+                if (t) {
+                        good += complete(queue, writes, out_of_step);
+                }
+        }
+        good += complete(queue, writes, out_of_step);
+        write_queue_stop(queue);
+        return good;
+}
+
+// The tracks of <timing>, each followed by LONG_TRACK_PAD samples of gap.
+static int pad_tracks(struct timing_arena *padded,
+                                        const struct timing_arena *timing)
+{
+        timing_arena_init(padded);
+        padded->samples = malloc((timing->used + TRACKS * LONG_TRACK_PAD)
+                                                * sizeof(*padded->samples));
+        if (!padded->samples) {
+                return -1;
+        }
+        for (unsigned int t = 0; t < TRACKS; t++) {
+                size_t count;
+                const uint16_t *samples = timing_arena_get(timing, t, &count);
+                uint16_t *out = padded->samples + padded->used;
+
+                memcpy(out, samples, count * sizeof(*samples));
+                for (size_t i = 0; i < LONG_TRACK_PAD; i++) {
+                        out[count + i] = GAP_SAMPLE;
+                }
+                padded->tracks[t].offset = padded->used;
+                padded->tracks[t].count = count + LONG_TRACK_PAD;
+                padded->tracks[t].present = true;
+                padded->used += count + LONG_TRACK_PAD;
+        }
+        padded->capacity = padded->used;
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        const unsigned int iterations = argc > 1 ? atoi(argv[1]) : 1;
+        struct timing_arena timing;
+        unsigned int seed = 1, good, writes = 0, out_of_step = 0;
+        double t;
+        int rc = EXIT_SUCCESS;
+
+        FILE *fp = tmpfile();
+        struct caps_parser *parser = NULL;
+        if (!fp || bench_amiga_ipf(fp, TRACKS, &seed) != 0
+                        || !(parser = caps_parser_init(fp))
+                        || caps_parser_decode_all(parser, 0) != TRACKS) {
+                fprintf(stderr, "Could not make the IPF image\n");
+                return EXIT_FAILURE;
+        }
+        timing_arena_init(&timing);
+        timing_arena_from_caps(&timing, parser);
+
+        struct pru *pru = pru_setup_backend(&spin_backend);
+        if (!pru) {
+                return EXIT_FAILURE;
+        }
+        pru_start_motor(pru);
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                good = write_serial(pru, &timing);
+        }
+        bench_report("write, then read back, decode", bench_now() - t,
+                                        iterations * TRACKS, 0);
+        printf("good sectors: %u of %u\n", good, TRACKS * AMIGA_SECTORS_PER_TRACK);
+        if (good != TRACKS * AMIGA_SECTORS_PER_TRACK) {
+                rc = EXIT_FAILURE;
+        }
+
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                writes = 0;
+                good = write_queued(pru, &timing, &writes, &out_of_step);
+        }
+        bench_report("write + verify, queued", bench_now() - t,
+                                        iterations * TRACKS, 0);
+        printf("good sectors: %u of %u, writes: %u, out of step: %u\n",
+                good, TRACKS * AMIGA_SECTORS_PER_TRACK, writes, out_of_step);
+        if (good != TRACKS * AMIGA_SECTORS_PER_TRACK || out_of_step) {
+                rc = EXIT_FAILURE;
+        }
+
+        struct timing_arena padded;
+        if (pad_tracks(&padded, &timing)) {
+                fprintf(stderr, "Could not pad the tracks\n");
+                return EXIT_FAILURE;
+        }
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                writes = 0;
+                good = write_queued(pru, &padded, &writes, &out_of_step);
+        }
+        bench_report("write + verify, queued, long tracks", bench_now() - t,
+                                        iterations * TRACKS, 0);
+        printf("good sectors: %u of %u, writes: %u, out of step: %u\n",
+                good, TRACKS * AMIGA_SECTORS_PER_TRACK, writes, out_of_step);
+        if (good != TRACKS * AMIGA_SECTORS_PER_TRACK || writes != TRACKS
+                                                        || out_of_step) {
+                rc = EXIT_FAILURE;
+        }
+        timing_arena_cleanup(&padded);
+
+        for (size_t i = 0; i < timing.used; i++) {
+                timing.samples[i] = timing.samples[i]
+                                * (100 - SLOW_DRIVE_PERCENT) / 100;
+        }
+        t = bench_now();
+        for (unsigned int it = 0; it < iterations; it++) {
+                writes = 0;
+                good = write_queued(pru, &timing, &writes, &out_of_step);
+        }
+        bench_report("write + verify, queued, slow drive", bench_now() - t,
+                                        iterations * TRACKS, 0);
+        printf("good sectors: %u of %u, writes: %u, out of step: %u\n",
+                good, TRACKS * AMIGA_SECTORS_PER_TRACK, writes, out_of_step);
+        if (good != TRACKS * AMIGA_SECTORS_PER_TRACK || writes != TRACKS
+                                                        || out_of_step) {
+                rc = EXIT_FAILURE;
+        }
+
+        pru_stop_motor(pru);
+        pru_exit(pru);
+        timing_arena_cleanup(&timing);
+        caps_parser_cleanup(parser);
+        fclose(fp);
+        return rc;
+}
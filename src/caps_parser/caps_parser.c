@@ -1,30 +1,49 @@
 #include <assert.h>
 #include <endian.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "caps_parser.h"
 #include "../mfm_utils/mfm_utils.h"
+#include "../mfm_utils/mfm_encode.h"
 
 #define DO_PRAGMA(x) _Pragma (#x)
 // #define TODO(x) DO_PRAGMA(message ("TODO - " #x))
 #define TODO(x)
 
-static bool __attribute__((__unused__)) read_track_to_bitstream(
-                                const struct caps_parser * restrict p,
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmultichar"
+enum caps_chunk_name {
+        CAPS = 'CAPS',
+        INFO = 'INFO',
+        IMGE = 'IMGE',
+        DATA = 'DATA',
+};
+#pragma GCC diagnostic pop
+
+/**
+ * A chunk header, and where its contents are in the map.
+ */
+struct caps_chunk {
+        struct caps_header header;      // name and len in host order
+        const uint8_t *body;            // Right after the header
+        size_t extra_len;               // Bytes after the chunk, for DATA
+};
+
+static bool read_track_to_bitstream(
                                 const struct CapsImage * restrict caps_image,
-                                const struct caps_node * restrict data_node,
-                                const struct CapsBlock * restrict sector_info,
-                                                        size_t sector_count,
+                                const struct caps_data_area * restrict data_area,
+                                const struct CapsBlock * restrict first_block,
                                 uint8_t * restrict bitstream,
                                                         size_t track_size);
 
-static uint16_t __attribute__((__unused__)) * parse_ipf_samples(const uint8_t *samples,
-                                                        size_t num_samples,
-                                                        uint16_t prev_sample);
 static void __attribute__((__unused__)) print_caps_data(
                                                 struct CapsData *caps_data);
 static void __attribute__((__unused__)) print_caps_block(
@@ -39,141 +58,238 @@ static const char __attribute__((__unused__)) * sampletype_to_string(
 
 static void __attribute__((__unused__)) hexdump(const void *data, size_t len);
 
-struct caps_parser *caps_parser_init(FILE *fp)
+/**
+ * @brief       Read the chunk header at *pos, and move *pos past the chunk.
+ *
+ * @return      1 for a chunk, 0 at the end of the file, -1 on errors.
+ */
+static int read_chunk(const struct caps_parser *p, size_t *pos,
+                                                struct caps_chunk *chunk)
 {
         static_assert(sizeof(struct caps_header) == 12, "Size assertion failed!");
 
-        struct caps_parser *p = malloc(sizeof(*p));
-        if (!p) {
-                return NULL;
+        if (*pos == p->map_size) {
+                return 0;
+        }
+        if (p->map_size - *pos < sizeof chunk->header) {
+                fprintf(stderr, "Truncated caps chunk header!\n");
+                return -1;
+        }
+
+        memcpy(&chunk->header, p->map + *pos, sizeof chunk->header);
+        chunk->header.name = be32toh(chunk->header.name);
+        chunk->header.len = be32toh(chunk->header.len);
+        chunk->body = p->map + *pos + sizeof chunk->header;
+        chunk->extra_len = 0;
+
+        const uint32_t printable_name = htobe32(chunk->header.name);
+        unsigned int expected_len = sizeof chunk->header;
+        switch (chunk->header.name) {
+        case CAPS:
+                break;
+        case INFO:
+                expected_len += sizeof(struct CapsInfo);
+                break;
+        case IMGE:
+                expected_len += sizeof(struct CapsImage);
+                break;
+        case DATA:
+                expected_len += sizeof(struct CapsData);
+                break;
+        default:
+                fprintf(stderr, "Got unexpected caps chunk: %.4s\n",
+                                        (char *)&printable_name);
+                return -1;
         }
-        p->fp = fp;
-        p->caps_list_head.next = NULL;
 
-        int rc = fread(&p->caps_list_head.header, sizeof p->caps_list_head.header, 1, p->fp);
-        if (rc != 1) {
-                return NULL;
+        if (chunk->header.len != expected_len) {
+                fprintf(stderr,
+                        "Integrity error, expected_len: %u - actual_len: %u\n",
+                                                expected_len, chunk->header.len);
+                return -1;
+        }
+        if (p->map_size - *pos < expected_len) {
+                fprintf(stderr, "Failed to read caps chunk!\n");
+                return -1;
+        }
+
+        if (chunk->header.name == DATA) {
+                /**
+                 * The len reported in header is not correct when we
+                 * encounter the DATA chunks.
+                 * We have to parse the chunk to get the correct len
+                 */
+                struct CapsData data;
+                memcpy(&data, chunk->body, sizeof data);
+                chunk->extra_len = be32toh(data.size);
+                if (p->map_size - *pos - expected_len < chunk->extra_len) {
+                        fprintf(stderr, "Truncated DATA chunk!\n");
+                        return -1;
+                }
         }
-        p->caps_list_head.header.name = htobe32(p->caps_list_head.header.name);
-        p->caps_list_head.header.len = be32toh(p->caps_list_head.header.len);
-
-        p->caps_list_head.fpos = ftell(p->fp);
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wmultichar"
-        if (p->caps_list_head.header.name != 'CAPS') {
-#pragma GCC diagnostic pop
-                // This is not a CAPS file!
-                return NULL;
-        }
+        *pos += expected_len + chunk->extra_len;
+        return 1;
+}
 
-        uint32_t extra_len = 0;
-        struct caps_node *node = &p->caps_list_head;
-        while(true) {
-                struct caps_node *n = malloc(sizeof(*n));
-                if (!n) {
-                        // Memory error!
-                        caps_parser_cleanup(p);
-                        return NULL;
+/**
+ * @brief       Count the IMGE and DATA chunks, and check all chunks are sane.
+ */
+static bool count_chunks(struct caps_parser *p, size_t pos, uint32_t *max_did)
+{
+        struct caps_chunk chunk;
+        size_t chunk_count = 0;
+        int rc;
+
+        *max_did = 0;
+        while ((rc = read_chunk(p, &pos, &chunk)) > 0) {
+                uint32_t did = 0;
+
+                chunk_count++;
+                if (chunk.header.name == IMGE) {
+                        struct CapsImage imge;
+                        memcpy(&imge, chunk.body, sizeof imge);
+                        did = be32toh(imge.did);
+                        p->image_count++;
+                } else if (chunk.header.name == DATA) {
+                        struct CapsData data;
+                        memcpy(&data, chunk.body, sizeof data);
+                        did = be32toh(data.did);
+                }
+                if (did > *max_did) {
+                        *max_did = did;
                 }
+        }
+        if (rc < 0) {
+                return false;
+        }
 
-                n->next = NULL;
+        // dids are numbered from 1, one for each track.
+        if (*max_did > chunk_count) {
+                fprintf(stderr, "Integrity error, did %u with only %zu chunks\n",
+                                                        *max_did, chunk_count);
+                return false;
+        }
+        return true;
+}
 
-                rc = fread(&n->header, sizeof n->header, 1, p->fp);
-                if (rc != 1) {
-                        free(n);
-                        if (!feof(p->fp)) {
-                                fprintf(stderr, "Read error!\n");
-                                caps_parser_cleanup(p);
-                                return NULL;
+/**
+ * @brief       Fill in the IMGE array, and the track and did indexes.
+ */
+static void index_chunks(struct caps_parser *p, size_t pos)
+{
+        struct caps_chunk chunk;
+        size_t image = 0;
+
+        while (read_chunk(p, &pos, &chunk) > 0) {
+                if (chunk.header.name == INFO && !p->has_info) {
+                        memcpy(&p->info, chunk.body, sizeof p->info);
+                        p->has_info = true;
+                } else if (chunk.header.name == IMGE) {
+                        struct CapsImage *imge = &p->images[image];
+                        memcpy(imge, chunk.body, sizeof *imge);
+
+                        const uint32_t cylinder = be32toh(imge->cylinder);
+                        const uint32_t head = be32toh(imge->head);
+                        // The first one wins, like the old linear search.
+                        if (cylinder < CAPS_MAX_CYLINDERS && head < CAPS_MAX_HEADS
+                                        && p->track_index[cylinder][head] < 0) {
+                                p->track_index[cylinder][head] = image;
+                        }
+                        if (!p->data[be32toh(imge->did)].image) {
+                                p->data[be32toh(imge->did)].image = imge;
+                        }
+                        image++;
+                } else if (chunk.header.name == DATA) {
+                        struct CapsData data;
+                        memcpy(&data, chunk.body, sizeof data);
+
+                        struct caps_data_area *area = &p->data[be32toh(data.did)];
+                        if (!area->area) {
+                                area->data = data;
+                                area->area = chunk.body + sizeof data;
+                                area->size = chunk.extra_len;
                         }
-                        // End of file!
-                        break;
                 }
+        }
+}
 
-                n->header.name = be32toh(n->header.name);
-                n->header.len = be32toh(n->header.len);
-                n->fpos = ftell(p->fp);
+/**
+ * @brief       Map an IPF file, and index its chunks.
+ *
+ * @detail      The file is mapped, not read, so fp can be closed any time
+ *              after this. Track and did lookups are then array lookups,
+ *              and tracks decode straight from the mapped file.
+ *
+ * @return      The parser, or NULL if this is not a CAPS file or it is
+ *              broken.
+ */
+struct caps_parser *caps_parser_init(FILE *fp)
+{
+        struct stat st;
+        uint32_t max_did;
 
-                const uint32_t printable_name = htobe32(n->header.name);
-                // printf("Name: %.4s\n", (char *)&printable_name);
-                unsigned int expected_len = sizeof n->header;
-                switch (n->header.name) {
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wmultichar"
-                case 'INFO':
-#pragma GCC diagnostic pop
-                        expected_len += sizeof n->chunk.info;
-                        rc = fread(&n->chunk.info, sizeof n->chunk.info, 1, p->fp);
-                        break;
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wmultichar"
-                case 'IMGE':
-#pragma GCC diagnostic pop
-                        expected_len += sizeof n->chunk.imge;
-                        rc = fread(&n->chunk.imge, sizeof n->chunk.imge, 1, p->fp);
-                        break;
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wmultichar"
-                case 'DATA':
-#pragma GCC diagnostic pop
-                        expected_len += sizeof n->chunk.data;
-                        rc = fread(&n->chunk.data, sizeof n->chunk.data, 1, p->fp);
-                        break;
-                default:
-                        fprintf(stderr, "Got unexpected caps chunk: %.4s\n",
-                                        (char *)&printable_name);
-                        rc = 0;
-                }
-                if (rc != 1) {
-                        fprintf(stderr, "Failed to read caps chunk!\n");
-                        free(n);
-                        caps_parser_cleanup(p);
-                        return NULL;
-                }
+        struct caps_parser *p = calloc(1, sizeof(*p));
+        if (!p) {
+                return NULL;
+        }
+        memset(p->track_index, 0xff, sizeof(p->track_index));
 
-                if (n->header.len != expected_len) {
-                        fprintf(stderr,
-                                "Integrity error, expected_len: %u - actual_len: %u\n",
-                                                        expected_len, n->header.len);
-                        free(n);
-                        caps_parser_cleanup(p);
-                        return NULL;
-                }
+        if (fstat(fileno(fp), &st) != 0) {
+                fprintf(stderr, "Couldn't stat file: %s\n", strerror(errno));
+                goto error;
+        }
+        if (st.st_size < (off_t)sizeof(struct caps_header)) {
+                // Too small to be a CAPS file.
+                goto error;
+        }
+        p->map_size = st.st_size;
 
-                extra_len = 0;
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wmultichar"
-                if (n->header.name == 'DATA') {
-#pragma GCC diagnostic pop
-                        /**
-                         * The len reported in header is not correct when we
-                         * encounter the DATA chunks.
-                         * We have to parse the chunk to get the correct len
-                         */
-                        extra_len = be32toh(n->chunk.data.size);
-                }
+        void *map = mmap(NULL, p->map_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        if (map == MAP_FAILED) {
+                fprintf(stderr, "Couldn't map file: %s\n", strerror(errno));
+                p->map_size = 0;
+                goto error;
+        }
+        p->map = map;
 
-                // Move pointer to end of chunk
-                fseek(p->fp, (n->fpos + n->header.len - sizeof(struct caps_header) + extra_len), SEEK_SET);
+        size_t pos = 0;
+        struct caps_chunk chunk;
+        if (read_chunk(p, &pos, &chunk) <= 0 || chunk.header.name != CAPS) {
+                // This is not a CAPS file!
+                goto error;
+        }
 
-                node->next = n;
-                node = node->next;
+        if (!count_chunks(p, pos, &max_did)) {
+                goto error;
         }
 
-        printf("Init done!\n");
+        p->did_count = max_did + 1;
+        p->images = calloc(p->image_count ? p->image_count : 1, sizeof(*p->images));
+        p->data = calloc(p->did_count, sizeof(*p->data));
+        if (!p->images || !p->data) {
+                // Memory error!
+                goto error;
+        }
+
+        index_chunks(p, pos);
+
         return p;
+
+error:
+        caps_parser_cleanup(p);
+        return NULL;
 }
 
 void caps_parser_cleanup(struct caps_parser *p)
 {
-        struct caps_node *node = &p->caps_list_head;
-        struct caps_node *next = node->next;
-        while(next) {
-                struct caps_node *this = next;
-                next = next->next;
-                free(this);
+        if (p->map) {
+                munmap((void *)p->map, p->map_size);
         }
+        free(p->images);
+        free(p->data);
+        free(p->cache);
+        free(p->tracks);
         free(p);
 }
 
@@ -184,22 +300,11 @@ bool caps_parser_get_caps_image_for_track_and_head(const struct caps_parser *p,
                                         const struct CapsImage ** caps_image,
                                  unsigned char track, unsigned char head)
 {
-        struct caps_node *node = p->caps_list_head.next;
-        while(node) {
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wmultichar"
-                if (node->header.name == 'IMGE') {
-#pragma GCC diagnostic pop
-                        if (be32toh(node->chunk.imge.cylinder) == track &&
-                            be32toh(node->chunk.imge.head) == head) {
-                                *caps_image = &node->chunk.imge;
-                                return true;
-                        }
-
-                }
-                node = node->next;
+        if (head >= CAPS_MAX_HEADS || p->track_index[track][head] < 0) {
+                return false;
         }
-        return false;
+        *caps_image = &p->images[p->track_index[track][head]];
+        return true;
 }
 
 /**
@@ -208,180 +313,263 @@ bool caps_parser_get_caps_image_for_track_and_head(const struct caps_parser *p,
 bool caps_parser_get_caps_image_for_did(const struct caps_parser *p,
                                 struct CapsImage **caps_image, uint32_t did)
 {
-        struct caps_node *node = p->caps_list_head.next;
-        while(node) {
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wmultichar"
-                if (node->header.name == 'IMGE') {
-#pragma GCC diagnostic pop
-                        if (be32toh(node->chunk.imge.did) != did) {
-                                *caps_image = &node->chunk.imge;
-                                return true;
-                        }
-
-                }
-                node = node->next;
+        if (did >= p->did_count || !p->data[did].image) {
+                return false;
         }
-        return false;
+        *caps_image = p->data[did].image;
+        return true;
 }
 
-uint8_t *caps_parser_get_bitstream_for_track(const struct caps_parser *p,
-                                        const struct CapsImage * caps_image)
+/**
+ * @brief       Decode a track into a buffer of track_size bytes.
+ */
+static bool decode_track(const struct caps_parser *p,
+                        const struct CapsImage *caps_image,
+                        uint8_t *bitstream, size_t track_size)
 {
-        uint8_t *rc = NULL;
-        bool found = false;
-	// We have a caps_imge struct.
-	// Now find the related caps_data struct
-        struct caps_node *node = p->caps_list_head.next;
-        while(node) {
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wmultichar"
-                if (node->header.name == 'DATA') {
-#pragma GCC diagnostic pop
-                        if (node->chunk.data.did == caps_image->did) {
-                                found = true;
-                                break;
-                        }
-                }
-                node = node->next;
-        }
-
-        if (!found) {
+        // We have a caps_imge struct.
+        // Now find the related caps_data struct
+        const uint32_t did = be32toh(caps_image->did);
+        if (did >= p->did_count || !p->data[did].area) {
                 fprintf(stderr,
                         "Integrety error: Could not find track data!\n");
-                goto error_track_data_not_found;
+                return false;
         }
+        const struct caps_data_area *data_area = &p->data[did];
 
-        //print_caps_data(&node->chunk.data);
+        //print_caps_data(&data_area->data);
 
-        const long caps_block_pos = node->fpos + sizeof node->chunk.data;
-        int err = fseek(p->fp, caps_block_pos,  SEEK_SET);
-        if (err != 0) {
-                fprintf(stderr,
-                        "Couldn't seek in file: %s\n", strerror(errno));
-                goto error_seek_failed;
+        size_t sector_count = be32toh(caps_image->blkcnt);
+
+        static_assert(sizeof(struct CapsBlock) == 32, "CapsBlock/sector_info has padding!");
+        if (sector_count == 0
+                        || sector_count > data_area->size / sizeof(struct CapsBlock)) {
+                fprintf(stderr, "Track has %zu blocks, that doesn't fit in"
+                                " %zu bytes of data\n", sector_count,
+                                                        data_area->size);
+                return false;
         }
+        // The samples of all blocks follow each other, from the first one.
+        struct CapsBlock first_block;
+        memcpy(&first_block, data_area->area, sizeof(first_block));
 
-        size_t sector_count = be32toh(caps_image->blkcnt);
+        memset(bitstream, 0xaa, track_size);
+
+        // read_track_to_bitstream will write out error message!
+        return read_track_to_bitstream(caps_image, data_area, &first_block,
+                                                bitstream, track_size);
+}
+
+static size_t track_size_for(const struct CapsImage *caps_image)
+{
         // trkbits is the complete track size in bits.
         size_t track_size = be32toh(caps_image->trkbits) >> 3; // Div. 8 to get bytes.
 
-        /*
-        if (be32toh(caps_image->trkbits) & 0x7) {
-                fprintf(stderr,
-                        "Assertion error, track bits isn't evenly divisable by 8\n");
-                goto error_trkbits_out_of_range;
-        }
-        */
-
         if (track_size > INT16_MAX) {
                 fprintf(stderr,
                         "Assertion error, track is more than %d bytes!\n",
                                                                 INT16_MAX);
-                goto error_trkbits_out_of_range;
+                return 0;
         }
+        return track_size;
+}
 
-        struct CapsBlock *sector_info = malloc(sizeof(*sector_info) * sector_count);
-        if (!sector_info) {
-                fprintf(stderr,
-                        "Coundn't allocate memory for sector data\n");
-                goto error_sector_info_alloc_failed;
-        }
-        static_assert(sizeof(*sector_info) == 32, "CapsBlock/sector_info has padding!");
-
-
-        err = fread(sector_info, sizeof(*sector_info), sector_count, p->fp);
-        if (err != sector_count) {
-                fprintf(stderr, "Failed to read sector_info out of file\n");
-                goto error_read_failed;
+uint8_t *caps_parser_get_bitstream_for_track(const struct caps_parser *p,
+                                        const struct CapsImage * caps_image)
+{
+        const size_t track_size = track_size_for(caps_image);
+        if (!track_size) {
+                return NULL;
         }
 
-	uint32_t total_bits = 0;
-	for (int i = 0; i < sector_count; ++i) {
-		total_bits += be32toh(sector_info[i].blockbits);
-		total_bits += be32toh(sector_info[i].gapbits);
-		// printf("Sector: %d - blockbits: %u\n", i, be32toh(sector_info[i].blockbits));
-		// printf("Sector: %d - gapbits: %u\n", i, be32toh(sector_info[i].gapbits));
-	}
-	// printf("Accumulated bits: %u (%u)\n", total_bits, (total_bits / 8));
-
         uint8_t *bitstream = malloc(track_size);
         if (!bitstream) {
                 fprintf(stderr,
                         "Couldn't allocate memory for bitstream\n");
-                goto error_bitstream_alloc_failed;
-
+                return NULL;
         }
 
-        memset(bitstream, 0xaa, track_size);
-
-        found = read_track_to_bitstream(p, caps_image, node,
-                                sector_info, sector_count,
-                                bitstream, track_size);
-        if (found) {
-                rc = bitstream;
-        } else {
-                // read_track_to_bitstream will write out error message!
+        if (!decode_track(p, caps_image, bitstream, track_size)) {
                 free(bitstream);
+                return NULL;
         }
 
+        return bitstream;
+}
 
-error_bitstream_alloc_failed:
-error_read_failed:
-        free(sector_info);
+struct decode_all_job {
+        struct caps_parser *p;
+        pthread_mutex_t lock;
+        size_t next;            // Next image to decode
+};
 
-error_sector_info_alloc_failed:
-error_trkbits_out_of_range:
-error_seek_failed:
-error_track_data_not_found:
+static void *decode_all_worker(void *arg)
+{
+        struct decode_all_job *job = arg;
+        struct caps_parser *p = job->p;
+
+        while (true) {
+                pthread_mutex_lock(&job->lock);
+                const size_t i = job->next++;
+                pthread_mutex_unlock(&job->lock);
 
-        return rc;
+                if (i >= p->image_count) {
+                        break;
+                }
+                struct caps_track *track = &p->tracks[i];
+                if (track->bits) {
+                        track->decoded = decode_track(p, &p->images[i],
+                                        p->cache + track->offset,
+                                        track->bits >> 3);
+                }
+        }
+
+        return NULL;
 }
 
-void caps_parser_show_file_info(struct caps_parser *p)
+/**
+ * @brief       Decode every track of the image into one buffer, up front.
+ *
+ * @detail      Each track found by cylinder and head is decoded once, by
+ *              <workers> threads, into p->cache. After this,
+ *              caps_parser_get_track() is a lookup. The tracks are laid
+ *              out in track order, each on its own cache line so threads
+ *              don't share a line.
+ *
+ * @param       workers         Number of threads, 0 for one per CPU.
+ *
+ * @return      The number of tracks decoded, negative on error.
+ */
+int caps_parser_decode_all(struct caps_parser *p, unsigned int workers)
 {
-        struct caps_node *node = p->caps_list_head.next;
-        bool found = false;
-        while(node) {
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wmultichar"
-                if (node->header.name == 'INFO') {
-#pragma GCC diagnostic pop
-                        found = true;
+        struct decode_all_job job = { .p = p };
+        size_t size = 0;
+
+        free(p->cache);
+        free(p->tracks);
+        p->cache = NULL;
+        p->cache_size = 0;
+        p->tracks = calloc(p->image_count ? p->image_count : 1, sizeof(*p->tracks));
+        if (!p->tracks) {
+                fprintf(stderr, "Couldn't allocate track cache index\n");
+                return -1;
+        }
+
+        for (unsigned int cylinder = 0; cylinder < CAPS_MAX_CYLINDERS; cylinder++) {
+                for (unsigned int head = 0; head < CAPS_MAX_HEADS; head++) {
+                        const int32_t i = p->track_index[cylinder][head];
+                        if (i < 0) {
+                                continue;
+                        }
+                        const size_t track_size = track_size_for(&p->images[i]);
+                        if (!track_size) {
+                                continue;
+                        }
+                        p->tracks[i].offset = size;
+                        p->tracks[i].bits = be32toh(p->images[i].trkbits);
+                        size += (track_size + 63) & ~(size_t)63;
+                }
+        }
+
+        p->cache = malloc(size ? size : 1);
+        if (!p->cache) {
+                fprintf(stderr, "Couldn't allocate %zu bytes of track cache\n",
+                                                                        size);
+                return -1;
+        }
+        p->cache_size = size;
+
+        if (!workers) {
+                const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                workers = cpus > 0 ? cpus : 1;
+        }
+
+        pthread_t *threads = calloc(workers, sizeof(*threads));
+        unsigned int started = 0;
+
+        pthread_mutex_init(&job.lock, NULL);
+        // This thread is one of the workers.
+        for (unsigned int i = 1; threads && i < workers; i++) {
+                if (pthread_create(&threads[started], NULL,
+                                        decode_all_worker, &job)) {
+                        fprintf(stderr, "Couldn't start decode thread %u\n", i);
                         break;
                 }
-                node = node->next;
+                started++;
+        }
+        decode_all_worker(&job);
+        for (unsigned int i = 0; i < started; i++) {
+                pthread_join(threads[i], NULL);
+        }
+        pthread_mutex_destroy(&job.lock);
+        free(threads);
+
+        int decoded = 0;
+        for (size_t i = 0; i < p->image_count; i++) {
+                if (p->tracks[i].decoded) {
+                        decoded++;
+                }
+        }
+        return decoded;
+}
+
+/**
+ * @brief       Get a track from the cache made by caps_parser_decode_all().
+ *
+ * @param       bits            <OUT> The track length in bits, trkbits.
+ *
+ * @return      The MFM of the track, owned by the parser. NULL if the
+ *              track isn't in the image, or didn't decode.
+ */
+const uint8_t *caps_parser_get_track(const struct caps_parser *p,
+                        unsigned char cylinder, unsigned char head,
+                                                        uint32_t *bits)
+{
+        if (!p->tracks || head >= CAPS_MAX_HEADS
+                                || p->track_index[cylinder][head] < 0) {
+                return NULL;
         }
-        if (!found) {
+        const struct caps_track *track = &p->tracks[p->track_index[cylinder][head]];
+        if (!track->decoded) {
+                return NULL;
+        }
+        *bits = track->bits;
+        return p->cache + track->offset;
+}
+
+void caps_parser_show_file_info(struct caps_parser *p)
+{
+        if (!p->has_info) {
                 printf("No INFO chunk found in IPS data!\n");
                 return;
         }
+        const struct CapsInfo *info = &p->info;
 
         printf("*------------------------------------------------------------------------\n");
         printf("|                                CapsInfo:\n");
         printf("*------------------------------------------------------------------------\n");
-        printf("| Image type: %s\n", be32toh(node->chunk.info.type) == 1 ? "FDD" :
-                                   be32toh(node->chunk.info.type) == 0 ? "N/A" :
+        printf("| Image type: %s\n", be32toh(info->type) == 1 ? "FDD" :
+                                   be32toh(info->type) == 0 ? "N/A" :
                                                  "UNKNOWN VERSION");
-        printf("| Encoder: %s\n", be32toh(node->chunk.info.encoder) == 2 ? "RAW" :
-                                be32toh(node->chunk.info.encoder) == 1 ? "MFM" :
-                                be32toh(node->chunk.info.encoder) == 0 ? "N/A" :
+        printf("| Encoder: %s\n", be32toh(info->encoder) == 2 ? "RAW" :
+                                be32toh(info->encoder) == 1 ? "MFM" :
+                                be32toh(info->encoder) == 0 ? "N/A" :
                                                  "UNKNOWN VERSION");
-        printf("| Encoder revision: %d\n", be32toh(node->chunk.info.encrev));
-        printf("| Release: %d\n", be32toh(node->chunk.info.release));
-        printf("| Revision: %d\n", be32toh(node->chunk.info.revision));
-        printf("| Original source ref.: 0x%08x\n", be32toh(node->chunk.info.origin));
-        printf("| Min. cylinder: %d\n", be32toh(node->chunk.info.mincylinder));
-        printf("| Max. cylinder: %d\n", be32toh(node->chunk.info.maxcylinder));
-        printf("| Min. head: %d\n", be32toh(node->chunk.info.minhead));
-        printf("| Max. head: %d\n", be32toh(node->chunk.info.maxhead));
-        printf("| Date: 0x%08x (%u)\n", be32toh(node->chunk.info.date),
-                                      be32toh(node->chunk.info.date));
-        printf("| Time: 0x%08x (%u)\n", be32toh(node->chunk.info.time),
-                                      be32toh(node->chunk.info.time));
+        printf("| Encoder revision: %d\n", be32toh(info->encrev));
+        printf("| Release: %d\n", be32toh(info->release));
+        printf("| Revision: %d\n", be32toh(info->revision));
+        printf("| Original source ref.: 0x%08x\n", be32toh(info->origin));
+        printf("| Min. cylinder: %d\n", be32toh(info->mincylinder));
+        printf("| Max. cylinder: %d\n", be32toh(info->maxcylinder));
+        printf("| Min. head: %d\n", be32toh(info->minhead));
+        printf("| Max. head: %d\n", be32toh(info->maxhead));
+        printf("| Date: 0x%08x (%u)\n", be32toh(info->date),
+                                      be32toh(info->date));
+        printf("| Time: 0x%08x (%u)\n", be32toh(info->time),
+                                      be32toh(info->time));
         printf("| Platforms: [");
         for (unsigned int i = 0; i < 4; ++i) {
-                const uint32_t id = be32toh(node->chunk.info.platform[i]);
+                const uint32_t id = be32toh(info->platform[i]);
                 if (id == 0 || id > 9) {
                         // Platform is N/A. or above max.
                         continue;
@@ -389,11 +577,11 @@ void caps_parser_show_file_info(struct caps_parser *p)
                 if (i > 0) {
                         printf(", ");
                 }
-                printf("%s", platform_to_string(be32toh(node->chunk.info.platform[i])));
+                printf("%s", platform_to_string(be32toh(info->platform[i])));
         }
         printf("]\n");
-        printf("| Disk #: %d\n", be32toh(node->chunk.info.disknum));
-        printf("| User Id: 0x%08x\n", be32toh(node->chunk.info.userid));
+        printf("| Disk #: %d\n", be32toh(info->disknum));
+        printf("| User Id: 0x%08x\n", be32toh(info->userid));
         printf("*------------------------------------------------------------------------\n");
 }
 
@@ -415,54 +603,32 @@ void caps_parser_show_track_info(struct caps_parser *p, unsigned int cylinder,
 }
 
 /**
- * @brief       Read ipf samples out of file.
+ * @brief       Decode the ipf samples of a track, from the mapped file.
  */
-static bool read_track_to_bitstream( const struct caps_parser * restrict p,
+static bool read_track_to_bitstream(
                                 const struct CapsImage * restrict caps_image,
-                                const struct caps_node * restrict data_node,
-        const struct CapsBlock * restrict sector_info, size_t sector_count,
+                                const struct caps_data_area * restrict data_area,
+                                const struct CapsBlock * restrict first_block,
                         uint8_t * restrict bitstream, size_t track_size)
 {
-        (void) sector_count;
-        (void) track_size;
-
-        const long expected_pos = data_node->fpos
-                                + sizeof data_node->chunk.data
-                                + be32toh(sector_info[0].dataoffset);
-        const long pos = ftell(p->fp);
-        if (pos < 0) {
-                fprintf(stderr,
-                        "Couldn't read file position!\n");
-                return false;
-        }
-        if (pos != expected_pos) {
+        const size_t data_offset = be32toh(first_block->dataoffset);
+        if (data_offset > data_area->size) {
                 fprintf(stderr,
-                        "We are not at correct position in the file!\n");
-                return false;
-        }
-
-        const size_t caps_data_data_len = be32toh(data_node->chunk.data.size)
-                                    - be32toh(sector_info[0].dataoffset);
-        // We read the ipf samples for a single sector from the ipf file into this buffer.
-        uint8_t *caps_data_data = malloc(caps_data_data_len);
-        if (!caps_data_data) {
-                fprintf(stderr, "Memory allocation for caps_data_data failed!\n");
+                        "Sample data offset %zu is outside the data area!\n",
+                                                                data_offset);
                 return false;
         }
 
-        int ret = fread(caps_data_data, 1, caps_data_data_len, p->fp);
-        if (ret != caps_data_data_len) {
-                fprintf(stderr, "Couldn't read sample data from disk!\n");
-                free(caps_data_data);
-                return false;
-        }
+        const size_t caps_data_data_len = data_area->size - data_offset;
+        const uint8_t *caps_data_data = data_area->area + data_offset;
 
         /*
-        uint32_t did = be32toh(data_node->chunk.data.did);
+        uint32_t did = be32toh(data_area->data.did);
         printf("DID: %u\n", did);
         */
 
         uint8_t *mfm_ptr = bitstream;
+        const uint8_t * const mfm_end = bitstream + track_size;
 
         uint8_t prev_sample = 0xaa;
 
@@ -478,6 +644,11 @@ static bool read_track_to_bitstream( const struct caps_parser * restrict p,
                 const uint8_t sample_type = sample_head & 0x1f;
                 const uint8_t sizeof_sample_len = sample_head >> 5;
 
+                if ((size_t)(endptr - caps_data_ptr) < sizeof_sample_len) {
+                        fprintf(stderr, "Truncated sample header!\n");
+                        goto break_loop;
+                }
+
                 size_t num_samples = 0;
                 switch(sizeof_sample_len) {
                 case 0:
@@ -514,10 +685,29 @@ static bool read_track_to_bitstream( const struct caps_parser * restrict p,
 
                 caps_data_ptr += sizeof_sample_len;
 
+                if (num_samples > (size_t)(endptr - caps_data_ptr)) {
+                        fprintf(stderr,
+                                "Integrety error. %zu samples past the end of the data area\n",
+                                                                        num_samples);
+                        goto break_loop;
+                }
+                // A mark is copied as it is, data and gap bytes are MFM encoded.
+                const size_t mfm_len = sample_type == 1 ? num_samples
+                                                        : num_samples * 2;
+                if ((sample_type == 1 || sample_type == 2 || sample_type == 3)
+                                && mfm_len > (size_t)(mfm_end - mfm_ptr)) {
+                        fprintf(stderr,
+                                "Integrety error. Samples don't fit in a %zu byte track\n",
+                                                                        track_size);
+                        goto break_loop;
+                }
+
                 if (sample_type == 0) {
                         // End!
                         //printf("Found end of sector samples!\n");
 			// printf("Sample type: End\n");
+                } else if (num_samples == 0) {
+                        // Nothing to add.
                 } else if (sample_type == 1) {
                         // This sample is MFM encoded
                         // Usually 0x4489 0x4489
@@ -537,19 +727,10 @@ static bool read_track_to_bitstream( const struct caps_parser * restrict p,
                 } else if (sample_type == 2 /* data */ || sample_type == 3 /* gap */) {
                         // These samples are the data bytes or gap bytes without MFM encoding
 
-                        uint16_t *mfm_samples = parse_ipf_samples(caps_data_ptr, num_samples, prev_sample << 8);
-                        uint16_t last_sample = mfm_samples[num_samples - 1];
-                        prev_sample = last_sample >> 8;
-                        /*
-                        if (prev_sample & 0x01) {
-                                printf("[0x%02x] has bit 0 set!\n", prev_sample);
-                        }
-                        */
-
-                        memcpy(mfm_ptr, mfm_samples, num_samples * 2);
+                        prev_sample = mfm_encode_bytes(caps_data_ptr, num_samples,
+                                                        prev_sample, mfm_ptr);
                         mfm_ptr += num_samples * 2;
 
-                        free(mfm_samples);
                         if (num_samples * 2 == 1080) {
                                 sector++;
                         }
@@ -566,7 +747,7 @@ break_loop: ; // <- Semicolon to get ridd of compiler error <:)
         const size_t bytes_written = mfm_ptr - bitstream;
         if ( bytes_written != (be32toh(caps_image->databits) >> 3) ) {
                 fprintf(stderr,
-                        "Wrong amount of data written. Expected %u bytes, but we wrote %u bytes\n",
+                        "Wrong amount of data written. Expected %zu bytes, but we wrote %zu bytes\n",
                                                 expected_bytes, bytes_written);
         } else {
                 /*
@@ -575,76 +756,17 @@ break_loop: ; // <- Semicolon to get ridd of compiler error <:)
                 */
         }
 
-        free(caps_data_data);
-
         return true;
 }
 
-/**
- * @brief	Helper to convert ipf samples to mfm data
- */
-static inline uint16_t ipf_to_mfm(uint8_t ipf)
-{
-        uint16_t mfm = 0;
-        size_t bit = 0x80;
-
-        while(bit) {
-                mfm <<= 2;
-                if (ipf & bit) {
-                        // Set data bit
-                        mfm |= 0x01;
-                } else if ((mfm & 0x04) == 0) {
-                        // Add clock bit if needed
-                        mfm |= 0x02;
-                }
-                bit >>= 1;
-        }
-
-        return htobe16(mfm);
-}
-
-static uint16_t *parse_ipf_samples(const uint8_t *samples, size_t num_samples,
-                                                        uint16_t prev_sample)
-{
-        uint16_t *mfm_samples = malloc(num_samples * 2);
-        if (!mfm_samples) {
-                fprintf(stderr, "mfm sample alloc failed!\n");
-                return NULL;
-        }
-
-        for (unsigned int i = 0; i < num_samples; ++i) {
-                mfm_samples[i] = ipf_to_mfm(samples[i]);
-                if (prev_sample & htobe16(0x0001)) {
-                        // Clear bit 15
-                        mfm_samples[i] &= ~htobe16(1 << 15);
-                }
-                prev_sample = mfm_samples[i];
-        }
-
-        // hexdump(mfm_samples, num_samples * 2);
-
-        return mfm_samples;
-}
-
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wmultichar"
-static const uint32_t IMGE = 'IMGE';
-// static const uint32_t DATA = 'DATA';
-#pragma GCC diagnostic pop
-
 void caps_parser_show_den_types(const struct caps_parser *p)
 {
         uint32_t arr[16] = {0};
-        struct caps_node *node = p->caps_list_head.next;
-        while(node) {
-                // if (memcmp(&node->header.name, needle, sizeof(*needle)) == 0) {
-                if (node->header.name == IMGE) {
-                        uint32_t type = be32toh(node->chunk.imge.dentype);
-                        if (type < 16) {
-                                arr[type]++;
-                        }
+        for (size_t i = 0; i < p->image_count; i++) {
+                uint32_t type = be32toh(p->images[i].dentype);
+                if (type < 16) {
+                        arr[type]++;
                 }
-                node = node->next;
         }
 
         printf("Detected DEN types:\n");
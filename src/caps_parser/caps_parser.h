@@ -103,22 +103,48 @@ struct CapsBlock {
 };
 
 
-union caps_chunk {
-        struct CapsInfo  info;  // Global info
-        struct CapsImage imge;  // Track Info
-        struct CapsData  data;  // Sector info
+#define CAPS_MAX_CYLINDERS      256
+#define CAPS_MAX_HEADS          2
+
+/**
+ * The IMGE and DATA chunks of one did.
+ * The CapsBlock table and the samples follow right after the DATA chunk
+ * in the mapped file, and are not aligned, so read them with memcpy().
+ */
+struct caps_data_area {
+        struct CapsImage *image;        // NULL if there is no IMGE chunk
+        struct CapsData data;
+        const uint8_t *area;            // NULL if there is no DATA chunk
+        size_t size;                    // Data area size in bytes
 };
 
-struct caps_node {
-        struct caps_header header;
-        union caps_chunk chunk;
-        long fpos;              // absolute file position right after the header.
-        struct caps_node *next;
+/**
+ * A track in the cache made by caps_parser_decode_all().
+ */
+struct caps_track {
+        size_t offset;          // Into caps_parser.cache
+        uint32_t bits;          // trkbits, 0 if the track isn't cached
+        bool decoded;           // false if the track failed to decode
 };
 
+/**
+ * The whole file is mapped, and indexed once in caps_parser_init().
+ */
 struct caps_parser {
-        FILE *fp;
-        struct caps_node caps_list_head;
+        const uint8_t *map;
+        size_t map_size;
+        struct CapsInfo info;
+        bool has_info;
+        struct CapsImage *images;       // IMGE chunks, in file order
+        size_t image_count;
+        struct caps_data_area *data;    // By did
+        uint32_t did_count;
+        // Index in images for a cylinder and head, -1 if it isn't there.
+        int32_t track_index[CAPS_MAX_CYLINDERS][CAPS_MAX_HEADS];
+        // The MFM of every track, from caps_parser_decode_all().
+        uint8_t *cache;
+        size_t cache_size;
+        struct caps_track *tracks;      // By image, like images
 };
 
 struct caps_parser *caps_parser_init(FILE *fp);
@@ -132,6 +158,10 @@ bool caps_parser_get_caps_image_for_did(const struct caps_parser *p,
 
 uint8_t *caps_parser_get_bitstream_for_track(const struct caps_parser *p,
                                         const struct CapsImage * caps_image);
+int caps_parser_decode_all(struct caps_parser *p, unsigned int workers);
+const uint8_t *caps_parser_get_track(const struct caps_parser *p,
+                        unsigned char cylinder, unsigned char head,
+                                                        uint32_t *bits);
 // For printing structs.
 void caps_parser_show_den_types(const struct caps_parser *p);
 
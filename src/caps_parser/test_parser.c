@@ -1,6 +1,8 @@
 #include "caps_parser.h"
 #include "../write_flux_opts.h"
 #include "../mfm_utils/mfm_utils.h"
+#include "../mfm_utils/mfm_sync.h"
+#include "../mfm_utils/mfm_bitstream.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,11 +35,6 @@ __attribute__((__unused__))
 static void write_data_to_disk(const struct write_flux_opts *opts, struct caps_parser *parser);
 __attribute__((__unused__))
 static int bitstream_to_timing(uint32_t *samples, const uint8_t *bitstream, size_t track_size);
-__attribute__((__unused__))
-static bool find_sync_marker(struct track_samples *track, size_t *index);
-__attribute__((__unused__))
-static size_t timing_sample_to_bitstream(const uint32_t * restrict samples, size_t samples_count,
-                                        uint8_t * restrict bitstream, size_t bitstream_size);
 
 int main(int argc, char *argv[])
 {
@@ -75,6 +72,10 @@ int main(int argc, char *argv[])
                 die("Could not initialize mfm buffer\n");
         }
 
+        const struct mfm_sync_pattern amiga_sync = MFM_SYNC_AMIGA;
+        struct mfm_sync_search sync_search;
+        mfm_sync_search_init(&sync_search, &amiga_sync, 1);
+
         // write_data_to_disk(&opts, parser);
 
         const struct CapsImage * track_data = NULL;
@@ -219,9 +220,12 @@ end_check:
 #endif
 
                 size_t index = 0;
-                if (find_sync_marker(&tt, &index)) {
+                struct mfm_sync_hit sync_hit;
+                if (mfm_sync_find_all(&sync_search, tt.samples, tt.sample_count,
+                                                        &sync_hit, 1)) {
+                        index = sync_hit.sample;
                         memset(disk_track_mfm_bitstream, 0x00, 1088 * 11);
-                        size_t consumed = timing_sample_to_bitstream(
+                        size_t consumed = mfm_flux_to_bitstream(
                                         tt.samples + index,
                                         tt.sample_count - index,
                                         disk_track_mfm_bitstream, 1088 * 11);
@@ -403,139 +407,6 @@ static void write_data_to_disk(const struct write_flux_opts *opts, struct caps_p
         } while(track < last_track);
 }
 
-static size_t timing_sample_to_bitstream(const uint32_t * restrict samples, size_t samples_count,
-                                         uint8_t * restrict bitstream, size_t bitstream_size)
-{
-        // clear bitstream..
-        memset(bitstream, 0x00, bitstream_size);
-        /**
-         * We start at bit -2 as this is what the bitstream will look like from
-         * the index we found for sync:
-         *
-         *     |~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~|
-         *    01010001001000100101000100100010010
-         *     |~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~|
-         *
-         * While the actual sync mark are the bits in the box.
-         *
-         *   xx|01000100100010010100010010001001|x
-         *
-         * Without the -2 here, the data will be offset by one bit.
-         *
-         * TODO:
-         * Investigate if we can set `bit` to 0 and just change
-         * the index we return from find_sync_marker(...)
-         *
-         */
-        unsigned int bit = -2; // See Note ^^^
-        size_t i = 0;
-        for (; i < samples_count; i++) {
-                if (samples[i] > 700) {
-                        bit += 4;
-                } else if (samples[i] > 500) {
-                        bit += 3;
-                } else {
-                        bit += 2;
-                }
-                const int byte_no = bit >> 3;  // Div. 8
-                const int bit_no = bit & 0x07; // Mod. 8
-                if (byte_no >= bitstream_size) {
-                        // Bitstream full.
-                        printf("Bitstream buffer full!\n");
-                        return i + 1;
-                }
-                bitstream[byte_no] |= (1 << (7 - (bit_no)));
-        }
-
-        return i;
-}
-
-static bool find_sync_marker(struct track_samples *track, size_t *index)
-{
-        /**
-         * A the most bits between flux transitions is 4
-         * There are only three valid flux values:
-         *
-         *      01      This is 4 micro-seconds
-         *      001     This is 6 micro-seconds
-         *      0001    This is 8 micro-seconds.
-         */
-        enum sample_type { UNDEF, MS4, MS6, MS8 };
-
-        /**
-         * This is the series of flux transion timing data
-         * we are looking for.
-         * The following is the timing values to
-         * encode 0x44894489 as MFM data timing.
-         */
-        // TODO: I'd assume the first sample should be MS6 instead of MS4
-        //       as 0xaa is preceeding the sync marker so the preceding bits were 0b10
-        static const enum sample_type sync[10] = {
-                MS4, MS8, MS6, MS8, MS6, // 0x4489
-                MS4, MS8, MS6, MS8, MS6  // 0x4489
-        };
-
-        /**
-         * In this loop, we maintain the 10 latest
-         * flux timing values in a ring buffer,
-         * and compare it against the sync buffer
-         * to see if they match.
-         */
-        enum sample_type ring_buffer[10] = {UNDEF};
-
-        /*
-         * Multiply count with 10 to get nSec
-         * Divide by 100 to get μSec
-         */
-
-        //int sector = 0;
-
-        for (int i = *index; i < track->sample_count; i++) {
-                if (track->samples[i] > 700) {
-                        ring_buffer[i % 10] = MS8;
-                } else if (track->samples[i] > 500) {
-                        ring_buffer[i % 10] = MS6;
-                } else {
-                        ring_buffer[i % 10] = MS4;
-                }
-
-                int r_index = (i - 10);
-                // Wait until the ringbuffer is full before we start comparing.
-                if (r_index < 0) {
-                        continue;
-                }
-
-                bool found = true;
-                for (int e = 0; e < 10; e++) {
-                        if (sync[e] != ring_buffer[(r_index + e) % 10]) {
-                                found = false;
-                                break;
-                        }
-                }
-                if (found) {
-                        *index = i - 10;
-                        return true;
-                        /*
-                        if (sector >= 11) {
-                                // Current implementation only expects 11 sectors!
-                                fprintf(stderr,
-                                "%s: Error, found sector marker for sector: %d\n",
-                                                        __func__, sector + 1);
-                        } else {
-                                // Setup pointers to start of sector in the track struct.
-                                track->sectors[sector].samples =
-                                                        &track->samples[i - 10];
-                                printf(
-                                "Sync for sector %d found at sample inndex: %d\n",
-                                                                sector + 1, i);
-                        }
-                        sector++;
-                        */
-                }
-        }
-        return false;
-}
-
 static void hexdump(const void *rdata, size_t len)
 {
         const uint8_t *data = rdata;
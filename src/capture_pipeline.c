@@ -0,0 +1,646 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arm-interface.h"
+#include "capture_pipeline.h"
+#include "pru-setup.h"
+#include "track_schedule.h"
+#include "mfm_utils/amiga_decode.h"
+
+/**
+ * The pipeline is a ring of <queue_depth> slots.
+ *
+ * The producer (the calling thread) fills slot `produced`, the workers
+ * decode slot `dispatched`, and the writer thread drains slot `written`.
+ * A slot can only be reused when the writer is done with it, so at most
+ * queue_depth tracks are held in memory at any time.
+ */
+enum slot_state {
+        SLOT_EMPTY,
+        SLOT_CAPTURED,
+        SLOT_DECODING,
+        SLOT_DECODED,
+};
+
+struct capture_slot {
+        struct capture_track track;
+        enum slot_state state;
+};
+
+struct capture_pipeline {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+
+        const struct capture_ops *ops;
+        struct capture_slot *slots;
+        unsigned int depth;
+
+        unsigned int produced;
+        unsigned int dispatched;
+        unsigned int written;
+        bool producer_done;
+        bool abort;
+};
+
+static void *capture_worker(void *arg)
+{
+        struct capture_pipeline *p = arg;
+
+        pthread_mutex_lock(&p->lock);
+        while (true) {
+                while (p->dispatched == p->produced
+                                        && !p->producer_done && !p->abort) {
+                        pthread_cond_wait(&p->cond, &p->lock);
+                }
+                if (p->abort || p->dispatched == p->produced) {
+                        break;
+                }
+
+                struct capture_slot *slot = &p->slots[p->dispatched % p->depth];
+                p->dispatched++;
+                slot->state = SLOT_DECODING;
+                pthread_mutex_unlock(&p->lock);
+
+                slot->track.status = p->ops->decode
+                        ? p->ops->decode(&slot->track, p->ops->ctx)
+                        : 0;
+
+                pthread_mutex_lock(&p->lock);
+                slot->state = SLOT_DECODED;
+                pthread_cond_broadcast(&p->cond);
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        return NULL;
+}
+
+static void *capture_writer(void *arg)
+{
+        struct capture_pipeline *p = arg;
+
+        pthread_mutex_lock(&p->lock);
+        while (true) {
+                struct capture_slot *slot = &p->slots[p->written % p->depth];
+                while (slot->state != SLOT_DECODED
+                                && !(p->producer_done && p->written == p->produced)
+                                && !p->abort) {
+                        pthread_cond_wait(&p->cond, &p->lock);
+                }
+                if (p->abort || slot->state != SLOT_DECODED) {
+                        break;
+                }
+                pthread_mutex_unlock(&p->lock);
+
+                int rc = p->ops->write(&slot->track, p->ops->ctx);
+
+                free(slot->track.samples);
+                free(slot->track.index_offsets);
+                memset(&slot->track, 0x00, sizeof(slot->track));
+
+                pthread_mutex_lock(&p->lock);
+                slot->state = SLOT_EMPTY;
+                p->written++;
+                if (rc) {
+                        fprintf(stderr, "Write stage failed, abort capture!\n");
+                        p->abort = true;
+                }
+                pthread_cond_broadcast(&p->cond);
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        return NULL;
+}
+
+/**
+ * @brief       Capture the tracks of a schedule, while decoding and
+ *              writing the previous tracks in the background.
+ *
+ * @detail      The calling thread drives the source. Each finished track is
+ *              handed to <workers> decode threads, and a single writer thread
+ *              persists the tracks in the same order as they were read.
+ *              The producer only blocks when <queue_depth> tracks are
+ *              waiting to be decoded or written.
+ *
+ * @return      0 on success, negative on error.
+ */
+int capture_pipeline_run(struct capture_source *source,
+                        const struct capture_ops *ops,
+                        const struct capture_config *config)
+{
+        struct capture_pipeline p = {0};
+        pthread_t *workers;
+        pthread_t writer;
+        unsigned int i, worker_count = 0;
+        int rc = 0;
+
+        p.ops = ops;
+        p.depth = config->queue_depth ? config->queue_depth
+                                      : CAPTURE_DEFAULT_QUEUE_DEPTH;
+        const unsigned int n_workers = config->workers ? config->workers
+                                                   : CAPTURE_DEFAULT_WORKERS;
+
+        p.slots = calloc(p.depth, sizeof(*p.slots));
+        if (!p.slots) {
+                fprintf(stderr, "Couldn't allocate capture queue\n");
+                return -1;
+        }
+        workers = calloc(n_workers, sizeof(*workers));
+        if (!workers) {
+                fprintf(stderr, "Couldn't allocate worker threads\n");
+                free(p.slots);
+                return -1;
+        }
+
+        pthread_mutex_init(&p.lock, NULL);
+        pthread_cond_init(&p.cond, NULL);
+
+        if (pthread_create(&writer, NULL, capture_writer, &p)) {
+                fprintf(stderr, "Couldn't start writer thread\n");
+                rc = -1;
+                goto writer_failed;
+        }
+        for (i = 0; i < n_workers; i++) {
+                if (pthread_create(&workers[i], NULL, capture_worker, &p)) {
+                        fprintf(stderr, "Couldn't start worker thread %u\n", i);
+                        break;
+                }
+                worker_count++;
+        }
+        if (!worker_count) {
+                rc = -1;
+                pthread_mutex_lock(&p.lock);
+                p.abort = true;
+                pthread_mutex_unlock(&p.lock);
+        }
+
+        source->schedule = config->schedule;
+        unsigned int t;
+        while (track_schedule_next(config->schedule, &t)) {
+                pthread_mutex_lock(&p.lock);
+                while (p.produced - p.written >= p.depth && !p.abort) {
+                        pthread_cond_wait(&p.cond, &p.lock);
+                }
+                const bool abort = p.abort;
+                pthread_mutex_unlock(&p.lock);
+                if (abort) {
+                        rc = -1;
+                        break;
+                }
+
+                // This slot is ours, until we publish it below.
+                struct capture_slot *slot = &p.slots[p.produced % p.depth];
+
+                if (source->seek(source, t >> 1, t & 1)) {
+                        fprintf(stderr, "Seek to track %u failed\n", t);
+                        rc = -1;
+                        break;
+                }
+
+                slot->track.track = t;
+                slot->track.revolutions = config->revolutions;
+                slot->track.sample_count = source->read(source,
+                                                &slot->track.revolutions,
+                                                &slot->track.samples,
+                                                &slot->track.index_offsets);
+                if (!slot->track.sample_count) {
+                        fprintf(stderr, "Got zero samples from track %u\n", t);
+                        rc = -1;
+                        break;
+                }
+
+                pthread_mutex_lock(&p.lock);
+                slot->state = SLOT_CAPTURED;
+                p.produced++;
+                pthread_cond_broadcast(&p.cond);
+                pthread_mutex_unlock(&p.lock);
+        }
+
+        source->schedule = NULL;
+
+        pthread_mutex_lock(&p.lock);
+        p.producer_done = true;
+        if (rc) {
+                p.abort = true;
+        }
+        pthread_cond_broadcast(&p.cond);
+        pthread_mutex_unlock(&p.lock);
+
+        for (i = 0; i < worker_count; i++) {
+                pthread_join(workers[i], NULL);
+        }
+        pthread_join(writer, NULL);
+
+        if (p.abort) {
+                rc = -1;
+        }
+
+writer_failed:
+        // Release anything left behind by an aborted run.
+        for (i = 0; i < p.depth; i++) {
+                free(p.slots[i].track.samples);
+                free(p.slots[i].track.index_offsets);
+                if (p.slots[i].track.result && ops->free_result) {
+                        ops->free_result(p.slots[i].track.result, ops->ctx);
+                }
+        }
+
+        pthread_cond_destroy(&p.cond);
+        pthread_mutex_destroy(&p.lock);
+        free(workers);
+        free(p.slots);
+
+        return rc;
+}
+
+/* -------------------------------------------------------------------------
+ * PRU source
+ * ---------------------------------------------------------------------- */
+
+static int pru_source_seek(struct capture_source *source,
+                        unsigned int cylinder, unsigned int head)
+{
+        struct pru *pru = source->ctx;
+
+        if ((int)cylinder != source->cylinder) {
+                if ((int)cylinder > source->cylinder) {
+                        pru_set_head_dir(pru, PRU_HEAD_INC);
+                        pru_step_head(pru, cylinder - source->cylinder);
+                } else {
+                        pru_set_head_dir(pru, PRU_HEAD_DEC);
+                        pru_step_head(pru, source->cylinder - cylinder);
+                }
+                source->cylinder = cylinder;
+        }
+        if ((int)head != source->head) {
+                pru_set_head_side(pru, head ? PRU_HEAD_LOWER : PRU_HEAD_UPPER);
+                source->head = head;
+        }
+
+        return 0;
+}
+
+static int pru_source_read(struct capture_source *source, uint8_t *revolutions,
+                        uint32_t **samples, uint32_t **index_offsets)
+{
+        if (!source->adaptive)
+                return pru_read_timing(source->ctx, samples, *revolutions,
+                                                                index_offsets);
+
+        // Stop as soon as every sector has been good in some revolution.
+        struct amiga_fusion_stream *verify = malloc(sizeof(*verify));
+        if (!verify) {
+                fprintf(stderr, "Couldn't allocate memory for verify\n");
+                return 0;
+        }
+        amiga_fusion_stream_init(verify, NULL);
+        const int sample_count = pru_read_timing_until(source->ctx, samples,
+                        revolutions, index_offsets, amiga_fusion_consume,
+                                                                verify);
+        free(verify);
+
+        return sample_count;
+}
+
+/**
+ * @brief       Use the PRU as capture source.
+ *
+ * @detail      The caller must have started the motor and reset the
+ *              drive to cylinder 0 before the pipeline runs.
+ */
+void capture_source_pru_init(struct capture_source *source, struct pru *pru)
+{
+        source->seek = pru_source_seek;
+        source->read = pru_source_read;
+        source->ctx = pru;
+        source->schedule = NULL;
+        source->adaptive = false;
+        source->cylinder = 0;
+        source->head = -1; // Unknown, force a head select on first seek.
+}
+
+/* -------------------------------------------------------------------------
+ * PRU queue source
+ *
+ * Reads a cylinder with one pru_run_queue(): the step, both sides and
+ * their reads. A seek is only noted, the queue of the next read does it.
+ * Head 1 is read along with head 0, and kept until it is asked for.
+ * ---------------------------------------------------------------------- */
+
+struct pru_queue_track {
+        uint32_t *samples;
+        size_t count;
+        size_t size;
+        uint32_t *index_offsets;
+        bool ready;
+};
+
+struct pru_queue_source {
+        struct pru *pru;
+        int cylinder;                   // Where the drive is
+        int cached_cylinder;            // Of the tracks below
+        uint8_t revolutions;
+        struct pru_queue_track tracks[TRACKS_PER_CYLINDER];
+        int op_head[6];                 // Track each queued read goes to
+};
+
+static void pru_queue_track_free(struct pru_queue_track *track)
+{
+        free(track->samples);
+        free(track->index_offsets);
+        memset(track, 0x00, sizeof(*track));
+}
+
+static int pru_queue_samples(unsigned int index, const uint32_t *samples,
+                                                size_t count, void *ctx)
+{
+        struct pru_queue_source *q = ctx;
+        struct pru_queue_track *track = &q->tracks[q->op_head[index]];
+
+        if (track->count + count > track->size) {
+                size_t size = track->size * 2;
+                uint32_t *data = realloc(track->samples, size * sizeof(*data));
+                if (!data) {
+                        fprintf(stderr, "Couldn't grow memory for raw_timing\n");
+                        return -1;
+                }
+                track->samples = data;
+                track->size = size;
+        }
+
+        memcpy(track->samples + track->count, samples, count * sizeof(*samples));
+        track->count += count;
+
+        return 0;
+}
+
+static void pru_queue_done(unsigned int index, const struct pru_queue_op *op,
+                                const uint32_t *rev_offsets, void *ctx)
+{
+        struct pru_queue_source *q = ctx;
+        struct pru_queue_track *track = &q->tracks[q->op_head[index]];
+
+        memcpy(track->index_offsets, rev_offsets,
+                        (op->argument ? op->argument : 1) * sizeof(*rev_offsets));
+        track->ready = track->count == op->result;
+}
+
+static int pru_queue_source_seek(struct capture_source *source,
+                        unsigned int cylinder, unsigned int head)
+{
+        source->cylinder = cylinder;
+        source->head = head;
+        return 0;
+}
+
+static int pru_queue_source_read(struct capture_source *source,
+                        uint8_t *revs, uint32_t **samples,
+                        uint32_t **index_offsets)
+{
+        const uint8_t revolutions = *revs;
+        struct pru_queue_source *q = source->ctx;
+        struct pru_queue_track *track = &q->tracks[source->head];
+        struct pru_queue_op ops[6];
+        unsigned int count = 0, tracks, i;
+        int sample_count = 0;
+
+        *samples = NULL;
+        *index_offsets = NULL;
+
+        if (q->cached_cylinder != source->cylinder
+                                        || q->revolutions != revolutions) {
+                pru_queue_track_free(&q->tracks[0]);
+                pru_queue_track_free(&q->tracks[1]);
+        }
+
+        if (!track->ready) {
+                if (source->cylinder != q->cylinder) {
+                        const bool inc = source->cylinder > q->cylinder;
+                        ops[count++] = (struct pru_queue_op){
+                                .command = COMMAND_SET_HEAD_DIR,
+                                .argument = inc ? 1 : 0,
+                        };
+                        ops[count++] = (struct pru_queue_op){
+                                .command = COMMAND_STEP_HEAD,
+                                .argument = inc ? source->cylinder - q->cylinder
+                                                : q->cylinder - source->cylinder,
+                        };
+                }
+                // Head 0 brings head 1 along, if it comes next.
+                const unsigned int other = source->cylinder * 2 + 1;
+                tracks = source->head == 0 && (!source->schedule
+                        || track_schedule_pending(source->schedule, other))
+                                ? 2 : 1;
+                for (i = 0; i < tracks; i++) {
+                        const unsigned int head = source->head + i;
+                        ops[count++] = (struct pru_queue_op){
+                                .command = COMMAND_SET_HEAD_SIDE,
+                                .argument = head ? 0 : 1,
+                        };
+                        q->op_head[count] = head;
+                        ops[count++] = (struct pru_queue_op){
+                                .command = COMMAND_READ_TIMING,
+                                .argument = revolutions,
+                        };
+
+                        struct pru_queue_track *t = &q->tracks[head];
+                        pru_queue_track_free(t);
+                        // Room for 100,000 samples per revolution,
+                        // as pru_read_timing().
+                        t->size = 100000 * (revolutions ? revolutions : 1);
+                        t->samples = malloc(t->size * sizeof(*t->samples));
+                        t->index_offsets = calloc(1, 0x1000);
+                        if (!t->samples || !t->index_offsets) {
+                                fprintf(stderr,
+                                        "Couldn't allocate memory for raw_timing\n");
+                                pru_queue_track_free(t);
+                                return 0;
+                        }
+                }
+
+                const struct pru_queue_reader reader = {
+                        .samples = pru_queue_samples,
+                        .done = pru_queue_done,
+                        .ctx = q,
+                };
+
+                const int done = pru_run_queue(q->pru, ops, count, &reader);
+                q->cached_cylinder = source->cylinder;
+                q->revolutions = revolutions;
+                for (i = 0; i < count; i++) {
+                        if (ops[i].command == COMMAND_STEP_HEAD && ops[i].done)
+                                q->cylinder = source->cylinder;
+                }
+                if (done != (int)count) {
+                        fprintf(stderr, "PRU queue stopped after %d of %u ops\n",
+                                                                done, count);
+                }
+        }
+
+        if (track->ready) {
+                *samples = track->samples;
+                *index_offsets = track->index_offsets;
+                sample_count = track->count;
+                // Handed over to the pipeline.
+                memset(track, 0x00, sizeof(*track));
+        } else {
+                pru_queue_track_free(track);
+        }
+
+        return sample_count;
+}
+
+/**
+ * @brief       Use the PRU as capture source, a cylinder at a time.
+ *
+ * @detail      As capture_source_pru_init(), but each cylinder is one
+ *              round trip to the PRU, see pru_run_queue().
+ */
+bool capture_source_pru_queue_init(struct capture_source *source,
+                                                        struct pru *pru)
+{
+        struct pru_queue_source *q = calloc(1, sizeof(*q));
+        if (!q) {
+                return false;
+        }
+        q->pru = pru;
+        q->cached_cylinder = -1;
+
+        source->seek = pru_queue_source_seek;
+        source->read = pru_queue_source_read;
+        source->ctx = q;
+        source->schedule = NULL;
+        source->adaptive = false;
+        source->cylinder = 0;
+        source->head = 0;
+
+        return true;
+}
+
+void capture_source_pru_queue_cleanup(struct capture_source *source)
+{
+        struct pru_queue_source *q = source->ctx;
+
+        pru_queue_track_free(&q->tracks[0]);
+        pru_queue_track_free(&q->tracks[1]);
+        free(q);
+        source->ctx = NULL;
+}
+
+/* -------------------------------------------------------------------------
+ * File source
+ *
+ * Replays raw uint32_t timing dumps, as written by read_track_timing,
+ * one file per track named <prefix><track number as %03u>.
+ * ---------------------------------------------------------------------- */
+
+// 200ms per revolution at 300rpm, in 10 nSec ticks.
+#define FILE_SOURCE_REV_TICKS   20000000
+
+static int file_source_seek(struct capture_source *source,
+                        unsigned int cylinder, unsigned int head)
+{
+        source->cylinder = cylinder;
+        source->head = head;
+        return 0;
+}
+
+static int file_source_read(struct capture_source *source, uint8_t *revs,
+                        uint32_t **samples, uint32_t **index_offsets)
+{
+        const char *prefix = source->ctx;
+        const uint8_t revolutions = *revs;
+        const unsigned int track = source->cylinder * 2 + source->head;
+        char filename[512];
+        int sample_count = 0;
+        long size;
+
+        *samples = NULL;
+        *index_offsets = NULL;
+
+        snprintf(filename, sizeof(filename), "%s%03u", prefix, track);
+        FILE *fp = fopen(filename, "rb");
+        if (!fp) {
+                fprintf(stderr, "Could not open %s: %s\n",
+                                                filename, strerror(errno));
+                return 0;
+        }
+
+        fseek(fp, 0L, SEEK_END);
+        size = ftell(fp);
+        rewind(fp);
+        if (size < (long)sizeof(**samples)) {
+                fprintf(stderr, "%s: no samples in file\n", filename);
+                goto out;
+        }
+
+        *samples = malloc(size);
+        // Same size as the buffer pru_read_timing hands out.
+        *index_offsets = calloc(0x1000 / sizeof(**index_offsets),
+                                                sizeof(**index_offsets));
+        if (!*samples || !*index_offsets) {
+                fprintf(stderr, "Couldn't allocate memory for %s\n", filename);
+                goto out;
+        }
+
+        sample_count = fread(*samples, sizeof(**samples),
+                                size / sizeof(**samples), fp);
+
+        // The dumps carry no index information, so we place an index
+        // pulse every 200ms of flux time.
+        uint64_t time = 0;
+        unsigned int rev = 0;
+        for (int i = 0; i < sample_count && rev < revolutions; i++) {
+                time += (*samples)[i];
+                if (time >= (uint64_t)FILE_SOURCE_REV_TICKS * (rev + 1)) {
+                        (*index_offsets)[rev++] = i + 1;
+                }
+        }
+        while (rev < revolutions) {
+                (*index_offsets)[rev++] = sample_count;
+        }
+
+out:
+        if (!sample_count) {
+                free(*samples);
+                free(*index_offsets);
+                *samples = NULL;
+                *index_offsets = NULL;
+        }
+        fclose(fp);
+        return sample_count;
+}
+
+/**
+ * @brief       Use a set of track dumps on disk as capture source.
+ *
+ * @param       pattern         File name prefix. Track N is read from
+ *                              <pattern>NNN, i.e "dump/t" -> "dump/t042"
+ */
+bool capture_source_file_init(struct capture_source *source,
+                                                const char *pattern)
+{
+        char *prefix = malloc(strlen(pattern) + 1);
+        if (!prefix) {
+                return false;
+        }
+        strcpy(prefix, pattern);
+
+        source->seek = file_source_seek;
+        source->read = file_source_read;
+        source->ctx = prefix;
+        source->schedule = NULL;
+        source->adaptive = false;
+        source->cylinder = 0;
+        source->head = 0;
+
+        return true;
+}
+
+void capture_source_file_cleanup(struct capture_source *source)
+{
+        free(source->ctx);
+        source->ctx = NULL;
+}
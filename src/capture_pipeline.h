@@ -0,0 +1,96 @@
+#ifndef CAPTURE_PIPELINE_H
+#define CAPTURE_PIPELINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct pru;
+struct track_schedule;
+
+/**
+ * One captured track on its way through the pipeline.
+ *
+ * The samples and index_offsets buffers are heap allocated by the source,
+ * and freed by the pipeline after the write stage is done with the track.
+ */
+struct capture_track {
+        unsigned int track;             // cylinder * 2 + head
+        uint8_t revolutions;
+        uint32_t *samples;              // Flux timing, counts of 10 nSec.
+        int sample_count;
+        uint32_t *index_offsets;        // Sample index of each index pulse.
+        void *result;                   // Owned by the decode/write callbacks.
+        int status;                     // Return value from the decode stage.
+};
+
+/**
+ * Something that can deliver raw flux for a track.
+ * The PRU is the real thing, the file source replays dumps from disk.
+ */
+struct capture_source {
+        /**
+         * Move the head to the given cylinder and select head.
+         * Return 0 on success.
+         */
+        int (*seek)(struct capture_source *source, unsigned int cylinder,
+                                                        unsigned int head);
+        /**
+         * Read <revolutions> revolutions from the current track.
+         * Same contract as pru_read_timing, return the sample count.
+         * An adaptive source can read fewer, and updates <revolutions>.
+         */
+        int (*read)(struct capture_source *source, uint8_t *revolutions,
+                        uint32_t **samples, uint32_t **index_offsets);
+        void *ctx;
+        int cylinder;                   // Current head position, kept by seek
+        int head;
+        const struct track_schedule *schedule;  // Set while a capture runs
+        bool adaptive;          // Stop once the sectors are good, the
+                                // revolutions are the most to read
+};
+
+struct capture_ops {
+        /**
+         * Called from the worker threads, possibly out of track order.
+         * Whatever is stored in track->result is passed on to write.
+         */
+        int (*decode)(struct capture_track *track, void *ctx);
+        /**
+         * Called from the single writer thread, in the order the tracks
+         * were read.
+         * The write callback must free track->result.
+         */
+        int (*write)(struct capture_track *track, void *ctx);
+        /**
+         * Frees track->result of a track that was decoded, but never
+         * written as the capture was aborted. Can be NULL if decode
+         * leaves no result.
+         */
+        void (*free_result)(void *result, void *ctx);
+        void *ctx;
+};
+
+struct capture_config {
+        struct track_schedule *schedule;        // Planned by the caller
+        uint8_t revolutions;
+        unsigned int workers;           // Number of decode threads
+        unsigned int queue_depth;       // Max tracks in flight
+};
+
+#define CAPTURE_DEFAULT_WORKERS         2
+#define CAPTURE_MAX_WORKERS             64
+#define CAPTURE_DEFAULT_QUEUE_DEPTH     8
+
+int capture_pipeline_run(struct capture_source *source,
+                        const struct capture_ops *ops,
+                        const struct capture_config *config);
+
+void capture_source_pru_init(struct capture_source *source, struct pru *pru);
+bool capture_source_pru_queue_init(struct capture_source *source,
+                                                        struct pru *pru);
+void capture_source_pru_queue_cleanup(struct capture_source *source);
+bool capture_source_file_init(struct capture_source *source,
+                                                const char *pattern);
+void capture_source_file_cleanup(struct capture_source *source);
+
+#endif /* CAPTURE_PIPELINE_H */
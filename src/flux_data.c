@@ -1,59 +1,176 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#include <math.h>
 
 #include "flux_data.h"
 
-/* Cross correlation - get the delay for the consecutive revolutions */
-/* http://paulbourke.net/miscellaneous/correlate/ */
-static int xcorr(uint32_t *x, uint32_t *y, int len, double mx, double sx)
+/*
+ * The revolutions are lined up with the first by cross correlation.
+ * http://paulbourke.net/miscellaneous/correlate/
+ *
+ * The samples are taken from their mean and clamped to int16_t, so the
+ * products fit an int32_t for a block of FLUX_ALIGN_BLOCK samples. The
+ * same samples of the first revolution are compared at every delay, so
+ * the sums can be compared as they are, without normalizing them.
+ */
+#define FLUX_ALIGN_BLOCK        2048
+#define FLUX_ALIGN_CLAMP        1000
+// Most a sample is taken to differ from the mean, so that the squares
+// of 64 revolutions add up in an uint32_t.
+#define FLUX_VARIANCE_CLAMP     4095
+
+static void flux_center(const uint32_t *in, int len, int16_t *out)
 {
-        int i, j, delay, best_delay;
-        double my, sy, sxy, denom, r;
+        int64_t sum = 0;
+        int i;
 
-        // Calculate Y_Mean
-        my = 0;
         for (i = 0; i < len; i++)
-                my += y[i];
-        my /= len;
-        //printf("mean x: %f, mean y: %f\n", mx, my);
+                sum += in[i];
+        const int32_t mean = sum / len;
 
-        // Calculate Y_Denominator
-        sy = 0;
-        for (i = 0; i < len; i++)
-                sy += (y[i] - my) * (y[i] - my);
-        denom = sqrt(sx * sy);
-        //printf("denominator: %f\n", denom);
-
-        r = 0;
-        best_delay = 0;
-        for (delay = -10; delay < 10; delay++) {
-                sxy = 0;
-                for (i = 0; i < len; i++) {
-                        j = i + delay;
-                        if (j < 0 || j >= len)
-                                continue;
-                        sxy += (x[i] - mx) * (y[j] - my);
+        for (i = 0; i < len; i++) {
+                int32_t v = (int32_t)in[i] - mean;
+                if (v > FLUX_ALIGN_CLAMP)
+                        v = FLUX_ALIGN_CLAMP;
+                else if (v < -FLUX_ALIGN_CLAMP)
+                        v = -FLUX_ALIGN_CLAMP;
+                out[i] = v;
+        }
+}
+
+// Four delays at a time: each sample of x is loaded once for all four.
+static void flux_dot4(const int16_t *x, const int16_t *y, int len,
+                                                        int64_t *corr)
+{
+        int32_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+
+        for (int i = 0; i < len; i++) {
+                const int32_t v = x[i];
+                s0 += v * y[i];
+                s1 += v * y[i + 1];
+                s2 += v * y[i + 2];
+                s3 += v * y[i + 3];
+        }
+        corr[0] += s0;
+        corr[1] += s1;
+        corr[2] += s2;
+        corr[3] += s3;
+}
+
+static int32_t flux_dot(const int16_t *x, const int16_t *y, int len)
+{
+        int32_t sum = 0;
+
+        for (int i = 0; i < len; i++)
+                sum += x[i] * y[i];
+        return sum;
+}
+
+/**
+ * @brief       Find how far each revolution is off the first.
+ *
+ * @detail      Each revolution is searched <window> samples either way
+ *              of its start. All of them go through one pass over the
+ *              first revolution, a block at a time, so it stays in cache.
+ *              The peak is refined with a parabola through its neighbours.
+ *
+ * @param       data            Flux timing, counts of 10 nSec.
+ * @param       starts          Sample where each revolution starts
+ * @param       len             Samples in each revolution, at least
+ * @param       revolutions     Number of revolutions
+ * @param       window          Most samples a revolution can be off
+ * @param       shift           <OUT> For each revolution, how far it is
+ *                              off, in 1/FLUX_SHIFT_ONE samples. 0 for
+ *                              the first.
+ *
+ * @return      0 on success, -1 on error.
+ */
+int flux_align(const uint32_t *data, const int *starts, int len,
+                        int revolutions, int window, int *shift)
+{
+        const int delays = 2 * window + 1;
+        int16_t *centered;
+        int64_t *corr;
+        int i, rev, d;
+
+        if (revolutions < 1 || window < 1 || len <= 2 * window) {
+                fprintf(stderr, "Can't align %d revolutions of %d samples\n",
+                                                        revolutions, len);
+                return -1;
+        }
+
+        centered = malloc(sizeof(*centered) * len * revolutions);
+        corr = calloc(sizeof(*corr), delays * revolutions);
+        if (!centered || !corr) {
+                fprintf(stderr, "Couldn't allocate alignment buffers\n");
+                free(centered);
+                free(corr);
+                return -1;
+        }
+
+        for (rev = 0; rev < revolutions; rev++)
+                flux_center(data + starts[rev], len, centered + rev * len);
+
+        const int16_t *x = centered;
+        for (i = window; i < len - window; i += FLUX_ALIGN_BLOCK) {
+                const int n = len - window - i < FLUX_ALIGN_BLOCK
+                                        ? len - window - i : FLUX_ALIGN_BLOCK;
+                for (rev = 1; rev < revolutions; rev++) {
+                        const int16_t *y = centered + rev * len + i - window;
+                        int64_t *c = corr + rev * delays;
+                        for (d = 0; d + 4 <= delays; d += 4)
+                                flux_dot4(x + i, y + d, n, c + d);
+                        for (; d < delays; d++)
+                                c[d] += flux_dot(x + i, y + d, n);
+                }
+        }
+
+        shift[0] = 0;
+        for (rev = 1; rev < revolutions; rev++) {
+                const int64_t *c = corr + rev * delays;
+                int best = 0;
+
+                for (d = 1; d < delays; d++) {
+                        if (c[d] > c[best])
+                                best = d;
                 }
-                //printf("Delay: %3d - coefficient: %8f\n", delay, sxy / denom);
-                if (sxy / denom > r) {
-                        r = sxy / denom;
-                        best_delay = delay;
+
+                shift[rev] = (best - window) * FLUX_SHIFT_ONE;
+                if (best > 0 && best < delays - 1) {
+                        const int64_t num = c[best - 1] - c[best + 1];
+                        const int64_t den = c[best - 1] - 2 * c[best]
+                                                        + c[best + 1];
+                        if (den < 0)
+                                shift[rev] += num * (FLUX_SHIFT_ONE / 2) / den;
                 }
         }
-        return best_delay;
+
+        free(centered);
+        free(corr);
+
+        return 0;
 }
 
-struct flux_data *flux_data_init(uint32_t *data, int tot_len, int *idx_pos,
-                                                        int revolutions)
+/**
+ * @brief       Copy a read, with its revolutions lined up.
+ *
+ * @param       data            Flux timing, as from pru_read_timing()
+ * @param       tot_len         Number of samples in data
+ * @param       rev_offsets     Sample count at each index pulse
+ * @param       revolutions     Number of revolutions
+ * @param       window          Most samples a revolution can be off the
+ *                              first, i.e. FLUX_ALIGN_WINDOW
+ *
+ * @return      The aligned flux, or NULL on error.
+ */
+struct flux_data *flux_data_init(const uint32_t *data, int tot_len,
+                        const uint32_t *rev_offsets, int revolutions,
+                        int window)
 {
-        int i, len, delay;
-        uint32_t *x, *y;
-        double mx, sx;
+        int i, start;
         struct flux_data *flux_data = NULL;
 
-        flux_data = malloc(sizeof(*flux_data));
+        flux_data = calloc(1, sizeof(*flux_data));
         if (!flux_data)
                 return NULL;
 
@@ -65,80 +182,123 @@ struct flux_data *flux_data_init(uint32_t *data, int tot_len, int *idx_pos,
         memcpy(flux_data->data, data, sizeof(*data) * tot_len);
 
         flux_data->idx_pos = calloc(sizeof(*flux_data->idx_pos), revolutions);
-        if (!flux_data->idx_pos)
+        flux_data->shift = calloc(sizeof(*flux_data->shift), revolutions);
+        if (!flux_data->idx_pos || !flux_data->shift)
+                goto err_out;
+
+        // Make sure len is within range, for the shortest revolution
+        // and the last one being pushed on by the window.
+        flux_data->len = tot_len;
+        for (i = 0, start = 0; i < revolutions; i++) {
+                const int len = (int)rev_offsets[i] - start;
+                if (len < flux_data->len)
+                        flux_data->len = len;
+                if (!i)
+                        flux_data->master_len = len;
+                flux_data->idx_pos[i] = start;
+                start = rev_offsets[i];
+        }
+        if (revolutions > 1 && start + window > tot_len)
+                flux_data->len -= start + window - tot_len;
+
+        if (revolutions > 1 && flux_align(data, flux_data->idx_pos,
+                        flux_data->len, revolutions, window,
+                                                flux_data->shift) < 0)
                 goto err_out;
 
-        // Make sure len is within range
-        len = idx_pos[0];
         for (i = 1; i < revolutions; i++) {
-                len = (idx_pos[i] > len) ? len : idx_pos[i];
+                const int delay = flux_data->shift[i] >= 0
+                        ? (flux_data->shift[i] + FLUX_SHIFT_ONE / 2)
+                                                        / FLUX_SHIFT_ONE
+                        : -((-flux_data->shift[i] + FLUX_SHIFT_ONE / 2)
+                                                        / FLUX_SHIFT_ONE);
+                flux_data->idx_pos[i] += delay;
         }
 
-        x = data;
-        y = data;
+        return flux_data;
 
-        // Calculate X_Mean
-        mx = 0;
-        for (i = 0; i < len; i++)
-                mx += x[i];
-        mx /= len;
+err_out:
+        if (flux_data) flux_data_free(flux_data);
 
-        // Calculate denominator
-        sx = 0;
-        for (i = 0; i < len; i++)
-                sx += (x[i] - mx) * (x[i] - mx);
+        return NULL;
+}
 
-        // We use this loop both to cross corrolate the offsets,
-        // and to fill the idx_pos of flux_data, wrt. the cross corrolation
-        delay = 0;
-        for (i = 0; i < revolutions; i++) {
-                flux_data->idx_pos[i] = idx_pos[i] - delay;
+/**
+ * @brief       Average the lined up revolutions into one.
+ *
+ * @detail      The flux intervals of each revolution are taken in the
+ *              same order as those of the first, so a revolution that
+ *              gained or lost a flux transition shows up as a high
+ *              variance from there on. The samples past flux_data->len,
+ *              up to the index of the first revolution, are taken from
+ *              the first revolution as they are, with no variance.
+ *              Mean and variance come from one pass, summing how far each
+ *              revolution is off the first, a block at a time, so the
+ *              sums stay in cache while every revolution is added in.
+ *
+ * @param       flux_data       As from flux_data_init()
+ * @param       mean            <OUT> flux_data->master_len samples, the
+ *                              averaged revolution
+ * @param       variance        <OUT> flux_data->master_len samples, how
+ *                              much each one varies over the revolutions,
+ *                              in counts of 10 nSec squared. Can be NULL.
+ *
+ * @return      Number of samples in mean.
+ */
+int flux_average(const struct flux_data *flux_data, uint32_t *mean,
+                                                        uint32_t *variance)
+{
+        const int revolutions = flux_data->revolutions;
+        const int len = flux_data->len;
+        const uint32_t *x = flux_data->data + flux_data->idx_pos[0];
+        int32_t sum[FLUX_ALIGN_BLOCK];
+        uint32_t squares[FLUX_ALIGN_BLOCK];
+        int i, n, rev;
 
-                if (revolutions - 1 == i) break;
+        for (i = 0; i < len; i += n) {
+                n = len - i < FLUX_ALIGN_BLOCK ? len - i : FLUX_ALIGN_BLOCK;
 
-                y += idx_pos[i];
-                delay = xcorr(x, y, len, mx, sx);
-                flux_data->idx_pos[i] += delay;
-        }
+                memset(sum, 0x00, sizeof(*sum) * n);
+                memset(squares, 0x00, sizeof(*squares) * n);
+                for (rev = 1; rev < revolutions; rev++) {
+                        const uint32_t *y = flux_data->data
+                                        + flux_data->idx_pos[rev] + i;
+                        for (int k = 0; k < n; k++) {
+                                int32_t d = (int32_t)(y[k] - x[i + k]);
+                                if (d > FLUX_VARIANCE_CLAMP)
+                                        d = FLUX_VARIANCE_CLAMP;
+                                else if (d < -FLUX_VARIANCE_CLAMP)
+                                        d = -FLUX_VARIANCE_CLAMP;
+                                sum[k] += d;
+                                squares[k] += d * d;
+                        }
+                }
 
-#if 1
-        {
-                int rev;
-                uint32_t *fd_ptr;
-
-                printf("------------------------------\n"
-                       "|  Debug FluxData Alignment  |\n"
-                       "------------------------------\n");
-
-                i = 0;
-                do { i++; } while(data[i] < 5000);
-
-                printf("Found sample > 5000 @: %d\n", i);
-                fd_ptr = data;
-                for (rev = 0; rev < revolutions; rev++) {
-                        printf("\n%d\n", rev);
-                        printf("[%d %d %d %d]\n", fd_ptr[i-4], fd_ptr[i-3],
-                                                  fd_ptr[i-2], fd_ptr[i-1]);
-                        printf("[%d %d %d %d]\n", fd_ptr[i],   fd_ptr[i+1],
-                                                  fd_ptr[i+2], fd_ptr[i+3]);
-                        fd_ptr += flux_data->idx_pos[rev];
+                for (int k = 0; k < n; k++) {
+                        const int32_t s = sum[k];
+                        const int32_t half = s < 0 ? -revolutions / 2
+                                                        : revolutions / 2;
+                        mean[i + k] = x[i + k] + (s + half) / revolutions;
+                        if (variance)
+                                variance[i + k] = ((int64_t)squares[k]
+                                        * revolutions - (int64_t)s * s)
+                                        / ((int64_t)revolutions * revolutions);
                 }
         }
-#endif
-        return flux_data;
 
-err_out:
-        if (flux_data) flux_data_free(flux_data);
+        for (i = len; i < flux_data->master_len; i++) {
+                mean[i] = x[i];
+                if (variance)
+                        variance[i] = 0;
+        }
 
-        return NULL;
+        return flux_data->master_len;
 }
 
 void flux_data_free(struct flux_data *flux_data)
 {
-        if (flux_data->data)
-                free(flux_data->data);
-        if (flux_data->idx_pos)
-                free(flux_data->idx_pos);
+        free(flux_data->data);
+        free(flux_data->idx_pos);
+        free(flux_data->shift);
         free(flux_data);
 }
-
@@ -3,13 +3,32 @@
 
 #include <stdint.h>
 
+// Revolutions are searched this many samples either way, by default.
+#define FLUX_ALIGN_WINDOW       64
+// flux_data.shift is in 1/FLUX_SHIFT_ONE samples.
+#define FLUX_SHIFT_ONE          256
+// An averaged sample that varies more than this, in counts of 10 nSec
+// squared, over the revolutions is likely a weak bit. 0.5 uSec.
+#define FLUX_WEAK_VARIANCE      (50 * 50)
+
 struct flux_data {
         int revolutions;
-        int *idx_pos;
+        int len;                // Samples of each revolution that line up
+        int master_len;         // Samples of the first revolution, the one
+                                // the others are lined up with
+        int *idx_pos;           // Start of each revolution in data,
+                                // aligned with the first
+        int *shift;             // Alignment of each revolution, with the
+                                // sub-sample part, in 1/FLUX_SHIFT_ONE
         uint32_t *data;
 };
 
-struct flux_data *flux_data_init(uint32_t *data, int tot_len, int *idx_pos,
-                                                        int revolutions);
+int flux_align(const uint32_t *data, const int *starts, int len,
+                        int revolutions, int window, int *shift);
+struct flux_data *flux_data_init(const uint32_t *data, int tot_len,
+                        const uint32_t *rev_offsets, int revolutions,
+                        int window);
+int flux_average(const struct flux_data *flux_data, uint32_t *mean,
+                                                        uint32_t *variance);
 void flux_data_free(struct flux_data *data);
 #endif /* FLUX_DATA_H */
@@ -14,6 +14,7 @@
 #include "read_flux.h"
 #include "read_flux_simple.h"
 #include "write_flux.h"
+#include "mfm_utils/amiga_decode.h"
 
 #define min(a,b) ((a < b) ? a : b)
 #define max(a,b) ((a > b) ? a : b)
@@ -21,23 +22,16 @@
 #define MASK 0x55555555 /* 0b010101010101 ... 010101 */
 unsigned int decode_data(void *in_buf, int len, void *out_buf)
 {
-        unsigned int *input = in_buf;
-        unsigned int *output = out_buf;
-        unsigned int odd_bits, even_bits;
-        unsigned int chksum = 0L;
-        int data_size = len/2;
+        const int data_size = len / 2;
+        uint32_t *output = out_buf;
+        uint32_t chksum;
         int i;
 
-        memset(out_buf, 0, data_size);
-        for (i = 0; i < data_size/sizeof(int); i++) {
-                odd_bits = *input;
-                even_bits = *(input+(data_size/sizeof(int)));
-                chksum ^= odd_bits;
-                chksum ^= even_bits;
-
-                *output = be32toh((even_bits & MASK) | ((odd_bits & MASK) << 1));
-                input++;
-                output++;
+        chksum = amiga_decode_longs(in_buf, (uint8_t *)in_buf + data_size,
+                                                        out_buf, data_size);
+        // encode_data() stores the longs byte swapped, so swap them back.
+        for (i = 0; i < data_size / sizeof(*output); i++) {
+                output[i] = be32toh(output[i]);
         }
         return (chksum & MASK);
 }
@@ -370,7 +364,7 @@ int init_write(int argc, char ** argv)
         }
         fclose(fp);
 
-        printf("Done: read: %d\n", count * 4);
+        printf("Done: read: %zu\n", count * 4);
         hexdump(dwords, RAW_MFM_SECTOR_SIZE);
         free(dwords);
         return 0;
@@ -831,14 +825,14 @@ int main(int argc, char **argv)
         signal(SIGINT, int_handler);
 
         printf("Running command\n");
-        m->init(mod_argc, mod_argv);
+        const int rc = m->init(mod_argc, mod_argv);
 
         free(mod_argv);
         free(mod_argv_data);
 
         pru_exit(pru);
 
-        exit(0);
+        exit(rc ? 1 : 0);
 }
 
 #if 0
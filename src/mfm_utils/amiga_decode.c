@@ -0,0 +1,430 @@
+#include <string.h>
+#include <endian.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "amiga_decode.h"
+
+/**
+ * An amiga sector is stored as all the odd bits of a block, then all the
+ * even bits, with the MFM clock bits in between.
+ * Decoding is (odd & 0x55555555) << 1 | (even & 0x55555555), and the
+ * checksums are the XOR of the raw longs. Both work the same on every
+ * byte, so the longs are never byte swapped, and the vector code does
+ * 16 bytes at a time.
+ */
+
+#define AMIGA_MASK      0x55555555
+
+// Offsets from the 4489 4489 sync.
+#define INFO_ODD        4
+#define LABEL_ODD       12
+#define HEADER_SUM_ODD  44
+#define DATA_SUM_ODD    52
+#define DATA_ODD        60
+
+static inline uint32_t load32(const uint8_t *p)
+{
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+}
+
+static inline uint32_t decode_long(uint32_t odd, uint32_t even)
+{
+        return ((odd & AMIGA_MASK) << 1) | (even & AMIGA_MASK);
+}
+
+/**
+ * @brief       Decode a block of odd / even longs, and XOR them together.
+ *
+ * @param       odd             The odd bits, `bytes` long
+ * @param       even            The even bits, `bytes` long
+ * @param       out             <OUT> `bytes` of decoded data, or NULL
+ *                              to only do the checksum.
+ * @param       bytes           A multiple of 4.
+ *
+ * @return      The XOR of all the raw longs, not masked.
+ */
+uint32_t amiga_decode_longs(const uint8_t * restrict odd,
+                        const uint8_t * restrict even,
+                        uint8_t * restrict out, size_t bytes)
+{
+        uint32_t checksum = 0;
+        size_t i = 0;
+
+#if defined(__SSE2__)
+        const __m128i mask = _mm_set1_epi32(AMIGA_MASK);
+        __m128i sum = _mm_setzero_si128();
+
+        for (; i + 16 <= bytes; i += 16) {
+                const __m128i o = _mm_loadu_si128((const __m128i *)(odd + i));
+                const __m128i e = _mm_loadu_si128((const __m128i *)(even + i));
+
+                sum = _mm_xor_si128(sum, _mm_xor_si128(o, e));
+                if (out) {
+                        _mm_storeu_si128((__m128i *)(out + i), _mm_or_si128(
+                                _mm_slli_epi32(_mm_and_si128(o, mask), 1),
+                                _mm_and_si128(e, mask)));
+                }
+        }
+        sum = _mm_xor_si128(sum, _mm_shuffle_epi32(sum, 0x4e));
+        sum = _mm_xor_si128(sum, _mm_shuffle_epi32(sum, 0xb1));
+        checksum = _mm_cvtsi128_si32(sum);
+#elif defined(__ARM_NEON)
+        const uint32x4_t mask = vdupq_n_u32(AMIGA_MASK);
+        uint32x4_t sum = vdupq_n_u32(0);
+
+        for (; i + 16 <= bytes; i += 16) {
+                const uint32x4_t o = vreinterpretq_u32_u8(vld1q_u8(odd + i));
+                const uint32x4_t e = vreinterpretq_u32_u8(vld1q_u8(even + i));
+
+                sum = veorq_u32(sum, veorq_u32(o, e));
+                if (out) {
+                        vst1q_u8(out + i, vreinterpretq_u8_u32(vorrq_u32(
+                                vshlq_n_u32(vandq_u32(o, mask), 1),
+                                vandq_u32(e, mask))));
+                }
+        }
+        uint32x2_t folded = veor_u32(vget_low_u32(sum), vget_high_u32(sum));
+        checksum = vget_lane_u32(folded, 0) ^ vget_lane_u32(folded, 1);
+#endif
+
+        for (; i < bytes; i += 4) {
+                const uint32_t o = load32(odd + i);
+                const uint32_t e = load32(even + i);
+
+                checksum ^= o ^ e;
+                if (out) {
+                        const uint32_t d = decode_long(o, e);
+                        memcpy(out + i, &d, sizeof(d));
+                }
+        }
+
+        return checksum;
+}
+
+/**
+ * @brief       Decode one amiga sector, without allocating anything.
+ *
+ * @param       mfm             AMIGA_MFM_SECTOR_BODY bytes, starting with
+ *                              the sync (0x4489 0x4489).
+ * @param       sector          <OUT> Header and checksums.
+ * @param       data            <OUT> AMIGA_SECTOR_DATA_SIZE bytes for the
+ *                              sector data, or NULL to only check it.
+ *
+ * @return      0 on success, -2 if the sync is missing.
+ */
+int amiga_decode_sector(const uint8_t * restrict mfm,
+                        struct amiga_sector * restrict sector,
+                        uint8_t * restrict data)
+{
+        memset(sector, 0x00, sizeof(*sector));
+
+        if (load32(mfm) != htobe32(0x44894489)) {
+                return -2;
+        }
+
+        sector->header_info = decode_long(load32(mfm + INFO_ODD),
+                                                load32(mfm + INFO_ODD + 4));
+        for (unsigned int i = 0; i < 4; i++) {
+                sector->header_sector_label[i] = decode_long(
+                                        load32(mfm + LABEL_ODD + 4 * i),
+                                        load32(mfm + LABEL_ODD + 16 + 4 * i));
+        }
+
+        // The header checksum covers info and label, 40 bytes in a row.
+        uint32_t checksum = 0;
+        for (unsigned int i = INFO_ODD; i < HEADER_SUM_ODD; i += 4) {
+                checksum ^= load32(mfm + i);
+        }
+        sector->calculated_header_checksum = checksum;
+        checksum ^= load32(mfm + HEADER_SUM_ODD) ^ load32(mfm + HEADER_SUM_ODD + 4);
+        sector->header_checksum_ok = (checksum & AMIGA_MASK) == 0;
+
+        checksum = amiga_decode_longs(mfm + DATA_ODD,
+                                mfm + DATA_ODD + AMIGA_SECTOR_DATA_SIZE,
+                                data, AMIGA_SECTOR_DATA_SIZE);
+        sector->calculated_data_checksum = checksum;
+        checksum ^= load32(mfm + DATA_SUM_ODD) ^ load32(mfm + DATA_SUM_ODD + 4);
+        sector->data_checksum_ok = (checksum & AMIGA_MASK) == 0;
+
+        return 0;
+}
+
+/**
+ * @brief       Decode a batch of sectors, as stored by mfm_stream.
+ *
+ * @param       track           `count` sectors of AMIGA_MFM_SECTOR_SIZE bytes,
+ *                              each aaaa aaaa 4489 4489 + header and data.
+ * @param       count           Number of sectors, AMIGA_SECTORS_PER_TRACK
+ *                              for a whole track.
+ * @param       sectors         <OUT> `count` decoded headers. A sector without
+ *                              the sync is left zeroed, so both checksums fail.
+ * @param       data            <OUT> `count` * AMIGA_SECTOR_DATA_SIZE bytes
+ *                              in the same order, or NULL.
+ *
+ * @return      The number of sectors with good header and data checksums.
+ */
+unsigned int amiga_decode_sectors(const uint8_t * restrict track,
+                        unsigned int count,
+                        struct amiga_sector * restrict sectors,
+                        uint8_t * restrict data)
+{
+        unsigned int good = 0;
+
+        for (unsigned int i = 0; i < count; i++) {
+                const int rc = amiga_decode_sector(
+                                track + i * AMIGA_MFM_SECTOR_SIZE + 4,
+                                &sectors[i],
+                                data ? data + i * AMIGA_SECTOR_DATA_SIZE : NULL);
+                if (rc == 0 && sectors[i].header_checksum_ok
+                                        && sectors[i].data_checksum_ok) {
+                        good++;
+                }
+        }
+
+        return good;
+}
+
+static inline bool sector_good(const struct amiga_track_sector *s)
+{
+        return s->sector.header_checksum_ok && s->sector.data_checksum_ok;
+}
+
+/**
+ * @brief       Sort the sectors an mfm_stream found by sector number.
+ *
+ * @detail      A sector goes to the slot given by its header. A sector
+ *              number out of range, or a second copy of a sector that
+ *              is no better than the first, is counted as unplaced.
+ */
+void amiga_track_from_stream(const struct mfm_stream *stream,
+                        struct amiga_track *track)
+{
+        memset(track, 0x00, sizeof(*track));
+
+        for (unsigned int i = 0; i < stream->sector_count; i++) {
+                const struct mfm_stream_sector *found = &stream->sectors[i];
+                const unsigned int sector_no =
+                                (be32toh(found->sector.header_info) >> 8) & 0xff;
+
+                if (found->rc || sector_no >= AMIGA_SECTORS_PER_TRACK) {
+                        track->unplaced++;
+                        continue;
+                }
+
+                const struct amiga_track_sector entry = {
+                        .found = true,
+                        .sector = found->sector,
+                        .mfm = stream->track + i * AMIGA_MFM_SECTOR_SIZE,
+                        .data = stream->data
+                                ? stream->data + i * AMIGA_SECTOR_DATA_SIZE
+                                : NULL,
+                        .sample_index = found->sample_index,
+                };
+                struct amiga_track_sector *slot = &track->sectors[sector_no];
+
+                if (slot->found) {
+                        track->unplaced++;
+                        if (sector_good(slot) || !sector_good(&entry)) {
+                                continue;
+                        }
+                        track->found--;
+                }
+                *slot = entry;
+                track->found++;
+        }
+
+        for (unsigned int i = 0; i < AMIGA_SECTORS_PER_TRACK; i++) {
+                if (track->sectors[i].found && sector_good(&track->sectors[i])) {
+                        track->good++;
+                }
+        }
+}
+
+/**
+ * @brief       Decode a whole amiga track from flux, in one pass.
+ *
+ * @param       samples         Flux timing, counts of 10 nSec.
+ * @param       sample_count    Number of samples
+ * @param       pll             Bitcell clock, or NULL for fixed 2us cells.
+ * @param       track           <OUT> The sectors, by sector number.
+ * @param       mfm             AMIGA_SECTORS_PER_TRACK * AMIGA_MFM_SECTOR_SIZE
+ *                              bytes for the raw sectors, in the order found.
+ * @param       data            AMIGA_SECTORS_PER_TRACK * AMIGA_SECTOR_DATA_SIZE
+ *                              bytes for the sector data, or NULL.
+ *
+ * @return      The number of good sectors.
+ */
+unsigned int amiga_decode_track(const uint32_t *samples, size_t sample_count,
+                        struct mfm_pll *pll, struct amiga_track *track,
+                        uint8_t *mfm, uint8_t *data)
+{
+        struct mfm_stream stream;
+
+        mfm_stream_init(&stream, mfm);
+        stream.data = data;
+        stream.pll = pll;
+        mfm_stream_feed(&stream, samples, sample_count);
+        mfm_stream_finish(&stream);
+
+        amiga_track_from_stream(&stream, track);
+
+        return track->good;
+}
+
+void amiga_fusion_init(struct amiga_fusion *fusion)
+{
+        memset(&fusion->track, 0x00, sizeof(fusion->track));
+        memset(fusion->revolution, 0x00, sizeof(fusion->revolution));
+        fusion->revolutions = 0;
+}
+
+/**
+ * @brief       Merge the sectors of one more revolution.
+ *
+ * @detail      A sector is taken from the first revolution it is good in.
+ *              Until then, the first copy found is kept.
+ *
+ * @return      The number of good sectors so far.
+ */
+unsigned int amiga_fusion_merge(struct amiga_fusion *fusion,
+                        const struct amiga_track *track)
+{
+        struct amiga_track *fused = &fusion->track;
+
+        for (unsigned int i = 0; i < AMIGA_SECTORS_PER_TRACK; i++) {
+                const struct amiga_track_sector *s = &track->sectors[i];
+                struct amiga_track_sector *slot = &fused->sectors[i];
+
+                if (!s->found || (slot->found
+                                && (sector_good(slot) || !sector_good(s)))) {
+                        continue;
+                }
+
+                uint8_t *mfm = fusion->mfm + i * AMIGA_MFM_SECTOR_SIZE;
+                uint8_t *data = fusion->data + i * AMIGA_SECTOR_DATA_SIZE;
+                memcpy(mfm, s->mfm, AMIGA_MFM_SECTOR_SIZE);
+                if (s->data)
+                        memcpy(data, s->data, AMIGA_SECTOR_DATA_SIZE);
+
+                *slot = *s;
+                slot->mfm = mfm;
+                slot->data = s->data ? data : NULL;
+                fusion->revolution[i] = fusion->revolutions;
+        }
+        fused->unplaced += track->unplaced;
+        fusion->revolutions++;
+
+        fused->found = 0;
+        fused->good = 0;
+        for (unsigned int i = 0; i < AMIGA_SECTORS_PER_TRACK; i++) {
+                if (fused->sectors[i].found) {
+                        fused->found++;
+                        if (sector_good(&fused->sectors[i]))
+                                fused->good++;
+                }
+        }
+
+        return fused->good;
+}
+
+/**
+ * @brief       Decode the revolutions of a read, and merge each of them,
+ *              until every sector is good.
+ *
+ * @detail      A revolution is decoded from its index pulse until 11
+ *              sectors are found, which can run into the next revolution.
+ *              So the sector the index pulse lands in is read whole.
+ *
+ * @param       samples         Flux timing, as from pru_read_timing()
+ * @param       index_offsets   Sample index of each index pulse
+ * @param       revolutions     Number of revolutions in samples
+ * @param       pll             Bitcell clock, or NULL for fixed 2us cells.
+ *
+ * @return      The number of good sectors so far.
+ */
+unsigned int amiga_fusion_add(struct amiga_fusion *fusion,
+                        const uint32_t *samples, size_t sample_count,
+                        const uint32_t *index_offsets, uint8_t revolutions,
+                        struct mfm_pll *pll)
+{
+        // Fed in blocks, to stop as soon as the sectors are found.
+        const size_t block = 0x400;
+        size_t start = 0;
+
+        for (unsigned int rev = 0; rev < revolutions
+                        && fusion->track.good < AMIGA_SECTORS_PER_TRACK; rev++) {
+                struct mfm_stream stream;
+                struct amiga_track track;
+
+                mfm_stream_init(&stream, fusion->rev_mfm);
+                stream.data = fusion->rev_data;
+                stream.pll = pll;
+                for (size_t i = start; i < sample_count
+                                && stream.sector_count < AMIGA_SECTORS_PER_TRACK;
+                                                                i += block) {
+                        const size_t count = sample_count - i < block
+                                                ? sample_count - i : block;
+                        mfm_stream_feed(&stream, samples + i, count);
+                }
+                mfm_stream_finish(&stream);
+                for (unsigned int i = 0; i < stream.sector_count; i++) {
+                        stream.sectors[i].sample_index += start;
+                }
+
+                amiga_track_from_stream(&stream, &track);
+                amiga_fusion_merge(fusion, &track);
+
+                if (index_offsets[rev] <= start)
+                        break;
+                start = index_offsets[rev];
+        }
+
+        return fusion->track.good;
+}
+
+void amiga_fusion_stream_init(struct amiga_fusion_stream *fs,
+                        struct mfm_pll *pll)
+{
+        amiga_fusion_init(&fs->fusion);
+        mfm_stream_init(&fs->stream, fs->fusion.rev_mfm);
+        fs->stream.pll = pll;
+}
+
+/**
+ * @brief       Feed a block of samples, with the amiga_fusion_stream as
+ *              <ctx>, i.e. as a pru_timing_consumer.
+ *
+ * @detail      Each run of 11 sectors, about a revolution, is merged as
+ *              soon as it is found, and the next run starts with the next
+ *              block.
+ *
+ * @return      1 when every sector is good, else 0.
+ */
+int amiga_fusion_consume(const uint32_t *samples, size_t count, void *ctx)
+{
+        struct amiga_fusion_stream *fs = ctx;
+        struct amiga_track track;
+
+        mfm_stream_feed(&fs->stream, samples, count);
+        if (fs->stream.sector_count < AMIGA_SECTORS_PER_TRACK)
+                return 0;
+
+        mfm_stream_finish(&fs->stream);
+        amiga_track_from_stream(&fs->stream, &track);
+        if (amiga_fusion_merge(&fs->fusion, &track) == AMIGA_SECTORS_PER_TRACK)
+                return 1;
+
+        struct mfm_pll *pll = fs->stream.pll;
+        mfm_stream_init(&fs->stream, fs->fusion.rev_mfm);
+        fs->stream.pll = pll;
+
+        return 0;
+}
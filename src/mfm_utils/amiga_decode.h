@@ -0,0 +1,84 @@
+#ifndef AMIGA_DECODE_H
+#define AMIGA_DECODE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "mfm_utils.h"
+
+#define AMIGA_SECTOR_DATA_SIZE          512
+// 4489 4489, then the header and the data, as given to amiga_decode_sector().
+#define AMIGA_MFM_SECTOR_BODY           (AMIGA_MFM_SECTOR_SIZE - 4)
+
+struct mfm_pll;
+
+/**
+ * One sector of a decoded track, at the index of its sector number.
+ */
+struct amiga_track_sector {
+        bool found;
+        struct amiga_sector sector;
+        const uint8_t *mfm;             // aaaa aaaa 4489 4489 + header and data
+        const uint8_t *data;            // 512 decoded bytes, or NULL
+        size_t sample_index;            // Sample where the sync ends
+};
+
+struct amiga_track {
+        struct amiga_track_sector sectors[AMIGA_SECTORS_PER_TRACK];
+        unsigned int found;             // Sectors in the map
+        unsigned int good;              // Of those, with good checksums
+        unsigned int unplaced;          // Syncs with no usable sector number
+};
+
+/**
+ * The best copy of each sector, over the revolutions of a track.
+ * track points into mfm and data, which hold the copies.
+ */
+struct amiga_fusion {
+        struct amiga_track track;
+        unsigned int revolution[AMIGA_SECTORS_PER_TRACK]; // Copy came from
+        unsigned int revolutions;       // Merged so far
+        uint8_t mfm[AMIGA_SECTORS_PER_TRACK * AMIGA_MFM_SECTOR_SIZE];
+        uint8_t data[AMIGA_SECTORS_PER_TRACK * AMIGA_SECTOR_DATA_SIZE];
+        // One revolution, while it is decoded
+        uint8_t rev_mfm[AMIGA_SECTORS_PER_TRACK * AMIGA_MFM_SECTOR_SIZE];
+        uint8_t rev_data[AMIGA_SECTORS_PER_TRACK * AMIGA_SECTOR_DATA_SIZE];
+};
+
+int amiga_decode_sector(const uint8_t * restrict mfm,
+                        struct amiga_sector * restrict sector,
+                        uint8_t * restrict data);
+unsigned int amiga_decode_sectors(const uint8_t * restrict track,
+                        unsigned int count,
+                        struct amiga_sector * restrict sectors,
+                        uint8_t * restrict data);
+void amiga_track_from_stream(const struct mfm_stream *stream,
+                        struct amiga_track *track);
+unsigned int amiga_decode_track(const uint32_t *samples, size_t sample_count,
+                        struct mfm_pll *pll, struct amiga_track *track,
+                        uint8_t *mfm, uint8_t *data);
+/**
+ * Fuses the sectors of a read while the samples arrive, see
+ * amiga_fusion_consume().
+ */
+struct amiga_fusion_stream {
+        struct amiga_fusion fusion;
+        struct mfm_stream stream;
+};
+
+void amiga_fusion_init(struct amiga_fusion *fusion);
+unsigned int amiga_fusion_merge(struct amiga_fusion *fusion,
+                        const struct amiga_track *track);
+unsigned int amiga_fusion_add(struct amiga_fusion *fusion,
+                        const uint32_t *samples, size_t sample_count,
+                        const uint32_t *index_offsets, uint8_t revolutions,
+                        struct mfm_pll *pll);
+void amiga_fusion_stream_init(struct amiga_fusion_stream *fs,
+                        struct mfm_pll *pll);
+int amiga_fusion_consume(const uint32_t *samples, size_t count, void *ctx);
+uint32_t amiga_decode_longs(const uint8_t * restrict odd,
+                        const uint8_t * restrict even,
+                        uint8_t * restrict out, size_t bytes);
+
+#endif /* AMIGA_DECODE_H */
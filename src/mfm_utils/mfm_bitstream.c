@@ -0,0 +1,423 @@
+#include <string.h>
+#include <endian.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "mfm_bitstream.h"
+
+/**
+ * Every flux sample is 2, 3 or 4 bitcells: <cells - 1> zeros and a one.
+ *
+ * The vector kernels classify 8 samples at a time, and take a prefix sum
+ * of the cell lengths to get the position of each sample's one bit in a
+ * 32-bit word. The word is then appended to a 64-bit accumulator, which
+ * is written out 32 bits at a time.
+ * The kernels stop while there still is room for a full block, and the
+ * last few bytes are done one bit at a time, like the scalar reference.
+ */
+
+// Same thresholds as the decoders, without the branches.
+static inline unsigned int sample_to_cells(uint32_t sample)
+{
+        return 2 + (sample > 500) + (sample > 700);
+}
+
+struct bit_writer {
+        uint8_t *out;           // Next byte to write
+        uint64_t acc;           // Right aligned, `fill` bits valid
+        unsigned int fill;      // Always less than 32 between calls
+};
+
+static inline void put_bits(struct bit_writer *w, uint32_t bits,
+                                                        unsigned int count)
+{
+        w->acc = (w->acc << count) | bits;
+        w->fill += count;
+        if (w->fill >= 32) {
+                w->fill -= 32;
+                const uint32_t word = htobe32((uint32_t)(w->acc >> w->fill));
+                memcpy(w->out, &word, sizeof(word));
+                w->out += sizeof(word);
+        }
+}
+
+/*
+ * `word` has the one bit of the last sample as its lowest set bit,
+ * everything below is not part of the block.
+ */
+static inline void put_block(struct bit_writer *w, uint32_t word)
+{
+        const unsigned int unused = __builtin_ctz(word);
+
+        put_bits(w, word >> unused, 32 - unused);
+}
+
+/*
+ * Each block function converts whole blocks of 8 samples while there
+ * is room for them, and returns the number of samples used.
+ */
+
+static size_t flux_blocks_portable(const uint32_t *samples, size_t count,
+                                struct bit_writer *w, const uint8_t *end)
+{
+        size_t i = 0;
+
+        for (; i + 8 <= count && w->out + 8 <= end; i += 8) {
+                for (unsigned int s = 0; s < 8; s++) {
+                        put_bits(w, 1, sample_to_cells(samples[i + s]));
+                }
+        }
+
+        return i;
+}
+
+#if defined(__SSE2__)
+/*
+ * SSE2 has no variable shift, so 2^n is made by putting n in the
+ * exponent of a float. Exact for all n the blocks need, 0 - 30.
+ */
+static inline __m128i sse2_pow2(__m128i n)
+{
+        const __m128i f = _mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23);
+
+        return _mm_cvtps_epi32(_mm_castsi128_ps(f));
+}
+
+static inline __m128i sse2_cells(const uint32_t *samples)
+{
+        // No unsigned compare either, flip the sign bits.
+        const __m128i bias = _mm_set1_epi32(INT32_MIN);
+        const __m128i s = _mm_xor_si128(
+                        _mm_loadu_si128((const __m128i *)samples), bias);
+        const __m128i m500 = _mm_cmpgt_epi32(s, _mm_set1_epi32(INT32_MIN + 500));
+        const __m128i m700 = _mm_cmpgt_epi32(s, _mm_set1_epi32(INT32_MIN + 700));
+
+        // The compares are -1 when true.
+        return _mm_sub_epi32(_mm_sub_epi32(_mm_set1_epi32(2), m500), m700);
+}
+
+static inline __m128i sse2_prefix_sum(__m128i v)
+{
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+        return _mm_add_epi32(v, _mm_slli_si128(v, 8));
+}
+
+static size_t flux_blocks_sse2(const uint32_t *samples, size_t count,
+                                struct bit_writer *w, const uint8_t *end)
+{
+        const __m128i thirty_two = _mm_set1_epi32(32);
+        size_t i = 0;
+
+        for (; i + 8 <= count && w->out + 8 <= end; i += 8) {
+                const __m128i lo = sse2_prefix_sum(sse2_cells(samples + i));
+                const __m128i hi = _mm_add_epi32(
+                                sse2_prefix_sum(sse2_cells(samples + i + 4)),
+                                _mm_shuffle_epi32(lo, 0xff));
+
+                __m128i bits = _mm_or_si128(
+                                sse2_pow2(_mm_sub_epi32(thirty_two, lo)),
+                                sse2_pow2(_mm_sub_epi32(thirty_two, hi)));
+                bits = _mm_or_si128(bits, _mm_shuffle_epi32(bits, 0x4e));
+                bits = _mm_or_si128(bits, _mm_shuffle_epi32(bits, 0xb1));
+
+                put_block(w, _mm_cvtsi128_si32(bits));
+        }
+
+        return i;
+}
+
+static bool sse2_supported(void)
+{
+        return true;
+}
+#endif
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#define MFM_BITSTREAM_AVX2
+__attribute__((target("avx2")))
+static size_t flux_blocks_avx2(const uint32_t *samples, size_t count,
+                                struct bit_writer *w, const uint8_t *end)
+{
+        const __m256i bias = _mm256_set1_epi32(INT32_MIN);
+        const __m256i t500 = _mm256_set1_epi32(INT32_MIN + 500);
+        const __m256i t700 = _mm256_set1_epi32(INT32_MIN + 700);
+        const __m256i two = _mm256_set1_epi32(2);
+        const __m256i one = _mm256_set1_epi32(1);
+        const __m256i thirty_two = _mm256_set1_epi32(32);
+        size_t i = 0;
+
+        for (; i + 8 <= count && w->out + 8 <= end; i += 8) {
+                const __m256i s = _mm256_xor_si256(
+                        _mm256_loadu_si256((const __m256i *)(samples + i)), bias);
+                __m256i p = _mm256_sub_epi32(
+                                _mm256_sub_epi32(two, _mm256_cmpgt_epi32(s, t500)),
+                                _mm256_cmpgt_epi32(s, t700));
+
+                // Prefix sum in each 128-bit lane, then carry low into high.
+                p = _mm256_add_epi32(p, _mm256_slli_si256(p, 4));
+                p = _mm256_add_epi32(p, _mm256_slli_si256(p, 8));
+                p = _mm256_add_epi32(p, _mm256_shuffle_epi32(
+                                _mm256_permute2x128_si256(p, p, 0x08), 0xff));
+
+                const __m256i bits = _mm256_sllv_epi32(one,
+                                                _mm256_sub_epi32(thirty_two, p));
+                __m128i r = _mm_or_si128(_mm256_castsi256_si128(bits),
+                                        _mm256_extracti128_si256(bits, 1));
+                r = _mm_or_si128(r, _mm_shuffle_epi32(r, 0x4e));
+                r = _mm_or_si128(r, _mm_shuffle_epi32(r, 0xb1));
+
+                put_block(w, _mm_cvtsi128_si32(r));
+        }
+
+        return i;
+}
+
+static bool avx2_supported(void)
+{
+        return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#if defined(__ARM_NEON)
+static inline uint32x4_t neon_cells(const uint32_t *samples)
+{
+        const uint32x4_t s = vld1q_u32(samples);
+        const uint32x4_t m500 = vcgtq_u32(s, vdupq_n_u32(500));
+        const uint32x4_t m700 = vcgtq_u32(s, vdupq_n_u32(700));
+
+        // The compares are all ones when true.
+        return vsubq_u32(vsubq_u32(vdupq_n_u32(2), m500), m700);
+}
+
+static inline uint32x4_t neon_prefix_sum(uint32x4_t v)
+{
+        const uint32x4_t zero = vdupq_n_u32(0);
+
+        v = vaddq_u32(v, vextq_u32(zero, v, 3));
+        return vaddq_u32(v, vextq_u32(zero, v, 2));
+}
+
+static size_t flux_blocks_neon(const uint32_t *samples, size_t count,
+                                struct bit_writer *w, const uint8_t *end)
+{
+        const uint32x4_t one = vdupq_n_u32(1);
+        const uint32x4_t thirty_two = vdupq_n_u32(32);
+        size_t i = 0;
+
+        for (; i + 8 <= count && w->out + 8 <= end; i += 8) {
+                const uint32x4_t lo = neon_prefix_sum(neon_cells(samples + i));
+                const uint32x4_t hi = vaddq_u32(
+                                neon_prefix_sum(neon_cells(samples + i + 4)),
+                                vdupq_lane_u32(vget_high_u32(lo), 1));
+
+                const uint32x4_t bits = vorrq_u32(
+                        vshlq_u32(one, vreinterpretq_s32_u32(
+                                                vsubq_u32(thirty_two, lo))),
+                        vshlq_u32(one, vreinterpretq_s32_u32(
+                                                vsubq_u32(thirty_two, hi))));
+                uint32x2_t r = vorr_u32(vget_low_u32(bits), vget_high_u32(bits));
+                r = vorr_u32(r, vrev64_u32(r));
+
+                put_block(w, vget_lane_u32(r, 0));
+        }
+
+        return i;
+}
+
+static bool neon_supported(void)
+{
+        return true;
+}
+#endif
+
+static bool always_supported(void)
+{
+        return true;
+}
+
+/**
+ * @brief       Common part of the kernels, everything but the blocks.
+ */
+static inline size_t flux_to_bitstream(const uint32_t * restrict samples,
+                size_t samples_count,
+                uint8_t * restrict bitstream, size_t bitstream_size,
+                size_t (*blocks)(const uint32_t *, size_t,
+                                        struct bit_writer *, const uint8_t *))
+{
+        if (samples_count < 2 || bitstream_size < 8) {
+                return mfm_flux_to_bitstream_scalar(samples, samples_count,
+                                                bitstream, bitstream_size);
+        }
+
+        const uint8_t *end = bitstream + bitstream_size;
+        struct bit_writer w = { .out = bitstream };
+
+        /*
+         * The first bit is dropped, to line up with the sync index,
+         * see mfm_flux_to_bitstream_scalar().
+         */
+        put_bits(&w, 1, sample_to_cells(samples[0]) - 1);
+        size_t i = 1 + blocks(samples + 1, samples_count - 1, &w, end);
+
+        // Write out what is left in the accumulator, and clear the rest.
+        memset(w.out, 0x00, end - w.out);
+        for (unsigned int b = 0; b < w.fill; b += 8) {
+                w.out[b >> 3] = (w.acc << (64 - w.fill)) >> (56 - b);
+        }
+
+        size_t bit = (w.out - bitstream) * 8 + w.fill - 1;
+        for (; i < samples_count; i++) {
+                bit += sample_to_cells(samples[i]);
+                if ((bit >> 3) >= bitstream_size) {
+                        // Bitstream full.
+                        return i + 1;
+                }
+                bitstream[bit >> 3] |= 1 << (7 - (bit & 0x07));
+        }
+
+        return i;
+}
+
+#if defined(MFM_BITSTREAM_AVX2)
+static size_t convert_avx2(const uint32_t * restrict samples, size_t samples_count,
+                        uint8_t * restrict bitstream, size_t bitstream_size)
+{
+        return flux_to_bitstream(samples, samples_count, bitstream,
+                                        bitstream_size, flux_blocks_avx2);
+}
+#endif
+
+#if defined(__SSE2__)
+static size_t convert_sse2(const uint32_t * restrict samples, size_t samples_count,
+                        uint8_t * restrict bitstream, size_t bitstream_size)
+{
+        return flux_to_bitstream(samples, samples_count, bitstream,
+                                        bitstream_size, flux_blocks_sse2);
+}
+#endif
+
+#if defined(__ARM_NEON)
+static size_t convert_neon(const uint32_t * restrict samples, size_t samples_count,
+                        uint8_t * restrict bitstream, size_t bitstream_size)
+{
+        return flux_to_bitstream(samples, samples_count, bitstream,
+                                        bitstream_size, flux_blocks_neon);
+}
+#endif
+
+static size_t convert_portable(const uint32_t * restrict samples,
+                        size_t samples_count,
+                        uint8_t * restrict bitstream, size_t bitstream_size)
+{
+        return flux_to_bitstream(samples, samples_count, bitstream,
+                                        bitstream_size, flux_blocks_portable);
+}
+
+const struct mfm_bitstream_kernel mfm_bitstream_kernels[] = {
+#if defined(MFM_BITSTREAM_AVX2)
+        { "avx2", avx2_supported, convert_avx2 },
+#endif
+#if defined(__SSE2__)
+        { "sse2", sse2_supported, convert_sse2 },
+#endif
+#if defined(__ARM_NEON)
+        { "neon", neon_supported, convert_neon },
+#endif
+        { "portable", always_supported, convert_portable },
+        { "scalar", always_supported, mfm_flux_to_bitstream_scalar },
+        { NULL },
+};
+
+static const struct mfm_bitstream_kernel *best_kernel(void)
+{
+        const struct mfm_bitstream_kernel *k = mfm_bitstream_kernels;
+
+        while (!k->supported()) {
+                k++;
+        }
+
+        return k;
+}
+
+/**
+ * @brief       Name of the kernel mfm_flux_to_bitstream() uses on this CPU.
+ */
+const char *mfm_flux_to_bitstream_kernel(void)
+{
+        return best_kernel()->name;
+}
+
+/**
+ * @detail      Parse `samples_count` flux timing data into a bitstream, based on
+ *              a hardcoded bitcell time of 2 microseconds.
+ *              The bitstream is written into the given `bitstream` pointer until
+ *              either we are out of samples to read or the bitstream buffer is full.
+ *              Uses the fastest kernel for this CPU, the result is the same
+ *              as from mfm_flux_to_bitstream_scalar().
+ *
+ * @param       samples         Flux timing, counts of 10 nSec,
+ *                              starting at the index of a sync.
+ * @param       samples_count   Number of samples
+ * @param       bitstream       <OUT> Cleared, then filled with MFM bits.
+ * @param       bitstream_size  Size of bitstream in bytes
+ *
+ * @return      The number of samples used.
+ *              One more than fits, if the bitstream is full.
+ */
+size_t mfm_flux_to_bitstream(const uint32_t * restrict samples, size_t samples_count,
+                        uint8_t * restrict bitstream, size_t bitstream_size)
+{
+        return best_kernel()->convert(samples, samples_count,
+                                        bitstream, bitstream_size);
+}
+
+/**
+ * @brief       The plain one bit at a time version of mfm_flux_to_bitstream(),
+ *              kept as the reference for the others.
+ */
+size_t mfm_flux_to_bitstream_scalar(const uint32_t * restrict samples,
+                        size_t samples_count,
+                        uint8_t * restrict bitstream, size_t bitstream_size)
+{
+        // clear bitstream..
+        memset(bitstream, 0x00, bitstream_size);
+        /**
+         * We start at bit -2 as this is what the bitstream will look like from
+         * the index we found for sync:
+         *
+         *     |~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~|
+         *    01010001001000100101000100100010010
+         *     |~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~|
+         *
+         * While the actual sync mark are the bits in the box.
+         *
+         *   xx|01000100100010010100010010001001|x
+         *
+         * Without the -2 here, the data will be offset by one bit.
+         */
+        size_t bit = -2; // See Note ^^^
+        size_t i = 0;
+        for (; i < samples_count; i++) {
+                if (samples[i] > 700) {
+                        bit += 4;
+                } else if (samples[i] > 500) {
+                        bit += 3;
+                } else {
+                        bit += 2;
+                }
+                const size_t byte_no = bit >> 3;  // Div. 8
+                const int bit_no = bit & 0x07; // Mod. 8
+                if (byte_no >= bitstream_size) {
+                        // Bitstream full.
+                        return i + 1;
+                }
+                bitstream[byte_no] |= (1 << (7 - (bit_no)));
+        }
+
+        return i;
+}
@@ -0,0 +1,32 @@
+#ifndef MFM_BITSTREAM_H
+#define MFM_BITSTREAM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+/**
+ * One way of turning flux timing into MFM bits.
+ * The kernels all give the exact same bitstream, they differ in speed only.
+ */
+struct mfm_bitstream_kernel {
+        const char *name;
+        bool (*supported)(void);
+        size_t (*convert)(const uint32_t * restrict samples, size_t samples_count,
+                        uint8_t * restrict bitstream, size_t bitstream_size);
+};
+
+/**
+ * The kernels built for this target, fastest first.
+ * Ends with the plain scalar reference, and a { NULL } entry.
+ */
+extern const struct mfm_bitstream_kernel mfm_bitstream_kernels[];
+
+size_t mfm_flux_to_bitstream(const uint32_t * restrict samples, size_t samples_count,
+                        uint8_t * restrict bitstream, size_t bitstream_size);
+size_t mfm_flux_to_bitstream_scalar(const uint32_t * restrict samples,
+                        size_t samples_count,
+                        uint8_t * restrict bitstream, size_t bitstream_size);
+const char *mfm_flux_to_bitstream_kernel(void);
+
+#endif /* MFM_BITSTREAM_H */
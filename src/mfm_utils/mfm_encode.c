@@ -0,0 +1,144 @@
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "mfm_encode.h"
+
+/**
+ * MFM puts each data bit on the odd positions of a 16 bit word, data bit
+ * 7 at bit 14, and a clock bit in front of it. The clock bit is set when
+ * the data bits on both sides of it are 0. So the clock bits of a byte
+ * only depend on the byte, except for bit 15 which also depends on the
+ * last data bit before it, bit 0 of the MFM byte before.
+ *
+ * The table has the MFM of each byte with the data bit before it 0,
+ * bit 15 is then cleared if that bit was 1. The vector code spreads the
+ * bits with shifts, 16 bytes at a time, and takes the bit before each
+ * word from the word next to it.
+ */
+
+#define SPREAD(b)       ((((b) & 0x80) << 7) | (((b) & 0x40) << 6) \
+                        | (((b) & 0x20) << 5) | (((b) & 0x10) << 4) \
+                        | (((b) & 0x08) << 3) | (((b) & 0x04) << 2) \
+                        | (((b) & 0x02) << 1) | ((b) & 0x01))
+#define MFM(b)          (SPREAD(b) | (~((SPREAD(b) << 1) | (SPREAD(b) >> 1)) \
+                                                                & 0xaaaa))
+
+#define MFM2(b)         MFM(b), MFM((b) + 1)
+#define MFM4(b)         MFM2(b), MFM2((b) + 2)
+#define MFM8(b)         MFM4(b), MFM4((b) + 4)
+#define MFM16(b)        MFM8(b), MFM8((b) + 8)
+#define MFM32(b)        MFM16(b), MFM16((b) + 16)
+#define MFM64(b)        MFM32(b), MFM32((b) + 32)
+#define MFM128(b)       MFM64(b), MFM64((b) + 64)
+
+static const uint16_t mfm_table[256] = { MFM128(0), MFM128(128) };
+
+/**
+ * @brief       MFM encode data bytes, like the data and gap samples of
+ *              an IPF file.
+ *
+ * @param       data            `count` bytes to encode.
+ * @param       prev            The MFM byte before `mfm`, its last bit
+ *                              decides the first clock bit.
+ * @param       mfm             <OUT> 2 * `count` bytes of MFM, MSB first.
+ *
+ * @return      The last MFM byte, or `prev` if count is 0.
+ */
+uint8_t mfm_encode_bytes(const uint8_t * restrict data, size_t count,
+                        uint8_t prev, uint8_t * restrict mfm)
+{
+        size_t i = 0;
+
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i clock_bits = _mm_set1_epi16((short)0xaaaa);
+        // Bit 0 of the word before, in the last lane.
+        __m128i before = _mm_slli_si128(_mm_cvtsi32_si128(prev & 1), 14);
+
+        for (; i + 16 <= count; i += 16) {
+                const __m128i in = _mm_loadu_si128((const __m128i *)(data + i));
+                __m128i words[2] = {
+                        _mm_unpacklo_epi8(in, zero),
+                        _mm_unpackhi_epi8(in, zero),
+                };
+
+                for (int w = 0; w < 2; w++) {
+                        __m128i x = words[w];
+                        x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi16(x, 4)),
+                                                _mm_set1_epi16(0x0f0f));
+                        x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi16(x, 2)),
+                                                _mm_set1_epi16(0x3333));
+                        x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi16(x, 1)),
+                                                _mm_set1_epi16(0x5555));
+
+                        const __m128i prev_words = _mm_or_si128(
+                                        _mm_slli_si128(x, 2),
+                                        _mm_srli_si128(before, 14));
+                        const __m128i next_to = _mm_or_si128(
+                                        _mm_or_si128(_mm_slli_epi16(x, 1),
+                                                     _mm_srli_epi16(x, 1)),
+                                        _mm_slli_epi16(prev_words, 15));
+                        const __m128i m = _mm_or_si128(x,
+                                        _mm_andnot_si128(next_to, clock_bits));
+
+                        _mm_storeu_si128((__m128i *)(mfm + 2 * i + 16 * w),
+                                        _mm_or_si128(_mm_slli_epi16(m, 8),
+                                                     _mm_srli_epi16(m, 8)));
+                        before = x;
+                }
+        }
+#elif defined(__ARM_NEON)
+        const uint16x8_t clock_bits = vdupq_n_u16(0xaaaa);
+        // Bit 0 of the word before, in the last lane.
+        uint16x8_t before = vsetq_lane_u16(prev & 1, vdupq_n_u16(0), 7);
+
+        for (; i + 16 <= count; i += 16) {
+                const uint8x16_t in = vld1q_u8(data + i);
+                uint16x8_t words[2] = {
+                        vmovl_u8(vget_low_u8(in)),
+                        vmovl_u8(vget_high_u8(in)),
+                };
+
+                for (int w = 0; w < 2; w++) {
+                        uint16x8_t x = words[w];
+                        x = vandq_u16(vorrq_u16(x, vshlq_n_u16(x, 4)),
+                                                vdupq_n_u16(0x0f0f));
+                        x = vandq_u16(vorrq_u16(x, vshlq_n_u16(x, 2)),
+                                                vdupq_n_u16(0x3333));
+                        x = vandq_u16(vorrq_u16(x, vshlq_n_u16(x, 1)),
+                                                vdupq_n_u16(0x5555));
+
+                        const uint16x8_t prev_words = vextq_u16(before, x, 7);
+                        const uint16x8_t next_to = vorrq_u16(
+                                        vorrq_u16(vshlq_n_u16(x, 1),
+                                                  vshrq_n_u16(x, 1)),
+                                        vshlq_n_u16(prev_words, 15));
+                        const uint16x8_t m = vorrq_u16(x,
+                                        vbicq_u16(clock_bits, next_to));
+
+                        vst1q_u8(mfm + 2 * i + 16 * w,
+                                        vrev16q_u8(vreinterpretq_u8_u16(m)));
+                        before = x;
+                }
+        }
+#endif
+        if (i) {
+                prev = mfm[2 * i - 1];
+        }
+
+        for (; i < count; i++) {
+                const uint16_t m = mfm_table[data[i]] & ~((prev & 1) << 15);
+
+                mfm[2 * i] = m >> 8;
+                mfm[2 * i + 1] = m;
+                prev = m;
+        }
+
+        return prev;
+}
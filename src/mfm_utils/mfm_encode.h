@@ -0,0 +1,10 @@
+#ifndef MFM_ENCODE_H
+#define MFM_ENCODE_H
+
+#include <stdint.h>
+#include <unistd.h>
+
+uint8_t mfm_encode_bytes(const uint8_t * restrict data, size_t count,
+                        uint8_t prev, uint8_t * restrict mfm);
+
+#endif /* MFM_ENCODE_H */
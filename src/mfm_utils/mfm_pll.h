@@ -0,0 +1,97 @@
+#ifndef MFM_PLL_H
+#define MFM_PLL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+/*
+ * The PLL works in 1/256 of the 10 nSec sample ticks.
+ */
+#define MFM_PLL_FRAC_BITS       8
+#define MFM_PLL_CELL_2US        (200 << MFM_PLL_FRAC_BITS)
+
+/**
+ * @param       cell            Nominal bitcell, in 10 nSec << MFM_PLL_FRAC_BITS.
+ *                              MFM_PLL_CELL_2US, or from mfm_pll_estimate_cell().
+ * @param       period_gain     How much of each phase error goes into the
+ *                              bitcell period, of 256.
+ * @param       phase_gain      How much of each phase error is corrected
+ *                              right away, of 256.
+ * @param       range           How far the period may drift from `cell`,
+ *                              in percent.
+ */
+struct mfm_pll_opts {
+        uint32_t cell;
+        unsigned int period_gain;
+        unsigned int phase_gain;
+        unsigned int range;
+};
+
+/*
+ * 1.5% period and full phase correction, +/- 10%.
+ * This did best on jittered flux from drives off speed, see bench-mfm-pll.
+ */
+#define MFM_PLL_OPTS_DEFAULT    { .cell = MFM_PLL_CELL_2US, .period_gain = 4, \
+                                  .phase_gain = 256, .range = 10 }
+
+struct mfm_pll {
+        int32_t period;         // Current bitcell
+        int32_t centre;         // The nominal bitcell
+        int32_t min, max;
+        int32_t ticks;          // Time since the centre of the last cell
+        int32_t period_gain;
+        int32_t phase_gain;
+};
+
+void mfm_pll_init(struct mfm_pll *pll, const struct mfm_pll_opts *opts);
+uint32_t mfm_pll_estimate_cell(const uint32_t *samples, size_t count);
+size_t mfm_pll_to_bitstream(struct mfm_pll *pll,
+                        const uint32_t * restrict samples, size_t samples_count,
+                        uint8_t * restrict bitstream, size_t bitstream_size);
+
+/**
+ * @brief       Feed one flux sample to the PLL.
+ *
+ * @return      The number of bitcells since the last flux transition,
+ *              the last one being the transition.
+ *              0 if the sample is too short to be a transition of its own,
+ *              it is then added to the next sample.
+ */
+static inline unsigned int mfm_pll_cells(struct mfm_pll *pll, uint32_t sample)
+{
+        const int32_t half = pll->period >> 1;
+        unsigned int cells = 0;
+
+        // Gaps longer than this is no flux, not data.
+        if (sample > 0xffff) {
+                sample = 0xffff;
+        }
+        int32_t ticks = pll->ticks + (int32_t)(sample << MFM_PLL_FRAC_BITS);
+        if (ticks <= half) {
+                pll->ticks = ticks;
+                return 0;
+        }
+        do {
+                ticks -= pll->period;
+                cells++;
+        } while (ticks > half);
+
+        // Now ticks is how far the transition was from the centre of its cell.
+        if (cells <= 4) {
+                pll->period += (ticks * pll->period_gain) >> 8;
+        } else {
+                // Out of sync, drift back towards the nominal cell.
+                pll->period += ((pll->centre - pll->period) * pll->period_gain) >> 8;
+        }
+        if (pll->period < pll->min) {
+                pll->period = pll->min;
+        } else if (pll->period > pll->max) {
+                pll->period = pll->max;
+        }
+        pll->ticks = ticks - ((ticks * pll->phase_gain) >> 8);
+
+        return cells;
+}
+
+#endif /* MFM_PLL_H */
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "mfm_sync.h"
+
+/**
+ * The flux samples are turned into bits on the fly, and shifted into a
+ * 64-bit register: <cells - 1> zeros, then a one for the transition.
+ * Every sample ends on a one, so a sync word can only be complete
+ * right after a sample has been shifted in. The low byte of the register
+ * then picks out the few patterns that can end here from a table, and
+ * each of those is a single masked compare.
+ *
+ * Sync words that end in zeros are matched up to their last one, and
+ * confirmed by the length of the next sample.
+ */
+
+// Same thresholds as the decoders, without the branches.
+static inline unsigned int sample_to_cells(uint32_t sample)
+{
+        return 2 + (sample > 500) + (sample > 700);
+}
+
+/**
+ * @brief       Prepare a search for the given sync words.
+ *
+ * @return      false if there are too many patterns, or a pattern is
+ *              empty or without any flux transitions.
+ */
+bool mfm_sync_search_init(struct mfm_sync_search *search,
+                const struct mfm_sync_pattern *patterns, unsigned int count)
+{
+        memset(search, 0x00, sizeof(*search));
+
+        if (count > MFM_SYNC_MAX_PATTERNS) {
+                fprintf(stderr, "Too many sync patterns: %u\n", count);
+                return false;
+        }
+
+        for (unsigned int p = 0; p < count; p++) {
+                const unsigned int bits = patterns[p].bits;
+                uint64_t word = patterns[p].word;
+
+                if (bits < 64) {
+                        word &= (UINT64_C(1) << bits) - 1;
+                }
+                if (!bits || bits > 64 || !word) {
+                        fprintf(stderr, "Bad sync pattern: 0x%llx/%u\n",
+                                (unsigned long long)patterns[p].word, bits);
+                        return false;
+                }
+
+                const unsigned int trailing_zeros = __builtin_ctzll(word);
+                const unsigned int len = bits - trailing_zeros;
+
+                search->patterns[p].value = word >> trailing_zeros;
+                search->patterns[p].mask = len < 64
+                                         ? (UINT64_C(1) << len) - 1
+                                         : UINT64_MAX;
+                search->patterns[p].trailing_zeros = trailing_zeros;
+                search->patterns[p].transitions = __builtin_popcountll(word);
+
+                const unsigned int low = search->patterns[p].mask & 0xff;
+                for (unsigned int b = 0; b < 256; b++) {
+                        if ((b & low) == (search->patterns[p].value & low)) {
+                                search->candidates[b] |= 1u << p;
+                        }
+                }
+        }
+        search->count = count;
+
+        return true;
+}
+
+/**
+ * @brief       Find every sync word in a block of flux samples, in one pass.
+ *
+ * @param       search          Prepared with mfm_sync_search_init()
+ * @param       samples         Flux timing, counts of 10 nSec.
+ * @param       sample_count    Number of samples
+ * @param       hits            <OUT> The syncs found, in track order.
+ * @param       max_hits        Size of hits, the search stops when full.
+ *
+ * @return      The number of hits.
+ */
+size_t mfm_sync_find_all(const struct mfm_sync_search *search,
+                const uint32_t *samples, size_t sample_count,
+                struct mfm_sync_hit *hits, size_t max_hits)
+{
+        uint64_t reg = 0;
+        unsigned int filled = 0;        // Valid bits in reg, up to 64
+        unsigned int pending = 0;       // Matches waiting for their zeros
+        struct mfm_sync_hit pending_hit[MFM_SYNC_MAX_PATTERNS];
+        size_t hit_count = 0;
+
+        for (size_t i = 0; i < sample_count && hit_count < max_hits; i++) {
+                const unsigned int cells = sample_to_cells(samples[i]);
+
+                while (pending && hit_count < max_hits) {
+                        const unsigned int p = __builtin_ctz(pending);
+                        pending &= pending - 1;
+                        if (cells - 1 >= search->patterns[p].trailing_zeros) {
+                                hits[hit_count++] = pending_hit[p];
+                        }
+                }
+
+                reg = (reg << cells) | 1;
+                filled = filled + cells < 64 ? filled + cells : 64;
+
+                unsigned int candidates = search->candidates[reg & 0xff];
+                while (candidates) {
+                        const unsigned int p = __builtin_ctz(candidates);
+                        candidates &= candidates - 1;
+
+                        if ((reg & search->patterns[p].mask)
+                                                != search->patterns[p].value) {
+                                continue;
+                        }
+                        if (filled < 64 && (search->patterns[p].mask >> filled)) {
+                                // Part of the pattern is before the first sample.
+                                continue;
+                        }
+                        if (i + 1 < search->patterns[p].transitions) {
+                                continue;
+                        }
+
+                        const struct mfm_sync_hit hit = {
+                                .sample = i + 1 - search->patterns[p].transitions,
+                                .end = i,
+                                .pattern = p,
+                        };
+                        if (search->patterns[p].trailing_zeros) {
+                                pending_hit[p] = hit;
+                                pending |= 1u << p;
+                        } else if (hit_count < max_hits) {
+                                hits[hit_count++] = hit;
+                        }
+                }
+        }
+
+        return hit_count;
+}
@@ -0,0 +1,50 @@
+#ifndef MFM_SYNC_H
+#define MFM_SYNC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#define MFM_SYNC_MAX_PATTERNS   8
+
+// The standard amiga sector sync, 0x4489 0x4489
+#define MFM_SYNC_AMIGA          { .word = 0x44894489, .bits = 32 }
+
+/**
+ * A sync word, as MFM bits in the order they come off the disk,
+ * MSB first. Up to 64 bits, e.g. the custom dword given to
+ * pru_read_raw_track(), or 0x4489 on its own with .bits = 16.
+ */
+struct mfm_sync_pattern {
+        uint64_t word;
+        unsigned int bits;
+};
+
+struct mfm_sync_hit {
+        size_t sample;          // Sample with the first flux transition of the sync
+        size_t end;             // Sample with the last flux transition of the sync
+        unsigned int pattern;   // Index into the patterns given to init
+};
+
+/**
+ * Prepared search for up to MFM_SYNC_MAX_PATTERNS sync words.
+ */
+struct mfm_sync_search {
+        unsigned int count;
+        struct {
+                uint64_t value;         // The word without trailing zeros
+                uint64_t mask;
+                unsigned int trailing_zeros;
+                unsigned int transitions;
+        } patterns[MFM_SYNC_MAX_PATTERNS];
+        // Patterns that can end on the low byte of the bit register.
+        uint8_t candidates[256];
+};
+
+bool mfm_sync_search_init(struct mfm_sync_search *search,
+                const struct mfm_sync_pattern *patterns, unsigned int count);
+size_t mfm_sync_find_all(const struct mfm_sync_search *search,
+                const uint32_t *samples, size_t sample_count,
+                struct mfm_sync_hit *hits, size_t max_hits);
+
+#endif /* MFM_SYNC_H */
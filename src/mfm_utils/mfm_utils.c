@@ -4,31 +4,15 @@
 #include <string.h>
 
 #include "mfm_utils.h"
-
-struct amiga_sector_header_mfm {
-        /**
-         * uint16_t mfm_aaaa[2];
-         */
-        uint16_t mfm_4489[2];
-        uint32_t info_odd;
-        uint32_t info_even;
-        uint32_t sector_label_odd[4];
-        uint32_t sector_label_even[4];
-        uint32_t header_checksum_odd;
-        uint32_t header_checksum_even;
-        uint32_t data_checksum_odd;
-        uint32_t data_checksum_even;
-        /**
-         * uint8_t data_odd[512];
-         * uint8_t data_even[512];
-         */
-};
+#include "mfm_pll.h"
+#include "amiga_decode.h"
 
 /**
  * @brief       Try to parse a bitstream into an amiga standard sector.
  *
  * @detail      We expect that the bitstream is aligned so it starts on
  *              the standard amiga sector marker (0x4489 0x4489).
+ *              See amiga_decode_sector() to decode into a buffer of your own.
  *
  * @param       bitstream       The bitstream to parse
  * @param       byte_count      The length of the bitstream
@@ -46,111 +30,274 @@ int parse_amiga_mfm_sector(const uint8_t * restrict bitstream, size_t byte_count
 {
         memset(parsed_sector, 0x00, sizeof(*parsed_sector));
 
-        if (byte_count < 1068) {
-                fprintf(stderr, "Sector is not a standard amiga sector! - Expected 1068 bytes, found %u bytes.\n",
-                                                                byte_count);
+        if (byte_count < AMIGA_MFM_SECTOR_BODY) {
+                fprintf(stderr, "Sector is not a standard amiga sector! - Expected %d bytes, found %zu bytes.\n",
+                                                AMIGA_MFM_SECTOR_BODY, byte_count);
                 return -1;
         }
 
-        struct amiga_sector_header_mfm mfm_header;
-        size_t stream_position = 0;
-
-        memcpy(&mfm_header.mfm_4489, bitstream + stream_position, sizeof(mfm_header.mfm_4489));
-        stream_position += sizeof mfm_header.mfm_4489;
+        uint8_t *sector_data = NULL;
+        if (sector_data_out) {
+                sector_data = malloc(AMIGA_SECTOR_DATA_SIZE);
+                if (!sector_data) {
+                        fprintf(stderr, "\t\t -- [E] Could not allocate data buffer for sector data!\n");
+                        return -4;
+                }
+        }
 
-        if ( be16toh(mfm_header.mfm_4489[0]) != 0x4489 || be16toh(mfm_header.mfm_4489[1]) != 0x4489 ) {
+        if (amiga_decode_sector(bitstream, parsed_sector, sector_data)) {
                 fprintf(stderr, "Sector is not a standard amiga sector! - Missing sector header (0x4489)\n");
+                free(sector_data);
                 return -2;
         }
 
-        memcpy(&mfm_header.info_odd, bitstream + stream_position,
-                                        sizeof(mfm_header.info_odd));
-        stream_position += sizeof mfm_header.info_odd;
-        memcpy(&mfm_header.info_even, bitstream + stream_position,
-                                        sizeof(mfm_header.info_even));
-        stream_position += sizeof mfm_header.info_even;
-
-        memcpy(&mfm_header.sector_label_odd, bitstream + stream_position,
-                                        sizeof(mfm_header.sector_label_odd));
-        stream_position += sizeof mfm_header.sector_label_odd;
-        memcpy(&mfm_header.sector_label_even, bitstream + stream_position,
-                                        sizeof(mfm_header.sector_label_even));
-        stream_position += sizeof mfm_header.sector_label_even;
-
-        memcpy(&mfm_header.header_checksum_odd, bitstream + stream_position,
-                                        sizeof(mfm_header.header_checksum_odd));
-        stream_position += sizeof mfm_header.header_checksum_odd;
-        memcpy(&mfm_header.header_checksum_even, bitstream + stream_position,
-                                        sizeof(mfm_header.header_checksum_even));
-        stream_position += sizeof mfm_header.header_checksum_even;
-
-        memcpy(&mfm_header.data_checksum_odd, bitstream + stream_position,
-                                        sizeof(mfm_header.data_checksum_odd));
-        stream_position += sizeof mfm_header.data_checksum_odd;
-        memcpy(&mfm_header.data_checksum_even, bitstream + stream_position,
-                                        sizeof(mfm_header.data_checksum_even));
-        stream_position += sizeof mfm_header.data_checksum_even;
-
-
-        static const uint32_t mask = 0x55555555; // (0b01010101)
-
-        parsed_sector->header_info = mfm_header.info_odd & mask;
-        parsed_sector->header_info <<= 1;
-        parsed_sector->header_info |= mfm_header.info_even & mask;
-
-        uint32_t calculated_checksum = 0;
-        calculated_checksum ^= mfm_header.info_odd;
-        calculated_checksum ^= mfm_header.info_even;
-
-        for ( unsigned int i = 0; i < 4; ++i) {
-                parsed_sector->header_sector_label[i] = mfm_header.sector_label_odd[i] & mask;
-                parsed_sector->header_sector_label[i] <<= 1;
-                parsed_sector->header_sector_label[i] |= mfm_header.sector_label_even[i] & mask;
-
-                calculated_checksum ^= mfm_header.sector_label_odd[i];
-                calculated_checksum ^= mfm_header.sector_label_even[i];
+        if (sector_data_out) {
+                *sector_data_out = sector_data;
         }
 
-        parsed_sector->calculated_header_checksum = calculated_checksum;
+        return 0;
+}
+
 
-        calculated_checksum ^= mfm_header.header_checksum_odd;
-        calculated_checksum ^= mfm_header.header_checksum_even;
-        calculated_checksum &= mask;
-        
-        parsed_sector->header_checksum_ok = calculated_checksum == 0 ? true : false;
+/**
+ * @brief       Prepare an incremental decoder for one track.
+ *
+ * @param       stream          The decoder state
+ * @param       track           Buffer of AMIGA_SECTORS_PER_TRACK *
+ *                              AMIGA_MFM_SECTOR_SIZE bytes. Each sector found
+ *                              is stored here as aaaa aaaa 4489 4489 + data,
+ *                              the slots for sectors not found are left as is.
+ */
+void mfm_stream_init(struct mfm_stream *stream, uint8_t *track)
+{
+        memset(stream, 0x00, sizeof(*stream));
+        stream->track = track;
+}
 
-        uint32_t *sector_data = malloc(1024);
-        if (!sector_data) {
-                fprintf(stderr, "\t\t -- [E] Could not allocate data buffer for sector data!\n");
-                return -4;
-        }
-        memcpy(sector_data, bitstream + stream_position, 1024);
-        stream_position += 1024;
+static void mfm_stream_sector_done(struct mfm_stream *stream)
+{
+        struct mfm_stream_sector *s = &stream->sectors[stream->sector_count];
 
-        calculated_checksum = 0;
-        for (unsigned int i = 0; i < 512 / 4; ++i) {
-                calculated_checksum ^= sector_data[i];
-                calculated_checksum ^= sector_data[i + (512/4)];
+        s->rc = amiga_decode_sector(stream->out + 4, &s->sector,
+                        stream->data ? stream->data
+                                + stream->sector_count * AMIGA_SECTOR_DATA_SIZE
+                                : NULL);
+        stream->sector_count++;
+        stream->out = NULL;
+}
+
+/**
+ * @brief       Decode the next block of flux samples for this track.
+ *
+ * @detail      The samples are turned into bits with the same 2us cell
+ *              thresholds as the rest of the code, or by stream->pll if set
+ *              after mfm_stream_init(), and the bit position
+ *              is kept between calls, so a sector may be split over any
+ *              number of blocks. Each sector is parsed as soon as its
+ *              last bit has arrived.
+ */
+void mfm_stream_feed(struct mfm_stream *stream, const uint32_t *samples,
+                                                                size_t count)
+{
+        static const unsigned int payload_bits =
+                                        (AMIGA_MFM_SECTOR_SIZE - 8) * 8;
+        uint32_t shift = stream->shift;
+        unsigned int out_bit = stream->out_bit;
+
+        for (size_t i = 0; i < count; i++) {
+                unsigned int cells;
+
+                if (stream->pll) {
+                        cells = mfm_pll_cells(stream->pll, samples[i]);
+                        if (!cells) {
+                                continue;
+                        }
+                } else if (samples[i] > 700) {
+                        cells = 4;
+                } else if (samples[i] > 500) {
+                        cells = 3;
+                } else {
+                        cells = 2;
+                }
+                // <cells - 1> zeros, then the flux transition.
+                shift = cells < 32 ? (shift << cells) | 1 : 1;
 
-                sector_data[i] &= mask;
-                sector_data[i] <<= 1;
-                sector_data[i] |= sector_data[i + (512 / 4)] & mask;
+                if (stream->out) {
+                        // The buffer is cleared, only the ones are written.
+                        const unsigned int bit = out_bit + cells - 1;
+                        if (bit < payload_bits) {
+                                stream->out[8 + (bit >> 3)] |=
+                                                        0x80 >> (bit & 0x07);
+                        }
+                        out_bit += cells;
+                        if (out_bit >= payload_bits) {
+                                mfm_stream_sector_done(stream);
+                        }
+                        continue;
+                }
+
+                if (shift != 0x44894489
+                        || stream->sector_count == AMIGA_SECTORS_PER_TRACK) {
+                        continue;
+                }
+
+                // Sync! The next bit is the first bit of the sector header.
+                struct mfm_stream_sector *s =
+                                        &stream->sectors[stream->sector_count];
+                s->sample_index = stream->sample_index + i;
+
+                stream->out = stream->track
+                                + stream->sector_count * AMIGA_MFM_SECTOR_SIZE;
+                memset(stream->out, 0x00, AMIGA_MFM_SECTOR_SIZE);
+                memcpy(stream->out, "\xaa\xaa\xaa\xaa\x44\x89\x44\x89", 8);
+                out_bit = 0;
         }
 
-        parsed_sector->calculated_data_checksum = calculated_checksum;
+        stream->shift = shift;
+        stream->out_bit = out_bit;
+        stream->sample_index += count;
+}
 
-        if (sector_data_out) {
-                *sector_data_out = (uint8_t*)sector_data;
-        } else {
-                free(sector_data);
+/**
+ * @brief       The track is done, parse the sector we are in the middle of.
+ *
+ * @detail      A sector cut off by the end of the read is parsed with the
+ *              missing bits as zeros, and will fail the checksum.
+ */
+void mfm_stream_finish(struct mfm_stream *stream)
+{
+        if (stream->out) {
+                mfm_stream_sector_done(stream);
         }
+}
 
-        calculated_checksum ^= mfm_header.data_checksum_odd;
-        calculated_checksum ^= mfm_header.data_checksum_even;
-        calculated_checksum &= mask;
+/*
+ * The bits of mfm_find_raw_sectors(), as 32-bit words, first bit in the
+ * MSB. Starts with two words of zeros, so a sector can start before the
+ * first sample.
+ */
+#define RAW_LEAD_BITS   64
 
-        parsed_sector->data_checksum_ok = calculated_checksum == 0 ? true : false;
+static inline void raw_put_bits(uint32_t **out, uint64_t *acc,
+                        unsigned int *fill, uint32_t bits, unsigned int count)
+{
+        *acc = (*acc << count) | bits;
+        *fill += count;
+        if (*fill >= 32) {
+                *fill -= 32;
+                *(*out)++ = (uint32_t)(*acc >> *fill);
+        }
+}
 
-        return 0;
+static void raw_copy_sector(const uint32_t *words, size_t start, size_t zero_to,
+                                                                uint8_t *out)
+{
+        for (size_t w = 0; w < AMIGA_MFM_SECTOR_SIZE / 4; w++) {
+                const size_t bit = start + w * 32;
+                const uint32_t *src = words + (bit >> 5);
+                const unsigned int sh = bit & 31;
+                const uint32_t v = sh ? (src[0] << sh) | (src[1] >> (32 - sh))
+                                                                : src[0];
+                const uint32_t be = htobe32(v);
+                memcpy(out + w * 4, &be, sizeof(be));
+        }
+
+        // Bits from before the last sector ended are not part of this one.
+        for (size_t bit = start; bit < zero_to; bit++) {
+                const size_t i = bit - start;
+                out[i >> 3] &= ~(0x80 >> (i & 0x07));
+        }
 }
 
+/**
+ * @brief       Find the raw amiga sectors of a track, bit exact with
+ *              what read_track_timing always found.
+ *
+ * @detail      Samples over 720 are 4 bitcells, over 540 3, the rest 2.
+ *              A sector is the 32 bits before a 0x4489 4489 sync, the sync,
+ *              and the AMIGA_MFM_SECTOR_SIZE - 8 bytes after it. The search
+ *              for the next sync starts where a sector ends, with no bits
+ *              before it, so a sync inside a sector is skipped. A sector
+ *              cut off by the end of the samples is not counted.
+ *              The bits are assembled in a 64-bit accumulator and written
+ *              out a word at a time, the sync is a compare of the last 32
+ *              bits, and each sector is copied out a word at a time.
+ *
+ * @param       samples         Flux timing, counts of 10 nSec.
+ * @param       sample_count    Number of samples
+ * @param       sectors         <OUT> Room for max_sectors sectors of
+ *                              AMIGA_MFM_SECTOR_SIZE bytes, laid out as
+ *                              on the disk
+ * @param       max_sectors     Stop after this many sectors
+ *
+ * @return      Number of sectors found, -1 on error.
+ */
+int mfm_find_raw_sectors(const uint32_t *samples, int sample_count,
+                                        uint8_t *sectors, int max_sectors)
+{
+        static const size_t sector_bits = (AMIGA_MFM_SECTOR_SIZE - 8) * 8;
+        size_t *sync_end, *sector_start;
+        uint32_t *words, *out;
+        uint64_t acc = 0;
+        unsigned int fill = 0;
+        uint32_t shift = 0;             // The last 32 bits of this sector
+        size_t bit = RAW_LEAD_BITS;
+        size_t start = RAW_LEAD_BITS;   // Where this sector's bits start
+        size_t done_at = 0;             // Bit that completes the sector, or 0
+        int found = 0;
+
+        if (max_sectors <= 0)
+                return 0;
+
+        // Four bits a sample, the lead, and a word to read past the end.
+        words = calloc((RAW_LEAD_BITS + (size_t)sample_count * 4) / 32 + 3,
+                                                        sizeof(*words));
+        sync_end = malloc(2 * max_sectors * sizeof(*sync_end));
+        if (!words || !sync_end) {
+                fprintf(stderr, "Couldn't allocate memory for bitstream\n");
+                free(words);
+                free(sync_end);
+                return -1;
+        }
+        sector_start = sync_end + max_sectors;
+        out = words + RAW_LEAD_BITS / 32;
+
+        for (int i = 0; i < sample_count; i++) {
+                const unsigned int cells = 2 + (samples[i] > 540)
+                                                + (samples[i] > 720);
+
+                // <cells - 1> zeros, then the flux transition.
+                raw_put_bits(&out, &acc, &fill, 1, cells);
+                bit += cells;
+                shift = (shift << cells) | 1;
+
+                if (done_at) {
+                        if (bit < done_at)
+                                continue;
+                        sector_start[found++] = start;
+                        if (found == max_sectors)
+                                break;
+                        // The bits past the end go into the next sector.
+                        start = done_at;
+                        shift = bit > done_at;
+                        done_at = 0;
+                        continue;
+                }
+
+                if (shift == 0x44894489) {
+                        sync_end[found] = bit;
+                        done_at = bit + sector_bits;
+                }
+        }
+        if (fill)
+                *out = (uint32_t)(acc << (32 - fill));
+
+        for (int s = 0; s < found; s++) {
+                raw_copy_sector(words, sync_end[s] - 64, sector_start[s],
+                                        sectors + s * AMIGA_MFM_SECTOR_SIZE);
+        }
+
+        free(words);
+        free(sync_end);
+        return found;
+}
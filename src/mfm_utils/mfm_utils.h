@@ -18,4 +18,41 @@ int parse_amiga_mfm_sector(const uint8_t * restrict bitstream, size_t byte_count
                                         struct amiga_sector * restrict parsed_sector,
                                         uint8_t * restrict * restrict sector_data_out);
 
+#define AMIGA_SECTORS_PER_TRACK         11
+// aaaa aaaa 4489 4489, the header and the data.
+#define AMIGA_MFM_SECTOR_SIZE           1088
+
+struct mfm_stream_sector {
+        struct amiga_sector sector;
+        int rc;                         // From amiga_decode_sector
+        size_t sample_index;            // Sample where the sync ends
+};
+
+struct mfm_pll;
+
+/**
+ * Decode a track incrementally, as the flux samples arrive from the drive.
+ */
+struct mfm_stream {
+        uint8_t *track;
+        uint8_t *data;                  // Decoded sector data, in the order
+                                        // found, 512 bytes each, or NULL
+        struct mfm_pll *pll;            // Bitcell clock, NULL for fixed 2us
+        struct mfm_stream_sector sectors[AMIGA_SECTORS_PER_TRACK];
+        unsigned int sector_count;
+
+        uint32_t shift;                 // The last 32 bits
+        size_t sample_index;            // Samples fed so far
+        uint8_t *out;                   // Sector being filled, or NULL
+        unsigned int out_bit;           // Next bit in out, after the sync
+};
+
+void mfm_stream_init(struct mfm_stream *stream, uint8_t *track);
+void mfm_stream_feed(struct mfm_stream *stream, const uint32_t *samples,
+                                                                size_t count);
+void mfm_stream_finish(struct mfm_stream *stream);
+
+int mfm_find_raw_sectors(const uint32_t *samples, int sample_count,
+                                        uint8_t *sectors, int max_sectors);
+
 #endif /* MFM_UTILS_H */
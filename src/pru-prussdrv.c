@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <prussdrv.h>
+#include <pruss_intc_mapping.h>
+
+#include "pru-setup.h"
+
+#define PRU_NUM0        0
+
+extern const unsigned firmware[];
+extern const unsigned firmware_size;
+
+/*
+ * The real PRU, through the uio_pruss driver.
+ */
+
+static int prussdrv_backend_open(struct pru * pru)
+{
+        int rc;
+        void *ram, *shared_ram;
+
+        tpruss_intc_initdata pruss_intc_initdata = PRUSS_INTC_INITDATA;
+
+        /* Initialize PRU */
+        prussdrv_init();
+
+        rc = prussdrv_open(PRU_EVTOUT_0);
+        if (rc) {
+                fprintf(stderr, "Failed to open pruss device\n");
+                return -1;
+        }
+
+        /* Get the interrupt initialized */
+        prussdrv_pruintc_init(&pruss_intc_initdata);
+
+        rc = prussdrv_map_prumem(PRUSS0_PRU0_DATARAM, &ram);
+        if (rc) {
+                fprintf(stderr, "Failed to setup PRU_DRAM\n");
+                goto map_failed;
+        }
+        rc = prussdrv_map_prumem(PRUSS0_SHARED_DATARAM, &shared_ram);
+        if (rc) {
+                fprintf(stderr, "Failed to setup PRU_SHARED_RAM\n");
+                goto map_failed;
+        }
+
+        pru->ram = ram;                         // 8Kb // 0x2000 // 8192
+        pru->shared_ram = shared_ram;           // 12Kb // 0x3000 // 12288
+
+        return 0;
+
+map_failed:
+        prussdrv_exit();
+        return -1;
+}
+
+static int prussdrv_backend_start(struct pru * pru)
+{
+        printf("Exec firmware! - size: %x\n", firmware_size);
+
+        return prussdrv_exec_code(PRU_NUM0, firmware, firmware_size);
+}
+
+static void prussdrv_backend_wait_event(struct pru * pru)
+{
+        prussdrv_pru_wait_event(PRU_EVTOUT_0);
+}
+
+static void prussdrv_backend_clear_event(struct pru * pru)
+{
+        prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+}
+
+static void prussdrv_backend_close(struct pru * pru)
+{
+        prussdrv_pru_disable(PRU_NUM0);
+        prussdrv_exit();
+}
+
+const struct pru_backend pru_backend_prussdrv = {
+        .name           = "prussdrv",
+        .open           = prussdrv_backend_open,
+        .start          = prussdrv_backend_start,
+        .wait_event     = prussdrv_backend_wait_event,
+        .clear_event    = prussdrv_backend_clear_event,
+        .close          = prussdrv_backend_close,
+};
@@ -4,19 +4,12 @@
 #include <string.h>
 #include <endian.h>
 #include <stddef.h>
-
-#include <prussdrv.h>
-#include <pruss_intc_mapping.h>
+#include <stdbool.h>
 
 #include "arm-interface.h"
 #include "pru-setup.h"
 #include "list.h"
 
-#define PRU_NUM0        0
-
-extern const unsigned firmware[];
-extern const unsigned firmware_size;
-
 void hexdump(const void *b, size_t len)
 {
     int i;
@@ -44,72 +37,65 @@ void hexdump(const void *b, size_t len)
     printf("%s\n", str);
 }
 
+/*
+ * Wait for the next event from the PRU, and acknowledge it.
+ * Unlike pru_wait_event(), this does not care if the firmware is running,
+ * so it can be used while starting and stopping the firmware.
+ */
+static inline void pru_event(struct pru * pru)
+{
+        pru->backend->wait_event(pru);
+        pru->backend->clear_event(pru);
+}
+
+/*
+ * @brief       Bring up the PRU, with the backend picked from the environment.
+ *
+ * @detail      If PRU_SIM_ENV is set, or the binary is built without
+ *              prussdrv, the simulator is used instead of the real PRU.
+ */
 struct pru * pru_setup(void)
 {
-        int rc;
-        unsigned char * volatile ram;                   // 8Kb // 0x2000 // 8192
-        unsigned char * volatile shared_ram;            // 12Kb // 0x3000 // 12288
+#ifdef PRU_NO_PRUSSDRV
+        return pru_setup_backend(&pru_backend_sim);
+#else
+        if (getenv(PRU_SIM_ENV))
+                return pru_setup_backend(&pru_backend_sim);
 
-        /*
-        ptrdiff_t val = &_binary_firmware_bin_end - &_binary_firmware_bin_start;
-        printf("Size: %d\n", val);
-        printf("start %u\n", (uintptr_t)&_binary_firmware_bin_start);
-        printf("end  %u\n", (uintptr_t)&_binary_firmware_bin_end);
-        printf("size %u\n", (uintptr_t)&_binary_firmware_bin_size);
-        */
+        return pru_setup_backend(&pru_backend_prussdrv);
+#endif
+}
 
+struct pru * pru_setup_backend(const struct pru_backend *backend)
+{
         struct pru * pru;
 
-        tpruss_intc_initdata pruss_intc_initdata = PRUSS_INTC_INITDATA;
-
-        /* Initialize PRU */
-        prussdrv_init();
-
-        rc = prussdrv_open(PRU_EVTOUT_0);
-        if (rc) {
-                fprintf(stderr, "Failed to open pruss device\n");
-                return NULL;
-        }
-
-        /* Get the interrupt initialized */
-        prussdrv_pruintc_init(&pruss_intc_initdata);
-
-        rc = prussdrv_map_prumem(PRUSS0_PRU0_DATARAM, (void **)&ram);
-        if (rc) {
-                fprintf(stderr, "Failed to setup PRU_DRAM\n");
-                return NULL;
-        }
-        rc = prussdrv_map_prumem(PRUSS0_SHARED_DATARAM, (void **)&shared_ram);
-        if (rc) {
-                fprintf(stderr, "Failed to setup PRU_SHARED_RAM\n");
-                return NULL;
-        }
-
-        memset(ram, 0x00, 0x2000);
-        memset(shared_ram, 0x00, 0x3000);
-
         pru = malloc(sizeof(*pru));
         if (!pru) {
-                prussdrv_exit();
                 return NULL;
         }
 
         pru->running = 0;
-        pru->ram = ram;
-        pru->shared_ram = shared_ram;
+        pru->backend = backend;
+        pru->backend_data = NULL;
+
+        if (backend->open(pru)) {
+                fprintf(stderr, "Failed to open %s backend\n", backend->name);
+                free(pru);
+                return NULL;
+        }
 
-        printf("Exec firmware! - size: %x\n", firmware_size);
+        memset(pru->ram, 0x00, 0x2000);
+        memset(pru->shared_ram, 0x00, 0x3000);
 
-        rc = prussdrv_exec_code(PRU_NUM0, firmware, firmware_size);
-        if (rc) {
+        if (backend->start(pru)) {
                 fprintf(stderr, "Failed to load firmware\n");
+                backend->close(pru);
                 free(pru);
-                prussdrv_exit();
                 return NULL;
         }
 
-        prussdrv_pru_wait_event(PRU_EVTOUT_0);
-        prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+        pru_event(pru);
 
         pru->running = 1;
 
@@ -126,8 +112,7 @@ void stop_fw(struct pru * pru)
         pru->running = 0;
         intf->command = COMMAND_QUIT;
 
-        prussdrv_pru_wait_event(PRU_EVTOUT_0);
-        prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+        pru_event(pru);
 
         if (intf->command != (COMMAND_QUIT & 0x7f))
                 printf("QUIT wrong Ack: 0x%02x\n", intf->command);
@@ -140,20 +125,19 @@ void pru_exit(struct pru * pru)
         if (pru->running)
                 stop_fw(pru);
 
-        prussdrv_pru_disable(PRU_NUM0);
-        prussdrv_exit();
+        pru->backend->close(pru);
         free(pru);
 }
 
 void pru_wait_event(struct pru * pru)
 {
         if (!pru->running) return;
-        prussdrv_pru_wait_event(PRU_EVTOUT_0);
+        pru->backend->wait_event(pru);
 }
 void pru_clear_event(struct pru * pru)
 {
         if (!pru->running) return;
-        prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+        pru->backend->clear_event(pru);
 }
 
 
@@ -163,8 +147,7 @@ void pru_start_motor(struct pru * pru)
         if (!pru->running) return;
 
         intf->command = COMMAND_START_MOTOR;
-        prussdrv_pru_wait_event(PRU_EVTOUT_0);
-        prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+        pru_event(pru);
         if (intf->command != (COMMAND_START_MOTOR & 0x7f))
                 printf("Hm, wrong ack on start!\n");
 
@@ -177,8 +160,7 @@ void pru_stop_motor(struct pru * pru)
         if (!pru->running) return;
 
         intf->command = COMMAND_STOP_MOTOR;
-        prussdrv_pru_wait_event(PRU_EVTOUT_0);
-        prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+        pru_event(pru);
         if (intf->command != (COMMAND_STOP_MOTOR & 0x7f))
                 printf("Hm, wrong ack on stop!\n");
 
@@ -193,8 +175,7 @@ void pru_find_sync(struct pru * pru)
         // IMPORTANT: SET ARGUMENT BEFORE WE SET THE COMMAND!
         // The argument is number of dwords
         intf->command = COMMAND_FIND_SYNC;
-        prussdrv_pru_wait_event(PRU_EVTOUT_0);
-        prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+        pru_event(pru);
         if (intf->command != (COMMAND_FIND_SYNC & 0x7f))
                 printf("Got wrong Ack: 0x%02x\n", intf->command);
 
@@ -216,8 +197,7 @@ void pru_read_sector(struct pru * pru, void * data)
 
         intf->argument = (RAW_MFM_SECTOR_SIZE + 16) / 4;
         intf->command = COMMAND_READ_SECTOR;
-        prussdrv_pru_wait_event(PRU_EVTOUT_0);
-        prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+        pru_event(pru);
         if (intf->command != (COMMAND_READ_SECTOR & 0x7f))
                 printf("Got wrong Ack: 0x%02x\n", intf->command);
 
@@ -274,8 +254,7 @@ void pru_read_raw_track(struct pru * pru, void * data, uint32_t len,
         intf->command = COMMAND_READ_SECTOR;
 
         while(1) {
-                prussdrv_pru_wait_event(PRU_EVTOUT_0);
-                prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+                pru_event(pru);
 
                 // We read 0x1000 bytes at a time, from the 0x3000byte buffer
                 // jumping back and forth in sync with the PRU
@@ -338,8 +317,7 @@ int pru_read_bit_timing(struct pru * pru, uint16_t ** data)
         intf->command = COMMAND_READ_BIT_TIMING;
 
         while(1) {
-                prussdrv_pru_wait_event(PRU_EVTOUT_0);
-                prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+                pru_event(pru);
 
                 // We read 0x1000 bytes at a time, from the 0x3000byte buffer
                 // jumping back and forth in sync with the PRU
@@ -381,7 +359,7 @@ int pru_write_bit_timing(struct pru * pru, uint16_t *source,
         if (!pru->running) return sample_count;
 
         intf->read_count = sample_count;
-        printf("Sample count: %d, bytes: %d\n", sample_count,
+        printf("Sample count: %d, bytes: %zu\n", sample_count,
                                         sample_count * sizeof(*source));
 
         memcpy(dest, source, 0x2000);
@@ -392,8 +370,7 @@ int pru_write_bit_timing(struct pru * pru, uint16_t *source,
 
         while(1) {
                 // We spin here until PRU has consumed the first 0x1000 bytes.
-                prussdrv_pru_wait_event(PRU_EVTOUT_0);
-                prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+                pru_event(pru);
 
                 if (intf->command == COMMAND_WRITE_BIT_TIMING) {
                         // Replace one part of the buffer
@@ -440,8 +417,7 @@ void pru_erase_track(struct pru * pru)
         if (!pru->running) return;
 
         intf->command = COMMAND_ERASE_TRACK;
-        prussdrv_pru_wait_event(PRU_EVTOUT_0);
-        prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+        pru_event(pru);
         if (intf->command != (COMMAND_ERASE_TRACK & 0x7f))
                 printf("Got wrong Ack: 0x%02x\n", intf->command);
 }
@@ -461,8 +437,7 @@ void pru_write_track(struct pru * pru, void * data)
         }
 
         intf->command = COMMAND_WRITE_TRACK;
-        prussdrv_pru_wait_event(PRU_EVTOUT_0);
-        prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+        pru_event(pru);
         if (intf->command != (COMMAND_WRITE_TRACK & 0x7f))
                 printf("Got wrong Ack: 0x%02x\n", intf->command);
 }
@@ -475,8 +450,7 @@ void pru_set_head_dir(struct pru * pru, enum pru_head_dir dir)
         // IMPORTANT: SET ARGUMENT BEFORE WE SET THE COMMAND!
         intf->argument = (dir == PRU_HEAD_INC) ? 1 : 0;
         intf->command = COMMAND_SET_HEAD_DIR;
-        prussdrv_pru_wait_event(PRU_EVTOUT_0);
-        prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+        pru_event(pru);
         if (intf->command != (COMMAND_SET_HEAD_DIR & 0x7f))
                 printf("Got wrong Ack: 0x%02x\n", intf->command);
 
@@ -491,8 +465,7 @@ void pru_set_head_side(struct pru * pru, enum pru_head_side side)
         // IMPORTANT: SET ARGUMENT BEFORE WE SET THE COMMAND!
         intf->argument = (side == PRU_HEAD_UPPER) ? 1 : 0;
         intf->command = COMMAND_SET_HEAD_SIDE;
-        prussdrv_pru_wait_event(PRU_EVTOUT_0);
-        prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+        pru_event(pru);
         if (intf->command != (COMMAND_SET_HEAD_SIDE & 0x7f))
                 printf("Got wrong Ack: 0x%02x\n", intf->command);
 
@@ -508,8 +481,7 @@ void pru_step_head(struct pru * pru, uint16_t count)
         // IMPORTANT: SET ARGUMENT BEFORE WE SET THE COMMAND!
         intf->argument = count;
         intf->command = COMMAND_STEP_HEAD;
-        prussdrv_pru_wait_event(PRU_EVTOUT_0);
-        prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+        pru_event(pru);
         if (intf->command != (COMMAND_STEP_HEAD & 0x7f))
                 printf("Got wrong Ack: 0x%02x\n", intf->command);
 
@@ -522,8 +494,7 @@ void pru_reset_drive(struct pru * pru)
         if (!pru->running) return;
 
         intf->command = COMMAND_RESET_DRIVE;
-        prussdrv_pru_wait_event(PRU_EVTOUT_0);
-        prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+        pru_event(pru);
         if (intf->command != (COMMAND_RESET_DRIVE & 0x7f))
                 printf("Got wrong Ack: 0x%02x\n", intf->command);
 
@@ -536,27 +507,30 @@ int pru_test_track_0(struct pru * pru)
         if (!pru->running) return -1;
 
         intf->command = COMMAND_TEST_TRACK_0;
-        prussdrv_pru_wait_event(PRU_EVTOUT_0);
-        prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+        pru_event(pru);
         if (intf->command != (COMMAND_TEST_TRACK_0 & 0x7f))
                 printf("Got wrong Ack: 0x%02x\n", intf->command);
 
         return intf->argument;
 }
 
-int pru_write_timing(struct pru * pru, uint16_t *source,
-                                                int sample_count)
+/*
+ * Refill the PRU with write timing, 0x1000 bytes at a time, until the
+ * write is done. Return 1 if the PRU went on to read back (WRITE_VERIFY),
+ * with the first block of samples waiting, 0 when it acked, or -1.
+ */
+static int pru_feed_timing(struct pru * pru, uint8_t command,
+                                const uint16_t *source, int sample_count)
 {
+        unsigned int refills = 0;
         uint8_t mul = 0;
         uint16_t * volatile dest = (uint16_t * volatile)pru->shared_ram;
         int copy_size;
 
         volatile struct ARM_IF *intf = (volatile struct ARM_IF *)pru->ram;
-        if (!pru->running) {
-                return sample_count;
-        }
 
         intf->read_count = sample_count;
+        intf->phase = PHASE_WRITE;
 
         copy_size = (sample_count * sizeof(*source) > 0x1000) ? 0x1000 : sample_count * sizeof(*source);
         memcpy(dest, source, copy_size);
@@ -566,20 +540,32 @@ int pru_write_timing(struct pru * pru, uint16_t *source,
         mul = 1;
         dest += 0x1000/sizeof(*dest);
 
-        intf->command = COMMAND_WRITE_TIMING;
+        intf->command = command;
 
         while(1) {
                 // We spin here until PRU has consumed the first 0x1000 bytes.
-                prussdrv_pru_wait_event(PRU_EVTOUT_0);
-                prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+                pru_event(pru);
 
-                if (intf->command == COMMAND_WRITE_TIMING) {
+                if (intf->command == command) {
 #if 0
                         printf("INTERRUPT - sample_count: %d OFFSET: 0x%04x (%d)\n",
                                         *(uint32_t  *)(pru->ram + 0x80),
                                         *(uint16_t  *)(pru->ram + 0x90),
                                         *(uint16_t  *)(pru->ram + 0x90));
 #endif
+                        // A refill can be asked for just before the index,
+                        // and the PRU be reading by the time we get here.
+                        // Only once every refill is taken, this is the read.
+                        if (intf->phase == PHASE_VERIFY) {
+                                if (refills == intf->refills) {
+                                        return 1;
+                                }
+                                // The buffer is the read's now.
+                                refills++;
+                                continue;
+                        }
+                        refills++;
+
                         // Replace one part of the buffer
                         copy_size = (sample_count * sizeof(*source) > 0x1000)
                                 ? 0x1000 : sample_count * sizeof(*source);
@@ -588,7 +574,7 @@ int pru_write_timing(struct pru * pru, uint16_t *source,
                                 fprintf(stderr,
                                 "fatal -- pru request samples on empty buffer!"
                                                                         "\n");
-                                return sample_count;
+                                return -1;
                         }
 
                         memcpy(dest, source, copy_size);
@@ -601,87 +587,71 @@ int pru_write_timing(struct pru * pru, uint16_t *source,
                                 dest -= 0x1000/sizeof(*dest);
                         }
 
-                } else if (intf->command ==
-                                (COMMAND_WRITE_TIMING & 0x7f)) {
-                        break;
+                } else if (intf->command == (command & 0x7f)) {
+                        return 0;
                 } else {
                         printf("Got wrong Ack: 0x%02x\n", intf->command);
-                        break;
+                        return -1;
                 }
         }
+}
+
+int pru_write_timing(struct pru * pru, const uint16_t *source,
+                                                int sample_count)
+{
+        volatile struct ARM_IF *intf = (volatile struct ARM_IF *)pru->ram;
+        if (!pru->running) {
+                return sample_count;
+        }
+
+        if (pru_feed_timing(pru, COMMAND_WRITE_TIMING, source, sample_count) < 0) {
+                return sample_count;
+        }
 
         return intf->read_count;
 }
 
 /*
- * @brief       Read X revolutions of timingdata from current track.
- *
- * @detail      The timing data is represented as counts of 10 nano seconds.
- *
- * @param       pru             <IN>  This PRU object
- * @param       timing_data     <OUT> The samples will be returned to this pointer.
- * @param       revolutions     <IN>  The number of revolutions to read
- * @param       rev_offsets     <OUT> Offfests in the samples array where each rev. is stored.
- *
- * Read the timing of each bit from current track on floppy.
- * The read will start from INDEX, and read <revolutions> revolutions.
- * The function will return the number of samples read,
- * and the <data> pointer will contain the samples.
- * If <rev_offsets> is not NULL, it will be pointed to an array
- * of offsets into data for the start of each revolution.
+ * Hand each block of samples the PRU reads to <consume>, until <command>
+ * is acked. If <block_ready>, the first event is already in.
  */
-int pru_read_timing(struct pru * pru, uint32_t ** timing_data,
-                uint8_t revolutions, uint32_t ** rev_offsets)
+static int pru_stream_timing(struct pru * pru, uint8_t command,
+                uint8_t revolutions, pru_timing_consumer consume, void *ctx,
+                uint32_t *rev_offsets, bool block_ready)
 {
         uint8_t * volatile pru_buffer = pru->shared_ram;
         uint8_t * volatile pru_revolutions = pru->shared_ram + 0x2000;
+        const size_t block = 0x1000 / sizeof(uint32_t);
 
-        uint32_t *raw_timing;
-        uint8_t *data_ptr;
-
-        int sample_count = 0;
+        int sample_count = 0, remaining;
         uint8_t mul = 0;
+        int rc = 0;
 
         struct ARM_IF *intf = (struct ARM_IF *)pru->ram;
-        if (!pru->running)
-                return 0;
-
-        // We allocate room for 100,000 samples per revolution,
-        // this should be enough for all disks.
-        raw_timing = calloc(100000*revolutions, sizeof(*raw_timing));
-        if (!raw_timing) {
-                fprintf(stderr,
-                        "Couldn't allocate memory for raw_timing\n");
-                return 0;
-        }
-
-        data_ptr = (uint8_t *)raw_timing;
-
-        memset(pru->shared_ram, 0x00, 0x3000);
-        intf->argument = revolutions;
-        intf->command = COMMAND_READ_TIMING;
 
         while(1) {
                 // The PRU will set an interrupt when the buffer is full,
                 // or an error occured.
-                prussdrv_pru_wait_event(PRU_EVTOUT_0);
-                prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+                if (!block_ready)
+                        pru_event(pru);
+                block_ready = false;
 
-                // We read 0x1000 bytes at a time,
+                // We get 0x1000 bytes at a time,
                 // from the first 0x2000 bytes of the 0x3000 byte buffer
                 // jumping back and forth in sync with the PRU
-                if (intf->command == COMMAND_READ_TIMING) {
+                if (intf->command == command) {
                         // The buffer is full!
-                        memcpy(data_ptr, pru_buffer, 0x1000);
-                        data_ptr += 0x1000;
-                        sample_count += 0x1000/sizeof(*raw_timing);
+                        if (!rc)
+                                rc = consume((const uint32_t *)pru_buffer,
+                                                                block, ctx);
+                        sample_count += block;
 
                         if (++mul & 0x1)
                                 pru_buffer += 0x1000;
                         else
                                 pru_buffer -= 0x1000;
 
-                } else if (intf->command == (COMMAND_READ_TIMING & 0x7f)) {
+                } else if (intf->command == (command & 0x7f)) {
                         // The drive is done reading
                         break;
                 } else {
@@ -690,60 +660,472 @@ int pru_read_timing(struct pru * pru, uint32_t ** timing_data,
                         break;
                 }
         }
-        // Read the final bytes from the buffer, if any
-        memcpy(data_ptr, pru_buffer,
-                (intf->read_count - sample_count) * sizeof(*raw_timing));
 
-        sample_count += intf->read_count - sample_count;
-        if (sample_count != intf->read_count)
+        // The final samples in the buffer, if any
+        remaining = intf->read_count - sample_count;
+        if (remaining < 0 || remaining > (int)block) {
+                fprintf(stderr, "sample_count is not in sync with pru\n");
+        } else {
+                if (remaining && !rc)
+                        consume((const uint32_t *)pru_buffer, remaining, ctx);
+                sample_count += remaining;
+        }
+
+        if (rev_offsets)
+                memcpy(rev_offsets, pru_revolutions,
+                                        revolutions * sizeof(*rev_offsets));
+
+        return sample_count;
+}
+
+/*
+ * @brief       Read X revolutions of timing data, and hand each block of
+ *              samples to <consume> straight from the PRU shared RAM.
+ *
+ * @detail      The PRU fills one 0x1000 byte half of the shared RAM while
+ *              the host owns the other. <consume> is called with each half
+ *              as soon as the PRU is done with it, and must return before
+ *              the PRU comes back around to that half, ~2ms at 2us cells.
+ *              The samples are only valid during the call, copy them if
+ *              they are needed later.
+ *              If <consume> returns non-zero, no more samples are delivered,
+ *              but the read still runs to the end.
+ *
+ * @param       pru             <IN>  This PRU object
+ * @param       revolutions     <IN>  The number of revolutions to read
+ * @param       consume         <IN>  Called with each block of samples
+ * @param       ctx             <IN>  Passed on to <consume>
+ * @param       rev_offsets     <OUT> If not NULL, <revolutions> entries with
+ *                                    the sample count at each index pulse.
+ *
+ * @return      The number of samples read.
+ */
+int pru_read_timing_stream(struct pru * pru, uint8_t revolutions,
+                pru_timing_consumer consume, void *ctx, uint32_t *rev_offsets)
+{
+        struct ARM_IF *intf = (struct ARM_IF *)pru->ram;
+        if (!pru->running)
+                return 0;
+
+        // The PRU writes every sample before we get to see it,
+        // only the revolution table has to be cleared.
+        memset(pru->shared_ram + 0x2000, 0x00, 0x1000);
+        // A PHASE_STOP left by the last read would end this one.
+        intf->phase = 0;
+        intf->argument = revolutions;
+        intf->command = COMMAND_READ_TIMING;
+
+        return pru_stream_timing(pru, COMMAND_READ_TIMING, revolutions,
+                                        consume, ctx, rev_offsets, false);
+}
+
+/*
+ * @brief       Write a track, then read it back from the index pulse
+ *              the write stopped on.
+ *
+ * @detail      The write is the same as pru_write_timing(), the read the
+ *              same as pru_read_timing_stream(). With two commands, the
+ *              read waits a whole revolution for the next index. Here it
+ *              starts right away, and <consume> gets the samples as they
+ *              are read, so a verify can be done when the read is.
+ *              If the samples ran out before the index, the read waits
+ *              for the next one, as pru_read_timing_stream().
+ *
+ * @param       pru             <IN>  This PRU object
+ * @param       source          <IN>  Write timing, as pru_write_timing()
+ * @param       sample_count    <IN>  Number of samples in <source>
+ * @param       revolutions     <IN>  The number of revolutions to read back
+ * @param       consume         <IN>  Called with each block of samples read
+ * @param       ctx             <IN>  Passed on to <consume>
+ * @param       rev_offsets     <OUT> As pru_read_timing_stream(), or NULL
+ * @param       unwritten       <OUT> As returned by pru_write_timing()
+ *
+ * @return      The number of samples read back.
+ */
+int pru_write_verify(struct pru * pru, const uint16_t *source,
+                int sample_count, uint8_t revolutions,
+                pru_timing_consumer consume, void *ctx,
+                uint32_t *rev_offsets, int *unwritten)
+{
+        volatile struct ARM_IF *intf = (volatile struct ARM_IF *)pru->ram;
+        int rc;
+
+        *unwritten = sample_count;
+        if (!pru->running)
+                return 0;
+
+        memset(pru->shared_ram + 0x2000, 0x00, 0x1000);
+        intf->argument = revolutions;
+
+        rc = pru_feed_timing(pru, COMMAND_WRITE_VERIFY, source, sample_count);
+        if (rc < 0)
+                return 0;
+
+        // Left in read_count by the write, until the read is done.
+        // If it is done already, so few samples were read it failed anyway.
+        if (rc == 1)
+                *unwritten = intf->read_count;
+
+        // Either the first block or the ack is waiting.
+        return pru_stream_timing(pru, COMMAND_WRITE_VERIFY, revolutions,
+                                consume, ctx, rev_offsets, true);
+}
+
+/*
+ * A read op in a queue is done. Hand over what is left in the buffer,
+ * more than a block if the done interrupt came with the last block.
+ */
+static void pru_queue_read_done(struct pru * pru, struct pru_queue_op *op,
+                unsigned int index, const struct pru_queue_reader *reader,
+                uint8_t **pru_buffer, uint8_t *mul, uint32_t consumed,
+                int *rc)
+{
+        const size_t block = 0x1000 / sizeof(uint32_t);
+        size_t remaining = op->result - consumed;
+
+        if (op->result < consumed || remaining > 2 * block) {
                 fprintf(stderr, "sample_count is not in sync with pru\n");
+                remaining = 0;
+        }
+        while (remaining) {
+                const size_t count = remaining > block ? block : remaining;
+                if (!*rc)
+                        *rc = reader->samples(index,
+                                (const uint32_t *)*pru_buffer, count,
+                                                        reader->ctx);
+                remaining -= count;
+                if (++*mul & 0x1)
+                        *pru_buffer += 0x1000;
+                else
+                        *pru_buffer -= 0x1000;
+        }
+
+        if (reader->done)
+                reader->done(index, op,
+                        (const uint32_t *)(pru->shared_ram + 0x2000),
+                                                        reader->ctx);
+}
+
+/*
+ * @brief       Run a list of commands on the PRU, with one round trip
+ *              for all of them.
+ *
+ * @detail      Each command is run as if sent on its own, in order. A
+ *              scan of a cylinder is STEP_HEAD, SET_HEAD_SIDE,
+ *              READ_TIMING, SET_HEAD_SIDE, READ_TIMING.
+ *              The samples of each read go to <reader>, as with
+ *              pru_read_timing_stream(). The PRU only stops to tell the
+ *              host a read is done when another read follows, as that
+ *              read reuses the buffer.
+ *
+ * @param       pru             <IN>  This PRU object
+ * @param       ops             <IN/OUT> The commands, `done` and `result`
+ *                                    are filled in.
+ * @param       count           <IN>  Number of ops, up to QUEUE_MAX_OPS
+ * @param       reader          <IN>  Gets the samples, or NULL with no reads
+ *
+ * @return      The number of ops done, or -1.
+ */
+int pru_run_queue(struct pru * pru, struct pru_queue_op *ops,
+                unsigned int count, const struct pru_queue_reader *reader)
+{
+        volatile struct QUEUE_OP *queue =
+                        (volatile struct QUEUE_OP *)(pru->ram + QUEUE_OFFSET);
+        const size_t block = 0x1000 / sizeof(uint32_t);
+        uint8_t *pru_buffer = pru->shared_ram;
+        unsigned int i, op, done = 0;
+        uint32_t consumed = 0;
+        uint8_t mul = 0;
+        int rc = 0;
+
+        struct ARM_IF *intf = (struct ARM_IF *)pru->ram;
+        if (!pru->running)
+                return -1;
+        if (count > QUEUE_MAX_OPS) {
+                fprintf(stderr, "Too many ops for the PRU queue: %u\n", count);
+                return -1;
+        }
+
+        bool read_follows = false;
+        for (i = count; i-- > 0; ) {
+                const bool read = ops[i].command == COMMAND_READ_TIMING;
+                if (read && !reader) {
+                        fprintf(stderr, "Read in a PRU queue with no reader\n");
+                        return -1;
+                }
 
-        /*
-        extra_samples = 0;
-        for (i = 0; i < sample_count; i++) {
-            if (raw_timing[i] > UINT16_MAX) {
-                extra_samples++;
-                fprintf(stderr, "DEBUG: found long sample!\n");
-            }
+                queue[i].command = ops[i].command;
+                queue[i].flags = read && read_follows
+                                        ? 1 << QUEUE_OP_NOTIFY : 0;
+                queue[i].argument = ops[i].argument;
+                queue[i].result = 0;
+                ops[i].done = false;
+                ops[i].result = 0;
+                read_follows |= read;
         }
-        *timing_data = calloc(sample_count + extra_samples,
-                                    sizeof(*timing_data));
-        if (!*timing_data) {
-            fprintf(stderr,
-                    "Couldn't allocate memory for timing_data\n");
-            free(raw_timing);
-            return 0;
+
+        // A sample is never 0, so a zero at the start of a half means
+        // the PRU has not filled it since we took it.
+        memset(pru->shared_ram, 0x00, 0x3000);
+        intf->phase = 0;
+        intf->argument = count;
+        intf->command = COMMAND_RUN_QUEUE;
+
+        // The read op the samples are for
+        for (op = 0; op < count && ops[op].command != COMMAND_READ_TIMING; op++)
+                ;
+
+        while(1) {
+                pru_event(pru);
+
+                const bool finished = intf->command == (COMMAND_RUN_QUEUE & 0x7f);
+                if (!finished && intf->command != COMMAND_RUN_QUEUE) {
+                        printf("Got wrong Ack: 0x%02x\n", intf->command);
+                        break;
+                }
+
+                // Reads done since the last interrupt
+                if (op < count && !(queue[op].command & 0x80)) {
+                        ops[op].result = queue[op].result;
+                        pru_queue_read_done(pru, &ops[op], op, reader,
+                                        &pru_buffer, &mul, consumed, &rc);
+                        pru_buffer = pru->shared_ram;
+                        mul = 0;
+                        consumed = 0;
+                        memset(pru_buffer, 0x00, sizeof(uint32_t));
+                        memset(pru_buffer + 0x1000, 0x00, sizeof(uint32_t));
+                        for (op++; op < count
+                                && ops[op].command != COMMAND_READ_TIMING; op++)
+                                ;
+                } else if (!finished && op < count) {
+                        volatile uint32_t *first = (volatile uint32_t *)pru_buffer;
+
+                        // The interrupt of a read we already finished,
+                        // when it was done just after its last block.
+                        if (!*first)
+                                continue;
+
+                        // The buffer is full!
+                        if (!rc)
+                                rc = reader->samples(op,
+                                        (const uint32_t *)pru_buffer, block,
+                                                                reader->ctx);
+                        consumed += block;
+                        *first = 0;
+
+                        if (++mul & 0x1)
+                                pru_buffer += 0x1000;
+                        else
+                                pru_buffer -= 0x1000;
+                }
+
+                if (finished)
+                        break;
         }
-        timing_ptr = *timing_data;
-
-        for (i = 0; i < sample_count; i++) {
-            if (raw_timing[i] > UINT16_MAX) {
-                *timing_ptr = 0x0000;
-                timing_ptr++;
-                raw_timing[i] -= UINT16_MAX;
-            }
-            *timing_ptr = (uint16_t)raw_timing[i];
-            timing_ptr++;
+
+        for (i = 0; i < count; i++) {
+                ops[i].done = !(queue[i].command & 0x80);
+                ops[i].result = queue[i].result;
+                if (ops[i].done)
+                        done++;
         }
-        free(raw_timing);
 
-        sample_count += extra_samples;
-        */
+        return done;
+}
 
-        *timing_data = realloc(raw_timing, sample_count * sizeof(*raw_timing));
+struct timing_buffer {
+        uint32_t *data;
+        size_t count;
+        size_t size;
+};
 
-        if (!rev_offsets)
-                return sample_count;
+static int timing_buffer_append(const uint32_t *samples, size_t count,
+                                                                void *ctx)
+{
+        struct timing_buffer *buf = ctx;
+
+        if (buf->count + count > buf->size) {
+                size_t size = buf->size * 2;
+                uint32_t *data = realloc(buf->data, size * sizeof(*data));
+                if (!data) {
+                        fprintf(stderr,
+                                "Couldn't grow memory for raw_timing\n");
+                        return -1;
+                }
+                buf->data = data;
+                buf->size = size;
+        }
+
+        memcpy(buf->data + buf->count, samples, count * sizeof(*samples));
+        buf->count += count;
+
+        return 0;
+}
 
-        *rev_offsets = malloc(0x1000);
-        if (!*rev_offsets) {
+/*
+ * @brief       Read X revolutions of timingdata from current track.
+ *
+ * @detail      The timing data is represented as counts of 10 nano seconds.
+ *
+ * @param       pru             <IN>  This PRU object
+ * @param       timing_data     <OUT> The samples will be returned to this pointer.
+ * @param       revolutions     <IN>  The number of revolutions to read
+ * @param       rev_offsets     <OUT> Offfests in the samples array where each rev. is stored.
+ *
+ * Read the timing of each bit from current track on floppy.
+ * The read will start from INDEX, and read <revolutions> revolutions.
+ * The function will return the number of samples read,
+ * and the <data> pointer will contain the samples.
+ * If <rev_offsets> is not NULL, it will be pointed to an array
+ * of offsets into data for the start of each revolution.
+ *
+ * Use pru_read_timing_stream() if the samples don't need to be kept.
+ */
+int pru_read_timing(struct pru * pru, uint32_t ** timing_data,
+                uint8_t revolutions, uint32_t ** rev_offsets)
+{
+        struct timing_buffer buf = {0};
+        uint32_t *offsets = NULL;
+        int sample_count;
+
+        *timing_data = NULL;
+        if (!pru->running)
+                return 0;
+
+        // We start with room for 100,000 samples per revolution,
+        // this should be enough for all disks.
+        buf.size = 100000 * (revolutions ? revolutions : 1);
+        buf.data = malloc(buf.size * sizeof(*buf.data));
+        if (!buf.data) {
                 fprintf(stderr,
+                        "Couldn't allocate memory for raw_timing\n");
+                return 0;
+        }
+
+        if (rev_offsets) {
+                offsets = calloc(1, 0x1000);
+                if (!offsets) {
+                        fprintf(stderr,
                         "Couldn't allocate memory for revolution offsets!\n");
-                free(*timing_data);
-                *timing_data = NULL;
+                        free(buf.data);
+                        return 0;
+                }
+        }
+
+        sample_count = pru_read_timing_stream(pru, revolutions,
+                                timing_buffer_append, &buf, offsets);
+        if (buf.count != (size_t)sample_count) {
+                // We ran out of memory along the way
+                free(buf.data);
+                free(offsets);
                 return 0;
         }
-        memcpy(*rev_offsets, pru_revolutions, 0x1000);
+
+        *timing_data = realloc(buf.data, sample_count * sizeof(*buf.data));
+        if (!*timing_data)
+                *timing_data = buf.data;
+
+        if (rev_offsets)
+                *rev_offsets = offsets;
 
         return sample_count;
 }
+
+struct timing_until {
+        struct pru *pru;
+        struct timing_buffer buf;
+        pru_timing_consumer consume;
+        void *ctx;
+        bool done;
+};
+
+static int timing_until_append(const uint32_t *samples, size_t count,
+                                                                void *ctx)
+{
+        struct timing_until *until = ctx;
+        const volatile uint32_t *rev_table =
+                (const volatile uint32_t *)(until->pru->shared_ram + 0x2000);
+
+        if (!until->done)
+                until->done = until->consume(samples, count, until->ctx) != 0;
+
+        // Only whole revolutions are kept, so not before the first index.
+        if (until->done && rev_table[0]) {
+                volatile struct ARM_IF *intf =
+                                (volatile struct ARM_IF *)until->pru->ram;
+                intf->phase = PHASE_STOP;
+        }
+
+        return timing_buffer_append(samples, count, &until->buf);
+}
+
+/*
+ * @brief       Read revolutions of timing data, until <consume> has seen
+ *              enough of them.
+ *
+ * @detail      As pru_read_timing(), but each block of samples is also
+ *              handed to <consume> as it is read. When <consume> returns
+ *              non-zero, the PRU is stopped right away, and the samples are
+ *              cut back to the last index pulse. At least one revolution
+ *              is read.
+ *
+ * @param       pru             <IN>  This PRU object
+ * @param       timing_data     <OUT> The samples will be returned to this pointer.
+ * @param       revolutions     <IN/OUT> The most revolutions to read,
+ *                                    then the number read.
+ * @param       rev_offsets     <OUT> As pru_read_timing(), <revolutions>
+ *                                    entries.
+ * @param       consume         <IN>  Called with each block of samples
+ * @param       ctx             <IN>  Passed on to <consume>
+ *
+ * @return      The number of samples read, up to the last index pulse.
+ */
+int pru_read_timing_until(struct pru * pru, uint32_t ** timing_data,
+                uint8_t *revolutions, uint32_t ** rev_offsets,
+                pru_timing_consumer consume, void *ctx)
+{
+        struct timing_until until = {
+                .pru = pru,
+                .consume = consume,
+                .ctx = ctx,
+        };
+        uint32_t *offsets;
+        uint8_t done = 0;
+        int sample_count;
+
+        *timing_data = NULL;
+        *rev_offsets = NULL;
+        if (!pru->running || !*revolutions)
+                return 0;
+
+        until.buf.size = 100000 * *revolutions;
+        until.buf.data = malloc(until.buf.size * sizeof(*until.buf.data));
+        offsets = calloc(1, 0x1000);
+        if (!until.buf.data || !offsets) {
+                fprintf(stderr,
+                        "Couldn't allocate memory for raw_timing\n");
+                goto failed;
+        }
+
+        sample_count = pru_read_timing_stream(pru, *revolutions,
+                                timing_until_append, &until, offsets);
+        if (until.buf.count != (size_t)sample_count)
+                goto failed;
+
+        // What follows the last index pulse is part of a revolution.
+        while (done < *revolutions && offsets[done])
+                done++;
+        if (!done)
+                goto failed;
+
+        *revolutions = done;
+        *timing_data = until.buf.data;
+        *rev_offsets = offsets;
+
+        return offsets[done - 1];
+
+failed:
+        free(until.buf.data);
+        free(offsets);
+        return 0;
+}
@@ -3,6 +3,7 @@
 
 #include <unistd.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 //#define MFM_TRACK_LEN	 0x1900 //1080 //0x1900
 
@@ -36,15 +37,42 @@ enum pru_head_side {
         PRU_HEAD_LOWER
 };
 
+struct pru;
+
+/**
+ * The backend owns the PRU memory and the event line to the host.
+ * Everything above it only talks to ram/shared_ram and waits for events,
+ * so the same host code runs against the real PRU and the simulator.
+ */
+struct pru_backend {
+        const char *name;
+        /** Map ram (0x2000 bytes) and shared_ram (0x3000 bytes). */
+        int (*open)(struct pru *pru);
+        /** Start the firmware, it will raise one event when it is ready. */
+        int (*start)(struct pru *pru);
+        void (*wait_event)(struct pru *pru);
+        void (*clear_event)(struct pru *pru);
+        void (*close)(struct pru *pru);
+};
+
+extern const struct pru_backend pru_backend_prussdrv;
+extern const struct pru_backend pru_backend_sim;
+
+// Set this to a flux dump (or dump prefix) to run against the simulator.
+#define PRU_SIM_ENV     "BB_FLOPPY_REPLAY"
+
 struct pru {
 	unsigned char * volatile ram;
 	unsigned char * volatile shared_ram;
         int running;
+        const struct pru_backend *backend;
+        void *backend_data;
 };
 
 void hexdump(const void *b, size_t len);
 
 struct pru * pru_setup(void);
+struct pru * pru_setup_backend(const struct pru_backend *backend);
 void stop_fw(struct pru * pru);
 void pru_exit(struct pru * pru);
 void pru_wait_event(struct pru * pru);
@@ -73,6 +101,52 @@ int pru_write_bit_timing(struct pru * pru, uint16_t *source,
 int pru_test_track_0(struct pru * pru);
 int pru_read_timing(struct pru * pru, uint32_t ** timing_data,
                 uint8_t revolutions, uint32_t ** rev_offsets);
-int pru_write_timing(struct pru * pru, uint16_t *source,
+
+/**
+ * Gets each block of samples from pru_read_timing_stream(), straight from
+ * PRU memory. Return non-zero to stop getting samples.
+ */
+typedef int (*pru_timing_consumer)(const uint32_t *samples, size_t count,
+                                                                void *ctx);
+int pru_read_timing_stream(struct pru * pru, uint8_t revolutions,
+                pru_timing_consumer consume, void *ctx, uint32_t *rev_offsets);
+int pru_read_timing_until(struct pru * pru, uint32_t ** timing_data,
+                uint8_t *revolutions, uint32_t ** rev_offsets,
+                pru_timing_consumer consume, void *ctx);
+int pru_write_timing(struct pru * pru, const uint16_t *source,
                                                 int sample_count);
+int pru_write_verify(struct pru * pru, const uint16_t *source,
+                int sample_count, uint8_t revolutions,
+                pru_timing_consumer consume, void *ctx,
+                uint32_t *rev_offsets, int *unwritten);
+
+/**
+ * One op for pru_run_queue(), the same as the command of that name.
+ * SET_HEAD_DIR, SET_HEAD_SIDE, STEP_HEAD or READ_TIMING.
+ */
+struct pru_queue_op {
+        uint8_t command;
+        uint16_t argument;
+        bool done;                      // Set by pru_run_queue()
+        uint32_t result;                // Samples, for READ_TIMING
+};
+
+/**
+ * Gets the samples of each READ_TIMING op in a queue.
+ */
+struct pru_queue_reader {
+        /** As pru_timing_consumer, for op <index>. */
+        int (*samples)(unsigned int index, const uint32_t *samples,
+                                                size_t count, void *ctx);
+        /**
+         * Op <index> is done. <rev_offsets> is the sample count at each
+         * index pulse, as from pru_read_timing_stream().
+         */
+        void (*done)(unsigned int index, const struct pru_queue_op *op,
+                                const uint32_t *rev_offsets, void *ctx);
+        void *ctx;
+};
+
+int pru_run_queue(struct pru * pru, struct pru_queue_op *ops,
+                unsigned int count, const struct pru_queue_reader *reader);
 #endif
@@ -0,0 +1,559 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arm-interface.h"
+#include "pru-setup.h"
+
+/*
+ * A stand-in for the PRU and the drive, so the host code can be run and
+ * benchmarked without a BeagleBone.
+ *
+ * The firmware side of the protocol is run from wait_event(). Every call
+ * advances the current command to its next interrupt, or to its ack.
+ * READ_TIMING, WRITE_TIMING and WRITE_VERIFY follow the firmware sample
+ * by sample, including the ping-pong over the two 0x1000 byte halves of
+ * shared ram, so the host sees the same sequence of events as from the
+ * real PRU.
+ * There are no delays, the disk spins as fast as the host can keep up.
+ *
+ * The flux comes from raw uint32_t timing dumps, as written by
+ * read_track_timing. PRU_SIM_ENV names either a single dump, used for
+ * every track, or a prefix where track N is read from <prefix>NNN.
+ * Tracks written with WRITE_TIMING are kept in memory and read back.
+ * Without a dump, the track reads as a stream of 2us cells.
+ */
+
+#define SIM_RAM_SIZE            0x2000
+#define SIM_SHARED_RAM_SIZE     0x3000
+#define SIM_CYLINDERS           84
+#define SIM_TRACKS              (SIM_CYLINDERS * TRACKS_PER_CYLINDER)
+// 200ms per revolution at 300rpm, in 10 nSec ticks.
+#define SIM_REV_TICKS           20000000
+#define SIM_BLANK_CELL          400
+
+struct sim_track {
+        uint32_t *samples;
+        size_t count;
+};
+
+struct pru_sim {
+        uint8_t *ram;
+        uint8_t *shared_ram;
+        const char *replay;
+
+        /* The drive */
+        int cylinder;
+        int head;
+        bool head_inc;
+        bool motor_on;
+
+        struct sim_track single;                // PRU_SIM_ENV is one dump
+        struct sim_track dumps[SIM_TRACKS];     // Loaded on first use
+        bool missing[SIM_TRACKS];               // No dump for this track
+        struct sim_track written[SIM_TRACKS];   // From WRITE_TIMING
+        bool erased[SIM_TRACKS];
+        struct sim_track blank;
+
+        /* The command in progress, 0 when waiting for a command */
+        uint8_t command;
+        bool write_done;                        // The write has stopped
+        uint16_t refills;                       // Raised by the write
+        bool done;
+        bool verifying;                         // WRITE_VERIFY is reading
+        unsigned int queue_op;                  // RUN_QUEUE, the current op
+        unsigned int queue_count;
+        bool queue_reading;
+        struct ARM_IF queue_if;                 // The registers for the op
+        const struct sim_track *flux;
+        size_t flux_pos;
+        uint64_t time;
+        uint64_t next_index;
+        uint32_t ram_offset;
+        uint32_t rev_ram_offset;
+        uint32_t sample_count;
+        uint8_t revolutions;
+        struct sim_track capture;
+};
+
+static int sim_read_file(const char *filename, struct sim_track *track)
+{
+        long size;
+        FILE *fp = fopen(filename, "rb");
+        if (!fp)
+                return -1;
+
+        fseek(fp, 0L, SEEK_END);
+        size = ftell(fp);
+        rewind(fp);
+
+        track->count = size > 0 ? size / sizeof(*track->samples) : 0;
+        if (!track->count)
+                goto failed;
+
+        track->samples = malloc(track->count * sizeof(*track->samples));
+        if (!track->samples)
+                goto failed;
+
+        track->count = fread(track->samples, sizeof(*track->samples),
+                                                        track->count, fp);
+        if (!track->count)
+                goto failed;
+
+        fclose(fp);
+        return 0;
+
+failed:
+        free(track->samples);
+        track->samples = NULL;
+        track->count = 0;
+        fclose(fp);
+        return -1;
+}
+
+static inline int sim_track_number(const struct pru_sim *sim)
+{
+        return sim->cylinder * TRACKS_PER_CYLINDER + sim->head;
+}
+
+static const struct sim_track *sim_get_track(struct pru_sim *sim)
+{
+        const int track = sim_track_number(sim);
+        char filename[512];
+
+        if (sim->written[track].count)
+                return &sim->written[track];
+        if (sim->erased[track])
+                return &sim->blank;
+        if (sim->single.count)
+                return &sim->single;
+        if (sim->dumps[track].count)
+                return &sim->dumps[track];
+        if (!sim->replay || sim->missing[track])
+                return &sim->blank;
+
+        snprintf(filename, sizeof(filename), "%s%03d", sim->replay, track);
+        if (sim_read_file(filename, &sim->dumps[track])) {
+                fprintf(stderr, "sim: no flux in %s, track is blank\n",
+                                                                filename);
+                sim->missing[track] = true;
+                return &sim->blank;
+        }
+
+        return &sim->dumps[track];
+}
+
+static void sim_store_track(struct pru_sim *sim, struct sim_track *track)
+{
+        const int n = sim_track_number(sim);
+
+        free(sim->written[n].samples);
+        sim->written[n] = *track;
+        sim->erased[n] = false;
+
+        track->samples = NULL;
+        track->count = 0;
+}
+
+/*
+ * fnRead_Timing: Start at the index, store each sample to shared ram and
+ * interrupt the host every 0x1000 bytes. The sample count at each index
+ * pulse goes to 0x2000 and up. PHASE_STOP ends the read off the boundary.
+ *
+ * Return true if we stopped for an interrupt, false when done.
+ */
+static bool sim_read_timing(struct pru_sim *sim, volatile struct ARM_IF *intf)
+{
+        const struct sim_track *flux = sim->flux;
+
+        while (!sim->done) {
+                const uint32_t timer = flux->samples[sim->flux_pos];
+                bool irq;
+
+                if (++sim->flux_pos == flux->count)
+                        sim->flux_pos = 0;
+
+                memcpy(sim->shared_ram + sim->ram_offset, &timer,
+                                                        sizeof(timer));
+                sim->ram_offset += sizeof(timer);
+                sim->sample_count++;
+                // A zero sample would keep the disk from spinning.
+                sim->time += timer ? timer : 1;
+
+                irq = !(sim->ram_offset & 0x0fff);
+                if ((sim->ram_offset >> 12) == 2)
+                        sim->ram_offset = 0;
+
+                if (!irq && intf->phase == PHASE_STOP)
+                        break;
+
+                if (sim->time >= sim->next_index) {
+                        // The index hole is fixed to the disk, so each
+                        // revolution starts over at the same flux.
+                        sim->flux_pos = 0;
+                        sim->next_index += SIM_REV_TICKS;
+                        memcpy(sim->shared_ram + sim->rev_ram_offset,
+                                &sim->sample_count, sizeof(sim->sample_count));
+                        sim->rev_ram_offset += sizeof(sim->sample_count);
+
+                        if (--sim->revolutions == 0)
+                                sim->done = true;
+                }
+
+                if (irq)
+                        return true;
+        }
+
+        intf->read_count = sim->sample_count;
+        return false;
+}
+
+/*
+ * fnWrite_Timing: Start at the index, and ask the host for more samples
+ * at every 0x1000 byte boundary, as long as there are at least 0x1000
+ * samples left. Stops at the next index, or when all samples are out.
+ *
+ * As the PRU, the write goes on through the half it has while the host
+ * refills the other, up to the next boundary. So the write can be over
+ * before the host sees the interrupt for the refill.
+ *
+ * Return true if we stopped for an interrupt, false when done.
+ */
+static bool sim_write_timing(struct pru_sim *sim, volatile struct ARM_IF *intf)
+{
+        bool irq = false;
+        uint16_t timer;
+
+        if (sim->write_done)
+                return false;
+
+        while (sim->sample_count) {
+                if (!(sim->ram_offset & 0x0fff)) {
+                        // The host has yet to fill the next half.
+                        if (irq)
+                                return true;
+                        if (sim->sample_count >= 0x1000) {
+                                irq = true;
+                                sim->refills++;
+                        }
+                }
+
+                if ((sim->ram_offset >> 12) == 2)
+                        sim->ram_offset = 0;
+
+                memcpy(&timer, sim->shared_ram + sim->ram_offset,
+                                                        sizeof(timer));
+                sim->ram_offset += sizeof(timer);
+
+                if (sim->time >= SIM_REV_TICKS)
+                        break;
+
+                sim->capture.samples[sim->capture.count++] = timer;
+                sim->time += timer;
+                sim->sample_count--;
+        }
+
+        intf->read_count = sim->sample_count;
+        intf->refills = sim->refills;
+        sim_store_track(sim, &sim->capture);
+        sim->write_done = true;
+        return irq;
+}
+
+static void sim_begin_read(struct pru_sim *sim, volatile struct ARM_IF *intf)
+{
+        sim->flux = sim_get_track(sim);
+        sim->flux_pos = 0;
+        sim->time = 0;
+        sim->next_index = SIM_REV_TICKS;
+        sim->ram_offset = 0;
+        sim->rev_ram_offset = 0x2000;
+        sim->sample_count = 0;
+        sim->revolutions = intf->argument < 64 ? intf->argument : 64;
+        sim->done = false;
+}
+
+/*
+ * WRITE_VERIFY: fnWrite_Timing, then fnRead_Timing. A write that stopped
+ * on the index is read back from there, one that ran out of samples
+ * first from the next index.
+ */
+static bool sim_write_verify(struct pru_sim *sim, volatile struct ARM_IF *intf)
+{
+        if (!sim->verifying) {
+                const bool irq = sim_write_timing(sim, intf);
+
+                if (!sim->write_done)
+                        return irq;
+
+                const uint64_t stopped = sim->time;
+
+                intf->phase = PHASE_VERIFY;
+                sim->verifying = true;
+                sim_begin_read(sim, intf);
+                // fnRead_Timing_Now: the track starts at the index, so
+                // the flux does too, only the time goes on.
+                if (intf->read_count)
+                        sim->time = stopped % SIM_REV_TICKS;
+                // The host still has the refill to take, in the new phase.
+                if (irq)
+                        return true;
+        }
+
+        return sim_read_timing(sim, intf);
+}
+
+static void sim_begin(struct pru_sim *sim, volatile struct ARM_IF *intf);
+
+/*
+ * RUN_QUEUE: Each op as its own command, but acked in place. Stops
+ * for the interrupts of a read, and after an op with QUEUE_OP_NOTIFY.
+ */
+static bool sim_run_queue(struct pru_sim *sim)
+{
+        volatile struct QUEUE_OP *ops =
+                        (volatile struct QUEUE_OP *)(sim->ram + QUEUE_OFFSET);
+        const uint8_t command = sim->command;
+
+        while (sim->queue_op < sim->queue_count) {
+                volatile struct QUEUE_OP *op = &ops[sim->queue_op];
+
+                if (!sim->queue_reading) {
+                        switch (op->command) {
+                        case COMMAND_SET_HEAD_DIR:
+                        case COMMAND_SET_HEAD_SIDE:
+                        case COMMAND_STEP_HEAD:
+                        case COMMAND_READ_TIMING:
+                                break;
+                        default:
+                                return false;
+                        }
+                        sim->queue_if.argument = op->argument;
+                        sim->queue_if.read_count = 0;
+                        sim->command = op->command;
+                        sim_begin(sim, &sim->queue_if);
+                        sim->command = command;
+                        sim->queue_reading = op->command == COMMAND_READ_TIMING;
+                }
+                if (sim->queue_reading) {
+                        if (sim_read_timing(sim, &sim->queue_if))
+                                return true;
+                        sim->queue_reading = false;
+                }
+
+                op->result = sim->queue_if.read_count;
+                op->command &= 0x7f;
+                sim->queue_op++;
+                if (op->flags & (1 << QUEUE_OP_NOTIFY))
+                        return true;
+        }
+
+        return false;
+}
+
+static void sim_begin(struct pru_sim *sim, volatile struct ARM_IF *intf)
+{
+        switch (sim->command) {
+        case COMMAND_QUIT:
+                break;
+        case COMMAND_START_MOTOR:
+                sim->motor_on = true;
+                break;
+        case COMMAND_STOP_MOTOR:
+                sim->motor_on = false;
+                break;
+        case COMMAND_SET_HEAD_DIR:
+                sim->head_inc = intf->argument == 1;
+                break;
+        case COMMAND_SET_HEAD_SIDE:
+                sim->head = intf->argument == 1 ? 0 : 1;
+                break;
+        case COMMAND_STEP_HEAD:
+                sim->cylinder += sim->head_inc ? intf->argument
+                                               : -intf->argument;
+                if (sim->cylinder < 0)
+                        sim->cylinder = 0;
+                if (sim->cylinder >= SIM_CYLINDERS)
+                        sim->cylinder = SIM_CYLINDERS - 1;
+                break;
+        case COMMAND_RESET_DRIVE:
+                sim->cylinder = 0;
+                break;
+        case COMMAND_TEST_TRACK_0:
+                intf->argument = sim->cylinder == 0 ? 1 : 0;
+                break;
+        case COMMAND_ERASE_TRACK:
+                free(sim->written[sim_track_number(sim)].samples);
+                sim->written[sim_track_number(sim)].samples = NULL;
+                sim->written[sim_track_number(sim)].count = 0;
+                sim->erased[sim_track_number(sim)] = true;
+                break;
+        case COMMAND_READ_TIMING:
+                if (!sim->motor_on)
+                        fprintf(stderr, "sim: read with motor off\n");
+                sim_begin_read(sim, intf);
+                break;
+        case COMMAND_RUN_QUEUE:
+                sim->queue_op = 0;
+                sim->queue_count = intf->argument < QUEUE_MAX_OPS
+                                        ? intf->argument : QUEUE_MAX_OPS;
+                sim->queue_reading = false;
+                break;
+        case COMMAND_WRITE_VERIFY:
+                sim->verifying = false;
+                /* fall through */
+        case COMMAND_WRITE_TIMING:
+                if (!sim->motor_on)
+                        fprintf(stderr, "sim: write with motor off\n");
+                sim->sample_count = intf->read_count;
+                sim->time = 0;
+                sim->ram_offset = 0;
+                sim->write_done = false;
+                sim->refills = 0;
+                sim->capture.count = 0;
+                sim->capture.samples = malloc(sim->sample_count
+                                        * sizeof(*sim->capture.samples));
+                if (!sim->capture.samples) {
+                        fprintf(stderr, "sim: no memory for written track\n");
+                        sim->sample_count = 0;
+                }
+                break;
+        default:
+                fprintf(stderr, "sim: command 0x%02x is not simulated\n",
+                                                                sim->command);
+                break;
+        }
+}
+
+static void sim_wait_event(struct pru * pru)
+{
+        struct pru_sim *sim = pru->backend_data;
+        volatile struct ARM_IF *intf = (volatile struct ARM_IF *)sim->ram;
+
+        if (!sim->command) {
+                // Nothing pending, this is the event from firmware start up.
+                if (!(intf->command & 0x80))
+                        return;
+
+                sim->command = intf->command;
+                sim_begin(sim, intf);
+        } else if (intf->command == COMMAND_QUIT) {
+                // Same as M_CHECK_ABORT in the firmware
+                free(sim->capture.samples);
+                sim->capture.samples = NULL;
+                sim->command = COMMAND_QUIT;
+        }
+
+        switch (sim->command) {
+        case COMMAND_READ_TIMING:
+                if (sim_read_timing(sim, intf))
+                        return;
+                break;
+        case COMMAND_WRITE_TIMING:
+                if (sim_write_timing(sim, intf))
+                        return;
+                break;
+        case COMMAND_WRITE_VERIFY:
+                if (sim_write_verify(sim, intf))
+                        return;
+                break;
+        case COMMAND_RUN_QUEUE:
+                if (sim_run_queue(sim))
+                        return;
+                break;
+        default:
+                break;
+        }
+
+        // SEND_ACK
+        intf->command = sim->command & 0x7f;
+        sim->command = 0;
+}
+
+static void sim_clear_event(struct pru * pru)
+{
+}
+
+static int sim_open(struct pru * pru)
+{
+        struct pru_sim *sim;
+        size_t i;
+
+        sim = calloc(1, sizeof(*sim));
+        if (!sim)
+                return -1;
+
+        sim->ram = calloc(SIM_RAM_SIZE, 1);
+        sim->shared_ram = calloc(SIM_SHARED_RAM_SIZE, 1);
+        sim->blank.count = SIM_REV_TICKS / SIM_BLANK_CELL;
+        sim->blank.samples = malloc(sim->blank.count
+                                        * sizeof(*sim->blank.samples));
+        if (!sim->ram || !sim->shared_ram || !sim->blank.samples) {
+                free(sim->ram);
+                free(sim->shared_ram);
+                free(sim->blank.samples);
+                free(sim);
+                return -1;
+        }
+        for (i = 0; i < sim->blank.count; i++)
+                sim->blank.samples[i] = SIM_BLANK_CELL;
+
+        sim->replay = getenv(PRU_SIM_ENV);
+        if (sim->replay && !*sim->replay)
+                sim->replay = NULL;
+
+        // A file by that name is used for all tracks, else it is a prefix.
+        if (sim->replay && !sim_read_file(sim->replay, &sim->single))
+                printf("Simulated PRU, replaying %s on all tracks\n",
+                                                                sim->replay);
+        else if (sim->replay)
+                printf("Simulated PRU, replaying %sNNN\n", sim->replay);
+        else
+                printf("Simulated PRU, blank disk\n");
+
+        pru->ram = sim->ram;
+        pru->shared_ram = sim->shared_ram;
+        pru->backend_data = sim;
+
+        return 0;
+}
+
+static int sim_start(struct pru * pru)
+{
+        struct pru_sim *sim = pru->backend_data;
+
+        // Power on, the head is parked at cylinder 0.
+        sim->cylinder = 0;
+        sim->head = 0;
+        sim->command = 0;
+
+        return 0;
+}
+
+static void sim_close(struct pru * pru)
+{
+        struct pru_sim *sim = pru->backend_data;
+        int i;
+
+        for (i = 0; i < SIM_TRACKS; i++) {
+                free(sim->dumps[i].samples);
+                free(sim->written[i].samples);
+        }
+        free(sim->capture.samples);
+        free(sim->single.samples);
+        free(sim->blank.samples);
+        free(sim->shared_ram);
+        free(sim->ram);
+        free(sim);
+        pru->backend_data = NULL;
+}
+
+const struct pru_backend pru_backend_sim = {
+        .name           = "sim",
+        .open           = sim_open,
+        .start          = sim_start,
+        .wait_event     = sim_wait_event,
+        .clear_event    = sim_clear_event,
+        .close          = sim_close,
+};
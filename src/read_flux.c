@@ -10,36 +10,60 @@
 #include <unistd.h>
 
 #include "pru-setup.h"
+#include "capture_pipeline.h"
+#include "track_schedule.h"
 #include "flux_data.h"
 #include "read_flux.h"
 #include "read_flux_opts.h"
 #include "mfm_utils/mfm_utils.h"
+#include "mfm_utils/mfm_pll.h"
+#include "mfm_utils/amiga_decode.h"
 #include "caps_parser/caps_parser.h"
 
 void hexdump(const void *b, size_t len);
 extern struct pru * pru;
 
-struct sector_samples {
-        uint32_t *samples; // Pointer to first sample of sync marker (0x4489)
-        int samples_count;
-        int sector_number;
-};
-struct track_samples {
-        uint32_t *samples; // Raw sample data, heap allocated
-        int sample_count;
-        struct sector_samples sectors[11];
-};
-
-static bool find_sync_marker(struct track_samples *track, size_t *index);
-static uint8_t __attribute__((__unused__)) * samples_to_bitsream(
-                struct track_samples *track, size_t index, size_t *byte_count);
-static size_t timing_sample_to_bitstream(uint32_t * restrict samples, size_t samples_count,
-                                        uint8_t * restrict bitstream, size_t bitstream_size);
+// Return sweeps over the tracks with bad sectors.
+#define READ_RETRIES    2
+// More revolutions to read, when a sector is bad in the first one.
+#define READ_FUSION_REVOLUTIONS 4
+
+/**
+ * Runs while the PRU fills the other half of its buffer,
+ * so we only decode here, and draw when the track is done.
+ */
+static int read_flux_consume(const uint32_t *samples, size_t count, void *ctx)
+{
+        struct mfm_stream *stream = ctx;
+
+        mfm_stream_feed(stream, samples, count);
+
+        // Stop when we have all the sectors, the rest is just gap.
+        return stream->sector_count == AMIGA_SECTORS_PER_TRACK;
+}
+
+/**
+ * Read more revolutions of the track, and take each sector from the
+ * first revolution it is good in.
+ */
+static void read_flux_fuse(struct amiga_fusion *fusion, struct mfm_pll *pll)
+{
+        uint32_t *samples, *index_offsets;
+
+        int count = pru_read_timing(pru, &samples, READ_FUSION_REVOLUTIONS,
+                                                        &index_offsets);
+        if (!count) {
+                return;
+        }
+        amiga_fusion_add(fusion, samples, count, index_offsets,
+                                        READ_FUSION_REVOLUTIONS, pll);
+        free(samples);
+        free(index_offsets);
+}
 
 int read_flux(int argc, char ** argv)
 {
         uint8_t revolutions = 1;
-        uint32_t *index_offsets;
 
         int rc = 0;
         struct read_flux_opts opts = {0};
@@ -64,6 +88,20 @@ int read_flux(int argc, char ** argv)
 
         }
 
+        struct track_schedule schedule;
+        track_schedule_init(&schedule, READ_RETRIES);
+        if (track_schedule_parse(&schedule, opts.tracks)) {
+                rc = -1;
+                goto mfm_sector_bitstream_failed;
+        }
+
+        // The IPF tracks are compared with each track read, decode them all now.
+        if (caps_parser_decode_all(parser, 0) < 0) {
+                rc = -1;
+                fprintf(stderr, "Could not decode disk image\n");
+                goto mfm_sector_bitstream_failed;
+        }
+
         /**
          * This buffer is used to store all the databytes of the mfm track.
          */
@@ -74,6 +112,13 @@ int read_flux(int argc, char ** argv)
                 goto mfm_sector_bitstream_failed;
         }
 
+        struct amiga_fusion *fusion = malloc(sizeof(*fusion));
+        if (!fusion) {
+                rc = -1;
+                fprintf(stderr, "Could not allocate fusion buffer!\n");
+                goto fusion_failed;
+        }
+
         initscr();
         start_color();
         raw();
@@ -107,17 +152,19 @@ int read_flux(int argc, char ** argv)
         wrefresh(status_bar);
 
 
+        struct capture_source source;
+        capture_source_pru_init(&source, pru);
+
         pru_start_motor(pru);
         pru_reset_drive(pru);
 
         nodelay(log_window, TRUE);
         bool quit_set = false;
 
-        pru_set_head_dir(pru, PRU_HEAD_INC);
-
-        struct track_samples track = {0};
+        track_schedule_plan(&schedule, 0);
 
-        for (unsigned int i = 0; i < 80 * 2; i++) {
+        unsigned int i;
+        while (track_schedule_next(&schedule, &i)) {
                 int c = wgetch(log_window);
                 switch (c) {
                 case 'q':
@@ -128,7 +175,7 @@ int read_flux(int argc, char ** argv)
                 default:
                         break;
                 }
-                pru_set_head_side(pru, i & 1 ? PRU_HEAD_LOWER : PRU_HEAD_UPPER);
+                source.seek(&source, i >> 1, i & 1);
 
                 werase(status_bar);
                 mvwprintw(status_bar, 0, 10, "Read track: %d, head: %d", i >> 1, i & 1);
@@ -141,122 +188,107 @@ int read_flux(int argc, char ** argv)
                 // Clear the buffer to hold a new track.
                 memset(disk_track_mfm_bitstream, 0xaa, 1088 * 11);
                 /**
-                 * The call to pru_read_timing will allocate a buffer for samples.
-                 * Our track.samples variable will point to this buffer.
-                 * We own this buffer after this call!
-                 * The samples are count * 10 nSecs per flux transition
+                 * The sectors are decoded while the PRU reads the track,
+                 * one block of samples at a time, so they are ready
+                 * as soon as the index pulse ends the read.
+                 * Each sector found is stored in disk_track_mfm_bitstream
+                 * as 1088 bytes: aa aa aa aa 44 89 44 89 + 1080 bytes.
+                 * The first 56 bytes after the sync is the amiga sector
+                 * header, whis can be decoded into 28 regular bytes.
+                 * And the last 1024 bytes will be mfm decoded into 512 bytes
+                 * of data.
                  */
-                track.sample_count = pru_read_timing(pru, &track.samples, revolutions, &index_offsets);
-                size_t index = 0;
-                struct amiga_sector sector;
-
-                for (unsigned int sect = 0; sect < 11; ++sect) {
-                        wprintw(log_window, "------------ Look for sector sync %d ----------------\n", sect);
-                        wrefresh(log_window);
-
-                        /**
-                         * Each mfm sector takes 1088 bytes.
-                         * After stripping the 8 header bytes (aa aa aa aa 44 89 44 89),
-                         * we are left with 1080 bytes.
-                         * The first 56 bytes is the amiga sector header, whis can
-                         * be decoded into 28 regular bytes.
-                         * And the last 1024 bytes will be mfm decoded into 512 bytes
-                         * of data.
-                         */
-                        uint8_t *mfm_bitstream_ptr = disk_track_mfm_bitstream + (1088 * sect);
-
-                        /**
-                         * our timing_sample_to_bitstream(..) function starts by writing
-                         * the sync bytes (44 89 44 89).
-                         * So we skip four bytes ahead to where the sync bytes will be written.
-                         */
-                        mfm_bitstream_ptr += 4;
-
-                        if ( find_sync_marker(&track, &index) ) {
-                                wprintw(log_window, "sync found @ index: %u\n", index);
-
-                                size_t consumed = timing_sample_to_bitstream(
-                                                track.samples + index,
-                                                track.sample_count - index,
-                                                mfm_bitstream_ptr, 1084);
-                                wprintw(log_window, "mfm sector used %u samples\n", consumed);
-                                wrefresh(log_window);
-
-                                int rc = parse_amiga_mfm_sector(mfm_bitstream_ptr, 1084, &sector, NULL /* Don't keep sector data */);
-                                if (rc == 0) {
-                                        const uint8_t track_info = (be32toh(sector.header_info) >> 16) & 0xff;
-                                        const uint8_t sector_no = (be32toh(sector.header_info) >> 8) & 0xff;
-                                        //const uint8_t sector_to_gap = be32toh(sector.header_info) & 0xff;
-                                        //wprintw(w, "-- [I] Track: %d - head: %d\n", track_info >> 1, track_info & 1);
-                                        uint8_t sector_status = 0;
-                                        if (!sector.data_checksum_ok) {
-                                                sector_status |= 2;
-                                        }
-                                        if (!sector.header_checksum_ok) {
-                                                sector_status |= 1;
-                                        }
-                                        int color = COLOR_PAIR(2); // Green
-                                        switch(sector_status) {
-                                        case 1:
-                                                // Header bad
-                                                color = COLOR_PAIR(3); // Cyan
-                                                break;
-                                        case 2:
-                                                // Data bad
-                                                color = COLOR_PAIR(4); // Yellow
-                                                break;
-                                        case 3:
-                                                // Both bad
-                                                color = COLOR_PAIR(5); // Red
-                                                break;
-                                        default:
-                                                break;
-                                        }
+                struct mfm_stream stream;
+                mfm_stream_init(&stream, disk_track_mfm_bitstream);
+
+                const struct mfm_pll_opts pll_opts = MFM_PLL_OPTS_DEFAULT;
+                struct mfm_pll pll;
+                if (opts.pll) {
+                        mfm_pll_init(&pll, &pll_opts);
+                        stream.pll = &pll;
+                }
+                pru_read_timing_stream(pru, revolutions, read_flux_consume,
+                                                        &stream, NULL);
+                mfm_stream_finish(&stream);
 
-                                        (void) track_info;
-
-                                        mvwaddch(sector_window,
-                                                 1 + sect + ((i & 1) ? 15 : 0),  /* ROW */
-                                                 1 + ((i >> 1) * 2), /* COL */
-                                                ' ' | color);
-
-                                        if (sector_no < 16) {
-                                                const int ch = sector_no < 9
-                                                             ? '1' + sector_no
-                                                             : 'a' + (sector_no - 9);
-                                                mvwaddch(sector_window,
-                                                         1 + sect + ((i & 1) ? 15 : 0),  /* ROW */
-                                                         1 + ((i >> 1) * 2 + 1), /* COL */
-                                                         ch | color);
-                                        }
+                for (unsigned int sect = 0; sect < stream.sector_count; ++sect) {
+                        wprintw(log_window, "sync found @ index: %zu\n",
+                                        stream.sectors[sect].sample_index);
+                }
 
-                                        wrefresh(sector_window);
+                struct amiga_track track;
+                amiga_track_from_stream(&stream, &track);
+                amiga_fusion_init(fusion);
+                amiga_fusion_merge(fusion, &track);
+                if (fusion->track.good < AMIGA_SECTORS_PER_TRACK) {
+                        read_flux_fuse(fusion, stream.pll);
+                        wprintw(log_window, "Fused %u revolutions\n",
+                                                fusion->revolutions);
+                }
 
-                                }
+                // One row per sector number, in the order they are on the disk.
+                track = fusion->track;
 
-                                /**
-                                 * Move the index pointer, so we don't find the same
-                                 * sector sync marker on next iteration.
-                                 */
-                                index += 10;
-                        } else {
-                                //fprintf(stderr, "\t\tNo sync markers found in track %d - skipping\n", i);
+                for (unsigned int sector_no = 0; sector_no < AMIGA_SECTORS_PER_TRACK; ++sector_no) {
+                        const struct amiga_track_sector *s = &track.sectors[sector_no];
+                        if (!s->found) {
+                                continue;
+                        }
+
+                        uint8_t sector_status = 0;
+                        if (!s->sector.data_checksum_ok) {
+                                sector_status |= 2;
+                        }
+                        if (!s->sector.header_checksum_ok) {
+                                sector_status |= 1;
+                        }
+                        int color = COLOR_PAIR(2); // Green
+                        switch(sector_status) {
+                        case 1:
+                                // Header bad
+                                color = COLOR_PAIR(3); // Cyan
+                                break;
+                        case 2:
+                                // Data bad
+                                color = COLOR_PAIR(4); // Yellow
+                                break;
+                        case 3:
+                                // Both bad
+                                color = COLOR_PAIR(5); // Red
+                                break;
+                        default:
                                 break;
                         }
-                        wprintw(log_window, "Sector %d done!\n", sect);
-                        wrefresh(log_window);
+
+                        const int ch = sector_no < 9
+                                     ? '1' + sector_no
+                                     : 'a' + (sector_no - 9);
+                        mvwaddch(sector_window,
+                                 1 + sector_no + ((i & 1) ? 15 : 0),  /* ROW */
+                                 1 + ((i >> 1) * 2), /* COL */
+                                ' ' | color);
+                        mvwaddch(sector_window,
+                                 1 + sector_no + ((i & 1) ? 15 : 0),  /* ROW */
+                                 1 + ((i >> 1) * 2 + 1), /* COL */
+                                 ch | color);
+                }
+                wrefresh(sector_window);
+
+                wprintw(log_window, "Sectors: %u found, %u good\n",
+                                                track.found, track.good);
+                wrefresh(log_window);
+                if (track.good < AMIGA_SECTORS_PER_TRACK) {
+                        track_schedule_retry(&schedule, i);
                 }
 
                 wprintw(log_window, " ---------------- Track Done ---------------------\n");
                 wrefresh(log_window);
 
                 /** Check equality with CAPS Image **/
-                const struct CapsImage * track_data = NULL;
-                bool ret = caps_parser_get_caps_image_for_track_and_head(parser, &track_data, i >> 1, i & 1);
-                if (ret) {
-                        //caps_parser_print_caps_image(track_data);
-                        uint8_t *bitstream = caps_parser_get_bitstream_for_track(parser, track_data);
-
+                uint32_t track_bits;
+                const uint8_t *bitstream = caps_parser_get_track(parser,
+                                                i >> 1, i & 1, &track_bits);
+                if (bitstream && track_bits >= 1088 * 8) {
                         /*
                         FILE *disk_fp = fopen("disk_dump.bin", "w+");
                         FILE *ipf_fp = fopen("ipf_dump.bin", "w+");
@@ -294,20 +326,6 @@ int read_flux(int argc, char ** argv)
                                  1 + ((i >> 1) * 2), /* COL */
                                 ' ' | color);
                         wrefresh(sector_window);
-
-                        free(bitstream);
-                }
-
-                free(track.samples);
-                // Track data is invalid now!
-                memset(&track, 0x00, sizeof(track));
-
-                free(index_offsets);
-
-                if (i % 2) {
-                        pru_step_head(pru, 1);
-                        wprintw(log_window, "Step head!");
-                        wrefresh(log_window);
                 }
         }
 
@@ -387,6 +405,9 @@ stop_read:
         //hexdump(disk_track_mfm_bitstream, 32);
 
 #endif
+        free(fusion);
+
+fusion_failed:
         free(disk_track_mfm_bitstream);
 
 mfm_sector_bitstream_failed:
@@ -399,207 +420,3 @@ fopen_failed:
 
         return rc;
 }
-
-/**
- * @brief       Convert an array of timing values to an array of raw data
- *
- * @detail      struct track_samples contain all samples (timing data) read from
- *              a single track. We use index as a pointer to a specific sample to start
- *              converting to bitstream, based on a 2us bit cell size.
- *
- * @deprecated  Use timing_sample_to_bitstream instead!
- */
-static uint8_t *samples_to_bitsream(struct track_samples *track, size_t index, size_t *_byte_count)
-{
-        *_byte_count = 0; // return paramater.
-
-        // Maximum bits per sample is 4.
-        const int bit_count = (track->sample_count - index) * 4;
-        const int byte_count = 1 + (bit_count / 8);
-        uint8_t *bitstream = malloc(byte_count);
-        if (!bitstream) {
-                fprintf(stderr, "%s: malloc failed!\n", __func__);
-                return NULL;
-        }
-        memset(bitstream, 0x00, byte_count);
-
-        //printf("Timing to bitstream, allocated %d bytes for %d bits\n", byte_count, bit_count);
-
-        /**
-         * We start at bit -2 as this is what the bitstream will look like from
-         * the index we found for sync:
-         *
-         *     |~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~|
-         *    01010001001000100101000100100010010
-         *     |~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~|
-         *
-         * While the actual sync mark are the bits in the box.
-         *
-         *   xx|01000100100010010100010010001001|x
-         *
-         * Without the -2 here, the data will be offset by one bit.
-         *
-         * TODO:
-         * Investigate if we can set `bit` to 0 and just change
-         * the index we return from find_sync_marker(...)
-         *
-         */
-        unsigned int bit = -2; // See Note ^^^
-        for (int i = index; i < track->sample_count; i++) {
-                if (track->samples[i] > 700) {
-                        bit += 4;
-                } else if (track->samples[i] > 500) {
-                        bit += 3;
-                } else {
-                        bit += 2;
-                }
-                bitstream[bit / 8] |= (1 << (7 - (bit % 8)));
-        }
-
-        //hexdump(bitstream, 512);
-        //printf("Timing to bitstream, conversion done for %d bits\n", bit);
-        *_byte_count = byte_count;
-        return bitstream;
-}
-
-/**
- * @detail      Parse `samples_count` flux timing data into a bitstream, based on
- *              a hardcoded bitcell time of 2 microseconds.
- *              The bitsrem is written into the given `bitstream` pointer until
- *              either we are out of samples to read or the bitstream buffer is full.
- */
-static size_t timing_sample_to_bitstream(uint32_t * restrict samples, size_t samples_count,
-                                        uint8_t * restrict bitstream, size_t bitstream_size)
-{
-        // clear bitstream..
-        memset(bitstream, 0x00, bitstream_size);
-        /**
-         * We start at bit -2 as this is what the bitstream will look like from
-         * the index we found for sync:
-         *
-         *     |~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~|
-         *    01010001001000100101000100100010010
-         *     |~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~|
-         *
-         * While the actual sync mark are the bits in the box.
-         *
-         *   xx|01000100100010010100010010001001|x
-         *
-         * Without the -2 here, the data will be offset by one bit.
-         *
-         * TODO:
-         * Investigate if we can set `bit` to 0 and just change
-         * the index we return from find_sync_marker(...)
-         *
-         */
-        unsigned int bit = -2; // See Note ^^^
-        size_t i = 0;
-        for (; i < samples_count; i++) {
-                if (samples[i] > 700) {
-                        bit += 4;
-                } else if (samples[i] > 500) {
-                        bit += 3;
-                } else {
-                        bit += 2;
-                }
-                const int byte_no = bit >> 3;  // Div. 8
-                const int bit_no = bit & 0x07; // Mod. 8
-                if (byte_no >= bitstream_size) {
-                        // Bitstream full.
-                        return i + 1;
-                }
-                bitstream[byte_no] |= (1 << (7 - (bit_no)));
-        }
-
-        return i;
-}
-
-/**
- * @brief       Find sync markers (0x4489) in the timing sample data
- *              Setup the pointers to for the 11 sectors in the track struct.
- *              The pointers will point to the first sample of the sync marker
- *              in the sector.
- */
-static bool find_sync_marker(struct track_samples *track, size_t *index)
-{
-        /**
-         * A the most bits between flux transitions is 4
-         * There are only three valid flux values:
-         *
-         *      01      This is 4 micro-seconds
-         *      001     This is 6 micro-seconds
-         *      0001    This is 8 micro-seconds.
-         */
-        enum sample_type { UNDEF, MS4, MS6, MS8 };
-
-        /**
-         * This is the series of flux transion timing data
-         * we are looking for.
-         * The following is the timing values to
-         * encode 0x44894489 as MFM data timing.
-         */
-	// TODO: I'd assume the first sample should be MS6 instead of MS4
-	//       as 0xaa is preceeding the sync marker so the preceding bits were 0b10
-        static const enum sample_type sync[10] = {
-                MS4, MS8, MS6, MS8, MS6, // 0x4489
-                MS4, MS8, MS6, MS8, MS6  // 0x4489
-        };
-
-        /**
-         * In this loop, we maintain the 10 latest
-         * flux timing values in a ring buffer,
-         * and compare it against the sync buffer
-         * to see if they match.
-         */
-        enum sample_type ring_buffer[10] = {UNDEF};
-
-        /*
-         * Multiply count with 10 to get nSec
-         * Divide by 100 to get μSec
-         */
-
-        //int sector = 0;
-
-        for (int i = *index; i < track->sample_count; i++) {
-                if (track->samples[i] > 700) {
-                        ring_buffer[i % 10] = MS8;
-                } else if (track->samples[i] > 500) {
-                        ring_buffer[i % 10] = MS6;
-                } else {
-                        ring_buffer[i % 10] = MS4;
-                }
-
-                int r_index = (i - 10);
-                // Wait until the ringbuffer is full before we start comparing.
-                if (r_index < 0) continue;
-
-                bool found = true;
-                for (int e = 0; e < 10; e++) {
-                        if (sync[e] != ring_buffer[(r_index + e) % 10]) {
-                                found = false;
-                                break;
-                        }
-                }
-                if (found) {
-                        *index = i - 10;
-                        return true;
-                        /*
-                        if (sector >= 11) {
-                                // Current implementation only expects 11 sectors!
-                                fprintf(stderr,
-                                "%s: Error, found sector marker for sector: %d\n",
-                                                        __func__, sector + 1);
-                        } else {
-                                // Setup pointers to start of sector in the track struct.
-                                track->sectors[sector].samples =
-                                                        &track->samples[i - 10];
-                                printf(
-                                "Sync for sector %d found at sample inndex: %d\n",
-                                                                sector + 1, i);
-                        }
-                        sector++;
-                        */
-                }
-        }
-        return false;
-}
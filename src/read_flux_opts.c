@@ -6,18 +6,29 @@
 
 void read_flux_opts_print_usage(char * const argv[])
 {
-        printf("usage: %s <IPF-FILE>\n", argv[0]);
+        printf("usage: %s [-p] [-T <tracks>] <IPF-FILE>\n", argv[0]);
+        printf("\t-p\tFollow the drive speed with a PLL, "
+                                        "instead of fixed 2us bitcells\n");
+        printf("\t-T\tCylinders to read, i.e. 0-9,40:1\n");
 }
 
 bool read_flux_opts_parse(struct read_flux_opts *opts, int argc, char * const argv[])
 {
         opts->filename = NULL;
+        opts->pll = false;
+        opts->tracks = "0-79";
 
         do {
-                switch(getopt(argc, argv, "-:it:h:")) {
+                switch(getopt(argc, argv, "-:it:h:pT:")) {
                 case 1:
                         opts->filename = optarg;
                         break;
+                case 'p':
+                        opts->pll = true;
+                        break;
+                case 'T':
+                        opts->tracks = optarg;
+                        break;
                 case '?':
                         fprintf(stderr, "Unknown argument: -%c\n", optopt);
                         return false;
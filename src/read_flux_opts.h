@@ -5,6 +5,8 @@
 
 struct read_flux_opts {
         const char *filename;
+        bool pll;       // Decode with mfm_pll, not the fixed 2us cells
+        const char *tracks;     // Track list for track_schedule_parse()
 };
 
 void read_flux_opts_print_usage(char * const argv[]);
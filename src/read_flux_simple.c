@@ -4,6 +4,9 @@
 #include "flux_data.h"
 #include "read_flux_opts.h"
 #include "mfm_utils/mfm_utils.h"
+#include "mfm_utils/mfm_sync.h"
+#include "mfm_utils/mfm_bitstream.h"
+#include "mfm_utils/mfm_pll.h"
 #include "caps_parser/caps_parser.h"
 
 #include <assert.h>
@@ -30,11 +33,8 @@ struct track_samples {
         struct sector_samples sectors[11];
 };
 
-static bool find_sync_marker(struct track_samples *track, size_t *index);
 static uint8_t __attribute__((__unused__)) * samples_to_bitsream(
                 struct track_samples *track, size_t index, size_t *byte_count);
-static size_t timing_sample_to_bitstream(const uint32_t * restrict samples, size_t samples_count,
-                                        uint8_t * restrict bitstream, size_t bitstream_size);
 
 int read_flux_simple(int argc, char ** argv)
 {
@@ -98,23 +98,46 @@ int read_flux_simple(int argc, char ** argv)
         size_t index = 0;
         struct amiga_sector sector;
 
+        const struct mfm_sync_pattern amiga_sync = MFM_SYNC_AMIGA;
+        struct mfm_sync_search sync_search;
+        struct mfm_sync_hit sync_hit;
+        mfm_sync_search_init(&sync_search, &amiga_sync, 1);
+
         uint8_t *mfm_bitstream_ptr = disk_track_mfm_bitstream;
 
         /**
-         * our timing_sample_to_bitstream(..) function starts by writing
+         * our mfm_flux_to_bitstream(..) function starts by writing
          * the sync bytes (44 89 44 89).
          * So we skip four bytes ahead to where the sync bytes will be written.
          */
         mfm_bitstream_ptr += 4;
 
-        if ( find_sync_marker(&track, &index) ) {
-                printf("sync found @ index: %u\n", index);
-
-                size_t consumed = timing_sample_to_bitstream(
-                                track.samples + index,
-                                track.sample_count - index,
-                                mfm_bitstream_ptr, (1088 * 11) - 4);
-                printf("mfm sector used %u samples\n", consumed);
+        if ( mfm_sync_find_all(&sync_search, track.samples, track.sample_count,
+                                                        &sync_hit, 1) ) {
+                index = sync_hit.sample;
+                printf("sync found @ index: %zu\n", index);
+
+                size_t consumed;
+                if (opts.pll) {
+                        // Start the PLL at the speed of this revolution.
+                        struct mfm_pll_opts pll_opts = MFM_PLL_OPTS_DEFAULT;
+                        struct mfm_pll pll;
+                        pll_opts.cell = mfm_pll_estimate_cell(track.samples,
+                                                        track.sample_count);
+                        printf("bitcell: %.3f us\n", pll_opts.cell /
+                                        (100.0 * (1 << MFM_PLL_FRAC_BITS)));
+                        mfm_pll_init(&pll, &pll_opts);
+                        consumed = mfm_pll_to_bitstream(&pll,
+                                        track.samples + index,
+                                        track.sample_count - index,
+                                        mfm_bitstream_ptr, (1088 * 11) - 4);
+                } else {
+                        consumed = mfm_flux_to_bitstream(
+                                        track.samples + index,
+                                        track.sample_count - index,
+                                        mfm_bitstream_ptr, (1088 * 11) - 4);
+                }
+                printf("mfm sector used %zu samples\n", consumed);
 
                 int rc = parse_amiga_mfm_sector(mfm_bitstream_ptr, 1084, &sector, NULL /* Don't keep sector data */);
                 if (rc == 0) {
@@ -182,7 +205,7 @@ fopen_failed:
  *              a single track. We use index as a pointer to a specific sample to start
  *              converting to bitstream, based on a 2us bit cell size.
  *
- * @deprecated  Use timing_sample_to_bitstream instead!
+ * @deprecated  Use mfm_flux_to_bitstream instead!
  */
 static uint8_t *samples_to_bitsream(struct track_samples *track, size_t index, size_t *_byte_count)
 {
@@ -236,147 +259,3 @@ static uint8_t *samples_to_bitsream(struct track_samples *track, size_t index, s
         *_byte_count = byte_count;
         return bitstream;
 }
-
-/**
- * @detail      Parse `samples_count` flux timing data into a bitstream, based on
- *              a hardcoded bitcell time of 2 microseconds.
- *              The bitsrem is written into the given `bitstream` pointer until
- *              either we are out of samples to read or the bitstream buffer is full.
- */
-static size_t timing_sample_to_bitstream(const uint32_t * restrict samples, size_t samples_count,
-                                        uint8_t * restrict bitstream, size_t bitstream_size)
-{
-        // clear bitstream..
-        memset(bitstream, 0x00, bitstream_size);
-        /**
-         * We start at bit -2 as this is what the bitstream will look like from
-         * the index we found for sync:
-         *
-         *     |~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~|
-         *    01010001001000100101000100100010010
-         *     |~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~|
-         *
-         * While the actual sync mark are the bits in the box.
-         *
-         *   xx|01000100100010010100010010001001|x
-         *
-         * Without the -2 here, the data will be offset by one bit.
-         *
-         * TODO:
-         * Investigate if we can set `bit` to 0 and just change
-         * the index we return from find_sync_marker(...)
-         *
-         */
-        unsigned int bit = -2; // See Note ^^^
-        size_t i = 0;
-        for (; i < samples_count; i++) {
-                if (samples[i] > 700) {
-                        bit += 4;
-                } else if (samples[i] > 500) {
-                        bit += 3;
-                } else {
-                        bit += 2;
-                }
-                const int byte_no = bit >> 3;  // Div. 8
-                const int bit_no = bit & 0x07; // Mod. 8
-                if (byte_no >= bitstream_size) {
-                        // Bitstream full.
-                        return i + 1;
-                }
-                bitstream[byte_no] |= (1 << (7 - (bit_no)));
-        }
-
-        return i;
-}
-
-/**
- * @brief       Find sync markers (0x4489) in the timing sample data
- *              Setup the pointers to for the 11 sectors in the track struct.
- *              The pointers will point to the first sample of the sync marker
- *              in the sector.
- */
-static bool find_sync_marker(struct track_samples *track, size_t *index)
-{
-        /**
-         * A the most bits between flux transitions is 4
-         * There are only three valid flux values:
-         *
-         *      01      This is 4 micro-seconds
-         *      001     This is 6 micro-seconds
-         *      0001    This is 8 micro-seconds.
-         */
-        enum sample_type { UNDEF, MS4, MS6, MS8 };
-
-        /**
-         * This is the series of flux transion timing data
-         * we are looking for.
-         * The following is the timing values to
-         * encode 0x44894489 as MFM data timing.
-         */
-        // TODO: I'd assume the first sample should be MS6 instead of MS4
-        //       as 0xaa is preceeding the sync marker so the preceding bits were 0b10
-        static const enum sample_type sync[10] = {
-                MS4, MS8, MS6, MS8, MS6, // 0x4489
-                MS4, MS8, MS6, MS8, MS6  // 0x4489
-        };
-
-        /**
-         * In this loop, we maintain the 10 latest
-         * flux timing values in a ring buffer,
-         * and compare it against the sync buffer
-         * to see if they match.
-         */
-        enum sample_type ring_buffer[10] = {UNDEF};
-
-        /*
-         * Multiply count with 10 to get nSec
-         * Divide by 100 to get μSec
-         */
-
-        //int sector = 0;
-
-        for (int i = *index; i < track->sample_count; i++) {
-                if (track->samples[i] > 700) {
-                        ring_buffer[i % 10] = MS8;
-                } else if (track->samples[i] > 500) {
-                        ring_buffer[i % 10] = MS6;
-                } else {
-                        ring_buffer[i % 10] = MS4;
-                }
-
-                int r_index = (i - 10);
-                // Wait until the ringbuffer is full before we start comparing.
-                if (r_index < 0) {
-                        continue;
-                }
-
-                bool found = true;
-                for (int e = 0; e < 10; e++) {
-                        if (sync[e] != ring_buffer[(r_index + e) % 10]) {
-                                found = false;
-                                break;
-                        }
-                }
-                if (found) {
-                        *index = i - 10;
-                        return true;
-                        /*
-                        if (sector >= 11) {
-                                // Current implementation only expects 11 sectors!
-                                fprintf(stderr,
-                                "%s: Error, found sector marker for sector: %d\n",
-                                                        __func__, sector + 1);
-                        } else {
-                                // Setup pointers to start of sector in the track struct.
-                                track->sectors[sector].samples =
-                                                        &track->samples[i - 10];
-                                printf(
-                                "Sync for sector %d found at sample inndex: %d\n",
-                                                                sector + 1, i);
-                        }
-                        sector++;
-                        */
-                }
-        }
-        return false;
-}
@@ -9,30 +9,13 @@
 #include "mfm.h"
 #include "read_track_timing.h"
 #include "pru-setup.h"
+#include "flux_data.h"
+#include "mfm_utils/amiga_decode.h"
+#include "mfm_utils/mfm_utils.h"
 
 extern void usage(void);
 extern struct pru * pru;
 
-static void shift(void *d, int len, uint8_t bit)
-{
-	int i;
-        uint8_t *data = d;
-	for(i = 0; i < len-1; i++) {
-		data[i] <<= 1;
-		data[i] |= (data[i+1] & 0x80) >> 7;
-	}
-	data[len - 1] <<= 1;
-	if (bit) data[len - 1] |= 1;
-}
-
-static int check_sync(struct raw_mfm_sector *sector)
-{
-        if (sector->sync_word == 0x89448944) {
-                return 1;
-        }
-	return 0;
-}
-
 /* Parse timing info, and return <sector_count> sectors in <sectors> ptr.
  * */
 static int find_std_sector_headers(const uint32_t *timing, int sample_count,
@@ -52,37 +35,10 @@ static int find_std_sector_headers(const uint32_t *timing, int sample_count,
 	}
 	memset(raw_mfm_sectors, 0x00, count * sizeof(*raw_mfm_sectors));
 
-	c = count;
-        cur_sector = raw_mfm_sectors;
-	for(i=0; i < sample_count; i++) {
-		if (timing[i] > 720) {
-			shift(cur_sector, sizeof(*cur_sector), 0);
-			if (check_sync(cur_sector)) {
-				if (!--count) break;
-                                cur_sector++;
-                        }
-		}
-		if (timing[i] > 540) {
-			shift(cur_sector, sizeof(*cur_sector), 0);
-			if (check_sync(cur_sector)) {
-				if (!--count) break;
-                                cur_sector++;
-                        }
-		}
-		shift(cur_sector, sizeof(*cur_sector), 0);
-		if (check_sync(cur_sector)) {
-			if (!--count) break;
-                        cur_sector++;
-                }
-
-		shift(cur_sector, sizeof(*cur_sector), 1);
-		if (check_sync(cur_sector)) {
-			if (!--count) break;
-                        cur_sector++;
-                }
-	}
-
-	c -= count;
+	c = mfm_find_raw_sectors(timing, sample_count,
+				(uint8_t *)raw_mfm_sectors, count);
+	if (c < 0)
+		c = 0;
 	header_count = (header_count < c) ? header_count : c;
 
         cur_sector = raw_mfm_sectors;
@@ -248,10 +204,114 @@ static void quantize_samples(uint32_t * samples, int sample_count)
 	}
 }
 
+/*
+ * Take each sector from the first revolution it is good in, and tell
+ * which sectors are bad in all of them.
+ */
+static void fuse_revolutions(const uint32_t *timing, int sample_count,
+				const uint32_t *offsets, uint8_t revolutions)
+{
+	struct amiga_fusion *fusion = malloc(sizeof(*fusion));
+	unsigned int i;
+
+	if (!fusion) {
+		fprintf(stderr, "Couldn't allocate fusion buffer\n");
+		return;
+	}
+	amiga_fusion_init(fusion);
+	amiga_fusion_add(fusion, timing, sample_count, offsets, revolutions,
+									NULL);
+
+	printf("\n-----------------\nFused %u revolutions, %u sectors good\n",
+				fusion->revolutions, fusion->track.good);
+	for (i = 0; i < AMIGA_SECTORS_PER_TRACK; i++) {
+		const struct amiga_track_sector *s = &fusion->track.sectors[i];
+		if (!s->found)
+			printf("Sector %u: not found\n", i);
+		else if (s->sector.header_checksum_ok
+					&& s->sector.data_checksum_ok)
+			printf("Sector %u: good in revolution %u\n", i,
+						fusion->revolution[i]);
+		else
+			printf("Sector %u: bad in all revolutions\n", i);
+	}
+	free(fusion);
+}
+
+/*
+ * Average the revolutions into one, and tell how many of its samples
+ * vary like weak bits and how many sectors it decodes to.
+ */
+static void average_revolutions(const uint32_t *timing, int sample_count,
+				const uint32_t *offsets, uint8_t revolutions)
+{
+	struct flux_data *flux_data;
+	struct amiga_fusion *fusion = NULL;
+	uint32_t *mean = NULL, *variance = NULL;
+	uint32_t index_offset;
+	int i, weak = 0;
+
+	flux_data = flux_data_init(timing, sample_count, offsets, revolutions,
+							FLUX_ALIGN_WINDOW);
+	if (!flux_data)
+		return;
+
+	mean = malloc(sizeof(*mean) * flux_data->master_len);
+	variance = malloc(sizeof(*variance) * flux_data->master_len);
+	fusion = malloc(sizeof(*fusion));
+	if (!mean || !variance || !fusion) {
+		fprintf(stderr, "Couldn't allocate averaging buffers\n");
+		goto out;
+	}
+
+	index_offset = flux_average(flux_data, mean, variance);
+	for (i = 0; i < (int)index_offset; i++)
+		weak += variance[i] > FLUX_WEAK_VARIANCE;
+
+	amiga_fusion_init(fusion);
+	amiga_fusion_add(fusion, mean, index_offset, &index_offset, 1, NULL);
+
+	printf("\n-----------------\nAveraged %u revolutions: %u samples, "
+			"%d weak, %u sectors good\n", revolutions,
+			index_offset, weak, fusion->track.good);
+	for (i = 1; i < revolutions; i++)
+		printf("Revolution %d off by %.2f samples\n", i,
+			(double)flux_data->shift[i] / FLUX_SHIFT_ONE);
+
+out:
+	free(fusion);
+	free(variance);
+	free(mean);
+	flux_data_free(flux_data);
+}
+
+/*
+ * Read up to <count> revolutions, but stop as soon as every sector has
+ * been good in one of them. <count> is updated to the revolutions read.
+ */
+static int read_adaptive(uint32_t **timing, int *count, uint32_t **offsets)
+{
+	struct amiga_fusion_stream *verify = malloc(sizeof(*verify));
+	uint8_t revolutions = *count;
+	int sample_count;
+
+	if (!verify) {
+		fprintf(stderr, "Couldn't allocate verify buffer\n");
+		return 0;
+	}
+	amiga_fusion_stream_init(verify, NULL);
+	sample_count = pru_read_timing_until(pru, timing, &revolutions,
+				offsets, amiga_fusion_consume, verify);
+	free(verify);
+
+	*count = revolutions;
+	return sample_count;
+}
+
 int read_track_timing(int argc, char ** argv)
 {
-	int rc, i, e, opt, sample_count,
-	measure = 0, quantize = 0, count = 1;
+	int rc, i, opt, sample_count,
+	measure = 0, quantize = 0, adaptive = 0, average = 0, count = 1;
 	const char *fn = NULL;
 	char *filename = NULL;
 	FILE *fp;
@@ -262,7 +322,7 @@ int read_track_timing(int argc, char ** argv)
 	struct mfm_sector_header *header, *h;
 
 
-	while((opt = getopt(argc, argv, "-lMQt:C:")) != -1) {
+	while((opt = getopt(argc, argv, "-lMQAVt:C:")) != -1) {
 		switch(opt) {
 		case 't':
 			track_no = strtol(optarg, NULL, 0);
@@ -278,6 +338,14 @@ int read_track_timing(int argc, char ** argv)
 		case 'Q':
 			quantize = 1;
 			break;
+		case 'A':
+			// Stop early when the sectors are good, -C is the most
+			adaptive = 1;
+			break;
+		case 'V':
+			// Average the revolutions into one
+			average = 1;
+			break;
 		case 'C':
                         // Number of revolutions to sample
 			count = strtol(optarg, NULL, 0);
@@ -321,7 +389,10 @@ int read_track_timing(int argc, char ** argv)
 		pru_step_head(pru, track_no);
 	}
 	pru_set_head_side(pru, track_side);
-	sample_count = pru_read_timing(pru, &timing, count, &offsets);
+	if (adaptive)
+		sample_count = read_adaptive(&timing, &count, &offsets);
+	else
+		sample_count = pru_read_timing(pru, &timing, count, &offsets);
 	pru_reset_drive(pru);
 	pru_stop_motor(pru);
 
@@ -329,7 +400,7 @@ int read_track_timing(int argc, char ** argv)
 		return -1;
 	}
 
-	printf("\tGot %d samples\n", sample_count);
+	printf("\tGot %d samples, %d revolutions\n", sample_count, count);
 
 	if (quantize) {
 		printf("Quantize!\n");
@@ -377,31 +448,13 @@ int read_track_timing(int argc, char ** argv)
 	}
 
 		if (chksum_err && count > 1) {
-			for (e = 1; e < count; e++) {
-				rc = find_std_sector_headers(timing + offsets[e-1], offsets[e], header, 11);
-				if (!rc) {
-					printf("Loopread failed!\n");
-					continue;
-				}
-				printf("\n-----------------\nIter %d, got %d sectors!\n", e, rc);
-				h = header;
-				for (i = 0; i < rc; i++) {
-					if (i % 11 == 0) printf("---------------\n");
-					MFM_INFO_PRINT(h->info);
-					if (!h->head_chksum_ok) {
-						chksum_err = 1;
-						printf("Head Chksum error!\n");
-					}
-					if (!h->data_chksum_ok) {
-						chksum_err = 1;
-						printf("Data Chksum error!\n");
-					}
-					h++;
-				}
-			}
+			fuse_revolutions(timing, sample_count, offsets, count);
 		}
         }
 
+	if (average && count > 1)
+		average_revolutions(timing, sample_count, offsets, count);
+
 	if (!rc) {
 		fprintf(stderr,
 			"Couldn't find any standard sectors in data stream!\n"
@@ -483,7 +536,7 @@ int write_track_timing(int argc, char ** argv)
         timing[510] = 400;
         timing[511] = 400;
 
-        printf("Sending %d samples, (%d bytes)\n",
+        printf("Sending %d samples, (%zu bytes)\n",
                                                 sample_count,
                                 sample_count * sizeof(*timing));
         pru_start_motor(pru);
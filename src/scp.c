@@ -5,9 +5,14 @@
 #include <endian.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
 
 #include "pru-setup.h"
+#include "capture_pipeline.h"
+#include "flux_data.h"
 #include "scp.h"
+#include "track_schedule.h"
 
 #define SCP_MAGIC   "SCP"
 #define SCP_VERSION  0
@@ -34,10 +39,14 @@
 
 #define TDH_MAGIC "TRK"
 
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
 typedef struct _scp_file {
         char            *filename;
-        FILE            *fp;
+        int             fd;
         uint32_t        *offset_table;
+        uint32_t        data_end;       // Where the next TDH goes
+        uint32_t        checksum;       // Of the tracks written so far
         uint8_t         revolutions;
         uint8_t         start_track;
         uint8_t         end_track;
@@ -48,20 +57,46 @@ struct scp_rev_timing {
         uint32_t        sample_count;
 };
 
+// The checksum is the sum of all bytes after the header.
+static uint32_t scp_checksum(uint32_t checksum, const void *data, size_t size)
+{
+        const uint8_t *p = data;
+
+        for (size_t i = 0; i < size; i++)
+                checksum += p[i];
+        return checksum;
+}
+
+static void free_scp(SCP_FILE scp)
+{
+        free(scp->offset_table);
+        free(scp->filename);
+        free(scp);
+}
+
+/*
+ * The header and an empty offset table are written here, the offset
+ * table is filled in and the checksum set by close_scp().
+ */
 static SCP_FILE create_scp(const char *filename, uint8_t start_track,
                                 uint8_t end_track, uint8_t revolutions)
 {
         uint8_t header[0x10] = {0};
-        uint32_t *offset_table = NULL;
+        ssize_t written;
 
-        SCP_FILE scp = malloc(sizeof(_SCP_FILE));
+        SCP_FILE scp = calloc(1, sizeof(_SCP_FILE));
         if (!scp) {
                 fprintf(stderr, "Couldn't alloc memory for scp\n");
                 return NULL;
         }
 
-        scp->filename = malloc(strlen(filename) + 1);
-        strcpy(scp->filename, filename);
+        scp->filename = strdup(filename);
+        scp->offset_table = calloc(sizeof(*scp->offset_table), end_track + 1);
+        if (!scp->filename || !scp->offset_table) {
+                fprintf(stderr, "Couldn't alloc memory for offset table\n");
+                free_scp(scp);
+                return NULL;
+        }
 
         scp->revolutions = revolutions;
         scp->start_track = start_track;
@@ -80,32 +115,45 @@ static SCP_FILE create_scp(const char *filename, uint8_t start_track,
         // 0xC - 0xF == Checksum
         memset(header + 0xc, 0x00, 4);
 
-
-        offset_table = calloc(sizeof(*offset_table), end_track + 1);
-        if (!offset_table) {
-                fprintf(stderr, "Couldn't alloc memory for offset table\n");
+        scp->fd = open(scp->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (scp->fd < 0) {
+                fprintf(stderr, "Couldn't create %s\n", scp->filename);
+                free_scp(scp);
                 return NULL;
         }
-        scp->offset_table = offset_table;
-        // Mark the start for the first TrackDataHeader (TDH)
 
-        scp->fp = fopen(scp->filename, "w+b");
-        fwrite(header, 1, 0x10, scp->fp);
-        // Write the empty offset table - we fill it in when we close the file
-        fwrite(offset_table, end_track + 1, sizeof(*offset_table), scp->fp);
+        const struct iovec iov[] = {
+                { header, sizeof(header) },
+                { scp->offset_table,
+                        (end_track + 1) * sizeof(*scp->offset_table) },
+        };
+        written = pwritev(scp->fd, iov, ARRAY_SIZE(iov), 0);
+        if (written != (ssize_t)(iov[0].iov_len + iov[1].iov_len)) {
+                fprintf(stderr, "Couldn't write to %s\n", scp->filename);
+                close(scp->fd);
+                free_scp(scp);
+                return NULL;
+        }
 
-        // Set the first entry in the offset_table
-        scp->offset_table[0] = htole32(ftell(scp->fp));
+        // The tracks follow the offset table, in the order they are read.
+        scp->data_end = written;
 
         return scp;
 }
 
+/*
+ * An adaptive capture can have fewer than scp->revolutions revolutions
+ * of a track. The entries of the missing ones are left empty.
+ *
+ * The track goes out in one positional write, and is added to the
+ * checksum on the way, so the file is never read back.
+ */
 static int add_scp_track(SCP_FILE scp, uint8_t track_no, uint16_t *flux_data,
-                                                struct scp_rev_timing *durations)
+                        struct scp_rev_timing *durations, uint8_t revolutions)
 {
         int i;
         uint8_t tdh[0x4] = {0};
-        uint32_t *revolution_data;
+        uint32_t revolution_data[3 * 64] = {0};
         uint32_t *revolution;
         uint32_t offset;
         int sample_count = 0;
@@ -113,24 +161,18 @@ static int add_scp_track(SCP_FILE scp, uint8_t track_no, uint16_t *flux_data,
         struct tm *now;
         size_t timestamp_size;
         char timestamp[20];
+        ssize_t size;
         assert(scp);
-        assert(track_no >= 0);
         assert(track_no <= scp->end_track);
-        assert(scp->offset_table[track_no]);
+        assert(scp->revolutions <= 64);
 
-        sprintf((char *)tdh, TDH_MAGIC);
+        memcpy(tdh, TDH_MAGIC, 3);
         tdh[0x3] = track_no;
 
-        revolution_data = calloc(sizeof(*revolution_data),
-                                        3 * scp->revolutions);
-        if (!revolution_data) {
-                fprintf(stderr, "Couldn't alloc buf for revolution_data!\n");
-                return -1;
-        }
         revolution = revolution_data;
         offset = 0x4 + (sizeof(*revolution_data) * 3 * scp->revolutions);
 
-        for (i=0; i < scp->revolutions; i++) {
+        for (i=0; i < revolutions && i < scp->revolutions; i++) {
                 revolution[0] = htole32(durations[i].duration);
                 revolution[1] = htole32(durations[i].sample_count);
                 revolution[2] = htole32(offset);
@@ -147,133 +189,333 @@ static int add_scp_track(SCP_FILE scp, uint8_t track_no, uint16_t *flux_data,
                 fprintf(stderr, "Failed to get timestamp!\n");
         }
 
-        fseek(scp->fp, scp->offset_table[track_no], SEEK_SET);
-        fwrite(tdh, 1, 0x4, scp->fp);
-        fwrite(revolution_data, 3 * scp->revolutions,
-                sizeof(*revolution_data), scp->fp);
-        fwrite(flux_data, sample_count, sizeof(*flux_data), scp->fp);
-        fwrite(timestamp, timestamp_size, sizeof(*timestamp), scp->fp);
-        fflush(scp->fp);
-
-        // Setup offset_table to point to the next track (TDH)
-        if (track_no < scp->end_track) {
-                scp->offset_table[track_no + 1] = htole32(ftell(scp->fp));
+        const struct iovec iov[] = {
+                { tdh, sizeof(tdh) },
+                { revolution_data,
+                        3 * scp->revolutions * sizeof(*revolution_data) },
+                { flux_data, sample_count * sizeof(*flux_data) },
+                { timestamp, timestamp_size },
+        };
+        size = 0;
+        for (i = 0; i < (int)ARRAY_SIZE(iov); i++) {
+                scp->checksum = scp_checksum(scp->checksum, iov[i].iov_base,
+                                                        iov[i].iov_len);
+                size += iov[i].iov_len;
         }
 
+        if (pwritev(scp->fd, iov, ARRAY_SIZE(iov), scp->data_end) != size) {
+                fprintf(stderr, "Couldn't write track %u to %s\n", track_no,
+                                                        scp->filename);
+                return -1;
+        }
+
+        scp->offset_table[track_no] = htole32(scp->data_end);
+        scp->data_end += size;
+
         return 0;
 }
 
-static void close_scp(SCP_FILE scp)
+static int close_scp(SCP_FILE scp)
 {
-        uint8_t val;
-        uint32_t checksum = 0;
+        const size_t table_size = (scp->end_track + 1)
+                                        * sizeof(*scp->offset_table);
+        uint32_t checksum;
+        int rc = 0;
         assert(scp);
 
-        // Write the offset table
-        fseek(scp->fp, 0x10, SEEK_SET);
-        fwrite(scp->offset_table, scp->end_track + 1,
-                        sizeof(*scp->offset_table), scp->fp);
-        free(scp->offset_table);
+        checksum = htole32(scp_checksum(scp->checksum, scp->offset_table,
+                                                                table_size));
 
-        // Calculate checksum
-        fseek(scp->fp, 0x10, SEEK_SET);
-        while(fread(&val, 1, 1, scp->fp)) {
-                checksum += val;
+        if (pwrite(scp->fd, scp->offset_table, table_size, 0x10)
+                                                != (ssize_t)table_size
+                || pwrite(scp->fd, &checksum, sizeof(checksum), 0x0C)
+                                                != sizeof(checksum)) {
+                fprintf(stderr, "Couldn't finish %s\n", scp->filename);
+                rc = -1;
+        }
+        if (close(scp->fd)) {
+                fprintf(stderr, "Couldn't close %s\n", scp->filename);
+                rc = -1;
         }
-        checksum = htole32(checksum);
-        fseek(scp->fp, 0x0C, SEEK_SET);
-        fwrite(&checksum, 1, sizeof(checksum), scp->fp);
+        free_scp(scp);
 
-        fclose(scp->fp);
+        return rc;
 }
 
 extern struct pru * pru;
 
+/*
+ * x / 5 as a multiply: 0xcccccccd is 2^34 / 5 rounded up, which is
+ * exact for any 32 bit x.
+ */
+static inline uint32_t div5(uint32_t x)
+{
+        return ((uint64_t)x * 0xcccccccdu) >> 34;
+}
+
 // The pru has timing resolutions of 10.
 // The scp format has 25 as smalles timing resolution.
 // We have to multipy each sample by 0.4
 // and convert them to big endian uint16_t.
 //
-// Also, any overflows of the uint16_t shall result
-// in extra 0x0000 samples added to the dataset
+// The part of a 25 nSec tick that is left over from each sample is
+// carried on to the next one, so the revolutions keep their length
+// instead of losing up to 0.6 ticks a sample.
+//
+// Any overflows of the uint16_t shall result in extra 0x0000 samples,
+// each one 65536 ticks, added to the dataset. A sample can't be 0
+// after those, since that would be another overflow, so it's made 1.
 static int samples2scp(uint16_t **scp_samples, struct scp_rev_timing **timing,
                         uint32_t const *original_sample, uint8_t revolutions,
                                                 uint32_t const *index_offsets)
 {
-        int i, e;
-        uint16_t *sample_ptr;
-        int total_out_samples = 0, start_sample = 0;
+        const uint32_t total = revolutions ? index_offsets[revolutions - 1] : 0;
+        size_t size = total + total / 8 + 256;
+        size_t out = 0;
+        uint32_t rest = 0, i = 0;
+        uint16_t *samples;
 
+        *scp_samples = NULL;
         *timing = calloc(sizeof(**timing), revolutions);
-        if (!timing) {
-                fprintf(stderr, "Couldn't alloc mem for timing\n");
+        samples = malloc(sizeof(*samples) * size);
+        if (!*timing || !samples) {
+                fprintf(stderr, "Couldn't alloc mem for scp samples\n");
+                free(samples);
                 return -1;
         }
 
-        // First loop to fill the scp_rev_timing, and decide how big the
-        // scp_samples array should be.
-        for (e = 0; e < revolutions; e++) {
+        for (int e = 0; e < revolutions; e++) {
+                const size_t first = out;
                 uint32_t duration = 0;
-                uint32_t samples_per_rev = 0;
-                for (i = start_sample; i < index_offsets[e]; i++) {
-                        uint32_t tmp = (original_sample[i] << 1) / 5;
+
+                for (; i < index_offsets[e]; i++) {
+                        // In 1/5 of a 25 nSec tick, with what was left over.
+                        const uint32_t fifths = (original_sample[i] << 1)
+                                                                + rest;
+                        uint32_t tmp = div5(fifths);
+
+                        rest = fifths - tmp * 5;
                         duration += tmp;
-                        samples_per_rev++;
-                        if (tmp <= UINT16_MAX) continue;
-                        while(tmp > UINT16_MAX) {
-                                tmp -= UINT16_MAX;
-                                samples_per_rev++;
+
+                        // Room for this sample and all of its overflows.
+                        if (out + (tmp >> 16) + 1 > size) {
+                                uint16_t *grown;
+                                size = (out + (tmp >> 16) + 1) * 2;
+                                grown = realloc(samples,
+                                                sizeof(*samples) * size);
+                                if (!grown) {
+                                        fprintf(stderr, "Couldn't alloc mem for scp samples\n");
+                                        free(samples);
+                                        return -1;
+                                }
+                                samples = grown;
+                        }
+                        while (tmp > UINT16_MAX) {
+                                samples[out++] = 0;
+                                tmp -= UINT16_MAX + 1;
                         }
+                        if (!tmp) {
+                                tmp = 1;
+                                duration++;
+                        }
+                        samples[out++] = htobe16((uint16_t)tmp);
                 }
-                total_out_samples += samples_per_rev;
+
                 (*timing)[e].duration = duration;
-                (*timing)[e].sample_count = samples_per_rev;
-                start_sample = index_offsets[e];
+                (*timing)[e].sample_count = out - first;
+        }
+
+        *scp_samples = samples;
+        return out;
+}
+
+struct scp_capture {
+        SCP_FILE file;
+        bool average;           // One averaged revolution per track
+};
+
+struct scp_track_data {
+        uint16_t *converted_data;
+        struct scp_rev_timing *timing;
+        uint8_t revolutions;
+        int weak;               // Averaged samples that vary a lot, or -1
+};
+
+/*
+ * Average the revolutions of <track> into one, with the index at
+ * <index_offset>, and count the samples that look like weak bits.
+ */
+static uint32_t *scp_average_track(const struct capture_track *track,
+                                        uint32_t *index_offset, int *weak)
+{
+        struct flux_data *flux_data;
+        uint32_t *mean = NULL, *variance = NULL;
+        int i, len;
+
+        flux_data = flux_data_init(track->samples, track->sample_count,
+                                track->index_offsets, track->revolutions,
+                                                        FLUX_ALIGN_WINDOW);
+        if (!flux_data)
+                return NULL;
+
+        mean = malloc(sizeof(*mean) * flux_data->master_len);
+        variance = malloc(sizeof(*variance) * flux_data->master_len);
+        if (!mean || !variance) {
+                fprintf(stderr, "Couldn't alloc memory for averaging\n");
+                free(mean);
+                mean = NULL;
+                goto out;
         }
 
+        len = flux_average(flux_data, mean, variance);
+        *index_offset = len;
+        *weak = 0;
+        for (i = 0; i < len; i++)
+                *weak += variance[i] > FLUX_WEAK_VARIANCE;
+
+out:
+        free(variance);
+        flux_data_free(flux_data);
+
+        return mean;
+}
 
-        *scp_samples = calloc(sizeof(**scp_samples), total_out_samples);
-        if (!*scp_samples) {
-                fprintf(stderr, "Coulden't alloc memory for scp_samples\n");
+static int scp_decode_track(struct capture_track *track, void *ctx)
+{
+        const struct scp_capture *capture = ctx;
+        struct scp_track_data *data = calloc(1, sizeof(*data));
+        const uint32_t *samples = track->samples;
+        const uint32_t *index_offsets = track->index_offsets;
+        uint32_t *mean = NULL, mean_offset;
+        int rc;
+
+        if (!data) {
+                fprintf(stderr, "Couldn't alloc memory for track data\n");
                 return -1;
         }
-        sample_ptr = *scp_samples;
-        // Now do the conversion.
-        // start_sample has a confusing name,
-        // but it's the last value of <index_offset>
-        for (i = 0; i < start_sample; i++) {
-                uint32_t tmp = (original_sample[i] << 1) / 5;
-                while(tmp > UINT16_MAX) {
-                        tmp -= UINT16_MAX;
-                        sample_ptr++;
+        data->revolutions = track->revolutions;
+        data->weak = -1;
+
+        if (capture->average && track->revolutions > 1) {
+                mean = scp_average_track(track, &mean_offset, &data->weak);
+                if (!mean) {
+                        free(data);
+                        return -1;
                 }
-                sample_ptr[0] = htobe16((uint16_t)tmp);
-                sample_ptr++;
+                samples = mean;
+                index_offsets = &mean_offset;
+                data->revolutions = 1;
         }
-        assert(sample_ptr == *scp_samples + total_out_samples);
-        return total_out_samples;
+
+        rc = samples2scp(&data->converted_data, &data->timing, samples,
+                                        data->revolutions, index_offsets);
+        free(mean);
+        if (rc < 0) {
+                free(data->timing);
+                free(data);
+                return -1;
+        }
+        track->result = data;
+
+        return 0;
+}
+
+static void scp_free_track(void *result, void *ctx)
+{
+        struct scp_track_data *data = result;
+
+        free(data->converted_data);
+        free(data->timing);
+        free(data);
+}
+
+static int scp_write_track(struct capture_track *track, void *ctx)
+{
+        const struct scp_capture *capture = ctx;
+        struct scp_track_data *data = track->result;
+        int rc = -1, weak = -1;
+
+        if (data) {
+                rc = add_scp_track(capture->file, track->track,
+                                        data->converted_data, data->timing,
+                                                        data->revolutions);
+                weak = data->weak;
+                scp_free_track(data, ctx);
+        }
+        if (weak >= 0)
+                printf("Track: %u, head: %u %s, %d weak samples\n",
+                                track->track >> 1, track->track & 1,
+                                        rc ? "FAILED" : "written", weak);
+        else
+                printf("Track: %u, head: %u %s\n", track->track >> 1,
+                                track->track & 1, rc ? "FAILED" : "written");
+
+        return rc;
+}
+
+static void read_scp_usage(char * const argv[])
+{
+        printf("usage: %s [-r <revolutions>] [-j <threads>] [-F <prefix>] "
+                                "[-T <tracks>] [-a] [-m] <SCP-FILE>\n", argv[0]);
+        printf("\t-r\tRevolutions to read, 1-64\n");
+        printf("\t-j\tDecode threads, 1-%d\n", CAPTURE_MAX_WORKERS);
+        printf("\t-F\tReplay track dumps <prefix>NNN instead of the drive\n");
+        printf("\t-T\tCylinders to read, i.e. 0-9,40:1\n");
+        printf("\t-a\tStop reading a track when its sectors are good\n");
+        printf("\t-m\tStore the average of the revolutions read\n");
 }
 
-#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 int read_scp(int argc, char ** argv)
 {
-        int i, opt, filename_index = 0;
-        uint8_t start_track = 0;
-        uint8_t end_track = 159;
+        int rc, opt, filename_index = 0;
+        unsigned int start_track, end_track;
         uint8_t revolutions = 3;
-        uint32_t *samples;
-        uint32_t *index_offsets;
-        uint16_t *converted_data;
-        struct scp_rev_timing *timing;
+        unsigned int workers = CAPTURE_DEFAULT_WORKERS;
+        const char *replay_prefix = NULL;
+        const char *tracks = "0-79";
+        bool adaptive = false;
+        struct track_schedule schedule;
+        struct capture_source source;
+        struct scp_capture capture = { 0 };
         SCP_FILE file;
 
-        while((opt = getopt(argc, argv, "-r:")) != -1) {
+        while((opt = getopt(argc, argv, "-r:j:F:T:am")) != -1) {
                 switch(opt) {
                 case 'r':
                         revolutions = strtol(optarg, NULL, 0);
                         if (revolutions < 1) revolutions = 1;
                         if (revolutions > 64) revolutions = 64;
                         break;
+                case 'j': {
+                        // Number of decode threads
+                        const long n = strtol(optarg, NULL, 0);
+                        if (n < 1 || n > CAPTURE_MAX_WORKERS) {
+                                fprintf(stderr, "Bad thread count: %s\n",
+                                                                optarg);
+                                read_scp_usage(argv);
+                                return -1;
+                        }
+                        workers = n;
+                        break;
+                }
+                case 'F':
+                        // Replay track dumps from disk instead of the drive
+                        replay_prefix = optarg;
+                        break;
+                case 'T':
+                        // Cylinders to read, i.e. "0-9,40:1"
+                        tracks = optarg;
+                        break;
+                case 'a':
+                        // Stop reading a track when its sectors are
+                        // good, -r is the most revolutions to read.
+                        adaptive = true;
+                        break;
+                case 'm':
+                        // Store one revolution per track, the average
+                        // of the -r revolutions read.
+                        capture.average = true;
+                        break;
                 case 1:
                         filename_index = optind - 1;
                 }
@@ -285,49 +527,68 @@ int read_scp(int argc, char ** argv)
                 return -1;
         }
 
-        file = create_scp(argv[filename_index], start_track, end_track, revolutions);
-        if (!file) {
+        // No retry passes, a bad track is only known to the reader of the file.
+        track_schedule_init(&schedule, 0);
+        if (track_schedule_parse(&schedule, tracks)
+                || !track_schedule_span(&schedule, &start_track, &end_track)) {
                 return -1;
         }
-        printf("Filename: %s\n", file->filename);
-
-        pru_start_motor(pru);
-        pru_reset_drive(pru);
+        // The drive is reset to cylinder 0 before the capture.
+        track_schedule_plan(&schedule, 0);
 
-
-        pru_set_head_dir(pru, PRU_HEAD_INC);
-        for (i = 0; i < 160; i++) {
-                printf("Read track: %d, head: %d\n", i >> 1, i & 1);
-                if (i % 2) {
-                        pru_set_head_side(pru, PRU_HEAD_LOWER);
-                } else {
-                        pru_set_head_side(pru, PRU_HEAD_UPPER);
+        if (replay_prefix) {
+                if (!capture_source_file_init(&source, replay_prefix)) {
+                        return -1;
                 }
+        } else if (adaptive) {
+                // Each read is stopped on its own, so no queue of reads.
+                capture_source_pru_init(&source, pru);
+                source.adaptive = true;
+        } else if (!capture_source_pru_queue_init(&source, pru)) {
+                return -1;
+        }
 
-                pru_read_timing(pru, &samples, revolutions, &index_offsets);
-                printf("Read done! - ");
-
-                samples2scp(&converted_data, &timing, samples, revolutions,
-                                                        index_offsets);
-                printf("Converted! - ");
-                free(samples);
-                free(index_offsets);
-
-                add_scp_track(file, i, converted_data, timing);
-                printf("Written\n");
-                free(timing);
-                free(converted_data);
-
-                if (i % 2) {
-                        pru_step_head(pru, 1);
-                        printf("Step!\n");
+        file = create_scp(argv[filename_index], start_track, end_track,
+                                        capture.average ? 1 : revolutions);
+        if (!file) {
+                if (replay_prefix) {
+                        capture_source_file_cleanup(&source);
+                } else if (!adaptive) {
+                        capture_source_pru_queue_cleanup(&source);
+                }
+                return -1;
+        }
+        printf("Filename: %s\n", file->filename);
+        capture.file = file;
+
+        const struct capture_ops ops = {
+                .decode = scp_decode_track,
+                .write = scp_write_track,
+                .free_result = scp_free_track,
+                .ctx = &capture,
+        };
+        const struct capture_config config = {
+                .schedule = &schedule,
+                .revolutions = revolutions,
+                .workers = workers,
+                .queue_depth = CAPTURE_DEFAULT_QUEUE_DEPTH,
+        };
+
+        if (replay_prefix) {
+                rc = capture_pipeline_run(&source, &ops, &config);
+                capture_source_file_cleanup(&source);
+        } else {
+                pru_start_motor(pru);
+                pru_reset_drive(pru);
+                rc = capture_pipeline_run(&source, &ops, &config);
+                pru_stop_motor(pru);
+                if (!adaptive) {
+                        capture_source_pru_queue_cleanup(&source);
                 }
         }
-        pru_stop_motor(pru);
 
-        close_scp(file);
+        if (close_scp(file))
+                rc = -1;
 
-
-        return 0;
+        return rc;
 }
-
@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "scp_image.h"
+
+#define SCP_HEADER_SIZE         0x10
+// The offset table has room for this many tracks, at most.
+#define SCP_MAX_TRACKS          168
+
+static uint32_t get_le32(const uint8_t *p)
+{
+        uint32_t v;
+
+        memcpy(&v, p, sizeof(v));
+        return le32toh(v);
+}
+
+/**
+ * @return      true if <filename> starts like an SCP file.
+ */
+bool scp_image_probe(const char *filename)
+{
+        char magic[3];
+        FILE *fp = fopen(filename, "rb");
+        bool scp;
+
+        if (!fp)
+                return false;
+        scp = fread(magic, 1, sizeof(magic), fp) == sizeof(magic)
+                                && !memcmp(magic, "SCP", sizeof(magic));
+        fclose(fp);
+
+        return scp;
+}
+
+/**
+ * @brief       Map an SCP file, and check its header.
+ *
+ * @return      false on error, with the reason printed.
+ */
+bool scp_image_open(struct scp_image *image, const char *filename)
+{
+        struct stat st;
+        void *map;
+        int fd;
+
+        memset(image, 0x00, sizeof(*image));
+
+        fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+                fprintf(stderr, "Couldn't open %s\n", filename);
+                return false;
+        }
+        if (fstat(fd, &st) || st.st_size < SCP_HEADER_SIZE) {
+                fprintf(stderr, "%s is too short for an SCP file\n", filename);
+                close(fd);
+                return false;
+        }
+
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+                fprintf(stderr, "Couldn't map %s\n", filename);
+                return false;
+        }
+        image->map = map;
+        image->size = st.st_size;
+
+        const uint8_t *header = image->map;
+        if (memcmp(header, "SCP", 3)) {
+                fprintf(stderr, "%s is not an SCP file\n", filename);
+                goto bad_image;
+        }
+        if (header[0x9] != 0 && header[0x9] != 16) {
+                fprintf(stderr, "%s has %u bit samples, only 16 are supported\n",
+                                                        filename, header[0x9]);
+                goto bad_image;
+        }
+
+        image->revolutions = header[0x5];
+        image->start_track = header[0x6];
+        image->end_track = header[0x7];
+        image->tick_ns = 25 * (header[0xb] + 1);
+
+        if (image->start_track > image->end_track
+                        || image->end_track >= SCP_MAX_TRACKS
+                        || SCP_HEADER_SIZE + (image->end_track + 1) * 4
+                                                        > image->size) {
+                fprintf(stderr, "%s has a bad track range: %u-%u\n", filename,
+                                        image->start_track, image->end_track);
+                goto bad_image;
+        }
+
+        return true;
+
+bad_image:
+        scp_image_close(image);
+        return false;
+}
+
+void scp_image_close(struct scp_image *image)
+{
+        if (image->map)
+                munmap((void *)image->map, image->size);
+        memset(image, 0x00, sizeof(*image));
+}
+
+/**
+ * @brief       Find a revolution of a track, in place.
+ *
+ * @param       track           cylinder * 2 + head
+ * @param       revolution      From 0
+ * @param       rev             <OUT> Points into the map
+ *
+ * @return      false if the track or revolution isn't in the image, or
+ *              doesn't fit in the file.
+ */
+bool scp_image_revolution(const struct scp_image *image, unsigned int track,
+                unsigned int revolution, struct scp_revolution *rev)
+{
+        if (track < image->start_track || track > image->end_track
+                        || revolution >= image->revolutions)
+                return false;
+
+        const size_t tdh = get_le32(image->map + SCP_HEADER_SIZE + track * 4);
+        const size_t entry = tdh + 4 + revolution * 12;
+        if (!tdh || entry + 12 > image->size
+                        || memcmp(image->map + tdh, "TRK", 3)
+                        || image->map[tdh + 3] != track)
+                return false;
+
+        const size_t offset = get_le32(image->map + entry + 8);
+        rev->duration = get_le32(image->map + entry);
+        rev->count = get_le32(image->map + entry + 4);
+        rev->flux = image->map + tdh + offset;
+
+        // An adaptive capture leaves the revolutions it didn't read empty.
+        if (!rev->count || !offset)
+                return false;
+        if (tdh + offset + (size_t)rev->count * sizeof(uint16_t) > image->size)
+                return false;
+
+        return true;
+}
+
+/**
+ * @brief       Turn a revolution into write timing for pru_write_timing().
+ *
+ * @detail      The ticks are scaled to counts of 10 nSec, and what is left
+ *              of a count is carried on to the next sample, so the
+ *              revolution keeps its length. A sample too long for 16 bits
+ *              is written as the longest there is, it is no flux anyway.
+ *
+ * @param       timing          <OUT> Room for rev->count samples
+ *
+ * @return      The number of samples.
+ */
+size_t scp_revolution_to_timing(const struct scp_image *image,
+                const struct scp_revolution *rev, uint16_t *timing)
+{
+        // A tick is tick_ns / 10 counts, in halves to keep 2.5 exact.
+        const uint64_t halves = image->tick_ns / 5;
+        struct scp_flux_iter it;
+        uint64_t rest = 0;
+        uint32_t ticks;
+        size_t count = 0;
+
+        scp_flux_iter_init(&it, rev);
+        while (scp_flux_next(&it, &ticks)) {
+                const uint64_t v = ticks * halves + rest;
+                const uint64_t counts = v >> 1;
+
+                rest = v & 1;
+                timing[count++] = counts > UINT16_MAX ? UINT16_MAX : counts;
+        }
+
+        return count;
+}
@@ -0,0 +1,76 @@
+#ifndef SCP_IMAGE_H
+#define SCP_IMAGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <endian.h>
+#include <unistd.h>
+
+/**
+ * An SCP file, mapped read only. Nothing is copied out of it: the
+ * revolutions point into the map, and are valid until scp_image_close().
+ */
+struct scp_image {
+        const uint8_t *map;
+        size_t size;
+        uint8_t revolutions;
+        uint8_t start_track;
+        uint8_t end_track;
+        unsigned int tick_ns;           // Length of a flux tick, 25 nSec or more
+};
+
+/**
+ * One revolution of a track, as stored: big endian 16 bit ticks, where a
+ * 0 adds 65536 ticks to the sample after it.
+ */
+struct scp_revolution {
+        const uint8_t *flux;
+        uint32_t count;                 // 16 bit entries, overflows included
+        uint32_t duration;              // In ticks, index to index
+};
+
+struct scp_flux_iter {
+        const uint8_t *pos;
+        const uint8_t *end;
+};
+
+bool scp_image_probe(const char *filename);
+bool scp_image_open(struct scp_image *image, const char *filename);
+void scp_image_close(struct scp_image *image);
+bool scp_image_revolution(const struct scp_image *image, unsigned int track,
+                unsigned int revolution, struct scp_revolution *rev);
+size_t scp_revolution_to_timing(const struct scp_image *image,
+                const struct scp_revolution *rev, uint16_t *timing);
+
+static inline void scp_flux_iter_init(struct scp_flux_iter *it,
+                                        const struct scp_revolution *rev)
+{
+        it->pos = rev->flux;
+        it->end = rev->flux + rev->count * sizeof(uint16_t);
+}
+
+/**
+ * @brief       The next flux sample of a revolution, in ticks.
+ *
+ * @return      false at the end of the revolution.
+ */
+static inline bool scp_flux_next(struct scp_flux_iter *it, uint32_t *ticks)
+{
+        uint32_t overflow = 0;
+
+        while (it->pos < it->end) {
+                uint16_t be;
+
+                memcpy(&be, it->pos, sizeof(be));
+                it->pos += sizeof(be);
+                if (be) {
+                        *ticks = overflow + be16toh(be);
+                        return true;
+                }
+                overflow += 0x10000;
+        }
+        return false;
+}
+
+#endif /* SCP_IMAGE_H */
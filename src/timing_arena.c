@@ -0,0 +1,249 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timing_arena.h"
+#include "caps_parser/caps_parser.h"
+#include "scp_image.h"
+
+/**
+ * An MFM bitstream is written as the time between each pair of 1 bits:
+ * 2, 3 or 4 bitcells, sent to the PRU as 400, 600 and 800.
+ * Anything else can't be written, that 1 bit is dropped and the count
+ * starts over, as the bit by bit loop in write_flux did.
+ *
+ * The table is indexed by the bits counted since the last 1, at most
+ * CARRY_MAX, and the next byte. A byte can end at most 4 gaps, so each
+ * entry always stores 4 samples and says how many of them count.
+ */
+
+#define CARRY_MAX       5       // 5 or more bitcells, too long to write
+
+struct timing_lut_entry {
+        uint16_t samples[4];
+        uint8_t count;
+        uint8_t carry;
+};
+
+static struct timing_lut_entry timing_lut[CARRY_MAX + 1][256];
+static pthread_once_t timing_lut_once = PTHREAD_ONCE_INIT;
+
+static void timing_lut_init(void)
+{
+        for (unsigned int carry = 0; carry <= CARRY_MAX; carry++) {
+                for (unsigned int b = 0; b < 256; b++) {
+                        struct timing_lut_entry *e = &timing_lut[carry][b];
+                        unsigned int counter = carry;
+
+                        for (unsigned int bit = 0x80; bit; bit >>= 1) {
+                                if (counter < CARRY_MAX) {
+                                        counter++;
+                                }
+                                if (b & bit) {
+                                        if (counter >= 2 && counter <= 4) {
+                                                e->samples[e->count++] =
+                                                                counter * 200;
+                                        }
+                                        counter = 0;
+                                }
+                        }
+                        e->carry = counter;
+                }
+        }
+}
+
+/**
+ * @brief       Turn an MFM bitstream into write timing samples.
+ *
+ * @param       samples         <OUT> Room for TIMING_SAMPLES_PER_BYTE * bytes
+ *                              samples.
+ *
+ * @return      The number of samples.
+ */
+size_t timing_from_bitstream(const uint8_t * restrict bitstream, size_t bytes,
+                                                uint16_t * restrict samples)
+{
+        unsigned int carry = 0;
+        size_t count = 0;
+
+        pthread_once(&timing_lut_once, timing_lut_init);
+
+        for (size_t i = 0; i < bytes; i++) {
+                const struct timing_lut_entry *e = &timing_lut[carry][bitstream[i]];
+
+                memcpy(samples + count, e->samples, sizeof(e->samples));
+                count += e->count;
+                carry = e->carry;
+        }
+
+        return count;
+}
+
+void timing_arena_init(struct timing_arena *arena)
+{
+        memset(arena, 0x00, sizeof(*arena));
+}
+
+/**
+ * @brief       Forget all tracks, but keep the buffer for the next disk.
+ */
+void timing_arena_reset(struct timing_arena *arena)
+{
+        arena->used = 0;
+        memset(arena->tracks, 0x00, sizeof(arena->tracks));
+}
+
+void timing_arena_cleanup(struct timing_arena *arena)
+{
+        free(arena->samples);
+        timing_arena_init(arena);
+}
+
+static int reserve(struct timing_arena *arena, size_t count)
+{
+        if (arena->capacity - arena->used >= count) {
+                return 0;
+        }
+
+        size_t capacity = arena->capacity ? arena->capacity : 1u << 16;
+        while (capacity - arena->used < count) {
+                capacity *= 2;
+        }
+        uint16_t *samples = realloc(arena->samples, capacity * sizeof(*samples));
+        if (!samples) {
+                fprintf(stderr, "Couldn't grow write timing arena to %zu samples\n",
+                                                                capacity);
+                return -1;
+        }
+        arena->samples = samples;
+        arena->capacity = capacity;
+        return 0;
+}
+
+/**
+ * @brief       Encode the MFM bitstream of a track, after the other tracks.
+ *
+ * @param       track           cylinder * 2 + head
+ *
+ * @return      0 on success, negative on error.
+ */
+int timing_arena_add_bitstream(struct timing_arena *arena, unsigned int track,
+                        const uint8_t *bitstream, size_t bytes)
+{
+        if (track >= TIMING_ARENA_MAX_TRACKS) {
+                fprintf(stderr, "Track %u is out of range\n", track);
+                return -1;
+        }
+        if (reserve(arena, bytes * TIMING_SAMPLES_PER_BYTE)) {
+                return -1;
+        }
+
+        struct timing_arena_track *t = &arena->tracks[track];
+        t->offset = arena->used;
+        t->count = timing_from_bitstream(bitstream, bytes,
+                                        arena->samples + arena->used);
+        t->present = true;
+        arena->used += t->count;
+
+        return 0;
+}
+
+/**
+ * @brief       Encode every track of an IPF image.
+ *
+ * @detail      The tracks come from the cache made by
+ *              caps_parser_decode_all(), which must be called first.
+ *
+ * @return      The number of tracks, negative on error.
+ */
+int timing_arena_from_caps(struct timing_arena *arena,
+                        const struct caps_parser *parser)
+{
+        size_t total = 0;
+        int tracks = 0;
+
+        // One allocation for the whole disk.
+        for (unsigned int track = 0; track < TIMING_ARENA_MAX_TRACKS; track++) {
+                uint32_t bits;
+                if (caps_parser_get_track(parser, track >> 1, track & 1, &bits)) {
+                        total += (bits >> 3) * TIMING_SAMPLES_PER_BYTE;
+                }
+        }
+        if (reserve(arena, total)) {
+                return -1;
+        }
+
+        for (unsigned int track = 0; track < TIMING_ARENA_MAX_TRACKS; track++) {
+                uint32_t bits;
+                const uint8_t *bitstream = caps_parser_get_track(parser,
+                                                track >> 1, track & 1, &bits);
+                if (!bitstream) {
+                        continue;
+                }
+                if (timing_arena_add_bitstream(arena, track, bitstream, bits >> 3)) {
+                        return -1;
+                }
+                tracks++;
+        }
+
+        return tracks;
+}
+
+/**
+ * @brief       Take one revolution of every track of an SCP image.
+ *
+ * @detail      The flux is scaled straight from the mapped file into the
+ *              arena, in one pass over each revolution.
+ *
+ * @param       revolution      Which one, from 0. A track without it is
+ *                              left out.
+ *
+ * @return      The number of tracks, negative on error.
+ */
+int timing_arena_from_scp(struct timing_arena *arena,
+                        const struct scp_image *image, unsigned int revolution)
+{
+        struct scp_revolution rev;
+        size_t total = 0;
+        int tracks = 0;
+
+        // One allocation for the whole disk.
+        for (unsigned int track = 0; track < TIMING_ARENA_MAX_TRACKS; track++) {
+                if (scp_image_revolution(image, track, revolution, &rev)) {
+                        total += rev.count;
+                }
+        }
+        if (reserve(arena, total)) {
+                return -1;
+        }
+
+        for (unsigned int track = 0; track < TIMING_ARENA_MAX_TRACKS; track++) {
+                if (!scp_image_revolution(image, track, revolution, &rev)) {
+                        continue;
+                }
+
+                struct timing_arena_track *t = &arena->tracks[track];
+                t->offset = arena->used;
+                t->count = scp_revolution_to_timing(image, &rev,
+                                                arena->samples + arena->used);
+                t->present = true;
+                arena->used += t->count;
+                tracks++;
+        }
+
+        return tracks;
+}
+
+/**
+ * @return      The samples of a track, or NULL if it isn't in the arena.
+ */
+const uint16_t *timing_arena_get(const struct timing_arena *arena,
+                        unsigned int track, size_t *count)
+{
+        if (track >= TIMING_ARENA_MAX_TRACKS || !arena->tracks[track].present) {
+                return NULL;
+        }
+        *count = arena->tracks[track].count;
+        return arena->samples + arena->tracks[track].offset;
+}
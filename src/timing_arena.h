@@ -0,0 +1,50 @@
+#ifndef TIMING_ARENA_H
+#define TIMING_ARENA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+struct caps_parser;
+struct scp_image;
+
+// cylinder * 2 + head, for up to 256 cylinders.
+#define TIMING_ARENA_MAX_TRACKS         512
+
+// Room timing_from_bitstream() needs for a bitstream of <bytes>.
+#define TIMING_SAMPLES_PER_BYTE         4
+
+struct timing_arena_track {
+        size_t offset;                  // Into timing_arena.samples
+        size_t count;
+        bool present;
+};
+
+/**
+ * Write timing for a whole disk, ready for pru_write_timing().
+ * All tracks share one buffer, which is kept over timing_arena_reset(),
+ * so a second disk is encoded without allocating.
+ */
+struct timing_arena {
+        uint16_t *samples;
+        size_t capacity;                // In samples
+        size_t used;
+        struct timing_arena_track tracks[TIMING_ARENA_MAX_TRACKS];
+};
+
+size_t timing_from_bitstream(const uint8_t * restrict bitstream, size_t bytes,
+                                                uint16_t * restrict samples);
+
+void timing_arena_init(struct timing_arena *arena);
+void timing_arena_reset(struct timing_arena *arena);
+void timing_arena_cleanup(struct timing_arena *arena);
+int timing_arena_add_bitstream(struct timing_arena *arena, unsigned int track,
+                        const uint8_t *bitstream, size_t bytes);
+int timing_arena_from_caps(struct timing_arena *arena,
+                        const struct caps_parser *parser);
+int timing_arena_from_scp(struct timing_arena *arena,
+                        const struct scp_image *image, unsigned int revolution);
+const uint16_t *timing_arena_get(const struct timing_arena *arena,
+                        unsigned int track, size_t *count);
+
+#endif /* TIMING_ARENA_H */
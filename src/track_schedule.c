@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "track_schedule.h"
+
+/**
+ * @brief       Start an empty schedule.
+ *
+ * @param       schedule        <IN>  The schedule to set up
+ * @param       retry_passes    <IN>  How many return sweeps may be made
+ *                                    over the tracks that failed
+ */
+void track_schedule_init(struct track_schedule *schedule,
+                                                unsigned int retry_passes)
+{
+        memset(schedule, 0x00, sizeof(*schedule));
+        schedule->passes = retry_passes;
+}
+
+/**
+ * @brief       Want the tracks of a range of cylinders.
+ *
+ * @param       head            <IN>  0 or 1, or -1 for both heads
+ *
+ * @return      0 on success, -1 if the range is off the disk.
+ */
+int track_schedule_add(struct track_schedule *schedule,
+                        unsigned int first_cylinder, unsigned int last_cylinder,
+                        int head)
+{
+        if (first_cylinder > last_cylinder
+                        || last_cylinder >= TRACK_SCHEDULE_CYLINDERS
+                        || head < -1 || head > 1) {
+                fprintf(stderr, "Bad track range: %u-%u head %d\n",
+                                        first_cylinder, last_cylinder, head);
+                return -1;
+        }
+
+        for (unsigned int c = first_cylinder; c <= last_cylinder; c++) {
+                if (head != 1)
+                        schedule->wanted[c * 2] = true;
+                if (head != 0)
+                        schedule->wanted[c * 2 + 1] = true;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief       Want the tracks of a list like "0-9,40:1,70-79:0".
+ *
+ * @detail      Each entry is a cylinder or an inclusive range of cylinders,
+ *              with an optional ":<head>". Without a head, both heads.
+ *
+ * @return      0 on success, -1 on a bad list.
+ */
+int track_schedule_parse(struct track_schedule *schedule, const char *spec)
+{
+        const char *p = spec;
+
+        do {
+                char *end;
+                unsigned long first, last;
+                long head = -1;
+
+                first = strtoul(p, &end, 0);
+                if (end == p)
+                        goto bad_spec;
+                last = first;
+                p = end;
+                if (*p == '-') {
+                        last = strtoul(++p, &end, 0);
+                        if (end == p)
+                                goto bad_spec;
+                        p = end;
+                }
+                if (*p == ':') {
+                        head = strtol(++p, &end, 0);
+                        if (end == p)
+                                goto bad_spec;
+                        p = end;
+                }
+                if (*p && *p != ',')
+                        goto bad_spec;
+                if (track_schedule_add(schedule, first, last, head))
+                        return -1;
+        } while (*p && *++p);
+
+        return 0;
+
+bad_spec:
+        fprintf(stderr, "Bad track list: %s\n", spec);
+        return -1;
+}
+
+/**
+ * @brief       The first and the last of the wanted tracks.
+ *
+ * @return      false if no tracks are wanted.
+ */
+bool track_schedule_span(const struct track_schedule *schedule,
+                        unsigned int *first_track, unsigned int *last_track)
+{
+        bool any = false;
+
+        for (unsigned int t = 0; t < TRACK_SCHEDULE_TRACKS; t++) {
+                if (!schedule->wanted[t])
+                        continue;
+                if (!any)
+                        *first_track = t;
+                *last_track = t;
+                any = true;
+        }
+
+        return any;
+}
+
+static void track_schedule_sweep(struct track_schedule *schedule,
+                                                        int from, int to)
+{
+        const int step = from <= to ? 1 : -1;
+
+        for (int c = from; c != to + step; c += step) {
+                for (unsigned int head = 0; head < TRACKS_PER_CYLINDER; head++) {
+                        const unsigned int t = c * TRACKS_PER_CYLINDER + head;
+                        if (schedule->wanted[t])
+                                schedule->order[schedule->count++] = t;
+                }
+        }
+}
+
+/**
+ * @brief       Order the wanted tracks for the least head travel.
+ *
+ * @detail      From <cylinder>, the head first goes to the nearer end of
+ *              the wanted cylinders, then sweeps to the other end. The
+ *              cylinders on the way to the first end are done on the way.
+ *
+ * @param       cylinder        <IN>  Where the head is now
+ */
+void track_schedule_plan(struct track_schedule *schedule, int cylinder)
+{
+        unsigned int first = 0, last = 0;
+
+        schedule->count = 0;
+        schedule->next = 0;
+        schedule->cylinder = cylinder;
+        if (!track_schedule_span(schedule, &first, &last))
+                return;
+
+        const int lo = first / TRACKS_PER_CYLINDER;
+        const int hi = last / TRACKS_PER_CYLINDER;
+
+        if (cylinder <= lo) {
+                track_schedule_sweep(schedule, lo, hi);
+        } else if (cylinder >= hi) {
+                track_schedule_sweep(schedule, hi, lo);
+        } else if (cylinder - lo <= hi - cylinder) {
+                track_schedule_sweep(schedule, cylinder, lo);
+                track_schedule_sweep(schedule, cylinder + 1, hi);
+        } else {
+                track_schedule_sweep(schedule, cylinder, hi);
+                track_schedule_sweep(schedule, cylinder - 1, lo);
+        }
+}
+
+/**
+ * @brief       The next track to do.
+ *
+ * @detail      When a pass is done, the tracks that failed in it are
+ *              planned from where the head stopped, as long as there are
+ *              retry passes left.
+ *
+ * @return      false when there is nothing left to do.
+ */
+bool track_schedule_next(struct track_schedule *schedule, unsigned int *track)
+{
+        while (schedule->next == schedule->count) {
+                unsigned int failed = 0;
+
+                if (!schedule->passes)
+                        return false;
+                for (unsigned int t = 0; t < TRACK_SCHEDULE_TRACKS; t++) {
+                        if (schedule->failed[t]) {
+                                schedule->wanted[t] = true;
+                                schedule->failed[t] = false;
+                                failed++;
+                        }
+                }
+                if (!failed)
+                        return false;
+
+                schedule->passes--;
+                printf("Retry pass over %u tracks\n", failed);
+                track_schedule_plan(schedule, schedule->cylinder);
+        }
+
+        *track = schedule->order[schedule->next++];
+        schedule->wanted[*track] = false;
+        schedule->cylinder = *track / TRACKS_PER_CYLINDER;
+
+        return true;
+}
+
+/**
+ * @brief       Do <track> again in the next pass.
+ */
+void track_schedule_retry(struct track_schedule *schedule, unsigned int track)
+{
+        if (track < TRACK_SCHEDULE_TRACKS)
+                schedule->failed[track] = true;
+}
+
+/**
+ * @return      true if <track> is still to come in this pass.
+ */
+bool track_schedule_pending(const struct track_schedule *schedule,
+                                                        unsigned int track)
+{
+        return track < TRACK_SCHEDULE_TRACKS && schedule->wanted[track];
+}
+
+/**
+ * @return      The number of tracks that failed in the last pass, with
+ *              no retry pass left for them.
+ */
+unsigned int track_schedule_failed(const struct track_schedule *schedule)
+{
+        unsigned int failed = 0;
+
+        for (unsigned int t = 0; t < TRACK_SCHEDULE_TRACKS; t++)
+                failed += schedule->failed[t];
+
+        return failed;
+}
@@ -0,0 +1,47 @@
+#ifndef TRACK_SCHEDULE_H
+#define TRACK_SCHEDULE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pru-setup.h"
+
+// The drive steps a few cylinders past the 80 of a normal disk.
+#define TRACK_SCHEDULE_CYLINDERS        84
+#define TRACK_SCHEDULE_TRACKS   (TRACK_SCHEDULE_CYLINDERS * TRACKS_PER_CYLINDER)
+
+/**
+ * The tracks of a command, in the order the head should visit them.
+ *
+ * Tracks are numbered cylinder * 2 + head, as everywhere else. A pass
+ * sweeps the head over the wanted cylinders once, both heads of a
+ * cylinder back to back, head 0 first. Tracks that fail are not read
+ * again right away, but collected for a return sweep when the pass is
+ * done, starting from where the head is.
+ */
+struct track_schedule {
+        bool wanted[TRACK_SCHEDULE_TRACKS];     // Still to come this pass
+        bool failed[TRACK_SCHEDULE_TRACKS];     // For the next pass
+        uint8_t order[TRACK_SCHEDULE_TRACKS];
+        unsigned int count;
+        unsigned int next;
+        unsigned int passes;                    // Retry passes left
+        int cylinder;                           // Of the last track handed out
+};
+
+void track_schedule_init(struct track_schedule *schedule,
+                                                unsigned int retry_passes);
+int track_schedule_add(struct track_schedule *schedule,
+                        unsigned int first_cylinder, unsigned int last_cylinder,
+                        int head);
+int track_schedule_parse(struct track_schedule *schedule, const char *spec);
+bool track_schedule_span(const struct track_schedule *schedule,
+                        unsigned int *first_track, unsigned int *last_track);
+void track_schedule_plan(struct track_schedule *schedule, int cylinder);
+bool track_schedule_next(struct track_schedule *schedule, unsigned int *track);
+void track_schedule_retry(struct track_schedule *schedule, unsigned int track);
+bool track_schedule_pending(const struct track_schedule *schedule,
+                                                        unsigned int track);
+unsigned int track_schedule_failed(const struct track_schedule *schedule);
+
+#endif // TRACK_SCHEDULE_H
@@ -6,11 +6,13 @@
 
 void write_flux_opts_print_usage(char * const argv[])
 {
-        printf("usage: %s [OPTION]... <IPF-FILE>\n", argv[0]);
+        printf("usage: %s [OPTION]... <IPF-FILE|SCP-FILE>\n", argv[0]);
         printf("\n");
         printf("  -i              only print ipf image info\n");
         printf("  -t <track>      Track number [0-83]\n");
         printf("  -h <head>       Head lower/upper [0|1]\n");
+        printf("  -T <tracks>     Cylinders to write, i.e. 0-9,40:1\n");
+        printf("  -r <rev>        Revolution of an SCP image to write [0-]\n");
 }
 
 bool write_flux_opts_parse(struct write_flux_opts *opts, int argc, char * const argv[])
@@ -18,13 +20,15 @@ bool write_flux_opts_parse(struct write_flux_opts *opts, int argc, char * const
         opts->filename = NULL;
         opts->track = -1;
         opts->head = -1;
+        opts->tracks = NULL;
+        opts->revolution = 0;
         opts->image_info_only = false;
 
         long strtol_res = -1;
         char *endptr = NULL;
 
         do {
-                switch(getopt(argc, argv, "-:it:h:")) {
+                switch(getopt(argc, argv, "-:it:h:T:r:")) {
                 case 'i':
                         opts->image_info_only = true;
                         break;
@@ -44,6 +48,17 @@ bool write_flux_opts_parse(struct write_flux_opts *opts, int argc, char * const
                         }
                         opts->head = strtol_res;
                         break;
+                case 'T':
+                        opts->tracks = optarg;
+                        break;
+                case 'r':
+                        strtol_res = strtol(optarg, &endptr, 0);
+                        if (optarg == endptr || strtol_res < 0) {
+                                fprintf(stderr, "Unknown revolution: %s\n", optarg);
+                                return false;
+                        }
+                        opts->revolution = strtol_res;
+                        break;
                 case 1:
                         opts->filename = optarg;
                         break;
@@ -55,7 +70,7 @@ bool write_flux_opts_parse(struct write_flux_opts *opts, int argc, char * const
         } while(optind < argc);
 
         if (!opts->filename) {
-                fprintf(stderr, "Missing required argument <IPF-FILE>\n");
+                fprintf(stderr, "Missing required argument <IPF-FILE|SCP-FILE>\n");
                 return false;
         }
 
@@ -8,6 +8,8 @@ struct write_flux_opts {
         bool image_info_only;
         int track;
         int head;
+        const char *tracks;     // Track list for track_schedule_parse()
+        unsigned int revolution;        // Of an SCP image, from 0
 };
 
 void write_flux_opts_print_usage(char * const argv[]);
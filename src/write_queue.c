@@ -0,0 +1,247 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "write_queue.h"
+#include "capture_pipeline.h"
+#include "mfm_utils/mfm_utils.h"
+#include "pru-setup.h"
+
+/**
+ * The I/O thread owns the PRU while the queue runs. It seeks, writes and
+ * verifies one job at a time, in the order they were submitted, while
+ * the caller prepares the next track and reports on the one before.
+ *
+ * Jobs are a ring of WRITE_QUEUE_DEPTH slots: `submitted` by the caller,
+ * `done` by the I/O thread, and `completed` when handed back. A slot is
+ * only reused once it has been handed back.
+ */
+struct write_queue {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        pthread_t thread;
+
+        struct capture_source source;
+        struct write_job jobs[WRITE_QUEUE_DEPTH];
+
+        unsigned int submitted;
+        unsigned int done;
+        unsigned int completed;
+        bool stop;
+};
+
+/**
+ * Runs in pru_write_verify() while the PRU fills the other half of its
+ * buffer, so the track is decoded by the time the read is done.
+ */
+static int write_queue_verify_consume(const uint32_t *samples, size_t count,
+                                                                void *ctx)
+{
+        struct mfm_stream *stream = ctx;
+
+        mfm_stream_feed(stream, samples, count);
+
+        return stream->sector_count == AMIGA_SECTORS_PER_TRACK;
+}
+
+static void write_queue_run_job(struct write_queue *queue, struct write_job *job)
+{
+        struct capture_source *source = &queue->source;
+
+        if (source->seek(source, job->track >> 1, job->track & 1)) {
+                fprintf(stderr, "Seek to track %u failed\n", job->track);
+                job->status = -1;
+                return;
+        }
+
+        if (!job->revolutions) {
+                job->unwritten = pru_write_timing(source->ctx, job->timing,
+                                                                job->count);
+                job->writes = 1;
+                return;
+        }
+
+        job->mfm = malloc(AMIGA_SECTORS_PER_TRACK * AMIGA_MFM_SECTOR_SIZE);
+        if (!job->mfm) {
+                fprintf(stderr, "Couldn't allocate verify buffer\n");
+                job->status = -1;
+                return;
+        }
+
+        do {
+                struct mfm_stream stream;
+
+                mfm_stream_init(&stream, job->mfm);
+                job->sample_count = pru_write_verify(source->ctx, job->timing,
+                                job->count, job->revolutions,
+                                write_queue_verify_consume, &stream, NULL,
+                                &job->unwritten);
+                mfm_stream_finish(&stream);
+                amiga_track_from_stream(&stream, &job->verify);
+                job->writes++;
+        } while (job->verify.good < job->expected
+                                        && job->writes <= job->retries);
+}
+
+static void *write_queue_thread(void *arg)
+{
+        struct write_queue *queue = arg;
+
+        pthread_mutex_lock(&queue->lock);
+        while (true) {
+                while (queue->done == queue->submitted && !queue->stop) {
+                        pthread_cond_wait(&queue->cond, &queue->lock);
+                }
+                // Stop only once every submitted track is on the disk.
+                if (queue->done == queue->submitted) {
+                        break;
+                }
+                struct write_job *job =
+                        &queue->jobs[queue->done % WRITE_QUEUE_DEPTH];
+                pthread_mutex_unlock(&queue->lock);
+
+                write_queue_run_job(queue, job);
+
+                pthread_mutex_lock(&queue->lock);
+                queue->done++;
+                pthread_cond_broadcast(&queue->cond);
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        return NULL;
+}
+
+/**
+ * @brief       Start the I/O thread that writes tracks to the PRU.
+ *
+ * @detail      The caller must have started the motor and reset the
+ *              drive to cylinder 0, and must not use the PRU again
+ *              until write_queue_stop().
+ *
+ * @return      The queue, or NULL on error.
+ */
+struct write_queue *write_queue_start(struct pru *pru)
+{
+        struct write_queue *queue = calloc(1, sizeof(*queue));
+        if (!queue) {
+                fprintf(stderr, "Couldn't allocate write queue\n");
+                return NULL;
+        }
+
+        capture_source_pru_init(&queue->source, pru);
+        pthread_mutex_init(&queue->lock, NULL);
+        pthread_cond_init(&queue->cond, NULL);
+
+        if (pthread_create(&queue->thread, NULL, write_queue_thread, queue)) {
+                fprintf(stderr, "Couldn't start write thread\n");
+                pthread_cond_destroy(&queue->cond);
+                pthread_mutex_destroy(&queue->lock);
+                free(queue);
+                return NULL;
+        }
+
+        return queue;
+}
+
+/**
+ * @brief       Queue a track for writing.
+ *
+ * @detail      Blocks while WRITE_QUEUE_DEPTH jobs are not yet handed
+ *              back, so hand back the oldest job before submitting
+ *              more than that.
+ *
+ * @return      0 on success, -1 if the queue is stopping.
+ */
+int write_queue_submit(struct write_queue *queue, const struct write_job *job)
+{
+        pthread_mutex_lock(&queue->lock);
+        while (queue->submitted - queue->completed >= WRITE_QUEUE_DEPTH
+                                                        && !queue->stop) {
+                pthread_cond_wait(&queue->cond, &queue->lock);
+        }
+        if (queue->stop) {
+                pthread_mutex_unlock(&queue->lock);
+                return -1;
+        }
+
+        struct write_job *slot = &queue->jobs[queue->submitted % WRITE_QUEUE_DEPTH];
+        *slot = *job;
+        slot->status = 0;
+        slot->unwritten = 0;
+        slot->writes = 0;
+        slot->sample_count = 0;
+        memset(&slot->verify, 0x00, sizeof(slot->verify));
+        slot->mfm = NULL;
+
+        queue->submitted++;
+        pthread_cond_broadcast(&queue->cond);
+        pthread_mutex_unlock(&queue->lock);
+
+        return 0;
+}
+
+/**
+ * @return      true if the oldest job is done, and write_queue_complete()
+ *              will not block.
+ */
+bool write_queue_poll(struct write_queue *queue)
+{
+        pthread_mutex_lock(&queue->lock);
+        const bool ready = queue->done != queue->completed;
+        pthread_mutex_unlock(&queue->lock);
+
+        return ready;
+}
+
+/**
+ * @brief       Wait for the oldest job, and hand it back.
+ *
+ * @param       job             <OUT> The job as submitted, with the result
+ *                                    of the write and the verify.
+ *
+ * @return      0 on success, -1 if no jobs are queued.
+ */
+int write_queue_complete(struct write_queue *queue, struct write_job *job)
+{
+        pthread_mutex_lock(&queue->lock);
+        if (queue->completed == queue->submitted) {
+                pthread_mutex_unlock(&queue->lock);
+                return -1;
+        }
+        while (queue->done == queue->completed) {
+                pthread_cond_wait(&queue->cond, &queue->lock);
+        }
+
+        *job = queue->jobs[queue->completed % WRITE_QUEUE_DEPTH];
+        queue->completed++;
+        pthread_cond_broadcast(&queue->cond);
+        pthread_mutex_unlock(&queue->lock);
+
+        return 0;
+}
+
+/**
+ * @brief       Finish the queued tracks, and stop the I/O thread.
+ *
+ * @detail      Verify buffers that were never handed back are freed.
+ */
+void write_queue_stop(struct write_queue *queue)
+{
+        pthread_mutex_lock(&queue->lock);
+        queue->stop = true;
+        pthread_cond_broadcast(&queue->cond);
+        pthread_mutex_unlock(&queue->lock);
+
+        pthread_join(queue->thread, NULL);
+
+        for (; queue->completed != queue->done; queue->completed++) {
+                struct write_job *job =
+                        &queue->jobs[queue->completed % WRITE_QUEUE_DEPTH];
+                free(job->mfm);
+        }
+
+        pthread_cond_destroy(&queue->cond);
+        pthread_mutex_destroy(&queue->lock);
+        free(queue);
+}
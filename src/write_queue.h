@@ -0,0 +1,50 @@
+#ifndef WRITE_QUEUE_H
+#define WRITE_QUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "mfm_utils/amiga_decode.h"
+
+struct pru;
+struct write_queue;
+
+// One track on the PRU, and one waiting for it.
+#define WRITE_QUEUE_DEPTH       2
+
+/**
+ * One track to write, and what came back from it.
+ *
+ * With `revolutions`, the track is read back in the same command as the
+ * write, and decoded as the samples come in. If fewer than `expected`
+ * sectors are good, it is written again, up to `retries` times.
+ *
+ * The timing belongs to the caller, and must stay put until the job
+ * is handed back by write_queue_complete(). The mfm buffer belongs
+ * to the caller after that, and is freed with free().
+ */
+struct write_job {
+        unsigned int track;             // cylinder * 2 + head
+        const uint16_t *timing;         // Write timing, as pru_write_timing()
+        size_t count;
+        uint8_t revolutions;            // To read back after the write, or 0
+        unsigned int expected;          // Good sectors for the verify to pass
+        unsigned int retries;
+
+        // Filled in by the I/O thread
+        int status;                     // 0, or negative on error
+        int unwritten;                  // From pru_write_timing()
+        unsigned int writes;            // 1, plus any rewrites
+        int sample_count;               // Read back by the last verify
+        struct amiga_track verify;      // From the last verify
+        uint8_t *mfm;                   // Raw sectors for `verify`
+};
+
+struct write_queue *write_queue_start(struct pru *pru);
+int write_queue_submit(struct write_queue *queue, const struct write_job *job);
+bool write_queue_poll(struct write_queue *queue);
+int write_queue_complete(struct write_queue *queue, struct write_job *job);
+void write_queue_stop(struct write_queue *queue);
+
+#endif /* WRITE_QUEUE_H */